@@ -0,0 +1,663 @@
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*!
+ * \brief The BinaryIO namespace contains the functionality to read and write the NPSAT binary input files.
+ *
+ * A binary file consists of a FileHeader, a table of ArrayHeader entries (one per array) and the payload,
+ * where each array starts at an offset that is a multiple of 8 bytes. The checksum of the header is
+ * the FNV-1a hash of the payload. Since the arrays are stored in their native type, the file can be
+ * memory mapped and used directly without any parsing.
+ *
+ * The binary files are created from the existing text files with the -c option of the npsat executable
+ * (see #convert_to_binary).
+ */
+namespace BinaryIO{
+
+    //! The first 8 bytes of every NPSAT binary file
+    static const char MAGIC[8] = {'N','P','S','A','T','B','I','N'};
+
+    //! The current version of the format. Files with a different version are rejected
+    static const uint32_t VERSION = 1;
+
+    //! The kind of data that a binary file holds
+    enum DATA_KIND { SCATTERED = 1, BOUNDARY_LINE = 2, MESH2D = 3, WELLS = 4, STREAMS = 5, TRACKING_MESH = 6 };
+
+    //! The type of the values of an array
+    enum ARRAY_TYPE { INT32 = 0, FLOAT64 = 1, CHAR = 2 };
+
+    struct FileHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t kind;
+        uint32_t n_arrays;
+        uint32_t reserved;
+        uint64_t checksum;
+    };
+
+    struct ArrayHeader{
+        char name[24];
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t count;
+        uint64_t offset;
+    };
+
+    //! Computes the FNV-1a 64 bit hash of a block of memory
+    inline uint64_t checksum(const char* data, uint64_t n, uint64_t hash = 14695981039346656037ULL){
+        for (uint64_t i = 0; i < n; ++i){
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    //! Returns the size in bytes of one value of the given type
+    inline uint64_t type_size(uint32_t type){
+        if (type == INT32)
+            return sizeof(int32_t);
+        else if (type == FLOAT64)
+            return sizeof(double);
+        else
+            return sizeof(char);
+    }
+
+    /*!
+     * \brief The InputBuffer class holds the raw bytes of an input file.
+     *
+     * The bytes are either a memory mapping of the file, a block of memory owned by the buffer or
+     * memory owned by someone else (e.g. a shared memory window, see #read_input_file) which is released
+     * through a callback when the buffer is cleared.
+     */
+    class InputBuffer{
+    public:
+        InputBuffer() : addr(0), n(0), mapped(false), release_fn(0), release_arg(0){}
+
+        ~InputBuffer(){ clear(); }
+
+        //! Maps the file into memory. Returns false if the file cannot be opened
+        bool map_file(const std::string& filename){
+            clear();
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0){
+                std::cerr << "Can't open " << filename << std::endl;
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0){
+                std::cerr << "Can't open " << filename << std::endl;
+                ::close(fd);
+                return false;
+            }
+            if (st.st_size == 0){
+                ::close(fd);
+                return true;
+            }
+            void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED){
+                std::cerr << "Can't map " << filename << " into memory" << std::endl;
+                return false;
+            }
+            addr = static_cast<const char*>(p);
+            n = st.st_size;
+            mapped = true;
+            return true;
+        }
+
+        //! Allocates a block of n bytes that is owned by the buffer and returns a pointer to it
+        char* allocate(uint64_t n_bytes){
+            clear();
+            owned.resize(n_bytes);
+            n = n_bytes;
+            addr = n_bytes > 0 ? &owned[0] : 0;
+            return const_cast<char*>(addr);
+        }
+
+        //! Uses n_bytes of external memory. The release function is called with the argument arg when the buffer is cleared
+        void attach(const char* p, uint64_t n_bytes, void (*release)(void*), void* arg){
+            clear();
+            addr = p;
+            n = n_bytes;
+            release_fn = release;
+            release_arg = arg;
+        }
+
+        //! Releases the memory of the buffer
+        void clear(){
+            if (mapped && addr != 0)
+                munmap(const_cast<char*>(addr), n);
+            if (release_fn != 0)
+                release_fn(release_arg);
+            std::vector<char>().swap(owned);
+            addr = 0;
+            n = 0;
+            mapped = false;
+            release_fn = 0;
+            release_arg = 0;
+        }
+
+        //! Returns a pointer to the first byte
+        const char* data()const{ return addr; }
+
+        //! Returns the number of bytes
+        uint64_t size()const{ return n; }
+
+    private:
+        InputBuffer(const InputBuffer&);
+        InputBuffer& operator=(const InputBuffer&);
+
+        std::vector<char> owned;
+        const char* addr;
+        uint64_t n;
+        bool mapped;
+        void (*release_fn)(void*);
+        void* release_arg;
+    };
+
+    /*!
+     * \brief The BufferStream class is an input stream over the bytes of an InputBuffer.
+     * It lets the text readers parse a buffer exactly as they would parse the file, without copying it.
+     */
+    class BufferStream : public std::istream{
+    public:
+        BufferStream(const InputBuffer& buffer)
+            : std::istream(0),
+              sbuf(buffer.data(), buffer.size())
+        {
+            rdbuf(&sbuf);
+        }
+
+    private:
+        struct MemoryBuf : public std::streambuf{
+            MemoryBuf(const char* p, uint64_t n){
+                char* b = const_cast<char*>(p);
+                setg(b, b, b + n);
+            }
+        };
+        MemoryBuf sbuf;
+    };
+
+    //! Returns true if the buffer starts with the NPSAT binary magic bytes
+    inline bool is_binary(const InputBuffer& buffer){
+        if (buffer.size() < 8)
+            return false;
+        return std::memcmp(buffer.data(), MAGIC, 8) == 0;
+    }
+
+    //! Returns the #DATA_KIND of the buffer or 0 if the buffer is not an NPSAT binary file.
+    //! Only the header is read, the file is not validated
+    inline unsigned int buffer_kind(const InputBuffer& buffer){
+        if (buffer.size() < sizeof(FileHeader) || !is_binary(buffer))
+            return 0;
+        FileHeader header;
+        std::memcpy(&header, buffer.data(), sizeof(FileHeader));
+        return header.kind;
+    }
+
+    /*!
+     * \brief The BinaryWriter class collects named arrays and writes them into a binary file.
+     */
+    class BinaryWriter{
+    public:
+        //! Adds an array of integers
+        void add(const std::string& name, const std::vector<int>& v){
+            std::vector<char> bytes(v.size()*sizeof(int32_t));
+            for (unsigned int i = 0; i < v.size(); ++i){
+                int32_t val = static_cast<int32_t>(v[i]);
+                std::memcpy(&bytes[i*sizeof(int32_t)], &val, sizeof(int32_t));
+            }
+            add_bytes(name, INT32, v.size(), bytes);
+        }
+
+        //! Adds an array of doubles
+        void add(const std::string& name, const std::vector<double>& v){
+            std::vector<char> bytes(v.size()*sizeof(double));
+            if (v.size() > 0)
+                std::memcpy(&bytes[0], &v[0], bytes.size());
+            add_bytes(name, FLOAT64, v.size(), bytes);
+        }
+
+        //! Adds a string
+        void add(const std::string& name, const std::string& s){
+            std::vector<char> bytes(s.begin(), s.end());
+            add_bytes(name, CHAR, s.size(), bytes);
+        }
+
+        //! Returns the number of bytes of the file that #serialize creates
+        uint64_t serialized_size()const{
+            uint64_t offset = sizeof(FileHeader) + arrays.size()*sizeof(ArrayHeader);
+            for (unsigned int i = 0; i < arrays.size(); ++i){
+                offset += (8 - offset % 8) % 8;
+                offset += data[i].size();
+            }
+            return offset;
+        }
+
+        //! Writes the content of the binary file into a block of #serialized_size bytes
+        void serialize(char* out, DATA_KIND kind)const{
+            FileHeader header;
+            std::memcpy(header.magic, MAGIC, 8);
+            header.version = VERSION;
+            header.kind = kind;
+            header.n_arrays = static_cast<uint32_t>(arrays.size());
+            header.reserved = 0;
+
+            const uint64_t data_start = sizeof(FileHeader) + arrays.size()*sizeof(ArrayHeader);
+            uint64_t offset = data_start;
+            std::vector<ArrayHeader> table(arrays.size());
+            for (unsigned int i = 0; i < arrays.size(); ++i){
+                table[i] = arrays[i];
+                // keep every array aligned at 8 bytes so that it can be used directly from the mapped memory
+                while (offset % 8 != 0)
+                    out[offset++] = 0;
+                table[i].offset = offset;
+                if (data[i].size() > 0)
+                    std::memcpy(out + offset, &data[i][0], data[i].size());
+                offset += data[i].size();
+            }
+            header.checksum = checksum(out + data_start, offset - data_start);
+            std::memcpy(out, &header, sizeof(FileHeader));
+            if (table.size() > 0)
+                std::memcpy(out + sizeof(FileHeader), &table[0], table.size()*sizeof(ArrayHeader));
+        }
+
+        //! Writes all the arrays that have been added into the file. Returns false if the file cannot be written
+        bool write(const std::string& filename, DATA_KIND kind)const{
+            std::vector<char> bytes(serialized_size());
+            serialize(bytes.data(), kind);
+
+            std::ofstream out(filename.c_str(), std::ios::binary);
+            if (!out.good()){
+                std::cerr << "Can't write " << filename << std::endl;
+                return false;
+            }
+            out.write(bytes.data(), bytes.size());
+            return out.good();
+        }
+
+    private:
+        std::vector<ArrayHeader> arrays;
+        std::vector<std::vector<char> > data;
+
+        void add_bytes(const std::string& name, ARRAY_TYPE type, uint64_t count, const std::vector<char>& bytes){
+            ArrayHeader ah;
+            std::memset(&ah, 0, sizeof(ArrayHeader));
+            std::strncpy(ah.name, name.c_str(), sizeof(ah.name)-1);
+            ah.type = type;
+            ah.count = count;
+            arrays.push_back(ah);
+            data.push_back(bytes);
+        }
+    };
+
+    /*!
+     * \brief The MappedFile class maps a binary file into memory and provides direct access to its arrays.
+     *
+     * The file is validated (magic bytes, version, table bounds and checksum) when it is opened.
+     * The pointers returned by the get methods are valid as long as the object lives.
+     */
+    class MappedFile{
+    public:
+        MappedFile() : addr(0), size(0), header(0), table(0){}
+
+        ~MappedFile(){ close(); }
+
+        //! Maps the file into memory. Returns false if the file cannot be opened or it is not a valid binary file.
+        //! The checksum test can be skipped when the same file is mapped again
+        bool open(const std::string& filename, bool verify_checksum = true){
+            close();
+            if (!own.map_file(filename))
+                return false;
+            return validate(own, filename, verify_checksum);
+        }
+
+        //! Uses the bytes of a buffer that has been read already (e.g. by #read_input_file).
+        //! The buffer must outlive this object. The filename is used only for the messages
+        bool open(const InputBuffer& buffer, const std::string& filename, bool verify_checksum = true){
+            close();
+            return validate(buffer, filename, verify_checksum);
+        }
+
+        //! Unmaps the file
+        void close(){
+            own.clear();
+            addr = 0;
+            size = 0;
+            header = 0;
+            table = 0;
+        }
+
+        //! Returns the kind of data of the file (see #DATA_KIND)
+        unsigned int kind()const{
+            return header == 0 ? 0 : header->kind;
+        }
+
+        //! Returns a pointer to the integer array with the given name. The number of values is returned in n
+        const int32_t* get_int(const std::string& name, uint64_t& n)const{
+            return reinterpret_cast<const int32_t*>(find(name, INT32, n));
+        }
+
+        //! Returns a pointer to the double array with the given name. The number of values is returned in n
+        const double* get_double(const std::string& name, uint64_t& n)const{
+            return reinterpret_cast<const double*>(find(name, FLOAT64, n));
+        }
+
+        //! Returns the string with the given name. If there is no such string it returns an empty string
+        std::string get_string(const std::string& name)const{
+            uint64_t n;
+            const char* p = find(name, CHAR, n);
+            if (p == 0)
+                return std::string();
+            return std::string(p, n);
+        }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        //! The memory mapping of the file when the object has opened the file itself
+        InputBuffer own;
+        const char* addr;
+        uint64_t size;
+        const FileHeader* header;
+        const ArrayHeader* table;
+
+        bool validate(const InputBuffer& buffer, const std::string& filename, bool verify_checksum){
+            if (buffer.size() < sizeof(FileHeader)){
+                std::cerr << filename << " is not an NPSAT binary file" << std::endl;
+                close();
+                return false;
+            }
+            addr = buffer.data();
+            size = buffer.size();
+            header = reinterpret_cast<const FileHeader*>(addr);
+
+            if (std::memcmp(header->magic, MAGIC, 8) != 0){
+                std::cerr << filename << " is not an NPSAT binary file" << std::endl;
+                close();
+                return false;
+            }
+            if (header->version != VERSION){
+                std::cerr << filename << " has version " << header->version << " but version " << VERSION << " is expected" << std::endl;
+                close();
+                return false;
+            }
+            uint64_t data_start = sizeof(FileHeader) + header->n_arrays*sizeof(ArrayHeader);
+            if (data_start > size){
+                std::cerr << filename << " is truncated" << std::endl;
+                close();
+                return false;
+            }
+            table = reinterpret_cast<const ArrayHeader*>(addr + sizeof(FileHeader));
+            for (unsigned int i = 0; i < header->n_arrays; ++i){
+                if (table[i].offset + table[i].count*type_size(table[i].type) > size){
+                    std::cerr << "The array " << table[i].name << " of " << filename << " is truncated" << std::endl;
+                    close();
+                    return false;
+                }
+            }
+            if (verify_checksum && checksum(addr + data_start, size - data_start) != header->checksum){
+                std::cerr << "Checksum mismatch in " << filename << std::endl;
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        const char* find(const std::string& name, ARRAY_TYPE type, uint64_t& n)const{
+            n = 0;
+            if (header == 0)
+                return 0;
+            for (unsigned int i = 0; i < header->n_arrays; ++i){
+                if (name == std::string(table[i].name) && table[i].type == static_cast<uint32_t>(type)){
+                    n = table[i].count;
+                    return addr + table[i].offset;
+                }
+            }
+            std::cerr << "The array " << name << " does not exist in the binary file" << std::endl;
+            return 0;
+        }
+    };
+
+    //! Splits a line into whitespace separated tokens. Unlike the fixed size buffers, lines of any length are read in full
+    inline std::vector<std::string> tokenize(const std::string& line){
+        std::vector<std::string> tokens;
+        std::istringstream inp(line);
+        std::string t;
+        while (inp >> t)
+            tokens.push_back(t);
+        return tokens;
+    }
+
+    //! Reads the next non empty line of the stream and returns its tokens
+    inline bool next_tokens(std::istream& in, std::vector<std::string>& tokens){
+        std::string line;
+        while (std::getline(in, line)){
+            tokens = tokenize(line);
+            if (tokens.size() > 0)
+                return true;
+        }
+        tokens.clear();
+        return false;
+    }
+
+    //! Reads the next non empty line and checks that it has at least n tokens. Returns false with a message otherwise
+    inline bool read_tokens(std::istream& in, unsigned int n, std::vector<std::string>& tokens, const std::string& filename){
+        if (!next_tokens(in, tokens)){
+            std::cerr << filename << " ended unexpectedly" << std::endl;
+            return false;
+        }
+        if (tokens.size() < n){
+            std::cerr << "Expected " << n << " values but found " << tokens.size() << " in " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    //! Converts the token to a number. Returns false with a message if the token is not a number
+    inline bool to_number(const std::string& token, double& value, const std::string& filename){
+        char* end;
+        value = std::strtod(token.c_str(), &end);
+        if (end == token.c_str() || *end != '\0'){
+            std::cerr << "Expected a number but found " << token << " in " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    //! Converts the token to a non negative count. Returns false with a message otherwise
+    inline bool to_count(const std::string& token, int& value, const std::string& filename){
+        double v;
+        if (!to_number(token, v, filename))
+            return false;
+        if (v < 0 || v != static_cast<int>(v)){
+            std::cerr << "Expected a non negative integer but found " << token << " in " << filename << std::endl;
+            return false;
+        }
+        value = static_cast<int>(v);
+        return true;
+    }
+
+    //! Reads the next line and appends exactly n numbers to the values. Returns false with a message if any is missing
+    inline bool read_numbers(std::istream& in, unsigned int n, std::vector<double>& values, const std::string& filename){
+        std::vector<std::string> tokens;
+        if (!read_tokens(in, n, tokens, filename))
+            return false;
+        for (unsigned int i = 0; i < n; ++i){
+            double v;
+            if (!to_number(tokens[i], v, filename))
+                return false;
+            values.push_back(v);
+        }
+        return true;
+    }
+
+    /*!
+     * \brief convert_to_binary converts an NPSAT text input file to the binary format.
+     * \param type is the type of the input file. Valid options are INTERP (for SCATTERED and BOUNDARY_LINE files),
+     * MESH (the 2D mesh of the FILE geometry), WELLS and STREAMS.
+     * \param input_file is the name of the text file
+     * \param output_file is the name of the binary file that will be written
+     * \return true if the conversion was successful
+     *
+     * The layout of the arrays for each type is:
+     * - SCATTERED: strings type (FULL, HOR, VERT) and style (STRATIFIED, SIMPLE), int size = {Npnts, Ndata, Ncols}
+     *   and double data with the Npnts x Ncols rows of the text file.
+     * - BOUNDARY_LINE: int size = {Npnts, Ndata}, double tolerance and double data with the Npnts rows of the text file.
+     * - MESH2D: double vertices (Nvert x 2) and int cells (Nelem x 4).
+     * - WELLS: double data (Nwells rows of X Y Ztop Zbot Q, where Y is omitted in 2D).
+     * - STREAMS: int npoints, double rate, double width (0 for polygon segments) and double coords
+     *   with the x y pairs of all segments.
+     */
+    template <int dim>
+    bool convert_to_binary(const std::string& type, const std::string& input_file, const std::string& output_file){
+        std::ifstream datafile(input_file.c_str());
+        if (!datafile.good()){
+            std::cerr << "Can't open " << input_file << std::endl;
+            return false;
+        }
+        BinaryWriter writer;
+        std::vector<std::string> tokens;
+        if (type == "INTERP"){
+            if (!read_tokens(datafile, 1, tokens, input_file))
+                return false;
+            if (tokens[0] == "SCATTERED"){
+                if (!read_tokens(datafile, 1, tokens, input_file))
+                    return false;
+                std::string sci_type = tokens[0];
+                if (!read_tokens(datafile, 1, tokens, input_file))
+                    return false;
+                std::string style = tokens[0];
+                int Npnts, Ndata;
+                if (!read_tokens(datafile, 2, tokens, input_file) ||
+                        !to_count(tokens[0], Npnts, input_file) || !to_count(tokens[1], Ndata, input_file))
+                    return false;
+                // see ScatterInterp#get_data for the cases where the data have only one coordinate
+                bool is_1D = (dim == 2 && style == "STRATIFIED") || (dim == 3 && sci_type == "VERT");
+                int Ncols = Ndata + (is_1D ? 1 : 2);
+                std::vector<double> data;
+                data.reserve(static_cast<size_t>(Npnts)*Ncols);
+                for (int i = 0; i < Npnts; ++i){
+                    if (!read_numbers(datafile, Ncols, data, input_file))
+                        return false;
+                }
+                std::vector<int> size;
+                size.push_back(Npnts); size.push_back(Ndata); size.push_back(Ncols);
+                writer.add("type", sci_type);
+                writer.add("style", style);
+                writer.add("size", size);
+                writer.add("data", data);
+                return writer.write(output_file, SCATTERED);
+            }
+            else if (tokens[0] == "BOUNDARY_LINE"){
+                int Npnts, Ndata;
+                std::vector<double> tolerance(1);
+                if (!read_tokens(datafile, 3, tokens, input_file) || !to_count(tokens[0], Npnts, input_file) ||
+                        !to_count(tokens[1], Ndata, input_file) || !to_number(tokens[2], tolerance[0], input_file))
+                    return false;
+                int Ncols = Ndata + dim - 1;
+                std::vector<double> data;
+                for (int i = 0; i < Npnts; ++i){
+                    if (!read_numbers(datafile, Ncols, data, input_file))
+                        return false;
+                }
+                std::vector<int> size;
+                size.push_back(Npnts); size.push_back(Ndata);
+                writer.add("size", size);
+                writer.add("tolerance", tolerance);
+                writer.add("data", data);
+                return writer.write(output_file, BOUNDARY_LINE);
+            }
+            else{
+                std::cerr << "Unknown interpolation method on " << input_file << std::endl;
+                return false;
+            }
+        }
+        else if (type == "MESH"){
+            int Nvert, Nelem;
+            if (!read_tokens(datafile, 2, tokens, input_file) ||
+                    !to_count(tokens[0], Nvert, input_file) || !to_count(tokens[1], Nelem, input_file))
+                return false;
+            std::vector<double> vertices;
+            vertices.reserve(static_cast<size_t>(Nvert)*2);
+            for (int i = 0; i < Nvert; ++i){
+                if (!read_numbers(datafile, 2, vertices, input_file))
+                    return false;
+            }
+            std::vector<double> temp;
+            std::vector<int> cells;
+            cells.reserve(static_cast<size_t>(Nelem)*4);
+            for (int i = 0; i < Nelem; ++i){
+                temp.clear();
+                if (!read_numbers(datafile, 4, temp, input_file))
+                    return false;
+                for (unsigned int j = 0; j < 4; ++j)
+                    cells.push_back(static_cast<int>(temp[j]));
+            }
+            writer.add("vertices", vertices);
+            writer.add("cells", cells);
+            return writer.write(output_file, MESH2D);
+        }
+        else if (type == "WELLS"){
+            int Nwells;
+            if (!read_tokens(datafile, 1, tokens, input_file) || !to_count(tokens[0], Nwells, input_file))
+                return false;
+            int Ncols = (dim == 3) ? 5 : 4;
+            std::vector<double> data;
+            for (int i = 0; i < Nwells; ++i){
+                if (!read_numbers(datafile, Ncols, data, input_file))
+                    return false;
+            }
+            writer.add("data", data);
+            return writer.write(output_file, WELLS);
+        }
+        else if (type == "STREAMS"){
+            int N_seg;
+            if (!read_tokens(datafile, 1, tokens, input_file) || !to_count(tokens[0], N_seg, input_file))
+                return false;
+            std::vector<int> npoints;
+            std::vector<double> rate, width, coords;
+            for (int i = 0; i < N_seg; ++i){
+                int N_points;
+                double seg_rate = 0.0, seg_width = 0.0;
+                if (!read_tokens(datafile, 1, tokens, input_file) || !to_count(tokens[0], N_points, input_file))
+                    return false;
+                if (tokens.size() > 1 && !to_number(tokens[1], seg_rate, input_file))
+                    return false;
+                if (N_points == 2 && tokens.size() > 2 && !to_number(tokens[2], seg_width, input_file))
+                    return false;
+                npoints.push_back(N_points);
+                rate.push_back(seg_rate);
+                width.push_back(seg_width);
+                for (int j = 0; j < N_points; ++j){
+                    if (!read_numbers(datafile, 2, coords, input_file))
+                        return false;
+                }
+            }
+            writer.add("npoints", npoints);
+            writer.add("rate", rate);
+            writer.add("width", width);
+            writer.add("coords", coords);
+            return writer.write(output_file, STREAMS);
+        }
+        std::cerr << "Unknown file type " << type << ". Valid options are INTERP, MESH, WELLS and STREAMS" << std::endl;
+        return false;
+    }
+}
+
+#endif // BINARY_IO_H
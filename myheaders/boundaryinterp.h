@@ -7,6 +7,9 @@
 
 #include "helper_functions.h"
 #include "scatterinterp.h"
+#include "binary_io.h"
+#include "mpi_help.h"
+#include "box_tree.h"
 
 using namespace dealii;
 
@@ -19,12 +22,19 @@ public:
     //! returns the interpolated value
     double interpolate(Point<dim> p)const;
 
-    //! read data from file
+    //! read data from file. The file can be either text or NPSAT binary (see BinaryIO#convert_to_binary).
+    //! The file is read with #read_input_file, therefore this must be called by all processors
     void get_data(std::string filename);
 
+    //! read data from the content of the file that has been read already
+    void get_data(std::string filename, const BinaryIO::InputBuffer& input);
+
     //! This will return true if the face defined by the two nodes is part of any segment of the boundary
     bool is_face_part_of_BND(Point<dim> A, Point<dim> B);
 
+    //! Returns the bounding box of the boundary line expanded by the #tolerance
+    void bounding_box(double& xmin, double& ymin, double& xmax, double& ymax)const;
+
 private:
 
     //! This is a vector with the corner points of the boundary polygon
@@ -47,6 +57,20 @@ private:
 
     bool isPoint_onBoundary(Point<dim> p);
 
+    //! Allocates the containers for #Npnts points
+    void allocate();
+
+    //! Sets the i-th point from a row of the input data with the coordinates followed by the #Ndata values
+    void set_point(unsigned int i, const double* row);
+
+    //! Reads the data from the content of a file in the NPSAT binary format
+    void get_data_binary(std::string filename, const BinaryIO::InputBuffer& input);
+
+    //! An index of the segment bounding boxes expanded by the #tolerance. The id of each box is the index of the first segment point
+    BoxTree segment_index;
+
+    //! Builds the #segment_index. It is called after the points have been read
+    void build_index();
 
 };
 
@@ -58,79 +82,147 @@ BoundaryInterp<dim>::BoundaryInterp(){
 }
 
 template <int dim>
-void BoundaryInterp<dim>::get_data(std::string filename){
-    std::ifstream  datafile(filename.c_str());
-    if (!datafile.good()){
-        std::cerr << "Can't open " << filename << std::endl;
-        return;
+void BoundaryInterp<dim>::allocate(){
+    Pnts.resize(Npnts);
+    Values.resize(Npnts);
+    Length.resize(Npnts);
+    if (Ndata > 1)
+        Elevations.resize(Npnts);
+}
+
+template <int dim>
+void BoundaryInterp<dim>::set_point(unsigned int i, const double* row){
+    for (unsigned int idim = 0; idim < dim-1; idim++){
+        Pnts[i][idim] = row[idim];
+    }
+    row += dim-1;
+
+    if (Ndata == 1){
+        Values[i].push_back(row[0]);
     }
     else{
-        char buffer[512];
-
-        {// Read the data type
-            datafile.getline(buffer, 512);
-            std::istringstream inp(buffer);
-            std::string temp;
-            inp >> temp;
-            if (temp != "BOUNDARY_LINE"){
-                std::cerr << " BOUNDARY_LINE Cannot read " << temp << " data." << std::endl;
-                return;
+        bool set_val = true;
+        for (unsigned int j = 0; j < Ndata; j++){
+            if (set_val){
+                Values[i].push_back(row[j]);
+                set_val = false;
+            }
+            else{
+                Elevations[i].push_back(row[j]);
+                set_val = true;
             }
-        }
 
-        {// Read the number of data and allocate space
-            datafile.getline(buffer, 512);
-            std::istringstream inp(buffer);
-            inp >> Npnts;
-            inp >> Ndata;
-            inp >> tolerance;
-            Pnts.resize(Npnts);
-            Values.resize(Npnts);
-            Length.resize(Npnts);
-            if (Ndata > 1)
-                Elevations.resize(Npnts);
         }
+    }
 
-        {// Read the data
-            double val;
-            for (unsigned int i = 0; i < Npnts; ++i){
-                datafile.getline(buffer, 512);
-                std::istringstream inp(buffer);
+    if (i == 0)
+        Length[i] = 0;
+    else{
+        double dst = Pnts[i].distance(Pnts[i-1]);
+        Length[i] = Length[i-1] + dst;
+    }
+}
 
-                for (unsigned int idim = 0; idim < dim-1; idim++){
-                    inp >> val;
-                    Pnts[i][idim] = val;
-                }
+template <int dim>
+void BoundaryInterp<dim>::get_data_binary(std::string filename, const BinaryIO::InputBuffer& input){
+    BinaryIO::MappedFile bfile;
+    if (!bfile.open(input, filename))
+        return;
+    if (bfile.kind() != BinaryIO::BOUNDARY_LINE){
+        std::cerr << " BOUNDARY_LINE Cannot read " << filename << ". It is not a BOUNDARY_LINE binary file" << std::endl;
+        return;
+    }
+    uint64_t n;
+    const int32_t* size = bfile.get_int("size", n);
+    if (size == 0 || n < 2)
+        return;
+    Npnts = size[0];
+    Ndata = size[1];
+    const double* tol = bfile.get_double("tolerance", n);
+    if (tol == 0 || n < 1)
+        return;
+    tolerance = tol[0];
+    const double* data = bfile.get_double("data", n);
+    const unsigned int Ncols = Ndata + dim - 1;
+    if (data == 0 || n < static_cast<uint64_t>(Npnts)*Ncols)
+        return;
+    allocate();
+    for (unsigned int i = 0; i < Npnts; ++i)
+        set_point(i, data + static_cast<uint64_t>(i)*Ncols);
+    build_index();
+}
 
-                if (Ndata == 1){
-                    inp >> val;
-                    Values[i].push_back(val);
-                }
-                else{
-                    bool set_val = true;
-                    for (unsigned int j = 0; j < Ndata; j++){
-                        inp >> val;
-                        if (set_val){
-                            Values[i].push_back(val);
-                            set_val = false;
-                        }
-                        else{
-                            Elevations[i].push_back(val);
-                            set_val = true;
-                        }
+template <int dim>
+void BoundaryInterp<dim>::build_index(){
+    segment_index.clear();
+    for (unsigned int i = 0; i + 1 < Npnts; ++i){
+        segment_index.add(std::min(Pnts[i][0], Pnts[i+1][0]) - tolerance,
+                          std::min(Pnts[i][1], Pnts[i+1][1]) - tolerance,
+                          std::max(Pnts[i][0], Pnts[i+1][0]) + tolerance,
+                          std::max(Pnts[i][1], Pnts[i+1][1]) + tolerance, i);
+    }
+    segment_index.build();
+}
 
-                    }
-                }
+template <int dim>
+void BoundaryInterp<dim>::bounding_box(double& xmin, double& ymin, double& xmax, double& ymax)const{
+    xmin = std::numeric_limits<double>::max();  ymin = std::numeric_limits<double>::max();
+    xmax = -std::numeric_limits<double>::max(); ymax = -std::numeric_limits<double>::max();
+    for (unsigned int i = 0; i < Npnts; ++i){
+        xmin = std::min(xmin, Pnts[i][0] - tolerance);
+        ymin = std::min(ymin, Pnts[i][1] - tolerance);
+        xmax = std::max(xmax, Pnts[i][0] + tolerance);
+        ymax = std::max(ymax, Pnts[i][1] + tolerance);
+    }
+}
 
-                if (i == 0)
-                    Length[i] = 0;
-                else{
-                    double dst = Pnts[i].distance(Pnts[i-1]);
-                    Length[i] = Length[i-1] + dst;
-                }
-            }
+template <int dim>
+void BoundaryInterp<dim>::get_data(std::string filename){
+    BinaryIO::InputBuffer input;
+    if (read_input_file(filename, input))
+        get_data(filename, input);
+}
+
+template <int dim>
+void BoundaryInterp<dim>::get_data(std::string filename, const BinaryIO::InputBuffer& input){
+    if (BinaryIO::is_binary(input)){
+        get_data_binary(filename, input);
+        return;
+    }
+    BinaryIO::BufferStream datafile(input);
+    std::string line;
+
+    {// Read the data type
+        getline(datafile, line);
+        std::istringstream inp(line);
+        std::string temp;
+        inp >> temp;
+        if (temp != "BOUNDARY_LINE"){
+            std::cerr << " BOUNDARY_LINE Cannot read " << temp << " data." << std::endl;
+            return;
         }
     }
+
+    {// Read the number of data and allocate space
+        getline(datafile, line);
+        std::istringstream inp(line);
+        inp >> Npnts;
+        inp >> Ndata;
+        inp >> tolerance;
+        allocate();
+    }
+
+    {// Read the data
+        std::vector<double> row(Ndata + dim - 1);
+        for (unsigned int i = 0; i < Npnts; ++i){
+            getline(datafile, line);
+            std::istringstream inp(line);
+            for (unsigned int j = 0; j < row.size(); ++j)
+                inp >> row[j];
+            set_point(i, row.data());
+        }
+    }
+    build_index();
 }
 
 template <int dim>
@@ -165,9 +257,11 @@ bool BoundaryInterp<dim>::isPoint_onSeg(Point<dim> p, int iSeg, double& dst_t) c
 
 template <int dim>
 bool BoundaryInterp<dim>::isPoint_onBoundary(Point<dim> p){
-    for (unsigned int ibnd = 0; ibnd < Npnts-1; ++ibnd){
+    std::vector<int> candidates;
+    segment_index.query(p[0], p[1], p[0], p[1], candidates);
+    for (unsigned int ic = 0; ic < candidates.size(); ++ic){
         double dst = 0;
-        if (isPoint_onSeg(p, ibnd, dst))
+        if (isPoint_onSeg(p, candidates[ic], dst))
             return true;
     }
 
@@ -185,7 +279,11 @@ bool BoundaryInterp<dim>::is_face_part_of_BND(Point<dim> A, Point<dim> B){
         std::cerr << " This face is too small. Maybe its an error" << std::endl;
     }
 
-    for (unsigned int ii = 0; ii < Npnts - 1; ii++){
+    // Both face points have to be within the tolerance of the segment, so the candidates of A are enough
+    std::vector<int> candidates;
+    segment_index.query(cx3, cy3, cx3, cy3, candidates);
+    for (unsigned int ic = 0; ic < candidates.size(); ic++){
+        const unsigned int ii = candidates[ic];
         lx1 = Pnts[ii][0]; ly1 = Pnts[ii][1];
         lx2 = Pnts[ii+1][0]; ly2 = Pnts[ii+1][1];
 
@@ -228,8 +326,11 @@ bool BoundaryInterp<dim>::is_face_part_of_BND(Point<dim> A, Point<dim> B){
 
 template <int dim>
 double BoundaryInterp<dim>::interpolate(Point<dim> p)const{
-
-    for (unsigned int i = 0; i < Npnts - 1; ++i){
+    // Only the segments whose expanded bounding box contains the point can be within the tolerance
+    std::vector<int> candidates;
+    segment_index.query(p[0], p[1], p[0], p[1], candidates);
+    for (unsigned int ic = 0; ic < candidates.size(); ++ic){
+        const unsigned int i = candidates[ic];
         double dst_t = 0;
         if (isPoint_onSeg(p, i, dst_t)){
             double t = dst_t/(Length[i+1] - Length[i]);
@@ -269,8 +370,7 @@ double BoundaryInterp<dim>::interpolate(Point<dim> p)const{
         }
     }
 
-    //std::cerr << "The Interpolation should never reach this point. There must be something wrong when assigning BC" << std::endl;
-    std::cout << "plot(" << p[0] << "," << p[1] << ",'or')" << std::endl;
+    std::cerr << "The point (" << p[0] << ", " << p[1] << ") is not on any segment of the boundary line" << std::endl;
     return -999999999;
 }
 
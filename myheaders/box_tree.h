@@ -0,0 +1,139 @@
+#ifndef BOX_TREE_H
+#define BOX_TREE_H
+
+#include <vector>
+#include <algorithm>
+
+/*!
+ * \brief The BoxTree class is a static bounding volume hierarchy of 2D axis aligned boxes.
+ *
+ * Each box carries an integer id. After all boxes have been added and the tree is built, #query returns
+ * the ids of the boxes that overlap a given rectangle. It is used to find the candidate boundary segments
+ * and polygons of a point or a face without looping through all of them.
+ *
+ * The tree holds only plain vectors, therefore it can be copied together with the class that owns it.
+ */
+class BoxTree{
+public:
+    //! Adds a box with the given id. The tree has to be built again after adding boxes
+    void add(double xmin, double ymin, double xmax, double ymax, int id);
+
+    //! Builds the hierarchy of the boxes that have been added
+    void build();
+
+    //! Removes all boxes
+    void clear();
+
+    //! Returns the number of boxes
+    unsigned int size()const{return boxes.size();}
+
+    /*!
+     * \brief query finds the boxes that overlap the rectangle. The boundaries of the boxes are inclusive.
+     * \param ids on return holds the ids of the overlapping boxes in ascending order
+     */
+    void query(double xmin, double ymin, double xmax, double ymax, std::vector<int>& ids)const;
+
+private:
+    struct Box{
+        double lo[2];
+        double hi[2];
+        int id;
+    };
+
+    //! A node is a leaf if count > 0. In that case the boxes [first, first + count) belong to the node
+    struct Node{
+        double lo[2];
+        double hi[2];
+        int left;
+        int right;
+        int first;
+        int count;
+    };
+
+    std::vector<Box> boxes;
+    std::vector<Node> nodes;
+
+    int build_node(int first, int count);
+};
+
+inline void BoxTree::add(double xmin, double ymin, double xmax, double ymax, int id){
+    Box b;
+    b.lo[0] = std::min(xmin, xmax); b.hi[0] = std::max(xmin, xmax);
+    b.lo[1] = std::min(ymin, ymax); b.hi[1] = std::max(ymin, ymax);
+    b.id = id;
+    boxes.push_back(b);
+}
+
+inline void BoxTree::clear(){
+    boxes.clear();
+    nodes.clear();
+}
+
+inline void BoxTree::build(){
+    nodes.clear();
+    if (boxes.size() > 0){
+        nodes.reserve(2*boxes.size());
+        build_node(0, boxes.size());
+    }
+}
+
+inline int BoxTree::build_node(int first, int count){
+    int inode = nodes.size();
+    nodes.push_back(Node());
+    Node n;
+    n.lo[0] = boxes[first].lo[0]; n.lo[1] = boxes[first].lo[1];
+    n.hi[0] = boxes[first].hi[0]; n.hi[1] = boxes[first].hi[1];
+    for (int i = first + 1; i < first + count; ++i){
+        for (unsigned int k = 0; k < 2; ++k){
+            n.lo[k] = std::min(n.lo[k], boxes[i].lo[k]);
+            n.hi[k] = std::max(n.hi[k], boxes[i].hi[k]);
+        }
+    }
+    n.left = -1;
+    n.right = -1;
+    n.first = first;
+    n.count = count;
+
+    const int leaf_size = 4;
+    if (count > leaf_size){
+        // Split the boxes in two halves along the longest side of the node using the box centers
+        const unsigned int axis = (n.hi[0] - n.lo[0]) >= (n.hi[1] - n.lo[1]) ? 0 : 1;
+        const int half = count/2;
+        std::nth_element(boxes.begin() + first, boxes.begin() + first + half, boxes.begin() + first + count,
+                         [axis](const Box& a, const Box& b){return a.lo[axis] + a.hi[axis] < b.lo[axis] + b.hi[axis];});
+        n.count = 0;
+        n.left = build_node(first, half);
+        n.right = build_node(first + half, count - half);
+    }
+    nodes[inode] = n;
+    return inode;
+}
+
+inline void BoxTree::query(double xmin, double ymin, double xmax, double ymax, std::vector<int>& ids)const{
+    ids.clear();
+    if (nodes.size() == 0)
+        return;
+    std::vector<int> stack(1, 0);
+    while (!stack.empty()){
+        const Node& n = nodes[stack.back()];
+        stack.pop_back();
+        if (n.lo[0] > xmax || n.hi[0] < xmin || n.lo[1] > ymax || n.hi[1] < ymin)
+            continue;
+        if (n.count > 0){
+            for (int i = n.first; i < n.first + n.count; ++i){
+                const Box& b = boxes[i];
+                if (b.lo[0] > xmax || b.hi[0] < xmin || b.lo[1] > ymax || b.hi[1] < ymin)
+                    continue;
+                ids.push_back(b.id);
+            }
+        }
+        else{
+            stack.push_back(n.left);
+            stack.push_back(n.right);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+#endif // BOX_TREE_H
@@ -0,0 +1,243 @@
+#ifndef CELL_GEOMETRY_CACHE_H
+#define CELL_GEOMETRY_CACHE_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include <deal.II/base/point.h>
+#include <deal.II/base/geometry_info.h>
+#include <deal.II/dofs/dof_handler.h>
+#include <deal.II/dofs/dof_accessor.h>
+
+using namespace dealii;
+
+/*!
+ * \brief The CellGeometryCache class holds the geometric information of the active cells that the particle tracking
+ * queries at every step.
+ *
+ * The mesh does not change during the particle tracking. Therefore the bounding boxes, the minimum vertex distances,
+ * the face planes, the face neighbors and the ownership of the cells are computed once and stored
+ * in contiguous arrays that are indexed by the active cell index.
+ */
+template <int dim>
+class CellGeometryCache{
+public:
+    typedef typename DoFHandler<dim>::active_cell_iterator cell_iterator;
+
+    //! Computes the data of all active cells of the dof handler. The data of artificial cells are not computed.
+    void build(const DoFHandler<dim>& dof_handler);
+
+    //! Returns true if the cache has been built
+    bool is_built()const{return !cells.empty();}
+
+    //! Returns the iterator of the cell with the given active cell index
+    const cell_iterator& cell(int icell)const{return cells[icell];}
+
+    //! Returns 0 if the cell is locally owned, 1 if it is ghost and 2 if it is artificial
+    int status(int icell)const{return cell_status[icell];}
+
+    //! Returns the minimum distance between any two vertices of the cell. This is the same as minimum_vertex_distance()
+    double min_vertex_distance(int icell)const{return min_dist[icell];}
+
+    //! Returns the center of the bounding box of the cell
+    Point<dim> bbox_center(int icell)const;
+
+    //! Returns the position of the point relative to the bounding box of the cell. It is 0 at the minimum and 1 at the maximum corner
+    Point<dim> bbox_position(int icell, const Point<dim>& p)const;
+
+    //! Returns false if the point is outside the bounding box of the cell. The box is slightly inflated
+    bool in_bbox(int icell, const Point<dim>& p)const;
+
+    /*!
+     * \brief plane_test compares the point against the planes of the cell faces.
+     *
+     * Each face plane has a tolerance equal to the largest distance of the face vertices from the plane.
+     * \return 1 if the point is inside all planes by more than the tolerance, 0 if it is outside of
+     * any plane by more than the tolerance and -1 if the test cannot decide.
+     */
+    int plane_test(int icell, const Point<dim>& p)const;
+
+    /*!
+     * \brief neighbor returns the active cell index of a neighbor across a face.
+     * \param icell is the active cell index
+     * \param iface is the face of the cell
+     * \param ichild If the neighbor is refined this is the index of the child behind the face. Otherwise only ichild = 0 is set.
+     * \return the active cell index of the neighbor or -1 if the face is on the boundary or there is no such child.
+     */
+    int neighbor(int icell, unsigned int iface, unsigned int ichild)const{
+        return neighbors[(icell*GeometryInfo<dim>::faces_per_cell + iface)*GeometryInfo<dim>::max_children_per_face + ichild];
+    }
+
+    /*!
+     * \brief build_halo marks the ghost cells where the particles can be traced without handing them to their owner.
+     *
+     * The halo is the ghost layer of the triangulation, i.e. the cells that share a vertex with the locally owned cells.
+     * The cells behind it are artificial and their velocity is not known on this processor, therefore the halo
+     * is one layer deep. A particle that steps from the halo into an artificial cell is handed to the owner of the halo cell
+     * of its last point (see Particle_Tracking::add_streamline_point).
+     * \param n_layers is 0 for no halo and 1 for the ghost layer. Larger values are the same as 1.
+     */
+    void build_halo(unsigned int n_layers);
+
+    //! Returns true if the cell is a ghost cell of the halo
+    bool in_halo(int icell)const{return halo[icell] != 0;}
+
+private:
+    std::vector<cell_iterator> cells;
+    std::vector<int> cell_status;
+    //! the minimum followed by the maximum corner of the bounding box
+    std::vector<double> bbox;
+    std::vector<double> min_dist;
+    //! For each face the outward unit normal, the offset and the tolerance of the plane
+    std::vector<double> planes;
+    std::vector<int> neighbors;
+    std::vector<char> halo;
+};
+
+template <int dim>
+void CellGeometryCache<dim>::build(const DoFHandler<dim>& dof_handler){
+    const unsigned int n_faces = GeometryInfo<dim>::faces_per_cell;
+    const unsigned int n_face_children = GeometryInfo<dim>::max_children_per_face;
+    const unsigned int n_cells = dof_handler.get_triangulation().n_active_cells();
+
+    cells.resize(n_cells);
+    cell_status.assign(n_cells, 2);
+    bbox.assign(n_cells*2*dim, 0.0);
+    min_dist.assign(n_cells, 0.0);
+    planes.assign(n_cells*n_faces*(dim + 2), 0.0);
+    neighbors.assign(n_cells*n_faces*n_face_children, -1);
+
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = dof_handler.begin_active(),
+    endc = dof_handler.end();
+    for (; cell != endc; ++cell){
+        const int icell = cell->active_cell_index();
+        cells[icell] = cell;
+        if (cell->is_artificial())
+            continue;
+        cell_status[icell] = cell->is_locally_owned() ? 0 : 1;
+
+        Point<dim> pmin = cell->vertex(0);
+        Point<dim> pmax = cell->vertex(0);
+        double dmin = std::numeric_limits<double>::max();
+        for (unsigned int i = 0; i < GeometryInfo<dim>::vertices_per_cell; ++i){
+            const Point<dim>& v = cell->vertex(i);
+            for (unsigned int idim = 0; idim < dim; ++idim){
+                pmin[idim] = std::min(pmin[idim], v[idim]);
+                pmax[idim] = std::max(pmax[idim], v[idim]);
+            }
+            for (unsigned int j = i + 1; j < GeometryInfo<dim>::vertices_per_cell; ++j)
+                dmin = std::min(dmin, v.distance(cell->vertex(j)));
+        }
+        for (unsigned int idim = 0; idim < dim; ++idim){
+            bbox[icell*2*dim + idim] = pmin[idim];
+            bbox[icell*2*dim + dim + idim] = pmax[idim];
+        }
+        min_dist[icell] = dmin;
+
+        const Point<dim> cc = cell->center();
+        const double diam = pmin.distance(pmax);
+        for (unsigned int iface = 0; iface < n_faces; ++iface){
+            // The normal of a line face is perpendicular to the line.
+            // The normal of a quadrilateral face is the cross product of its diagonals
+            Tensor<1,dim> n;
+            if (dim == 2){
+                const Tensor<1,dim> t = cell->face(iface)->vertex(1) - cell->face(iface)->vertex(0);
+                n[0] = t[1];
+                n[1] = -t[0];
+            }
+            else if (dim == 3){
+                const Tensor<1,dim> d1 = cell->face(iface)->vertex(3) - cell->face(iface)->vertex(0);
+                const Tensor<1,dim> d2 = cell->face(iface)->vertex(2) - cell->face(iface)->vertex(1);
+                n[0] = d1[1]*d2[2] - d1[2]*d2[1];
+                n[1] = d1[2]*d2[0] - d1[0]*d2[2];
+                n[2] = d1[0]*d2[1] - d1[1]*d2[0];
+            }
+            const Point<dim> fc = cell->face(iface)->center();
+            if (n*(fc - cc) < 0)
+                n = -n;
+            n = n/n.norm();
+            const double offset = n*fc;
+            double tol = 1e-8*diam;
+            for (unsigned int iv = 0; iv < GeometryInfo<dim>::vertices_per_face; ++iv)
+                tol = std::max(tol, std::abs(n*cell->face(iface)->vertex(iv) - offset) + 1e-8*diam);
+
+            double* pl = &planes[(icell*n_faces + iface)*(dim + 2)];
+            for (unsigned int idim = 0; idim < dim; ++idim)
+                pl[idim] = n[idim];
+            pl[dim] = offset;
+            pl[dim + 1] = tol;
+
+            if (cell->at_boundary(iface))
+                continue;
+            int* nb = &neighbors[(icell*n_faces + iface)*n_face_children];
+            if (cell->neighbor(iface)->active())
+                nb[0] = cell->neighbor(iface)->active_cell_index();
+            else{
+                for (unsigned int isub = 0; isub < cell->face(iface)->n_children(); ++isub)
+                    nb[isub] = cell->neighbor_child_on_subface(iface, isub)->active_cell_index();
+            }
+        }
+    }
+}
+
+template <int dim>
+void CellGeometryCache<dim>::build_halo(unsigned int n_layers){
+    const int n_cells = cells.size();
+    halo.assign(n_cells, 0);
+    if (n_layers == 0)
+        return;
+    for (int icell = 0; icell < n_cells; ++icell)
+        halo[icell] = cell_status[icell] == 1 ? 1 : 0;
+}
+
+template <int dim>
+Point<dim> CellGeometryCache<dim>::bbox_center(int icell)const{
+    Point<dim> c;
+    for (unsigned int idim = 0; idim < dim; ++idim)
+        c[idim] = 0.5*(bbox[icell*2*dim + idim] + bbox[icell*2*dim + dim + idim]);
+    return c;
+}
+
+template <int dim>
+Point<dim> CellGeometryCache<dim>::bbox_position(int icell, const Point<dim>& p)const{
+    Point<dim> r;
+    const double* lo = &bbox[icell*2*dim];
+    const double* hi = lo + dim;
+    for (unsigned int idim = 0; idim < dim; ++idim)
+        r[idim] = (p[idim] - lo[idim])/(hi[idim] - lo[idim]);
+    return r;
+}
+
+template <int dim>
+bool CellGeometryCache<dim>::in_bbox(int icell, const Point<dim>& p)const{
+    const double* lo = &bbox[icell*2*dim];
+    const double* hi = lo + dim;
+    for (unsigned int idim = 0; idim < dim; ++idim){
+        // point_inside has a small tolerance, so the box is slightly inflated
+        const double tol = 1e-6*(hi[idim] - lo[idim]);
+        if (p[idim] < lo[idim] - tol || p[idim] > hi[idim] + tol)
+            return false;
+    }
+    return true;
+}
+
+template <int dim>
+int CellGeometryCache<dim>::plane_test(int icell, const Point<dim>& p)const{
+    int outcome = 1;
+    for (unsigned int iface = 0; iface < GeometryInfo<dim>::faces_per_cell; ++iface){
+        const double* pl = &planes[(icell*GeometryInfo<dim>::faces_per_cell + iface)*(dim + 2)];
+        double dst = -pl[dim];
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            dst += pl[idim]*p[idim];
+        if (dst > pl[dim + 1])
+            return 0;
+        if (dst > -pl[dim + 1])
+            outcome = -1;
+    }
+    return outcome;
+}
+
+#endif // CELL_GEOMETRY_CACHE_H
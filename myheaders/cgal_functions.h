@@ -60,14 +60,46 @@ typedef ine_Kernel::Point_3                                                 ine_
 */
 typedef ine_Kernel::Triangle_3                                              ine_Triangle;
 
-/*! \var  typedef std::list<ine_Triangle>  ineTriangle_list
-    \brief Type definition of a list of triangles based on inexact kernel
+/*!
+ * \brief The ine_Stream_Triangle struct is a triangle together with an integer id.
+ * The id is carried by the primitives of the AABB tree, so the tree queries return it directly.
+ */
+struct ine_Stream_Triangle{
+    ine_Stream_Triangle(){}
+    ine_Stream_Triangle(const ine_Triangle& triangle_in, int id_in)
+        :triangle(triangle_in), id(id_in){}
+    ine_Triangle triangle;
+    int id;
+};
+
+/*! \var  typedef std::vector<ine_Stream_Triangle>  ineTriangle_list
+    \brief Type definition of a random access list of triangles with ids based on inexact kernel
 */
-typedef std::list<ine_Triangle>                                             ineTriangle_list;
+typedef std::vector<ine_Stream_Triangle>                                    ineTriangle_list;
+
+/*!
+ * \brief The ine_Primitive struct is the AABB tree primitive of an #ine_Stream_Triangle.
+ * The primitive keeps a copy of the triangle, therefore the tree does not depend on the container it was built from.
+ */
+struct ine_Primitive{
+    typedef int                  Id;
+    typedef ine_Kernel::Point_3  Point;
+    typedef ine_Triangle         Datum;
+
+    ine_Primitive(){}
+    ine_Primitive(ineTriangle_list::const_iterator it)
+        :m_triangle(it->triangle), m_id(it->id){}
+
+    const Id& id()const{return m_id;}
+    const Datum& datum()const{return m_triangle;}
+    Point reference_point()const{return m_triangle.vertex(0);}
+
+private:
+    Datum m_triangle;
+    Id m_id;
+};
 
 // typedefs from AABB tree
-typedef std::list<ine_Triangle>::iterator                                   ine_Iterator;
-typedef CGAL::AABB_triangle_primitive<ine_Kernel, ine_Iterator>             ine_Primitive;
 typedef CGAL::AABB_traits<ine_Kernel, ine_Primitive>                        ine_AABB_triangle_traits;
 typedef CGAL::AABB_tree<ine_AABB_triangle_traits>                           ine_Tree;
 typedef ine_Tree::Primitive_id                                              ine_primitive_id;
@@ -104,17 +136,13 @@ typedef CGAL::Barycentric_coordinates::Generalized_barycentric_coordinates_2<Mea
 
 
 void find_intersection_inner(ine_Tree& tree,
-                             ineTriangle_list& triangle_list,
                              ine_Triangle& triangle_query,
                              std::vector<int>& ids){
 
-    std::list<ine_primitive_id> intersects;
+    std::vector<ine_primitive_id> intersects;
     tree.all_intersected_primitives(triangle_query, std::back_inserter(intersects));
-    for (std::list<ine_primitive_id>::iterator it = intersects.begin(); it != intersects.end(); it++){
-        ine_primitive_id itt = *it;
-        std::size_t index_in_vector = static_cast<std::size_t>(std::distance(triangle_list.begin(), itt));
-        ids.push_back(static_cast<int>(index_in_vector));
-    }
+    for (unsigned int i = 0; i < intersects.size(); ++i)
+        ids.push_back(intersects[i]);
 }
 
 /*!
@@ -125,13 +153,12 @@ void find_intersection_inner(ine_Tree& tree,
  * which river segments intersect and returns their ids
  *
  * \param tree structure holds the data of the stream outlines
- * \param triangle_list
  * \param xp are the x coordinates of the quadrilateral cells
  * \param yp are the x coordinates of the quadrilateral cells
- * \param ids are the ids of the river segments that intersects with the quadrilateral cell in question
+ * \param ids are the ids of the triangle primitives that intersect with the quadrilateral cell in question.
+ * The same id may appear more than once
  */
 bool find_intersection_in_AABB_TREE(ine_Tree& tree,
-                                    ineTriangle_list& triangle_list,
                                     std::vector<double>& xp,
                                     std::vector<double>& yp,
                                     std::vector<int>& ids){
@@ -145,11 +172,11 @@ bool find_intersection_in_AABB_TREE(ine_Tree& tree,
     ine_Triangle tria1(ine_Point3(xp[0], yp[0], 0.0),
                        ine_Point3(xp[1], yp[1], 0.0),
                        ine_Point3(xp[2], yp[2], 0.0));
-    find_intersection_inner(tree, triangle_list, tria1, ids);
+    find_intersection_inner(tree, tria1, ids);
     ine_Triangle tria2(ine_Point3(xp[0], yp[0], 0.0),
                        ine_Point3(xp[2], yp[2], 0.0),
                        ine_Point3(xp[3], yp[3], 0.0));
-    find_intersection_inner(tree, triangle_list, tria2, ids);
+    find_intersection_inner(tree, tria2, ids);
 
     if (ids.size() > 0)
         return true;
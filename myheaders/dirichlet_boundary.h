@@ -2,13 +2,17 @@
 #define DIRICHLET_BOUNDARY_H
 
 
+#include <deal.II/base/mpi.h>
 #include <deal.II/dofs/function_map.h>
 #include <deal.II/distributed/tria.h>
+#include <deal.II/grid/cell_id.h>
 
 #include "interpinterface.h"
 #include "my_functions.h"
 #include "cgal_functions.h"
 #include "helper_functions.h"
+#include "mpi_help.h"
+#include "box_tree.h"
 
 
 namespace BoundaryConditions{
@@ -16,6 +20,9 @@ namespace BoundaryConditions{
 using namespace dealii;
 
 
+//! The types of the boundary primitives
+enum BoundType { BND_TOP, BND_BOT, BND_EDGE, BND_EDGETOP, BND_UNKNOWN };
+
 /*! A primitive boundary shape.
  *
  * A primitive shape boundary is a polygon that is associated with a single constant value.
@@ -36,6 +43,12 @@ public:
     //! The type of boundary. It can be any of the keywords TOP, BOT, EDGE
     std::string TYPE;
 
+    //! The #TYPE keyword as enumeration, so that the type tests during the assignment are cheap
+    BoundType type;
+
+    //! Sets the #type from the #TYPE keyword
+    void set_type();
+
     //! This is the minimum point of the polygon bounding box
     Point<2> BBmin;
 
@@ -84,6 +97,21 @@ bool BoundPrim::is_any_point_insideBB(std::vector<double> x, std::vector<double>
     return outcome;
 }
 
+void BoundPrim::set_type(){
+    if (TYPE == "TOP")
+        type = BND_TOP;
+    else if (TYPE == "BOT")
+        type = BND_BOT;
+    else if (TYPE == "EDGE")
+        type = BND_EDGE;
+    else if (TYPE == "EDGETOP")
+        type = BND_EDGETOP;
+    else{
+        type = BND_UNKNOWN;
+        std::cerr << TYPE << " is not a valid boundary type. Valid options are TOP, BOT, EDGE and EDGETOP" << std::endl;
+    }
+}
+
 bool BoundPrim::Point_in_BB(double xmin, double ymin, double xmax, double ymax, double x, double y){
     if (x > xmin && x < xmax && y > ymin && y < ymax)
         return true;
@@ -131,11 +159,16 @@ public:
     *
     * At the moment when the type is EDGE the next value must always be 2.
     *
+    * The file is read with #read_input_file, therefore this must be called by all processors.
     */
     void get_from_file(std::string& namefile, std::string& input_dir);
 
     void read_master_file(std::string& namefile, std::string& input_dir);
 
+    //! Enables the memoization of the boundary values (see InterpInterface#enable_cache).
+    //! It has to be called before #get_from_file
+    void set_cache(unsigned int max_size, double tolerance);
+
     //! This is a dealii structure that creates a map between face ids and boundaries and it is used
     //! during dirichlet boundary assignement
     typename FunctionMap<dim>::type		function_map;
@@ -166,6 +199,12 @@ public:
     * First we compute the distance between the boundary line and the vertices of the face. Since those faces are the vertical ones we can simply test
     * the first two vertices. If the distance is less than a specified threshold we used CGAL functions to test if there are
     * overlapping parts between the two segments.
+    *
+    * The boundary ids of the faces are cached by cell id. If the mesh has not changed since the last call
+    * the ids that are already on the triangulation are kept and only the id lists are rebuilt. Otherwise
+    * the cached ids are reapplied and the tests above are performed only for the cells that are not in the cache,
+    * i.e. the children of the cells that have been refined and the cells that became visible to this processor
+    * after repartitioning.
     */
     void assign_dirichlet_to_triangulation(parallel::distributed::Triangulation<dim>& triangulation,
                    typename FunctionMap<dim>::type&	dirichlet_boundary,
@@ -179,6 +218,13 @@ public:
      */
     void add_id(std::vector<int>& id_list, int id);
 
+    /*!
+     * \brief mesh_changed informs the class that the triangulation has been refined, coarsened or repartitioned
+     * so that the next #assign_dirichlet_to_triangulation updates the boundary ids of the new cells.
+     * NPSAT calls it from the Triangulation::Signals::any_change signal
+     */
+    void mesh_changed(){face_ids_current = false;}
+
 
     std::string namefile;
     std::vector<BoundPrim> boundary_parts;
@@ -186,24 +232,77 @@ public:
     std::vector<MyFunction<dim,dim>> DirFunctions;
     int Nbnd;
 
+private:
+    //! Index of the bounding boxes of the TOP primitives
+    BoxTree top_index;
+
+    //! Index of the bounding boxes of the BOT primitives
+    BoxTree bot_index;
+
+    //! Index of the bounding boxes of the EDGE and EDGETOP primitives
+    BoxTree edge_index;
+
+    //! Builds the indices of the boundary primitives. It is called at the end of #get_from_file
+    void build_index();
+
+    //! Returns the ids of the boundary primitives that may contain the face iface of the cell in ascending order
+    void face_candidates(const typename parallel::distributed::Triangulation<dim>::active_cell_iterator& cell,
+                         unsigned int iface, std::vector<int>& candidates)const;
+
+    //! The maximum number of cached values per boundary function. 0 disables the cache
+    unsigned int cache_size;
+
+    //! The quantization step of the cached coordinates
+    double cache_tolerance;
+
+    /*!
+     * \brief compute_face_id tests the face iface of the cell against the boundary primitives
+     * and returns the id that the face should have. This is either the default deal id of the face or
+     * the function map id of the first boundary primitive that contains the face
+     */
+    types::boundary_id compute_face_id(const typename parallel::distributed::Triangulation<dim>::active_cell_iterator& cell,
+                                       unsigned int iface, std::vector<int>& candidates);
+
+    //! Adds the id to the top or bottom list if it corresponds to a TOP or BOT boundary primitive
+    void add_face_id(types::boundary_id id, std::vector<int>& top_boundary_ids, std::vector<int>& bottom_boundary_ids);
+
+    //! The boundary ids of the faces of the locally owned and ghost cells that touch the boundary.
+    //! Interior faces are stored as numbers::invalid_boundary_id
+    std::map<CellId, std::vector<types::boundary_id> > face_ids;
+
+    //! False if the triangulation may have changed since the boundary ids have been assigned
+    bool face_ids_current;
+
+    //! The offset of the function map ids
+    static const int JJ = 17;
+
+    //! A vertical cell face is tested for colinearity with an EDGE line if both of its
+    //! vertices are closer than this distance to the line
+    static constexpr double edge_dst_thres = 20;
 };
 
 template <int dim>
 Dirichlet<dim>::Dirichlet(){
     Nbnd = 0;
+    cache_size = 0;
+    cache_tolerance = 0;
+    face_ids_current = false;
+}
+
+template <int dim>
+void Dirichlet<dim>::set_cache(unsigned int max_size, double tolerance){
+    cache_size = max_size;
+    cache_tolerance = tolerance;
 }
 
 template<int dim>
 void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir){
-    std::ifstream  datafile(filename.c_str());
-    if (!datafile.good()){
-        std::cout << "Can't open " << filename << std::endl;
-    }
-    else{
-        char buffer[512];
-        memset (buffer,' ',512);
-        datafile.getline(buffer,512);
-        std::istringstream inp(buffer);
+    BinaryIO::InputBuffer input;
+    if (read_input_file(filename, input)){
+        BinaryIO::BufferStream datafile(input);
+        std::string line;
+        getline(datafile, line);
+        std::istringstream inp(line);
         int N_bnd;
         inp >> N_bnd;
         int new_size = N_bnd + boundary_parts.size();
@@ -213,17 +312,17 @@ void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir
 
         std::string type;
         for (int i = 0; i < N_bnd; ++i){
-            memset (buffer,' ',512);
-            datafile.getline(buffer,512);
-            std::istringstream inp(buffer);
+            getline(datafile, line);
+            std::istringstream inp(line);
             inp >> boundary_parts[i].TYPE;
+            boundary_parts[i].set_type();
             if (dim == 2){
-                if (boundary_parts[i].TYPE == "EDGE" || boundary_parts[i].TYPE == "EDGETOP"){// in 2D an EDGE is represented by one point
+                if (boundary_parts[i].type == BND_EDGE || boundary_parts[i].type == BND_EDGETOP){// in 2D an EDGE is represented by one point
                     double x;
                     inp >> x; boundary_parts[i].Xcoords.push_back(x);
                     boundary_parts[i].Ycoords.push_back(0.0);
                 }
-                else if (boundary_parts[i].TYPE == "TOP" || boundary_parts[i].TYPE == "BOT"){ // in 2D the top and bottom is represented by 2 points
+                else if (boundary_parts[i].type == BND_TOP || boundary_parts[i].type == BND_BOT){ // in 2D the top and bottom is represented by 2 points
                     double x;
                     inp >> x; boundary_parts[i].Xcoords.push_back(x); boundary_parts[i].Ycoords.push_back(0.0);
                     inp >> x; boundary_parts[i].Xcoords.push_back(x); boundary_parts[i].Ycoords.push_back(0.0);
@@ -232,6 +331,7 @@ void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir
                 Nbnd++;
 
                 interp_funct[i].get_data(boundary_parts[i].value);
+                interp_funct[i].enable_cache(cache_size, cache_tolerance);
 
                 //MyFunction<dim,dim> tempfnc(interp_funct[i]);
                 //DirFunctions.push_back(tempfnc);
@@ -250,15 +350,15 @@ void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir
                     boundary_parts[i].value = input_dir + temp_str;
                 }
 
-                if (boundary_parts[i].TYPE == "TOP" || boundary_parts[i].TYPE == "BOT"){
+                if (boundary_parts[i].type == BND_TOP || boundary_parts[i].type == BND_BOT){
                     double x;
                     boundary_parts[i].BBmin[0] = 99999999999;
                     boundary_parts[i].BBmin[1] = 99999999999;
                     boundary_parts[i].BBmax[0] = -99999999999;
                     boundary_parts[i].BBmax[1] = -99999999999;
                     for (int iv = 0; iv < N; ++iv){
-                        datafile.getline(buffer,512);
-                        std::istringstream inp(buffer);
+                        getline(datafile, line);
+                        std::istringstream inp(line);
                         inp >> x;
                         // X coordinate
                         if (x < boundary_parts[i].BBmin[0])
@@ -278,16 +378,17 @@ void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir
                     Nbnd++;
 
                     interp_funct[i].get_data(boundary_parts[i].value);
+                    interp_funct[i].enable_cache(cache_size, cache_tolerance);
                     //MyFunction<dim,dim> tempfnc(interp_funct[i]);
                     //DirFunctions.push_back(tempfnc);
                     DirFunctions[i].set_interpolant(interp_funct[i]);
                 }
-                else if (boundary_parts[i].TYPE == "EDGE" || boundary_parts[i].TYPE == "EDGETOP"){// we read the value associated with the edge
+                else if (boundary_parts[i].type == BND_EDGE || boundary_parts[i].type == BND_EDGETOP){// we read the value associated with the edge
                     if (N>=2){
                         double x;
                         for (unsigned int iv = 0; iv < 2; ++iv){
-                            datafile.getline(buffer,512);
-                            std::istringstream inp(buffer);
+                            getline(datafile, line);
+                            std::istringstream inp(line);
                             inp >> x;
                             boundary_parts[i].Xcoords.push_back(x);
                             inp >> x;
@@ -295,6 +396,7 @@ void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir
                         }
                         Nbnd++;
                         interp_funct[i].get_data(boundary_parts[i].value);
+                        interp_funct[i].enable_cache(cache_size, cache_tolerance);
 
                         Point<dim> a,b;
                         a[0] = boundary_parts[i].Xcoords[0];
@@ -312,12 +414,75 @@ void Dirichlet<dim>::get_from_file(std::string& filename, std::string& input_dir
                     }
                     else{
                         interp_funct[i].get_data(boundary_parts[i].value);
+                        interp_funct[i].enable_cache(cache_size, cache_tolerance);
                         DirFunctions[i].set_interpolant(interp_funct[i]);
                     }
                 }
             }
         }
     }
+    build_index();
+}
+
+template <int dim>
+void Dirichlet<dim>::build_index(){
+    top_index.clear();
+    bot_index.clear();
+    edge_index.clear();
+    if (dim != 3)
+        return;
+    for (unsigned int i = 0; i < boundary_parts.size(); ++i){
+        if (boundary_parts[i].type == BND_TOP)
+            top_index.add(boundary_parts[i].BBmin[0], boundary_parts[i].BBmin[1], boundary_parts[i].BBmax[0], boundary_parts[i].BBmax[1], i);
+        else if (boundary_parts[i].type == BND_BOT)
+            bot_index.add(boundary_parts[i].BBmin[0], boundary_parts[i].BBmin[1], boundary_parts[i].BBmax[0], boundary_parts[i].BBmax[1], i);
+        else if (boundary_parts[i].type == BND_EDGE || boundary_parts[i].type == BND_EDGETOP){
+            if (boundary_parts[i].Xcoords.size() == 2){
+                // The faces that are closer than #edge_dst_thres to the edge line are tested for colinearity
+                edge_index.add(std::min(boundary_parts[i].Xcoords[0], boundary_parts[i].Xcoords[1]) - edge_dst_thres,
+                               std::min(boundary_parts[i].Ycoords[0], boundary_parts[i].Ycoords[1]) - edge_dst_thres,
+                               std::max(boundary_parts[i].Xcoords[0], boundary_parts[i].Xcoords[1]) + edge_dst_thres,
+                               std::max(boundary_parts[i].Ycoords[0], boundary_parts[i].Ycoords[1]) + edge_dst_thres, i);
+            }
+            else{
+                double xmin, ymin, xmax, ymax;
+                if (interp_funct[i].boundary_bounding_box(xmin, ymin, xmax, ymax))
+                    edge_index.add(xmin, ymin, xmax, ymax, i);
+                else
+                    // Without a known extent the part has to be tested against every face
+                    edge_index.add(-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(),
+                                   std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), i);
+            }
+        }
+    }
+    top_index.build();
+    bot_index.build();
+    edge_index.build();
+}
+
+template <int dim>
+void Dirichlet<dim>::face_candidates(const typename parallel::distributed::Triangulation<dim>::active_cell_iterator& cell,
+                                     unsigned int iface, std::vector<int>& candidates)const{
+    candidates.clear();
+    if (dim != 3){
+        for (unsigned int i = 0; i < boundary_parts.size(); ++i)
+            candidates.push_back(i);
+        return;
+    }
+    double xmin = std::numeric_limits<double>::max();  double ymin = std::numeric_limits<double>::max();
+    double xmax = -std::numeric_limits<double>::max(); double ymax = -std::numeric_limits<double>::max();
+    for (unsigned int ivert = 0; ivert < GeometryInfo<dim>::vertices_per_face; ++ivert){
+        xmin = std::min(xmin, cell->face(iface)->vertex(ivert)[0]);
+        ymin = std::min(ymin, cell->face(iface)->vertex(ivert)[1]);
+        xmax = std::max(xmax, cell->face(iface)->vertex(ivert)[0]);
+        ymax = std::max(ymax, cell->face(iface)->vertex(ivert)[1]);
+    }
+    if (iface == 5)
+        top_index.query(xmin, ymin, xmax, ymax, candidates);
+    else if (iface == 4)
+        bot_index.query(xmin, ymin, xmax, ymax, candidates);
+    else
+        edge_index.query(xmin, ymin, xmax, ymax, candidates);
 }
 
 template <int dim>
@@ -330,198 +495,242 @@ void Dirichlet<dim>::assign_dirichlet_to_triangulation(parallel::distributed::Tr
     top_boundary_ids.push_back(GeometryInfo<dim>::faces_per_cell-1);
     bottom_boundary_ids.push_back(GeometryInfo<dim>::faces_per_cell-2);
 
-    const int JJ = 17;
     for (unsigned int i = 0; i < DirFunctions.size(); ++i){
         dirichlet_boundary[JJ + i] = &DirFunctions[i];
     }
 
+    // If the mesh is the same as in the previous call the boundary ids are already set on the faces
+    const bool reuse_ids = face_ids_current;
+
+    std::map<CellId, std::vector<types::boundary_id> > new_face_ids;
+    typename std::map<CellId, std::vector<types::boundary_id> >::iterator it;
+    std::vector<int> candidates;
+    unsigned int n_computed = 0;
     typename parallel::distributed::Triangulation<dim>::active_cell_iterator
     cell = triangulation.begin_active(),
     endc = triangulation.end();
     for (; cell!=endc; ++cell){
         if (cell->is_locally_owned() || cell->is_ghost()){
-            for (unsigned int iface = 0; iface < GeometryInfo<dim>::faces_per_cell; ++iface){
-                if (cell->face(iface)->at_boundary()){
-                    // Here we reset the boundary indicators
-                    cell->face(iface)->set_all_boundary_ids(iface);
-                    for (unsigned int i = 0; i < boundary_parts.size(); ++i){
-                        if (dim == 2){
-                            if (boundary_parts[i].TYPE == "EDGE" && (cell->face(iface)->boundary_id() == 0 || cell->face(iface)->boundary_id() == 1) ){
-                                Point<dim> x1 = cell->face(iface)->vertex(0);
-                                if (abs(x1[0] - boundary_parts[i].Xcoords[0]) < 0.01){
-                                    cell->face(iface)->set_all_boundary_ids(JJ+i);
-                                    break;
-                                }
-                            }
-                            else if (boundary_parts[i].TYPE == "TOP" && cell->face(iface)->boundary_id() == 3){
-                                add_id(top_boundary_ids, 3);
-                                Point<dim> x1 = cell->face(iface)->vertex(0);
-                                Point<dim> x2 = cell->face(iface)->vertex(1);
-                                double xp1 = boundary_parts[i].Xcoords[0];
-                                double xp2 = boundary_parts[i].Xcoords[1];
-                                bool assign_this = false;
-                                if (xp1 > x1[0] && xp1 < x2[0])
-                                    assign_this = true;
-                                else if (xp2 > x1[0] && xp2 < x2[0])
-                                    assign_this = true;
-                                else if (x1[0] > xp1 && x1[0] < xp2)
-                                    assign_this = true;
-                                else if (x2[0] > xp1 && x2[0] < xp2)
-                                    assign_this = true;
-
-                                if (assign_this){
-                                    cell->face(iface)->set_all_boundary_ids(JJ+i);
-                                    add_id(top_boundary_ids, JJ+i);
-                                    break;
-                                }
-                            }
-                            else if (boundary_parts[i].TYPE == "BOT" && cell->face(iface)->boundary_id() == 2){
-                                add_id(bottom_boundary_ids, 2);
-                                Point<dim> x1 = cell->face(iface)->vertex(0);
-                                Point<dim> x2 = cell->face(iface)->vertex(1);
-                                double xp1 = boundary_parts[i].Xcoords[0];
-                                double xp2 = boundary_parts[i].Xcoords[1];
-                                bool assign_this = false;
-                                if (xp1 > x1[0] && xp1 < x2[0])
-                                    assign_this = true;
-                                else if (xp2 > x1[0] && xp2 < x2[0])
-                                    assign_this = true;
-                                else if (x1[0] > xp1 && x1[0] < xp2)
-                                    assign_this = true;
-                                else if (x2[0] > xp1 && x2[0] < xp2)
-                                    assign_this = true;
-
-                                if (assign_this){
-                                    cell->face(iface)->set_all_boundary_ids(JJ+i);
-                                    add_id(bottom_boundary_ids, JJ+i);
-                                    break;
-                                }
-                            }
-                        }
-                        else if (dim == 3){
-                            if ((boundary_parts[i].TYPE == "TOP" && (cell->face(iface)->boundary_id() == 5 || iface == 5)) ||
-                                (boundary_parts[i].TYPE == "BOT" && (cell->face(iface)->boundary_id() == 4 || iface == 4))  ){
-                                std::vector<double> xface, yface;
-                                for (unsigned int ivert = 0; ivert < GeometryInfo<dim>::vertices_per_face; ++ivert){
-                                    xface.push_back(cell->face(iface)->vertex(ivert)[0]);
-                                    yface.push_back(cell->face(iface)->vertex(ivert)[1]);
-                                }
+            if (!cell->at_boundary())
+                continue;
+            const CellId cell_id = cell->id();
+            it = face_ids.find(cell_id);
+            if (it == face_ids.end()){
+                // This cell is new. Here we reset the boundary indicators and test the faces against the boundary parts
+                std::vector<types::boundary_id> ids(GeometryInfo<dim>::faces_per_cell, numbers::invalid_boundary_id);
+                for (unsigned int iface = 0; iface < GeometryInfo<dim>::faces_per_cell; ++iface){
+                    if (cell->face(iface)->at_boundary()){
+                        cell->face(iface)->set_all_boundary_ids(iface);
+                        ids[iface] = compute_face_id(cell, iface, candidates);
+                        cell->face(iface)->set_all_boundary_ids(ids[iface]);
+                        add_face_id(ids[iface], top_boundary_ids, bottom_boundary_ids);
+                    }
+                }
+                n_computed++;
+                new_face_ids[cell_id] = ids;
+            }
+            else{
+                for (unsigned int iface = 0; iface < GeometryInfo<dim>::faces_per_cell; ++iface){
+                    if (it->second[iface] == numbers::invalid_boundary_id)
+                        continue;
+                    if (!reuse_ids)
+                        cell->face(iface)->set_all_boundary_ids(it->second[iface]);
+                    add_face_id(it->second[iface], top_boundary_ids, bottom_boundary_ids);
+                }
+                new_face_ids[cell_id].swap(it->second);
+            }
+        }
+    }
+    // The cells that have been refined or are no longer visible to this processor are dropped
+    face_ids.swap(new_face_ids);
+    face_ids_current = true;
+
+    // The counts of all processors are printed once. The ghost cells are counted by every processor that sees them
+    const unsigned int n_computed_all = Utilities::MPI::sum(n_computed, triangulation.get_communicator());
+    const unsigned int n_boundary_all = Utilities::MPI::sum(static_cast<unsigned int>(face_ids.size()),
+                                                            triangulation.get_communicator());
+    if (n_computed_all > 0 && Utilities::MPI::this_mpi_process(triangulation.get_communicator()) == 0)
+        std::cout << "\t Dirichlet ids computed for " << n_computed_all << " cells out of " << n_boundary_all
+                  << " boundary cells" << std::endl;
+}
 
-                                if (boundary_parts[i].is_any_point_insideBB(xface, yface) == false)
-                                    continue;
-
-                                // re-orient the cell coordinates
-                                double tempd = xface[2]; xface[2] = xface[3]; xface[3] = tempd;
-                                tempd = yface[2]; yface[2] = yface[3]; yface[3] = tempd;
-
-                                bool do_intersect = polyXpoly(boundary_parts[i].Xcoords, boundary_parts[i].Ycoords, xface, yface);
-                                if (do_intersect){
-                                    cell->face(iface)->set_all_boundary_ids(JJ+i);
-                                    if (boundary_parts[i].TYPE == "TOP")
-                                        add_id(top_boundary_ids, JJ+i);
-                                    else if (boundary_parts[i].TYPE == "BOT")
-                                        add_id(bottom_boundary_ids, JJ+i);
-                                    break;
-                                }
-                            }
-                            else if ((boundary_parts[i].TYPE == "EDGE" || boundary_parts[i].TYPE == "EDGETOP") && (
-                                         cell->face(iface)->boundary_id() == 0 ||
-                                         cell->face(iface)->boundary_id() == 1 ||
-                                         cell->face(iface)->boundary_id() == 2 ||
-                                         cell->face(iface)->boundary_id() == 3) )
-                            {
-                                if (boundary_parts[i].TYPE == "EDGETOP" && !cell->face(5)->at_boundary())
-                                    continue;
-
-                                double cx3,cy3,cx4,cy4; // variables for storing the cell face coordinates
-                                //double cz3, cz4;// z variables are used only fo debuging
-                                cx3 = cell->face(iface)->vertex(0)[0]; cy3 = cell->face(iface)->vertex(0)[1]; //cz3 = cell->face(iface)->vertex(0)[2];
-                                cx4 = cell->face(iface)->vertex(1)[0]; cy4 = cell->face(iface)->vertex(1)[1]; //cz4 = cell->face(iface)->vertex(1)[2];
-
-                                // Sometimes the faces are oriented in such a way that vertices 0 and 1 have the same x and y coordinates
-                                // In such cases we use the 2nd point
-                                if (Point<2>(cx3,cy3).distance(Point<2>(cx4,cy4)) < 0.1){
-                                    cx4 = cell->face(iface)->vertex(2)[0]; cy4 = cell->face(iface)->vertex(2)[1]; //cz4 = cell->face(iface)->vertex(2)[2];
-                                }
+template <int dim>
+types::boundary_id Dirichlet<dim>::compute_face_id(const typename parallel::distributed::Triangulation<dim>::active_cell_iterator& cell,
+                                                   unsigned int iface, std::vector<int>& candidates){
+    // Only the boundary parts whose extent overlaps the face are tested, in the order they were read
+    face_candidates(cell, iface, candidates);
+    for (unsigned int ic = 0; ic < candidates.size(); ++ic){
+        const unsigned int i = candidates[ic];
+        if (dim == 2){
+            if (boundary_parts[i].type == BND_EDGE && (cell->face(iface)->boundary_id() == 0 || cell->face(iface)->boundary_id() == 1) ){
+                Point<dim> x1 = cell->face(iface)->vertex(0);
+                if (abs(x1[0] - boundary_parts[i].Xcoords[0]) < 0.01){
+                    return JJ+i;
+                }
+            }
+            else if (boundary_parts[i].type == BND_TOP && cell->face(iface)->boundary_id() == 3){
+                Point<dim> x1 = cell->face(iface)->vertex(0);
+                Point<dim> x2 = cell->face(iface)->vertex(1);
+                double xp1 = boundary_parts[i].Xcoords[0];
+                double xp2 = boundary_parts[i].Xcoords[1];
+                bool assign_this = false;
+                if (xp1 > x1[0] && xp1 < x2[0])
+                    assign_this = true;
+                else if (xp2 > x1[0] && xp2 < x2[0])
+                    assign_this = true;
+                else if (x1[0] > xp1 && x1[0] < xp2)
+                    assign_this = true;
+                else if (x2[0] > xp1 && x2[0] < xp2)
+                    assign_this = true;
+
+                if (assign_this){
+                    return JJ+i;
+                }
+            }
+            else if (boundary_parts[i].type == BND_BOT && cell->face(iface)->boundary_id() == 2){
+                Point<dim> x1 = cell->face(iface)->vertex(0);
+                Point<dim> x2 = cell->face(iface)->vertex(1);
+                double xp1 = boundary_parts[i].Xcoords[0];
+                double xp2 = boundary_parts[i].Xcoords[1];
+                bool assign_this = false;
+                if (xp1 > x1[0] && xp1 < x2[0])
+                    assign_this = true;
+                else if (xp2 > x1[0] && xp2 < x2[0])
+                    assign_this = true;
+                else if (x1[0] > xp1 && x1[0] < xp2)
+                    assign_this = true;
+                else if (x2[0] > xp1 && x2[0] < xp2)
+                    assign_this = true;
+
+                if (assign_this){
+                    return JJ+i;
+                }
+            }
+        }
+        else if (dim == 3){
+            if ((boundary_parts[i].type == BND_TOP && (cell->face(iface)->boundary_id() == 5 || iface == 5)) ||
+                (boundary_parts[i].type == BND_BOT && (cell->face(iface)->boundary_id() == 4 || iface == 4))  ){
+                std::vector<double> xface, yface;
+                for (unsigned int ivert = 0; ivert < GeometryInfo<dim>::vertices_per_face; ++ivert){
+                    xface.push_back(cell->face(iface)->vertex(ivert)[0]);
+                    yface.push_back(cell->face(iface)->vertex(ivert)[1]);
+                }
 
-                                /*{// Debug code
-                                    Point<2> dbg(32374.5,1359430);
-                                    if (dbg.distance(Point<2>(cx3,cy3)) < 100 || dbg.distance(Point<2>(cx4,cy4)) < 100){
-                                        int iii = 0;
-                                        dummy_function(true,iii);
-                                    }
-                                }*/
-
-
-                                if (boundary_parts[i].Xcoords.size() == 2){
-                                    double lx1,ly1,lx2,ly2; // variables for storing the boundary coordinates
-
-                                    lx1 = boundary_parts[i].Xcoords[0]; ly1 = boundary_parts[i].Ycoords[0];
-                                    lx2 = boundary_parts[i].Xcoords[1]; ly2 = boundary_parts[i].Ycoords[1];
-                                    //double L = sqrt(pow(lx2 - lx1, 2) + pow(ly2 - ly1, 2));
-
-
-                                    // Next we will calculate the distance of the two cell points from the boundary line
-                                    double dst1 = distance_point_line(cx3,cy3,lx1,ly1,lx2,ly2);
-                                    double dst2 = distance_point_line(cx4,cy4,lx1,ly1,lx2,ly2);
-
-                                    // The cell face is collinear with the boundary line if the distances is very close to zero
-                                    // and one of the two distances is positive.
-                                    bool are_colinear = false;
-                                    if (std::abs(dst1) < 20 && std::abs(dst2) < 20){
-                                        if ( !(dst1 < 0) || !(dst2 < 0)){
-                                            are_colinear = true;
-                                        }
-                                        else{ // It maybe possible due to numerical errors that the distances are both negative
-                                            // This can happen under two circumstances.
-                                            // 1) The boundary line is smaller than the cell face. This means that the boundary condition
-                                            //    lines have not been set correctly.
-                                            //    FUTURE VERSION OF THE CODE SHOULD ADDRESS THIS CASE
-                                            // 2) The boundary segment is identical with the cell face. Then it is possible that both points
-                                            //    of the cell may appear outside of the boundary by very small amount.
-
-                                            //====== Case 2 ======
-                                            {
-                                                double min_dst1 = std::min(distance_2_points(cx3,cy3,lx1,ly1),distance_2_points(cx3,cy3,lx2,ly2));
-                                                double min_dst2 = std::min(distance_2_points(cx4,cy4,lx1,ly1),distance_2_points(cx4,cy4,lx2,ly2));
-                                                if (min_dst1 < 0.1 && min_dst2 < 0.1){
-                                                    are_colinear = true;
-                                                }
-                                            }
-                                        }
-                                        if (are_colinear){
-                                            // the face is colinear with the boundary however we will do an extra check using cgal methods
-                                            CGAL::Segment_2< exa_Kernel > segm(exa_Point2(lx1,ly1),exa_Point2(lx2,ly2));
-                                            if (segm.collinear_has_on(exa_Point2(cx3,cy3)) || segm.collinear_has_on(exa_Point2(cx4,cy4))){
-                                                cell->face(iface)->set_all_boundary_ids(JJ+i);
-                                                //print_cell_face_matlab<dim>(cell,iface);
-                                                break;
-                                            }
-                                        }
-                                    }
-                                }
-                                else if (boundary_parts[i].Xcoords.size() == 0){
-                                    // If there are no coordinates defined in the boundary then it must be an interpolation function of type
-                                    // boundary line
-                                    Point<dim> A, B;
-                                    A[0] = cx3; A[1] = cy3;
-                                    B[0] = cx4; B[1] = cy4;
-                                    if (interp_funct[i].is_face_part_of_BND(A,B)){
-                                        cell->face(iface)->set_all_boundary_ids(JJ+i);
-                                        break;
-                                    }
+                if (boundary_parts[i].is_any_point_insideBB(xface, yface) == false)
+                    continue;
+
+                // re-orient the cell coordinates
+                double tempd = xface[2]; xface[2] = xface[3]; xface[3] = tempd;
+                tempd = yface[2]; yface[2] = yface[3]; yface[3] = tempd;
+
+                bool do_intersect = polyXpoly(boundary_parts[i].Xcoords, boundary_parts[i].Ycoords, xface, yface);
+                if (do_intersect){
+                    return JJ+i;
+                }
+            }
+            else if ((boundary_parts[i].type == BND_EDGE || boundary_parts[i].type == BND_EDGETOP) && (
+                         cell->face(iface)->boundary_id() == 0 ||
+                         cell->face(iface)->boundary_id() == 1 ||
+                         cell->face(iface)->boundary_id() == 2 ||
+                         cell->face(iface)->boundary_id() == 3) )
+            {
+                if (boundary_parts[i].type == BND_EDGETOP && !cell->face(5)->at_boundary())
+                    continue;
+
+                double cx3,cy3,cx4,cy4; // variables for storing the cell face coordinates
+                //double cz3, cz4;// z variables are used only fo debuging
+                cx3 = cell->face(iface)->vertex(0)[0]; cy3 = cell->face(iface)->vertex(0)[1]; //cz3 = cell->face(iface)->vertex(0)[2];
+                cx4 = cell->face(iface)->vertex(1)[0]; cy4 = cell->face(iface)->vertex(1)[1]; //cz4 = cell->face(iface)->vertex(1)[2];
+
+                // Sometimes the faces are oriented in such a way that vertices 0 and 1 have the same x and y coordinates
+                // In such cases we use the 2nd point
+                if (Point<2>(cx3,cy3).distance(Point<2>(cx4,cy4)) < 0.1){
+                    cx4 = cell->face(iface)->vertex(2)[0]; cy4 = cell->face(iface)->vertex(2)[1]; //cz4 = cell->face(iface)->vertex(2)[2];
+                }
+
+                /*{// Debug code
+                    Point<2> dbg(32374.5,1359430);
+                    if (dbg.distance(Point<2>(cx3,cy3)) < 100 || dbg.distance(Point<2>(cx4,cy4)) < 100){
+                        int iii = 0;
+                        dummy_function(true,iii);
+                    }
+                }*/
+
+
+                if (boundary_parts[i].Xcoords.size() == 2){
+                    double lx1,ly1,lx2,ly2; // variables for storing the boundary coordinates
+
+                    lx1 = boundary_parts[i].Xcoords[0]; ly1 = boundary_parts[i].Ycoords[0];
+                    lx2 = boundary_parts[i].Xcoords[1]; ly2 = boundary_parts[i].Ycoords[1];
+                    //double L = sqrt(pow(lx2 - lx1, 2) + pow(ly2 - ly1, 2));
+
+
+                    // Next we will calculate the distance of the two cell points from the boundary line
+                    double dst1 = distance_point_line(cx3,cy3,lx1,ly1,lx2,ly2);
+                    double dst2 = distance_point_line(cx4,cy4,lx1,ly1,lx2,ly2);
+
+                    // The cell face is collinear with the boundary line if the distances is very close to zero
+                    // and one of the two distances is positive.
+                    bool are_colinear = false;
+                    if (std::abs(dst1) < edge_dst_thres && std::abs(dst2) < edge_dst_thres){
+                        if ( !(dst1 < 0) || !(dst2 < 0)){
+                            are_colinear = true;
+                        }
+                        else{ // It maybe possible due to numerical errors that the distances are both negative
+                            // This can happen under two circumstances.
+                            // 1) The boundary line is smaller than the cell face. This means that the boundary condition
+                            //    lines have not been set correctly.
+                            //    FUTURE VERSION OF THE CODE SHOULD ADDRESS THIS CASE
+                            // 2) The boundary segment is identical with the cell face. Then it is possible that both points
+                            //    of the cell may appear outside of the boundary by very small amount.
+
+                            //====== Case 2 ======
+                            {
+                                double min_dst1 = std::min(distance_2_points(cx3,cy3,lx1,ly1),distance_2_points(cx3,cy3,lx2,ly2));
+                                double min_dst2 = std::min(distance_2_points(cx4,cy4,lx1,ly1),distance_2_points(cx4,cy4,lx2,ly2));
+                                if (min_dst1 < 0.1 && min_dst2 < 0.1){
+                                    are_colinear = true;
                                 }
-                                else
-                                    std::cerr << "This boundary with id " << i << " has not 2 or 0 coordinates" << std::endl;
                             }
                         }
+                        if (are_colinear){
+                            // the face is colinear with the boundary however we will do an extra check using cgal methods
+                            CGAL::Segment_2< exa_Kernel > segm(exa_Point2(lx1,ly1),exa_Point2(lx2,ly2));
+                            if (segm.collinear_has_on(exa_Point2(cx3,cy3)) || segm.collinear_has_on(exa_Point2(cx4,cy4))){
+                                //print_cell_face_matlab<dim>(cell,iface);
+                                return JJ+i;
+                            }
+                        }
+                    }
+                }
+                else if (boundary_parts[i].Xcoords.size() == 0){
+                    // If there are no coordinates defined in the boundary then it must be an interpolation function of type
+                    // boundary line
+                    Point<dim> A, B;
+                    A[0] = cx3; A[1] = cy3;
+                    B[0] = cx4; B[1] = cy4;
+                    if (interp_funct[i].is_face_part_of_BND(A,B)){
+                        return JJ+i;
                     }
                 }
+                else
+                    std::cerr << "This boundary with id " << i << " has not 2 or 0 coordinates" << std::endl;
             }
         }
     }
+    return static_cast<types::boundary_id>(iface);
 }
 
+template <int dim>
+void Dirichlet<dim>::add_face_id(types::boundary_id id, std::vector<int>& top_boundary_ids, std::vector<int>& bottom_boundary_ids){
+    const int i = static_cast<int>(id) - JJ;
+    if (i < 0 || i >= static_cast<int>(boundary_parts.size()))
+        return;
+    if (boundary_parts[i].type == BND_TOP)
+        add_id(top_boundary_ids, id);
+    else if (boundary_parts[i].type == BND_BOT)
+        add_id(bottom_boundary_ids, id);
+}
 
 template <int dim>
 void Dirichlet<dim>::add_id(std::vector<int>& id_list, int id){
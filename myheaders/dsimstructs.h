@@ -27,6 +27,14 @@ struct SolverParameters{
     double solver_tol;
 
     int output_details;
+
+    //! The nonlinear iterations stop when the maximum water table change between two iterations
+    //! is smaller than NonLinearTol. Use 0 to run all #NonLinearIter iterations
+    double NonLinearTol;
+
+    //! Under relaxation factor of the water table update. The new water table is
+    //! old + RelaxFactor*(new - old). Use 1 for no relaxation
+    double RelaxFactor;
 };
 
 //! RefinementParameters is a struct with parameters that control the mesh refinements
@@ -72,10 +80,13 @@ struct ParticleParameters{
     //! streaml_iter is the maximum number of iterations for each particle
     int streaml_iter;
 
-    /*! There are three methods available for the particle tracking
+    /*! There are five methods available for the particle tracking
      *   - 1 -> for Euler
      *   - 2 -> for Runge Kutta 2nd order
      *   - 3 -> for Runge Kutta 4nd order
+     *   - 4 -> for adaptive Runge Kutta 3(2) (Bogacki-Shampine). The step length is controlled by #abs_tol and #rel_tol
+     *   - 5 -> for semi-analytical tracking (Pollock). The particles move from face to face of the cells
+     *   with the exact travel time of a cell-wise linear velocity that matches the face fluxes
      */
     int method;
 
@@ -89,6 +100,12 @@ struct ParticleParameters{
     //! the number of search layers around the current cell.
     int search_iter;
 
+    //! The absolute tolerance of the position error per step of the adaptive method. This is in length units.
+    double abs_tol;
+
+    //! The relative tolerance of the position error per step of the adaptive method. This is multiplied by the step length.
+    double rel_tol;
+
     //! Typically each stramline is represented by a polyline that may consist of a large number of vertices. To remove unnecessary
     //! vertices the program applies a Ramer–Douglas–Peucker algorithm (https://en.wikipedia.org/wiki/Ramer%E2%80%93Douglas%E2%80%93Peucker_algorithm)
     //!  where simplify_thres is the threshold of the simplification algorithm.
@@ -108,6 +125,64 @@ struct ParticleParameters{
 
     //! Well radius. The distance from the well that the particles will be realized
     double radius;
+
+    //! If this is greater than zero, every pilot_stride-th particle is traced in a pilot run before the particle tracking.
+    //! The number of steps per cell of the pilot run is used as cell weight to repartition the mesh.
+    int pilot_stride;
+
+    //! If this is greater than zero the particles advance in lock-step rounds grouped by their current cell.
+    //! The velocities of up to batch_size particles of the same cell are evaluated together.
+    //! 0 traces each particle to completion one at a time
+    int batch_size;
+
+    //! If this is 1 the particles are traced through the ghost layer and are sent to another processor when they leave it.
+    //! 0 sends the particles as soon as they enter a ghost cell
+    int halo_layers;
+
+    //! If this is 1 the velocity field is replicated on every compute node (see Particle_Tracking#build_replicated_mesh)
+    //! and each processor traces its share of the particles to completion without any communication
+    int replicated_mesh;
+
+    //! If this is 1 the velocity field is written into a tracking mesh file for the standalone tracer npsat_trace
+    int export_mesh;
+};
+
+/*!
+ * \brief The InputParameters struct holds the options that control how the input data are read
+ */
+struct InputParameters{
+    //! If this is set to 1 each processor keeps only the scattered interpolation points that lay
+    //! around its own part of the domain. Otherwise each processor reads the full data sets
+    int bLoadSubdomain;
+
+    //! The distance around the processor subdomain where the scattered points are also loaded.
+    //! This should be large enough so that the interpolation near the edges of the subdomain
+    //! is not affected by the missing points.
+    double subdomain_halo;
+
+    //! The way the input files are read (see #input_read_mode).
+    //! 0 -> every processor reads the files, 1 -> the processor 0 reads and broadcasts the files,
+    //! 2 -> as 1 but the processors of each node share a single copy of the file content
+    int ReadInputOnce;
+
+    //! The list of inputs whose interpolated values are memoized. Valid keywords are
+    //! TOP, BOT, KX, KY, KZ, POR, RCH and DIR (all Dirichlet boundary functions)
+    std::vector<std::string> cached_inputs;
+
+    //! The maximum number of values that are cached per input
+    int cache_size;
+
+    //! Points that are closer than this in every coordinate share the same cached value
+    double cache_tolerance;
+
+    //! Returns true if the input with the given keyword is in the #cached_inputs list
+    bool is_cached(const std::string& name)const{
+        for (unsigned int i = 0; i < cached_inputs.size(); ++i){
+            if (cached_inputs[i] == name)
+                return true;
+        }
+        return false;
+    }
 };
 
 
@@ -155,6 +230,12 @@ public:
     //! AquiferProperties#Nxyz
     std::vector<double>             vert_discr;
 
+    //! If 1 the mesh is partitioned with cell weights that keep the refined cells of each coarse cell on one processor
+    //! in most cases (see NPSAT#partition_columns). The x-y columns are not partition units: they can still be split at
+    //! the interfaces of the coarse layers, and the load per processor may be off by the cells of one coarse cell.
+    //! The discretization is the same as without this option
+    int                             column_partition;
+
     //! This is a 2D interpolation function for the top elevation
     InterpInterface<dim>          top_elevation;
 
@@ -226,6 +307,9 @@ public:
     //! Holds the Solver parameters
     SolverParameters                    solver_param;
 
+    //! Holds the options for reading the input data
+    InputParameters                     input_param;
+
     //! This is the main parameter file.
     std::string main_param_file;
 };
@@ -234,6 +318,7 @@ template <int dim>
 AquiferProperties<dim>::AquiferProperties(){
     have_wells = false;
     have_streams = false;
+    HK_function = 0;
 }
 
 
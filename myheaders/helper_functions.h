@@ -218,6 +218,91 @@ bool line_line_intersection(double b1, double m1, double b2, double m2,
     }
 }
 
+/*!
+ * \brief convex_clip_area computes the intersection of a polygon with a convex polygon
+ * using the Sutherland-Hodgman algorithm
+ *
+ * The subject polygon is clipped successively by each edge of the convex clip polygon.
+ * Both polygons can have any orientation. The clip polygon must be convex.
+ * \param xs x coordinates of the subject polygon
+ * \param ys y coordinates of the subject polygon
+ * \param xclip x coordinates of the convex clip polygon
+ * \param yclip y coordinates of the convex clip polygon
+ * \param xc x coordinate of the centroid of the intersection
+ * \param yc y coordinate of the centroid of the intersection
+ * \return the area of the intersection. If the polygons do not overlap the area is 0 and the centroid is not set
+ */
+double convex_clip_area(const std::vector<double>& xs, const std::vector<double>& ys,
+                        const std::vector<double>& xclip, const std::vector<double>& yclip,
+                        double& xc, double& yc){
+    const unsigned int nclip = xclip.size();
+    if (nclip < 3 || xs.size() < 3)
+        return 0;
+
+    // The orientation of the clip polygon decides which side of each edge is inside
+    double orient = 0;
+    for (unsigned int i = 0; i < nclip; ++i){
+        unsigned int j = (i + 1) % nclip;
+        orient += xclip[i]*yclip[j] - xclip[j]*yclip[i];
+    }
+    const double sgn = orient < 0 ? -1.0 : 1.0;
+
+    std::vector<double> xin(xs), yin(ys);
+    std::vector<double> xout, yout;
+    xout.reserve(xs.size() + nclip);
+    yout.reserve(xs.size() + nclip);
+    for (unsigned int i = 0; i < nclip && xin.size() > 0; ++i){
+        const unsigned int j = (i + 1) % nclip;
+        const double ex = xclip[j] - xclip[i];
+        const double ey = yclip[j] - yclip[i];
+        xout.clear();
+        yout.clear();
+        const unsigned int n = xin.size();
+        for (unsigned int k = 0; k < n; ++k){
+            const unsigned int kp = (k + n - 1) % n;
+            // positive side values are inside
+            const double dcur = sgn*(ex*(yin[k] - yclip[i]) - ey*(xin[k] - xclip[i]));
+            const double dprev = sgn*(ex*(yin[kp] - yclip[i]) - ey*(xin[kp] - xclip[i]));
+            if (dcur >= 0){
+                if (dprev < 0){
+                    const double t = dprev/(dprev - dcur);
+                    xout.push_back(xin[kp] + t*(xin[k] - xin[kp]));
+                    yout.push_back(yin[kp] + t*(yin[k] - yin[kp]));
+                }
+                xout.push_back(xin[k]);
+                yout.push_back(yin[k]);
+            }
+            else if (dprev >= 0){
+                const double t = dprev/(dprev - dcur);
+                xout.push_back(xin[kp] + t*(xin[k] - xin[kp]));
+                yout.push_back(yin[kp] + t*(yin[k] - yin[kp]));
+            }
+        }
+        xin.swap(xout);
+        yin.swap(yout);
+    }
+
+    const unsigned int n = xin.size();
+    if (n < 3)
+        return 0;
+    // area and centroid of the clipped polygon relative to its first vertex for better accuracy
+    double a = 0, cx = 0, cy = 0;
+    for (unsigned int k = 0; k < n; ++k){
+        const unsigned int kn = (k + 1) % n;
+        const double x0 = xin[k] - xin[0], y0 = yin[k] - yin[0];
+        const double x1 = xin[kn] - xin[0], y1 = yin[kn] - yin[0];
+        const double cr = x0*y1 - x1*y0;
+        a += cr;
+        cx += (x0 + x1)*cr;
+        cy += (y0 + y1)*cr;
+    }
+    if (std::abs(a) < 1e-12)
+        return 0;
+    xc = xin[0] + cx/(3.0*a);
+    yc = yin[0] + cy/(3.0*a);
+    return std::abs(a)/2.0;
+}
+
 
 /*!
  * \brief triangle_area Calculates the area of a triangle defined by the three vertices
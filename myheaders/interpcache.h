@@ -0,0 +1,127 @@
+#ifndef INTERPCACHE_H
+#define INTERPCACHE_H
+
+#include <cmath>
+#include <mutex>
+#include <unordered_map>
+
+#include <deal.II/base/point.h>
+
+using namespace dealii;
+
+/*!
+ * \brief The InterpCache class memoizes the values of an interpolation function.
+ *
+ * The coordinates of the points are quantized with a given tolerance and the quantized coordinates
+ * are used as the key of a hash map. Therefore points that are closer than the tolerance in every coordinate
+ * may share the same value. The size of the map is bounded. When it is full, the map is cleared and
+ * starts filling again.
+ *
+ * The methods are protected by a mutex so that the cache can be used from several threads.
+ */
+template <int dim>
+class InterpCache{
+public:
+    /*!
+     * \brief InterpCache initializes an empty cache
+     * \param max_size_in is the maximum number of values that the cache holds
+     * \param tolerance_in is the quantization step of the coordinates
+     * \param ignore_z_in if true the last coordinate is not part of the key.
+     * This is the case for interpolation functions that vary only in the horizontal directions.
+     */
+    InterpCache(unsigned int max_size_in, double tolerance_in, bool ignore_z_in);
+
+    //! If the value of point p is in the cache it is returned in value and the method returns true
+    bool find(const Point<dim>& p, double& value);
+
+    //! Stores the value of point p
+    void insert(const Point<dim>& p, double value);
+
+    //! Returns the number of queries that have been found in the cache
+    unsigned long n_hits()const{return hits;}
+
+    //! Returns the number of queries that have not been found in the cache
+    unsigned long n_misses()const{return misses;}
+
+    //! Returns the number of values that are currently in the cache
+    unsigned int size()const{return values.size();}
+
+private:
+    struct Key{
+        long long c[dim];
+        bool operator==(const Key& other)const{
+            for (unsigned int i = 0; i < dim; ++i){
+                if (c[i] != other.c[i])
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    struct KeyHash{
+        std::size_t operator()(const Key& k)const{
+            std::size_t h = 0;
+            for (unsigned int i = 0; i < dim; ++i)
+                h ^= std::hash<long long>()(k.c[i]) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    Key make_key(const Point<dim>& p)const;
+
+    std::unordered_map<Key, double, KeyHash> values;
+    std::mutex mtx;
+    unsigned int max_size;
+    double tolerance;
+    bool ignore_z;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+template <int dim>
+InterpCache<dim>::InterpCache(unsigned int max_size_in, double tolerance_in, bool ignore_z_in)
+    :
+      max_size(max_size_in),
+      tolerance(tolerance_in),
+      ignore_z(ignore_z_in),
+      hits(0),
+      misses(0)
+{
+    if (tolerance <= 0)
+        tolerance = 1e-6;
+}
+
+template <int dim>
+typename InterpCache<dim>::Key InterpCache<dim>::make_key(const Point<dim>& p)const{
+    Key k;
+    for (unsigned int i = 0; i < dim; ++i)
+        k.c[i] = static_cast<long long>(std::floor(p[i]/tolerance + 0.5));
+    if (ignore_z)
+        k.c[dim-1] = 0;
+    return k;
+}
+
+template <int dim>
+bool InterpCache<dim>::find(const Point<dim>& p, double& value){
+    Key k = make_key(p);
+    std::lock_guard<std::mutex> lock(mtx);
+    typename std::unordered_map<Key, double, KeyHash>::const_iterator it = values.find(k);
+    if (it == values.end()){
+        misses++;
+        return false;
+    }
+    hits++;
+    value = it->second;
+    return true;
+}
+
+template <int dim>
+void InterpCache<dim>::insert(const Point<dim>& p, double value){
+    Key k = make_key(p);
+    std::lock_guard<std::mutex> lock(mtx);
+    if (values.size() >= max_size)
+        values.clear();
+    values[k] = value;
+}
+
+#endif // INTERPCACHE_H
@@ -2,6 +2,7 @@
 #define INTERPINTERFACE_H
 
 #include <fstream>
+#include <memory>
 
 #include <deal.II/base/point.h>
 
@@ -9,6 +10,9 @@
 #include "helper_functions.h"
 #include "scatterinterp.h"
 #include "boundaryinterp.h"
+#include "binary_io.h"
+#include "mpi_help.h"
+#include "interpcache.h"
 
 using namespace dealii;
 
@@ -31,6 +35,8 @@ public:
     //! -A filename that containts the interpolation data. The first line of the file must be
     //! SCATTERED or GRIDDED. The format of the remaining data is descibed in grid_interp#get_data_file
     //! or in ScatterInterp#get_data.
+    //! -A file in the NPSAT binary format. The type of interpolant is defined in the file header.
+    //! The file is read with #read_input_file, therefore this must be called by all processors.
     void get_data(std::string namefile);
 
     void set_SCI_EDGE_points(Point<dim> a, Point<dim> b);
@@ -39,6 +45,30 @@ public:
 
     bool is_face_part_of_BND(Point<dim> A, Point<dim> B);
 
+    //! If the interpolation is a boundary line it returns its bounding box (see BoundaryInterp#bounding_box).
+    //! Otherwise it returns false
+    bool boundary_bounding_box(double& xmin, double& ymin, double& xmax, double& ymax)const;
+
+    //! Enables the subdomain restricted loading for scattered data. It has to be called before #get_data.
+    //! See ScatterInterp#set_subdomain_loading
+    void set_subdomain_loading(double halo);
+
+    //! Loads only the scattered data around the box defined by pmin and pmax. For any other type of interpolation
+    //! it does nothing. See ScatterInterp#load_subdomain
+    void load_subdomain(Point<dim> pmin, Point<dim> pmax);
+
+    /*!
+     * \brief enable_cache memoizes the interpolated values (see InterpCache). It has to be called after #get_data.
+     * Constant interpolation functions are never cached.
+     * The cache is shared between the copies of this object that are made after this call.
+     * \param max_size is the maximum number of values that are kept
+     * \param tolerance is the quantization step of the coordinates
+     */
+    void enable_cache(unsigned int max_size, double tolerance);
+
+    //! Returns the number of cache hits and misses. Both are zero if the cache is not enabled
+    void cache_stats(unsigned long& hits, unsigned long& misses)const;
+
 private:
     //! The type of interpolation
     //! * 0 -> Constrant interpolation
@@ -54,10 +84,18 @@ private:
 
      //! Container for boundary line interpolation
      BoundaryInterp<dim> BND_LINE;
+
+     //! The cache of the interpolated values. This is empty unless #enable_cache is called
+     std::shared_ptr<InterpCache<dim> > cache;
+
+     //! Computes the interpolation without looking at the cache
+     double evaluate(Point<dim> p)const;
 };
 
 template <int dim>
-InterpInterface<dim>::InterpInterface(){}
+InterpInterface<dim>::InterpInterface(){
+    TYPE = 0;
+}
 
 template <int dim>
 InterpInterface<dim>::InterpInterface(const InterpInterface<dim>& Interp_in)
@@ -65,7 +103,8 @@ InterpInterface<dim>::InterpInterface(const InterpInterface<dim>& Interp_in)
       TYPE(Interp_in.TYPE),
       CNI(Interp_in.CNI),
       SCI(Interp_in.SCI),
-      BND_LINE(Interp_in.BND_LINE)
+      BND_LINE(Interp_in.BND_LINE),
+      cache(Interp_in.cache)
 {}
 
 
@@ -76,39 +115,58 @@ void InterpInterface<dim>::get_data(std::string namefile){
         CNI.set_value(value);
         TYPE = 0;
     }else{
-        std::ifstream  datafile(namefile.c_str());
-        if (!datafile.good()){
-            std::cerr << "Can't open " << namefile << std::endl;
+        // The file is read once and its content is passed to the interpolation classes.
+        // With the subdomain loading only the header is read from the content, and the points
+        // are streamed later by ScatterInterp#load_subdomain. The content is released at the end of this call
+        BinaryIO::InputBuffer input;
+        if (!read_input_file(namefile, input))
+            return;
+        CNI = ConstInterp<dim>();
+        std::string type_temp;
+        if (BinaryIO::is_binary(input)){
+            unsigned int kind = BinaryIO::buffer_kind(input);
+            if (kind == BinaryIO::SCATTERED)
+                type_temp = "SCATTERED";
+            else if (kind == BinaryIO::BOUNDARY_LINE)
+                type_temp = "BOUNDARY_LINE";
         }
         else{
-            {
-                //ConstInterp<dim> cni_temp;
-                CNI = ConstInterp<dim>();
-            }
-
             // read the first line to determine what type of interpolant is
-            char buffer[512];
-            datafile.getline(buffer,512);
-            std::istringstream inp(buffer);
-            std::string type_temp;
+            BinaryIO::BufferStream datafile(input);
+            std::string line;
+            getline(datafile, line);
+            std::istringstream inp(line);
             inp >> type_temp;
-            if (type_temp == "SCATTERED"){
-                TYPE = 1;
-                SCI.get_data(namefile);
-            }
-            else if(type_temp == "BOUNDARY_LINE"){
-                TYPE = 2;
-                BND_LINE.get_data(namefile);
-            }
-            else{
-                std::cerr << "Unknown interpolation method on " << namefile << std::endl;
-            }
+        }
+
+        if (type_temp == "SCATTERED"){
+            TYPE = 1;
+            SCI.get_data(namefile, input);
+        }
+        else if(type_temp == "BOUNDARY_LINE"){
+            TYPE = 2;
+            BND_LINE.get_data(namefile, input);
+        }
+        else{
+            std::cerr << "Unknown interpolation method on " << namefile << std::endl;
         }
     }
 }
 
 template <int dim>
 double InterpInterface<dim>::interpolate(Point<dim> p)const{
+    if (!cache)
+        return evaluate(p);
+    double value;
+    if (cache->find(p, value))
+        return value;
+    value = evaluate(p);
+    cache->insert(p, value);
+    return value;
+}
+
+template <int dim>
+double InterpInterface<dim>::evaluate(Point<dim> p)const{
     if (TYPE == 0){
         return CNI.interpolate(p);
     }
@@ -135,6 +193,7 @@ void InterpInterface<dim>::set_SCI_EDGE_points(Point<dim> a, Point<dim> b){
 template <int dim>
 void InterpInterface<dim>::copy_from(InterpInterface<dim> interp_in){
     TYPE = interp_in.TYPE;
+    cache = interp_in.cache;
     if (TYPE == 0){
         CNI = interp_in.CNI;
     }
@@ -152,4 +211,41 @@ bool InterpInterface<dim>::is_face_part_of_BND(Point<dim> A, Point<dim> B){
         return false;
 }
 
+template <int dim>
+bool InterpInterface<dim>::boundary_bounding_box(double& xmin, double& ymin, double& xmax, double& ymax)const{
+    if (TYPE != 2)
+        return false;
+    BND_LINE.bounding_box(xmin, ymin, xmax, ymax);
+    return true;
+}
+
+template <int dim>
+void InterpInterface<dim>::set_subdomain_loading(double halo){
+    SCI.set_subdomain_loading(halo);
+}
+
+template <int dim>
+void InterpInterface<dim>::load_subdomain(Point<dim> pmin, Point<dim> pmax){
+    if (TYPE == 1)
+        SCI.load_subdomain(pmin, pmax);
+}
+
+template <int dim>
+void InterpInterface<dim>::enable_cache(unsigned int max_size, double tolerance){
+    if (TYPE == 0 || max_size == 0)
+        return;
+    bool ignore_z = (TYPE == 1 && SCI.is_horizontal());
+    cache = std::make_shared<InterpCache<dim> >(max_size, tolerance, ignore_z);
+}
+
+template <int dim>
+void InterpInterface<dim>::cache_stats(unsigned long& hits, unsigned long& misses)const{
+    hits = 0;
+    misses = 0;
+    if (cache){
+        hits = cache->n_hits();
+        misses = cache->n_misses();
+    }
+}
+
 #endif // INTERPINTERFACE_H
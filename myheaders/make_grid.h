@@ -13,6 +13,8 @@
 #include "my_macros.h"
 
 #include "dsimstructs.h"
+#include "binary_io.h"
+#include "mpi_help.h"
 
 namespace AquiferGrid{
     using namespace dealii;
@@ -55,13 +57,31 @@ namespace AquiferGrid{
         void make_box(parallel::distributed::Triangulation<dim>& triangulation);
 
         /*!
-        * \brief Reads the mesh file and creates a 2D triangulation.
-        * \param triangulation will hold the 2D output mesh.
+        * \brief Reads the mesh file and returns the vertices and the cells of the 2D mesh.
+        * The unused vertices are removed and the cells are reordered so that they can be used to create a triangulation.
+        * The mesh file can be either text or NPSAT binary (see BinaryIO#convert_to_binary).
+        * This is called only by the processor that reads the mesh.
+        * \param vertices are the 2D vertices
+        * \param cells are the 2D cells with counterclockwise vertex numbering
         */
-        bool read_2D_grid(Triangulation<dim-1>& triangulation);
+        bool read_2D_grid(std::vector< Point<dim-1> >& vertices, std::vector< CellData<dim-1> >& cells);
 
-        //! Converts the triangulation to a parallel version
-        void convert_to_parallel(Triangulation<dim>& tria3D, parallel::distributed::Triangulation<dim>& triangulation);
+        /*!
+        * \brief Reads the 2D mesh on the first processor and broadcasts it to all processors as compact arrays.
+        * Only the reading and cleaning of the file is done once. Every processor still receives the whole 2D mesh,
+        * because parallel::distributed::Triangulation needs the entire coarse mesh on every processor.
+        * \param xy are the coordinates of the vertices (x1 y1 x2 y2 ...)
+        * \param quads are the vertex ids of the cells in counterclockwise order (4 per cell)
+        */
+        bool distribute_2D_grid(std::vector<double>& xy, std::vector<int>& quads, MPI_Comm comm);
+
+        /*!
+        * \brief Creates the coarse parallel triangulation by extruding the 2D mesh arrays in #AquiferProperties::vert_discr layers
+        * with height 100. The vertex and cell numbering is identical to the one of
+        * dealii::GridGenerator::extrude_triangulation, but no serial triangulation is created.
+        */
+        void extrude_to_parallel(const std::vector<double>& xy, const std::vector<int>& quads,
+                                 parallel::distributed::Triangulation<dim>& triangulation);
 
         //! Assigns boundary ids
         void assign_default_boundary_id(parallel::distributed::Triangulation<dim>& triangulation);
@@ -109,21 +129,16 @@ namespace AquiferGrid{
             if (dim !=3 ){
                 std::cerr << "You cannot use the FILE geometry with problem dimension other that 3D" << std::endl;
             }else{
-                Triangulation<dim-1> tria2D;
-                Triangulation<dim> tria3D;
-                bool done = read_2D_grid(tria2D);
+                // The mesh is read and cleaned only by the first processor and the other processors
+                // receive compact vertex and cell arrays. No processor builds a serial triangulation.
+                std::vector<double> xy;
+                std::vector<int> quads;
+                bool done = distribute_2D_grid(xy, quads, triangulation.get_communicator());
                 if (done){
 #if _DIM>2
-                    dealii::GridGenerator::extrude_triangulation(tria2D,geom_param.vert_discr.size(), 100, tria3D);
-
-                    // This is going to work for deal version 9 and higher
-                    /*std::vector<double> slices;
-                    for (unsigned int i = 0; i < geom_param.vert_discr.size(); ++i)
-                        slices.push_back(100.0 * static_cast<double>(geom_param.vert_discr[i]));
-
-                    dealii::GridGenerator::extrude_triangulation(tria2D, slices, tria3D); */
-
-                    convert_to_parallel(tria3D, triangulation);
+                    extrude_to_parallel(xy, quads, triangulation);
+                    std::vector<double>().swap(xy);
+                    std::vector<int>().swap(quads);
                     triangulation.refine_global(geom_param.N_init_refinement);
                     assign_default_boundary_id(triangulation);
 #endif
@@ -141,25 +156,58 @@ namespace AquiferGrid{
     }
 
     template <int dim>
-    bool GridGenerator<dim>::read_2D_grid(Triangulation<dim-1>& triangulation){
+    bool GridGenerator<dim>::read_2D_grid(std::vector< Point<dim-1> >& vertices, std::vector< CellData<dim-1> >& cells){
         bool outcome = false;
-        std::ifstream tria_file(geom_param.input_mesh_file.c_str());
+        BinaryIO::InputBuffer input;
+        if (!read_input_file(geom_param.input_mesh_file, input, MPI_COMM_SELF))
+            return false;
+        if (BinaryIO::is_binary(input)){
+            BinaryIO::MappedFile bfile;
+            if (!bfile.open(input, geom_param.input_mesh_file))
+                return false;
+            if (bfile.kind() != BinaryIO::MESH2D){
+                std::cerr << geom_param.input_mesh_file << " is not a MESH binary file" << std::endl;
+                return false;
+            }
+            uint64_t Nvert, Nelem;
+            const double* vert_data = bfile.get_double("vertices", Nvert);
+            const int32_t* cell_data = bfile.get_int("cells", Nelem);
+            if (vert_data == 0 || cell_data == 0)
+                return false;
+            Nvert = Nvert/2;
+            Nelem = Nelem/4;
+            vertices.resize(Nvert);
+            cells.resize(Nelem);
+            SubCellData subcelldata;
+            for (unsigned int i = 0; i < Nvert; ++i){
+                vertices[i](0) = vert_data[2*i];
+                vertices[i](1) = vert_data[2*i+1];
+            }
+            for (unsigned int i = 0; i < Nelem; ++i){
+                for (unsigned int j = 0; j < 4; ++j)
+                    cells[i].vertices[j] = cell_data[4*i+j];
+            }
+            GridTools::delete_unused_vertices(vertices, cells, subcelldata);
+            GridReordering<dim-1>::invert_all_cells_of_negative_grid(vertices,cells);
+            GridReordering<dim-1>::reorder_cells(cells);
+            return true;
+        }
+
+        BinaryIO::BufferStream tria_file(input);
         if (tria_file.good()){
-            std::vector< Point<dim-1>> vertices;
-            std::vector< CellData<dim-1>> cells;
             SubCellData subcelldata;
-            char buffer[512];
+            std::string line;
             unsigned int Nvert, Nelem;
-            tria_file.getline(buffer,512);
-            std::istringstream inp(buffer);
+            getline(tria_file, line);
+            std::istringstream inp(line);
             inp >> Nvert; inp >> Nelem;
             vertices.resize(Nvert);
             cells.resize(Nelem);
             {// Read vertices
                 Point<dim-1> temp;
                 for (unsigned int i = 0; i < Nvert; ++i){
-                    tria_file.getline(buffer,512);
-                    std::istringstream inp(buffer);
+                    getline(tria_file, line);
+                    std::istringstream inp(line);
                     inp >> temp(0);
                     inp >> temp(1);
                     vertices[i] = temp;
@@ -169,8 +217,8 @@ namespace AquiferGrid{
             {//Read elements
                 std::vector<int> temp_int(4);
                 for (unsigned int i = 0; i < Nelem; ++i){
-                    tria_file.getline(buffer,512);
-                    std::istringstream inp(buffer);
+                    getline(tria_file, line);
+                    std::istringstream inp(line);
                     for (unsigned int j = 0; j < 4; ++j){
                         inp >> temp_int[j];
                     }
@@ -183,40 +231,86 @@ namespace AquiferGrid{
             GridTools::delete_unused_vertices(vertices, cells, subcelldata);
             GridReordering<dim-1>::invert_all_cells_of_negative_grid(vertices,cells);
             GridReordering<dim-1>::reorder_cells(cells);
-            triangulation.create_triangulation_compatibility(vertices, cells, subcelldata);
             outcome = true;
         }
         return outcome;
     }
 
     template <int dim>
-    void GridGenerator<dim>::convert_to_parallel(Triangulation<dim>& tria3D, parallel::distributed::Triangulation<dim>& triangulation){
-        std::vector<Point<dim> > tria3Dvert = tria3D.get_vertices();
-        std::vector<Point<dim> > vert(tria3Dvert.size());
-        for (unsigned int i = 0; i < tria3Dvert.size(); ++i){
-            Point<dim> temp;
-            for (unsigned int j = 0; j < dim; ++j){
-                temp[j] = tria3Dvert[i][j];
+    bool GridGenerator<dim>::distribute_2D_grid(std::vector<double>& xy, std::vector<int>& quads, MPI_Comm comm){
+        int my_rank;
+        MPI_Comm_rank(comm, &my_rank);
+        // The sizes are set to -1 if the reading fails
+        long long sizes[2] = {-1, -1};
+        if (my_rank == 0){
+            std::vector< Point<dim-1> > vertices;
+            std::vector< CellData<dim-1> > cells;
+            if (read_2D_grid(vertices, cells)){
+                xy.resize(2*vertices.size());
+                for (unsigned int i = 0; i < vertices.size(); ++i){
+                    xy[2*i]   = vertices[i](0);
+                    xy[2*i+1] = vertices[i](1);
+                }
+                quads.resize(4*cells.size());
+                for (unsigned int i = 0; i < cells.size(); ++i){
+                    for (unsigned int j = 0; j < 4; ++j)
+                        quads[4*i+j] = cells[i].vertices[j];
+                }
+                sizes[0] = xy.size();
+                sizes[1] = quads.size();
             }
-            vert[i]=temp;
         }
+        MPI_Bcast(sizes, 2, MPI_LONG_LONG, 0, comm);
+        if (sizes[0] < 0)
+            return false;
+        if (my_rank != 0){
+            xy.resize(sizes[0]);
+            quads.resize(sizes[1]);
+        }
+        Bcast_bytes(reinterpret_cast<char*>(xy.data()), sizes[0]*sizeof(double), 0, comm);
+        Bcast_bytes(reinterpret_cast<char*>(quads.data()), sizes[1]*sizeof(int), 0, comm);
+        return true;
+    }
 
-        std::vector< CellData<dim> > cells(tria3D.n_cells());
-        std::cout << tria3D.n_vertices() << " " << tria3D.n_used_vertices() << std::endl;
+    template <int dim>
+    void GridGenerator<dim>::extrude_to_parallel(const std::vector<double>& xy, const std::vector<int>& quads,
+                                                 parallel::distributed::Triangulation<dim>& triangulation){
+        const unsigned int n_slices = geom_param.vert_discr.size();
+        const unsigned int Nvert = xy.size()/2;
+        const unsigned int Nelem = quads.size()/4;
+        if (n_slices < 2){
+            std::cerr << "The vertical discretization must have at least 2 values" << std::endl;
+            return;
+        }
 
-        typename Triangulation<dim>::active_cell_iterator
-        cell = tria3D.begin_active(),
-        endc = tria3D.end();
-        int cell_index = 0;
-        for (; cell!=endc; ++cell){
-            for (unsigned int j = 0; j < GeometryInfo<dim>::vertices_per_cell; ++j){
-                cells[cell_index].vertices[j] = cell->vertex_index(j);
+        // The vertices of each slice are numbered after the vertices of the slice below
+        std::vector< Point<dim> > vertices(n_slices*Nvert);
+        for (unsigned int k = 0; k < n_slices; ++k){
+            const double z = 100.0*static_cast<double>(k)/static_cast<double>(n_slices-1);
+            for (unsigned int i = 0; i < Nvert; ++i){
+                vertices[k*Nvert + i][0] = xy[2*i];
+                vertices[k*Nvert + i][1] = xy[2*i+1];
+                vertices[k*Nvert + i][dim-1] = z;
+            }
+        }
+
+        // The 2D cells have counterclockwise numbering while deal uses lexicographic numbering,
+        // therefore the last two vertices of each cell are swapped
+        const unsigned int lex[4] = {0, 1, 3, 2};
+        std::vector< CellData<dim> > cells((n_slices-1)*Nelem);
+        unsigned int cell_index = 0;
+        for (unsigned int i = 0; i < Nelem; ++i){
+            for (unsigned int k = 0; k < n_slices-1; ++k){
+                for (unsigned int v = 0; v < 4; ++v){
+                    cells[cell_index].vertices[v] = quads[4*i + lex[v]] + k*Nvert;
+                    cells[cell_index].vertices[v+4] = quads[4*i + lex[v]] + (k+1)*Nvert;
+                }
+                ++cell_index;
             }
-            ++cell_index;
         }
 
         SubCellData subcelldata;
-        triangulation.create_triangulation(vert, cells, subcelldata);
+        triangulation.create_triangulation(vertices, cells, subcelldata);
     }
 
     template <int dim>
@@ -4,6 +4,7 @@
 #include <deal.II/dofs/dof_handler.h>
 #include <deal.II/dofs/dof_tools.h>
 #include <deal.II/fe/fe_system.h>
+#include <deal.II/fe/fe_q.h>
 #include <deal.II/fe/fe_values.h>
 #include <deal.II/fe/mapping_q1.h>
 #include <deal.II/lac/constraint_matrix.h>
@@ -113,7 +114,7 @@ public:
      * moving back the mesh nodes to their original position
      *
      * The method first loops through the locally owned and ghost cells and extracts the coordinates and dof for each node
-     * and stores it to #distributed_mesh_vertices. In addition keeps a custom map information for each node of the
+     * and keeps a custom map information for each node of the
      * triangulation such as : dof, whether is a hanging node, a list of connections with other nodes,
      * a list of the constraint for each node etc.
      *
@@ -131,14 +132,10 @@ public:
      * influence the algorithm because the hanging nodes have always the correct number of connections.
      */
     void updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
-                          FESystem<dim>& mesh_fe,
+                          FE_Q<dim>& mesh_fe,
                           ConstraintMatrix& mesh_constraints,
                           IndexSet& mesh_locally_owned,
                           IndexSet& mesh_locally_relevant,
-                          TrilinosWrappers::MPI::Vector& mesh_vertices,
-                          TrilinosWrappers::MPI::Vector& distributed_mesh_vertices,
-                          TrilinosWrappers::MPI::Vector& mesh_Offset_vertices,
-                          TrilinosWrappers::MPI::Vector& distributed_mesh_Offset_vertices,
                           MPI_Comm&  mpi_communicator,
                           ConditionalOStream pcout);
 
@@ -148,14 +145,51 @@ public:
     //! This should be called whenever we need to update the mesh elevation
     void updateMeshElevation(DoFHandler<dim>& mesh_dof_handler,
                              parallel::distributed::Triangulation<dim>& 	triangulation,
-                             ConstraintMatrix& mesh_constraints,
-                             TrilinosWrappers::MPI::Vector& mesh_vertices,
-                             TrilinosWrappers::MPI::Vector& distributed_mesh_vertices,
-                             TrilinosWrappers::MPI::Vector& mesh_Offset_vertices,
-                             TrilinosWrappers::MPI::Vector& distributed_mesh_Offset_vertices,
                              MPI_Comm&  mpi_communicator,
                              ConditionalOStream pcout);
 
+    /*!
+     * \brief build_columns stores the vertices of the locally owned and ghost cells into contiguous arrays.
+     * For each vertex the arrays hold the index of its column, its relative position between the top and bottom
+     * of the column and, for hanging vertices, the vertices that constrain it.
+     *
+     * It should be called right after a full #updateMeshElevation. As long as the topology of the mesh does not change,
+     * the elevation of every vertex is an affine function of the top and bottom of its column, so that
+     * #updateColumnElevation can be used instead of #updateMeshStruct and #updateMeshElevation.
+     */
+    void build_columns(DoFHandler<dim>& mesh_dof_handler,
+                       MPI_Comm&  mpi_communicator);
+
+    //! Returns true if the column arrays correspond to the current mesh structure
+    bool has_columns()const{return columns_valid;}
+
+    /*!
+     * \brief updateColumnElevation is the fast path of #updateMeshElevation. Once #assign_top_bottom has set the
+     * #PntsInfo::T and #PntsInfo::B, all vertex elevations are computed in one sweep over the column arrays
+     * and the vertices are communicated once.
+     */
+    void updateColumnElevation(DoFHandler<dim>& mesh_dof_handler,
+                               parallel::distributed::Triangulation<dim>& triangulation,
+                               ConditionalOStream pcout);
+
+    /*!
+     * \brief vertex_offset is the vertical displacement of each vertex of the triangulation from its flat position.
+     * It is indexed by the vertex index of the local triangulation and holds the displacement of every vertex
+     * that the processor has moved or received from other processors.
+     */
+    std::vector<double> vertex_offset;
+
+    //! Moves all vertices back to their flat position and sets the #vertex_offset to zero.
+    //! Each processor restores its own copy of the vertices, therefore no communication is needed.
+    void move_to_flat(parallel::distributed::Triangulation<dim>& triangulation);
+
+    /*!
+     * \brief column_stats counts the x-y columns that have locally owned nodes and how many of them have a node
+     * whose top or bottom node was resolved by another processor. The counts are summed over all processors,
+     * therefore a column that is split between two processors is counted by both.
+     */
+    void column_stats(int& n_split, int& n_columns, MPI_Comm& mpi_communicator);
+
     //! Clears out all the information
     void reset();
 
@@ -186,9 +220,10 @@ public:
     void dbg_set_scales(double xscale, double zscale);
 
     //! This is the method that actually moves the mesh vertices using the updated elevations in the #PointsMap.
-    //! This is called internally from #updateMeshElevation.
+    //! Each processor moves the vertices of its locally owned nodes and receives the other vertices of its cells
+    //! from the processors that own them. This is called internally from #updateMeshElevation.
     void move_vertices(DoFHandler<dim>& mesh_dof_handler,
-                       TrilinosWrappers::MPI::Vector& mesh_vertices);
+                       parallel::distributed::Triangulation<dim>& triangulation);
     //! Print the mesh to a format readable by a custom python houdini script.
     void printMesh(std::string folder, std::string filename, unsigned int i_proc, DoFHandler<dim>& mesh_dof_handler);
 
@@ -212,6 +247,27 @@ private:
 
     void respect_hanging_nodes();
 
+    //! Sends the vertices of the locally owned cells to the processors where they are ghost
+    //! and adds the displacement of the received vertices to the #vertex_offset
+    void communicate_moved_vertices(parallel::distributed::Triangulation<dim>& triangulation);
+
+    //! The triangulation index of each vertex in the column arrays
+    std::vector<unsigned int> col_vertex;
+    //! The index of the column of each vertex in #col_points
+    std::vector<unsigned int> col_index;
+    //! The relative position of each vertex between the bottom (0) and the top (1) of its column
+    std::vector<double> col_rel_pos;
+    //! The vertices that constrain the hanging vertex i are hang_ids[hang_ptr[i]] ... hang_ids[hang_ptr[i+1]-1]
+    std::vector<unsigned int> hang_ptr;
+    std::vector<unsigned int> hang_ids;
+    //! The position of each triangulation vertex in the column arrays or -1
+    std::vector<int> vertex_entry;
+    //! The columns. The pointers remain valid as long as the #PointsMap is not modified
+    std::vector<PntsInfo<dim>*> col_points;
+    //! The elevations of the vertices computed by #updateColumnElevation
+    std::vector<double> col_z;
+    bool columns_valid;
+
     //void dependency_scan(std::map<int, std::vector<int> > &dep, std::map<int, std::vector<int> > &ord);
 };
 
@@ -222,6 +278,7 @@ Mesh_struct<dim>::Mesh_struct(double xy_thr, double z_thr){
     _counter = 0;
     dbg_scale_x = 100;
     dbg_scale_z = 20;
+    columns_valid = false;
 }
 
 template <int dim>
@@ -284,14 +341,10 @@ int Mesh_struct<dim>::check_if_point_exists(Point<dim-1> p){
 
 template <int dim>
 void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
-                                       FESystem<dim>& mesh_fe,
+                                       FE_Q<dim>& mesh_fe,
                                        ConstraintMatrix& mesh_constraints,
                                        IndexSet& mesh_locally_owned,
                                        IndexSet& mesh_locally_relevant,
-                                       TrilinosWrappers::MPI::Vector& mesh_vertices,
-                                       TrilinosWrappers::MPI::Vector& distributed_mesh_vertices,
-                                       TrilinosWrappers::MPI::Vector& mesh_Offset_vertices,
-                                       TrilinosWrappers::MPI::Vector& distributed_mesh_Offset_vertices,
                                        MPI_Comm&  mpi_communicator,
                                        ConditionalOStream pcout){
     //std::string prefix = "iter";
@@ -306,8 +359,8 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
     reset(); // delete all
     MPI_Barrier(mpi_communicator);
 
-    const MappingQ1<dim> mapping;
-
+    // The scalar Q1 element has one dof per vertex. The dofs are used as the global ids of the vertices
+    // and to identify the hanging vertices
     mesh_dof_handler.distribute_dofs(mesh_fe);
 
     pcout << "Distribute mesh dofs..." << mesh_dof_handler.n_dofs() << std::endl << std::flush;
@@ -315,18 +368,6 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
     //pcout << "dofs 1" << mesh_dof_handler.n_dofs() << std::endl << std::flush;
     mesh_locally_owned = mesh_dof_handler.locally_owned_dofs();
     DoFTools::extract_locally_relevant_dofs (mesh_dof_handler, mesh_locally_relevant);
-    mesh_vertices.reinit (mesh_locally_owned, mesh_locally_relevant, mpi_communicator);
-    distributed_mesh_vertices.reinit(mesh_locally_owned, mpi_communicator);
-    mesh_Offset_vertices.reinit (mesh_locally_owned, mesh_locally_relevant, mpi_communicator);
-    distributed_mesh_Offset_vertices.reinit(mesh_locally_owned, mpi_communicator);
-
-    const std::vector<Point<dim> > mesh_support_points
-                                  = mesh_fe.base_element(0).get_unit_support_points();
-
-    FEValues<dim> fe_mesh_points (mapping,
-                                  mesh_fe,
-                                  mesh_support_points,
-                                  update_quadrature_points);
 
     mesh_constraints.clear();
     mesh_constraints.reinit(mesh_locally_relevant);
@@ -339,7 +380,6 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
     MPI_Barrier(mpi_communicator);
 
     pcout << "Update Mesh structure..." << std::endl << std::flush;
-    std::vector<unsigned int> cell_dof_indices (mesh_fe.dofs_per_cell);
     typename DoFHandler<dim>::active_cell_iterator
     cell = mesh_dof_handler.begin_active(),
     endc = mesh_dof_handler.end();
@@ -357,46 +397,22 @@ void Mesh_struct<dim>::updateMeshStruct(DoFHandler<dim>& mesh_dof_handler,
                 top_cell = true;
             }
 
-            fe_mesh_points.reinit(cell);
-            cell->get_dof_indices (cell_dof_indices);
-            // First we will loop through the cell dofs gathering all info we need for the points
+            // First we will loop through the cell vertices gathering all info we need for the points
             // and then we will loop again though the points to add the into the structure.
             // Therefore we would need to initialize several vectors
             std::map<int, trianode<dim> > curr_cell_info;
 
 
-            for (unsigned int idof = 0; idof < mesh_fe.base_element(0).dofs_per_cell; ++idof){
-                // for each dof of this cell we extract the coordinates and the dofs
-                Point <dim> current_node;
-                std::vector<int> current_dofs(dim);
-                std::vector<unsigned int> spi;
-                for (unsigned int dir = 0; dir < dim; ++dir){
-                    // for each cell support_point_index spans from 0 to dim*Nvert_per_cell-1
-                    // eg for dim =2 spans from 0-7
-                    // The first dim indices correspond to x,y,z of the first vertex of triangulation
-                    // The current_dofs contains the dof index for each coordinate.
-                    // The current_node containts the x,y,z coordinates
-                    // The distributed_mesh_vertices is a vector of size Nvertices*dim
-                    // essentially we are treating all xyz coordinates as variables although we are going to
-                    // change only the vertical component of it (In 2D this is the y).
-                    unsigned int support_point_index = mesh_fe.component_to_system_index(dir, idof );
-                    spi.push_back(support_point_index);
-                    current_dofs[dir] = static_cast<int>(cell_dof_indices[support_point_index]);
-                    current_node[dir] = fe_mesh_points.quadrature_point(idof)[dir];
-                    distributed_mesh_vertices[cell_dof_indices[support_point_index]] = current_node[dir];
-
-                    //pcout << "dir:" << dir << ", idof:" << idof << ", cur_dof:" << current_dofs[dir]
-                    //      <<   ", cur_nd:" << current_node[dir] << ", spi:" << support_point_index << std::endl;
-                }
-                // We have now loop throught dims of a given cell point and we initialize a trianode
+            for (unsigned int idof = 0; idof < mesh_fe.dofs_per_cell; ++idof){
+                // The dofs of the scalar Q1 element are the vertices of the cell in the same order
                 trianode<dim> temp;
-                temp.pnt = current_node;
-                temp.dof = current_dofs[dim-1];
-                temp.hang = mesh_constraints.is_constrained(current_dofs[dim-1]);
-                temp.cnstr_nd.push_back(current_dofs[dim-1]);
+                temp.pnt = cell->vertex(idof);
+                temp.dof = static_cast<int>(cell->vertex_dof_index(idof, 0));
+                temp.hang = mesh_constraints.is_constrained(temp.dof);
+                temp.cnstr_nd.push_back(temp.dof);
                 mesh_constraints.resolve_indices(temp.cnstr_nd);
-                temp.spi = spi[dim-1];
-                temp.islocal = distributed_mesh_vertices.in_local_range(temp.dof);
+                temp.spi = idof;
+                temp.islocal = mesh_locally_owned.is_element(temp.dof);
                 temp.isBot = 0;
                 temp.isTop = 0;
                 if (bot_cell){
@@ -690,6 +706,42 @@ void Mesh_struct<dim>::reset(){
     dof_ij.clear();
     CGALset.clear();
     local_dof.clear();
+    columns_valid = false;
+    col_vertex.clear();
+    col_index.clear();
+    col_rel_pos.clear();
+    hang_ptr.clear();
+    hang_ids.clear();
+    vertex_entry.clear();
+    col_points.clear();
+    col_z.clear();
+}
+
+template <int dim>
+void Mesh_struct<dim>::column_stats(int& n_split, int& n_columns, MPI_Comm& mpi_communicator){
+    const int my_rank = static_cast<int>(Utilities::MPI::this_mpi_process(mpi_communicator));
+    int counts[2] = {0, 0};
+    typename std::map<int , PntsInfo<dim> >::iterator it;
+    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
+        bool has_local = false;
+        bool is_split = false;
+        std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
+        for (; itz != it->second.Zlist.end(); ++itz){
+            if (!itz->is_local)
+                continue;
+            has_local = true;
+            if (itz->Top.proc != my_rank || itz->Bot.proc != my_rank)
+                is_split = true;
+        }
+        if (has_local){
+            counts[1]++;
+            if (is_split)
+                counts[0]++;
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, counts, 2, MPI_INT, MPI_SUM, mpi_communicator);
+    n_split = counts[0];
+    n_columns = counts[1];
 }
 
 template <int dim>
@@ -879,11 +931,6 @@ void Mesh_struct<dim>::dbg_meshStructInfo3D(std::string name, unsigned int my_ra
 template<int dim>
 void Mesh_struct<dim>::updateMeshElevation(DoFHandler<dim>& mesh_dof_handler,
                                            parallel::distributed::Triangulation<dim>& 	triangulation,
-                                           ConstraintMatrix& mesh_constraints,
-                                           TrilinosWrappers::MPI::Vector& mesh_vertices,
-                                           TrilinosWrappers::MPI::Vector& distributed_mesh_vertices,
-                                           TrilinosWrappers::MPI::Vector& mesh_Offset_vertices,
-                                           TrilinosWrappers::MPI::Vector& distributed_mesh_Offset_vertices,
                                            MPI_Comm&  mpi_communicator,
                                            ConditionalOStream pcout){
     //std::string prefix = "iter";
@@ -1173,33 +1220,16 @@ void Mesh_struct<dim>::updateMeshElevation(DoFHandler<dim>& mesh_dof_handler,
     //std::cout << "Rank " << my_rank << " has converged" << std::endl;
     MPI_Barrier(mpi_communicator);
 
-    // After we have finished with all updates in the z structure we have to copy the---------------------------------------
-    // new values to the distributed vector
-    for (it = PointsMap.begin(); it != PointsMap.end(); ++it){
-        std::vector<Zinfo>::iterator itz = it->second.Zlist.begin();
-        for (; itz != it->second.Zlist.end(); ++itz){
-            if (distributed_mesh_vertices.in_local_range(static_cast<unsigned int >(itz->dof))){
-                double dz = itz->z - distributed_mesh_vertices[static_cast<unsigned int >(itz->dof)];
-                distributed_mesh_Offset_vertices[static_cast<unsigned int >(itz->dof)] = dz;
-                distributed_mesh_vertices[static_cast<unsigned int >(itz->dof)] += dz;
-            }
-        }
-    }
-
-    // The compress sends the data to the processors that owns the data
-    distributed_mesh_Offset_vertices.compress(VectorOperation::insert);
-    distributed_mesh_vertices.compress(VectorOperation::add); // This was commented in the original dev code but i dont see any reason
-
-    // updates the elevations and offsets to the constraint nodes --------------------------
-    // although they should be ok
-    mesh_constraints.distribute(distributed_mesh_Offset_vertices);
-    mesh_Offset_vertices = distributed_mesh_Offset_vertices;
-
-    mesh_constraints.distribute(distributed_mesh_vertices);
-    mesh_vertices = distributed_mesh_vertices;
-
     //move the actual vertices ------------------------------------------------
-    move_vertices(mesh_dof_handler, mesh_vertices);
+    move_vertices(mesh_dof_handler, triangulation);
+}
+
+template <int dim>
+void Mesh_struct<dim>::communicate_moved_vertices(parallel::distributed::Triangulation<dim>& triangulation){
+    const std::vector<Point<dim> >& vertices = triangulation.get_vertices();
+    std::vector<double> z_before(vertices.size());
+    for (unsigned int i = 0; i < vertices.size(); ++i)
+        z_before[i] = vertices[i][dim-1];
 
     std::vector<bool> locally_owned_vertices = triangulation.get_used_vertices();
     typename parallel::distributed::Triangulation<dim>::active_cell_iterator
@@ -1213,28 +1243,181 @@ void Mesh_struct<dim>::updateMeshElevation(DoFHandler<dim>& mesh_dof_handler,
         }
     }
     triangulation.communicate_locally_moved_vertices(locally_owned_vertices);
+
+    vertex_offset.resize(vertices.size(), 0.0);
+    for (unsigned int i = 0; i < vertices.size(); ++i)
+        vertex_offset[i] += vertices[i][dim-1] - z_before[i];
 }
 
 template <int dim>
-void Mesh_struct<dim>::move_vertices(DoFHandler<dim>& mesh_dof_handler,
-                                     TrilinosWrappers::MPI::Vector& mesh_vertices){
-    // for debuging just print the cell mesh
+void Mesh_struct<dim>::move_to_flat(parallel::distributed::Triangulation<dim>& triangulation){
+    if (vertex_offset.size() == 0)
+        return;
+    std::vector<bool> done(triangulation.n_vertices(), false);
+    typename parallel::distributed::Triangulation<dim>::active_cell_iterator
+    cell = triangulation.begin_active(),
+    endc = triangulation.end();
+    for (; cell!=endc; ++cell){
+        for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v){
+            const unsigned int iv = cell->vertex_index(v);
+            if (done[iv] || iv >= vertex_offset.size())
+                continue;
+            cell->vertex(v)[dim-1] -= vertex_offset[iv];
+            done[iv] = true;
+        }
+    }
+    std::fill(vertex_offset.begin(), vertex_offset.end(), 0.0);
+}
+
+template <int dim>
+void Mesh_struct<dim>::build_columns(DoFHandler<dim>& mesh_dof_handler,
+                                     MPI_Comm&  mpi_communicator){
+    columns_valid = false;
+    col_vertex.clear();
+    col_index.clear();
+    col_rel_pos.clear();
+    hang_ptr.clear();
+    hang_ids.clear();
+    col_points.clear();
+    std::vector<int> col_z_index;
+    vertex_entry.assign(mesh_dof_handler.get_triangulation().n_vertices(), -1);
+
+    std::map<int, unsigned int> column_of_key;
+    std::map<int, unsigned int> entry_of_dof;
+    std::map<int,std::pair<int,int> >::iterator it_ij;
+    bool all_found = true;
+
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = mesh_dof_handler.begin_active(),
+    endc = mesh_dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (!(cell->is_locally_owned() || cell->is_ghost()))
+            continue;
+        for (unsigned int v = 0; v < GeometryInfo<dim>::vertices_per_cell; ++v){
+            unsigned int iv = cell->vertex_index(v);
+            if (vertex_entry[iv] >= 0)
+                continue;
+            int dof = static_cast<int>(cell->vertex_dof_index(v, 0));
+            it_ij = dof_ij.find(dof);
+            if (it_ij == dof_ij.end()){
+                all_found = false;
+                continue;
+            }
+            std::map<int, unsigned int>::iterator itc = column_of_key.find(it_ij->second.first);
+            if (itc == column_of_key.end()){
+                itc = column_of_key.insert(std::pair<int, unsigned int>(it_ij->second.first, col_points.size())).first;
+                col_points.push_back(&PointsMap[it_ij->second.first]);
+            }
+            const PntsInfo<dim>* pnt = col_points[itc->second];
+            double rel = 0;
+            if (pnt->T - pnt->B > 0)
+                rel = (cell->vertex(v)[dim-1] - pnt->B)/(pnt->T - pnt->B);
+
+            vertex_entry[iv] = static_cast<int>(col_vertex.size());
+            entry_of_dof[dof] = col_vertex.size();
+            col_vertex.push_back(iv);
+            col_index.push_back(itc->second);
+            col_z_index.push_back(it_ij->second.second);
+            col_rel_pos.push_back(rel);
+        }
+    }
+
+    // The hanging vertices are placed at the average of the vertices that constrain them
+    // If a constraining vertex is not part of the arrays the hanging vertex keeps the affine position
+    hang_ptr.push_back(0);
+    for (unsigned int i = 0; i < col_vertex.size(); ++i){
+        const Zinfo& zinfo = col_points[col_index[i]]->Zlist[col_z_index[i]];
+        if (zinfo.hanging == 1){
+            std::vector<unsigned int> ids;
+            for (unsigned int j = 0; j < zinfo.cnstr_nds.size(); ++j){
+                std::map<int, unsigned int>::iterator itd = entry_of_dof.find(zinfo.cnstr_nds[j]);
+                if (itd == entry_of_dof.end()){
+                    ids.clear();
+                    break;
+                }
+                ids.push_back(itd->second);
+            }
+            hang_ids.insert(hang_ids.end(), ids.begin(), ids.end());
+        }
+        hang_ptr.push_back(hang_ids.size());
+    }
+    col_z.resize(col_vertex.size());
 
+    // The fast path is used only if every processor could build its arrays
+    int n_missing = all_found ? 0 : 1;
+    MPI_Allreduce(MPI_IN_PLACE, &n_missing, 1, MPI_INT, MPI_MAX, mpi_communicator);
+    columns_valid = n_missing == 0;
+}
+
+template <int dim>
+void Mesh_struct<dim>::updateColumnElevation(DoFHandler<dim>& mesh_dof_handler,
+                                             parallel::distributed::Triangulation<dim>& triangulation,
+                                             ConditionalOStream pcout){
+    pcout << "Update Mesh elevation (columns)..." << std::endl;
+    const unsigned int n_col = col_points.size();
+    const unsigned int n_vert = col_vertex.size();
+    std::vector<double> top(n_col);
+    std::vector<double> thick(n_col);
+    for (unsigned int c = 0; c < n_col; ++c){
+        top[c] = col_points[c]->T;
+        thick[c] = col_points[c]->T - col_points[c]->B;
+    }
+
+    for (unsigned int i = 0; i < n_vert; ++i)
+        col_z[i] = top[col_index[i]] - (1.0 - col_rel_pos[i])*thick[col_index[i]];
+
+    for (unsigned int i = 0; i < n_vert; ++i){
+        const unsigned int n_c = hang_ptr[i+1] - hang_ptr[i];
+        if (n_c == 0)
+            continue;
+        double sum_z = 0;
+        for (unsigned int j = hang_ptr[i]; j < hang_ptr[i+1]; ++j)
+            sum_z += col_z[hang_ids[j]];
+        col_z[i] = sum_z/static_cast<double>(n_c);
+    }
+
+    vertex_offset.resize(triangulation.n_vertices(), 0.0);
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = mesh_dof_handler.begin_active(),
+    endc = mesh_dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (cell->is_locally_owned()){
+            for (unsigned int v = 0; v < GeometryInfo<dim>::vertices_per_cell; ++v){
+                const unsigned int iv = cell->vertex_index(v);
+                Point<dim>& p = cell->vertex(v);
+                const double z = col_z[vertex_entry[iv]];
+                vertex_offset[iv] += z - p[dim-1];
+                p[dim-1] = z;
+            }
+        }
+    }
+    communicate_moved_vertices(triangulation);
+}
 
+template <int dim>
+void Mesh_struct<dim>::move_vertices(DoFHandler<dim>& mesh_dof_handler,
+                                     parallel::distributed::Triangulation<dim>& triangulation){
+    vertex_offset.resize(triangulation.n_vertices(), 0.0);
+    std::map<int,std::pair<int,int> >::iterator it_ij;
     typename DoFHandler<dim>::active_cell_iterator
     cell = mesh_dof_handler.begin_active(),
     endc = mesh_dof_handler.end();
     for (; cell != endc; ++cell){
-        if (cell->is_locally_owned()){//cell->is_artificial() == false
+        if (cell->is_locally_owned()){
             for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
+                it_ij = dof_ij.find(static_cast<int>(cell->vertex_dof_index(vertex_no, 0)));
+                if (it_ij == dof_ij.end())
+                    continue;
+                const Zinfo& zinfo = PointsMap[it_ij->second.first].Zlist[it_ij->second.second];
+                if (!zinfo.is_local || !zinfo.isZset)
+                    continue;
                 Point<dim> &v=cell->vertex(vertex_no);
-                for (unsigned int dir=0; dir < dim; ++dir){
-                    //std::cout << cell->vertex_dof_index(vertex_no, dir) << ": " << v(dir) << ", " << mesh_vertices(cell->vertex_dof_index(vertex_no, dir)) << std::endl;
-                    v(dir) = mesh_vertices(cell->vertex_dof_index(vertex_no, dir));
-                }
+                vertex_offset[cell->vertex_index(vertex_no)] += zinfo.z - v(dim-1);
+                v(dim-1) = zinfo.z;
             }
         }
     }
+    communicate_moved_vertices(triangulation);
 }
 
 template<int dim>
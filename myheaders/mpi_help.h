@@ -2,9 +2,13 @@
 #define MPI_HELP_H
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
 #include <mpi.h>
 
 #include "streamlines.h"
+#include "binary_io.h"
 
 //! A method that prints the size of the input vector that my_rank processor has
 //! This is used for debuging only as it will produce alot of output
@@ -111,6 +115,15 @@ void max_scalar(T1 &scalar, unsigned int n_proc, MPI_Comm comm, MPI_Datatype MPI
 }
 
 
+/*!
+ * \brief allgather_bytes counts the bytes that this processor has received through #Sent_receive_data.
+ * It is used to compare the communication volume of different partitions.
+ */
+inline uint64_t& allgather_bytes(){
+    static uint64_t bytes = 0;
+    return bytes;
+}
+
 /*!
  * \brief Sent_receive_data: This function sends a vector to all processors and receives all the vectors that the other processor
  * have sent
@@ -142,6 +155,7 @@ void Sent_receive_data(std::vector<std::vector<T1> > &data,
 
     int totdata = displs[n_proc-1] + N_data_per_proc[n_proc-1];
     std::vector<T1> temp_receive(totdata);
+    allgather_bytes() += static_cast<uint64_t>(totdata)*sizeof(T1);
 
     MPI_Allgatherv(&data[my_rank][0], // This is what this processor will send to every other
                    N, //This is the size of the message from this processor
@@ -256,4 +270,153 @@ void Sent_receive_streamlines_all_to_all(std::vector<std::vector<Streamline<dim>
 
 }
 
+/*!
+ * \brief input_read_mode returns the way the input files are read by #read_input_file
+ * - 0 -> Every processor reads the files
+ * - 1 -> The processor 0 reads the files and broadcasts their content to the other processors
+ * - 2 -> The processor 0 reads the files and sends their content to one processor per node. The processors
+ * of each node access a single copy of the content through an MPI-3 shared memory window
+ */
+inline int& input_read_mode(){
+    static int mode = 1;
+    return mode;
+}
+
+/*!
+ * \brief Bcast_bytes broadcasts a block of bytes. The block is sent in chunks
+ * because the count argument of MPI_Bcast cannot exceed 2^31-1.
+ */
+inline void Bcast_bytes(char* p, uint64_t n, int root, MPI_Comm comm){
+    const uint64_t chunk = 1 << 30;
+    for (uint64_t i = 0; i < n; i += chunk){
+        int count = static_cast<int>(std::min(chunk, n - i));
+        MPI_Bcast(p + i, count, MPI_CHAR, root, comm);
+    }
+}
+
+//! The shared memory window that holds the content of an input file in read mode 2
+struct SharedInputWindow{
+    MPI_Win win;
+    MPI_Comm node_comm;
+};
+
+//! Frees the window of an input buffer. This is collective on the processors of the node
+inline void release_shared_input(void* arg){
+    SharedInputWindow* w = static_cast<SharedInputWindow*>(arg);
+    MPI_Win_free(&w->win);
+    MPI_Comm_free(&w->node_comm);
+    delete w;
+}
+
+/*!
+ * \brief read_input_file reads the content of an input file into the buffer according to the #input_read_mode.
+ * In modes 1 and 2 the file is opened only by the processor 0, therefore on parallel file systems the number of
+ * metadata and read operations does not depend on the number of processors.
+ *
+ * This must be called by all processors of the communicator. In mode 2 the buffers must also be released by all
+ * processors of each node in the same order, which is the case when the buffer is a local variable of the caller.
+ * \param filename is the name of the file
+ * \param buffer is the buffer where the content will be available. All processors get identical bytes
+ * \param comm is the MPI communicator
+ * \return false if the file cannot be read. The return value is the same on all processors
+ */
+inline bool read_input_file(const std::string& filename, BinaryIO::InputBuffer& buffer, MPI_Comm comm = MPI_COMM_WORLD){
+    int n_proc, my_rank;
+    MPI_Comm_size(comm, &n_proc);
+    MPI_Comm_rank(comm, &my_rank);
+    if (input_read_mode() == 0 || n_proc == 1)
+        return buffer.map_file(filename);
+
+    long long n = -1;
+    if (my_rank == 0){
+        if (buffer.map_file(filename))
+            n = static_cast<long long>(buffer.size());
+    }
+    MPI_Bcast(&n, 1, MPI_LONG_LONG, 0, comm);
+    if (n < 0)
+        return false;
+
+    if (input_read_mode() == 1){
+        if (my_rank == 0)
+            Bcast_bytes(const_cast<char*>(buffer.data()), n, 0, comm);
+        else
+            Bcast_bytes(buffer.allocate(n), n, 0, comm);
+        return true;
+    }
+
+    // Mode 2. The first processor of each node allocates the window and receives the content
+    SharedInputWindow* w = new SharedInputWindow;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, my_rank, MPI_INFO_NULL, &w->node_comm);
+    int node_rank;
+    MPI_Comm_rank(w->node_comm, &node_rank);
+    MPI_Comm leader_comm;
+    MPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, my_rank, &leader_comm);
+
+    char* base;
+    MPI_Win_allocate_shared(node_rank == 0 ? n : 0, 1, MPI_INFO_NULL, w->node_comm, &base, &w->win);
+    if (node_rank != 0){
+        MPI_Aint sz;
+        int disp;
+        MPI_Win_shared_query(w->win, 0, &sz, &disp, &base);
+    }
+
+    MPI_Win_fence(0, w->win);
+    if (node_rank == 0){
+        // The processor 0 is the first leader because the leaders are ordered by their rank
+        if (my_rank == 0 && n > 0)
+            std::memcpy(base, buffer.data(), n);
+        Bcast_bytes(base, n, 0, leader_comm);
+        MPI_Comm_free(&leader_comm);
+    }
+    MPI_Win_fence(0, w->win);
+
+    buffer.attach(base, n, release_shared_input, w);
+    return true;
+}
+
+/*!
+ * \brief gather_on_node_leaders collects the vectors of all processors on the first processor of each node.
+ *
+ * The vectors are first gathered on the first processor of each node and then exchanged between these processors.
+ * The other processors do not receive any data. The order of the values from different processors is not specified.
+ * \param local is the data of this processor
+ * \param all is the data of all processors. It is filled only on the first processor of each node
+ * \param node_comm is the communicator of the processors of the node
+ * \param leader_comm is the communicator of the first processors of all nodes. It is MPI_COMM_NULL on the other processors
+ */
+template <typename T>
+void gather_on_node_leaders(const std::vector<T>& local, std::vector<T>& all,
+                            MPI_Comm node_comm, MPI_Comm leader_comm, MPI_Datatype MPI_TYPE){
+    int node_size, node_rank;
+    MPI_Comm_size(node_comm, &node_size);
+    MPI_Comm_rank(node_comm, &node_rank);
+
+    int n = local.size();
+    std::vector<int> counts(node_size);
+    MPI_Gather(&n, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, node_comm);
+    std::vector<int> displs(node_size, 0);
+    for (int i = 1; i < node_size; ++i)
+        displs[i] = displs[i-1] + counts[i-1];
+    std::vector<T> node_data;
+    if (node_rank == 0)
+        node_data.resize(displs[node_size-1] + counts[node_size-1] + 1);
+    MPI_Gatherv(local.data(), n, MPI_TYPE, node_data.data(), &counts[0], &displs[0], MPI_TYPE, 0, node_comm);
+    if (node_rank != 0)
+        return;
+    node_data.pop_back();
+
+    int n_leaders;
+    MPI_Comm_size(leader_comm, &n_leaders);
+    int n_node = node_data.size();
+    counts.resize(n_leaders);
+    MPI_Allgather(&n_node, 1, MPI_INT, &counts[0], 1, MPI_INT, leader_comm);
+    displs.assign(n_leaders, 0);
+    for (int i = 1; i < n_leaders; ++i)
+        displs[i] = displs[i-1] + counts[i-1];
+    all.resize(displs[n_leaders-1] + counts[n_leaders-1] + 1);
+    MPI_Allgatherv(node_data.data(), n_node, MPI_TYPE, all.data(), &counts[0], &displs[0], MPI_TYPE, leader_comm);
+    all.pop_back();
+    allgather_bytes() += static_cast<uint64_t>(all.size())*sizeof(T);
+}
+
 #endif // MPI_HELP_H
@@ -10,6 +10,7 @@
 #include <deal.II/base/utilities.h>
 
 #include <deal.II/dofs/dof_handler.h>
+#include <deal.II/dofs/dof_tools.h>
 
 #include <deal.II/fe/fe_q.h>
 #include <deal.II/fe/fe_system.h>
@@ -52,14 +53,22 @@ public:
     //! error criteria
     void solve_refine();
 
-    //! This method does the actuall refinement and all the required actions that are associated with
-    //! such as transfer the refinement to other processors etc.
-    void do_refinement();
-
-    void do_refinement1();
+    //! Moves the vertices back to their flat position and refines the mesh.
+    //! Returns true if any processor had cells flagged, i.e. the topology of the mesh may have changed
+    bool do_refinement1();
 
     void particle_tracking();
 
+    /*!
+     * \brief repartition_for_tracking balances the particle tracking work between the processors.
+     *
+     * Every ParticleParameters::pilot_stride-th particle is traced with the current partition.
+     * The number of steps in each cell is then used as cell weight to repartition the triangulation.
+     * The head solution is transferred to the new partition and the mesh elevations are
+     * computed again from the last top and bottom grids.
+     * The pilot streamlines are written with the "_pilot" suffix in the prefix.
+     */
+    void repartition_for_tracking();
 
 
 private:
@@ -71,13 +80,13 @@ private:
 
     TrilinosWrappers::MPI::Vector               locally_relevant_solution;
 
-    // Moving mesh data
+    // Moving mesh data. The scalar dof handler provides the global ids of the vertices and the hanging
+    // vertex constraints. The vertex indices of the triangulation are local to each processor, so Mesh_struct
+    // cannot use them to match the vertices of the ghost cells. The #dof_handler has the same element but
+    // it is distributed again by GWFLOW after the mesh structure is built, and its numbering is used by the solution.
+    // The displacements of the vertices are stored in Mesh_struct::vertex_offset
     DoFHandler<dim>                             mesh_dof_handler;
-    FESystem<dim>                              	mesh_fe;
-    TrilinosWrappers::MPI::Vector               mesh_vertices;
-    TrilinosWrappers::MPI::Vector               distributed_mesh_vertices;
-    TrilinosWrappers::MPI::Vector               mesh_Offset_vertices;
-    TrilinosWrappers::MPI::Vector               distributed_mesh_Offset_vertices;
+    FE_Q<dim>                                   mesh_fe;
     IndexSet                                    mesh_locally_owned;
     IndexSet                                    mesh_locally_relevant;
     ConstraintMatrix                            mesh_constraints;
@@ -87,6 +96,9 @@ private:
 
     AquiferProperties<dim>                      AQProps;
 
+    //! Calls the mesh_changed methods of the boundary conditions and the wells on every change of the triangulation
+    boost::signals2::connection                 mesh_change_connection;
+
     Mesh_struct<dim>                            mesh_struct;
 
     // Boundary Conditions
@@ -99,7 +111,42 @@ private:
     int                                         my_rank;
 
     void make_grid();
-    void create_dim_1_grids();
+
+    //! If the subdomain loading is enabled, it reads the scattered input data that lay around
+    //! the locally owned cells. It has to be called every time the triangulation is refined or repartitioned.
+    void load_subdomain_data();
+
+    //! Prints the hit rate of the interpolation caches, summed over all processors
+    void print_cache_stats();
+
+    //! Prints the number of x-y columns that are split between processors and the bytes that
+    //! were gathered by all processors since bytes_before.
+    //! Running with and without the AquiferProperties::column_partition compares the communication volume of the two partitions
+    void print_mesh_comm(uint64_t bytes_before);
+
+    /*!
+     * \brief partition_columns repartitions the flat mesh so that the cells of each coarse cell stay on one processor.
+     *
+     * It does nothing unless AquiferProperties::column_partition is set. The last cell of each p4est tree gets a weight
+     * proportional to the number of cells of the tree, which moves the partition boundaries to the ends of the trees.
+     * This is a heuristic with the following limitations:
+     * - The partition unit is the coarse cell, not the x-y column. The trees of a column are not consecutive along the
+     * space filling curve, because deal.II orders the coarse cells itself, so a column can still be split at the interfaces of the coarse layers.
+     * - A boundary whose target falls in the last 5% of the weight of a tree still cuts that tree.
+     * - Since the boundaries move to the ends of the trees, the cells per processor may differ from an even split by up to the cells of one tree.
+     *
+     * #print_mesh_comm reports the number of split columns.
+     */
+    void partition_columns();
+
+    /*!
+     * \brief create_dim_1_grids builds the top and bottom dim-1 grids from the current solution.
+     * The water table elevations of the top grid are under relaxed using the SolverParameters::RelaxFactor.
+     * \param max_change on return holds the maximum absolute change of the water table over all processors
+     * \param rms_change on return holds the root mean square change of the water table over all processors.
+     * Vertices that are shared between processors contribute once per processor.
+     */
+    void create_dim_1_grids(double& max_change, double& rms_change);
     void flag_cells_for_refinement();
     void print_mesh();
     void save_solution();
@@ -119,7 +166,7 @@ NPSAT<dim>::NPSAT(AquiferProperties<dim> AQP)
     dof_handler (triangulation),
     fe (1),
     mesh_dof_handler (triangulation),
-    mesh_fe (FE_Q<dim>(1),dim),
+    mesh_fe (1),
     AQProps(AQP),
     mesh_struct(AQP.xy_thres, AQP.z_thres),
     pcout(std::cout,(Utilities::MPI::this_mpi_process(mpi_communicator) == 0))
@@ -127,12 +174,21 @@ NPSAT<dim>::NPSAT(AquiferProperties<dim> AQP)
     //user_input = CLI;
     my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
     pcout << "Simulation started at \n" << print_current_time() << std::endl;
+    // The refinement and the repartition change the cells, so the boundary ids and the
+    // well cells have to be found again
+    mesh_change_connection = triangulation.signals.any_change.connect([this](){
+        DirBC.mesh_changed();
+        AQProps.wells.mesh_changed();
+    });
     make_grid();
+    if (AQProps.input_param.is_cached("DIR"))
+        DirBC.set_cache(AQProps.input_param.cache_size, AQProps.input_param.cache_tolerance);
     DirBC.get_from_file(AQProps.dirichlet_file_names, AQProps.Dirs.input);
 }
 
 template <int dim>
 NPSAT<dim>::~NPSAT(){
+    mesh_change_connection.disconnect();
     dof_handler.clear();
     mesh_dof_handler.clear();
     mesh_struct.folder_Path = AQProps.Dirs.output;
@@ -143,44 +199,27 @@ void NPSAT<dim>::make_grid(){
     //int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
     AquiferGrid::GridGenerator<dim> gg(AQProps);
     gg.make_grid(triangulation);
+    partition_columns();
 
-    // set display scales only during debuging
-    mesh_struct.dbg_set_scales(AQProps.dbg_scale_x, AQProps.dbg_scale_z);
-    mesh_struct.prefix = "iter0";
-    mesh_struct.updateMeshStruct(mesh_dof_handler,
-                                 mesh_fe,
-                                 mesh_constraints,
-                                 mesh_locally_owned,
-                                 mesh_locally_relevant,
-                                 mesh_vertices,
-                                 distributed_mesh_vertices,
-                                 mesh_Offset_vertices,
-                                 distributed_mesh_Offset_vertices,
-                                 mpi_communicator, pcout);
-
-    const MyFunction<dim, dim> top_function(AQProps.top_elevation);
-    const MyFunction<dim, dim> bottom_function(AQProps.bottom_elevation);
-
-    mesh_struct.compute_initial_elevations(top_function,bottom_function);
+    load_subdomain_data();
 
-    mesh_struct.updateMeshElevation(mesh_dof_handler,
-                                    triangulation,
-                                    mesh_constraints,
-                                    mesh_vertices,
-                                    distributed_mesh_vertices,
-                                    mesh_Offset_vertices,
-                                    distributed_mesh_Offset_vertices,
-                                    mpi_communicator,
-                                    pcout);
+    // The functions copy the interpolation data, therefore they are created again
+    // after the subdomain data are reloaded
+    MyFunction<dim, dim> top_function(AQProps.top_elevation);
+    MyFunction<dim, dim> bottom_function(AQProps.bottom_elevation);
 
+    // The initial refinement around the wells and streams is applied on the flat mesh, before the
+    // mesh structure is built. The well screens are compared against the elevations that the mesh
+    // will have. Each level flags the children of the previous one, so the levels are still refined one
+    // after the other, but the mesh structure and the elevations are built only once after the last level.
+    // The flat mesh does not need the vertex communication of do_refinement1.
     unsigned int count_refinements = 0;
     while (true){
         bool done_wells = false;
         bool done_streams = false;
 
-
         if (count_refinements < AQProps.N_well_refinement){
-            AQProps.wells.flag_cells_for_refinement(triangulation);
+            AQProps.wells.flag_cells_for_refinement(triangulation, &top_function, &bottom_function, 100);
         }
         else
             done_wells = true;
@@ -194,32 +233,43 @@ void NPSAT<dim>::make_grid(){
         if (done_wells && done_streams)
             break;
 
-        do_refinement1();
-
-        mesh_struct.updateMeshStruct(mesh_dof_handler,
-                                     mesh_fe,
-                                     mesh_constraints,
-                                     mesh_locally_owned,
-                                     mesh_locally_relevant,
-                                     mesh_vertices,
-                                     distributed_mesh_vertices,
-                                     mesh_Offset_vertices,
-                                     distributed_mesh_Offset_vertices,
-                                     mpi_communicator, pcout);
-        mesh_struct.compute_initial_elevations(top_function,bottom_function);
-
-        mesh_struct.updateMeshElevation(mesh_dof_handler,
-                                        triangulation,
-                                        mesh_constraints,
-                                        mesh_vertices,
-                                        distributed_mesh_vertices,
-                                        mesh_Offset_vertices,
-                                        distributed_mesh_Offset_vertices,
-                                        mpi_communicator,
-                                        pcout);
-
+        triangulation.execute_coarsening_and_refinement();
         count_refinements++;
+        // The refinement moves cells between the processors. The next level flags the cells
+        // against the elevations of the new partition
+        load_subdomain_data();
+        top_function.set_interpolant(AQProps.top_elevation);
+        bottom_function.set_interpolant(AQProps.bottom_elevation);
     }
+    if (count_refinements > 0){
+        partition_columns();
+        load_subdomain_data();
+        top_function.set_interpolant(AQProps.top_elevation);
+        bottom_function.set_interpolant(AQProps.bottom_elevation);
+    }
+    if (count_refinements > 0)
+        pcout << "Initial refinement: " << count_refinements << " levels, "
+              << triangulation.n_global_active_cells() << " cells" << std::endl;
+
+    // set display scales only during debuging
+    mesh_struct.dbg_set_scales(AQProps.dbg_scale_x, AQProps.dbg_scale_z);
+    mesh_struct.prefix = "iter0";
+    const uint64_t bytes_before = allgather_bytes();
+    mesh_struct.updateMeshStruct(mesh_dof_handler,
+                                 mesh_fe,
+                                 mesh_constraints,
+                                 mesh_locally_owned,
+                                 mesh_locally_relevant,
+                                 mpi_communicator, pcout);
+
+    mesh_struct.compute_initial_elevations(top_function,bottom_function);
+
+    mesh_struct.updateMeshElevation(mesh_dof_handler,
+                                    triangulation,
+                                    mpi_communicator,
+                                    pcout);
+    mesh_struct.build_columns(mesh_dof_handler, mpi_communicator);
+    print_mesh_comm(bytes_before);
 
     //std::ofstream out ("test_tria_" + Utilities::int_to_string(my_rank,4) + ".vtk");
     //GridOut grid_out;
@@ -227,6 +277,52 @@ void NPSAT<dim>::make_grid(){
 
 }
 
+template <int dim>
+void NPSAT<dim>::load_subdomain_data(){
+    if (AQProps.input_param.bLoadSubdomain != 1)
+        return;
+
+    Point<dim> pmin, pmax;
+    for (unsigned int idim = 0; idim < dim; ++idim){
+        pmin[idim] = std::numeric_limits<double>::max();
+        pmax[idim] = -std::numeric_limits<double>::max();
+    }
+    bool has_cells = false;
+    typename parallel::distributed::Triangulation<dim>::active_cell_iterator
+    cell = triangulation.begin_active(),
+    endc = triangulation.end();
+    for (; cell!=endc; ++cell){
+        if (cell->is_locally_owned()){
+            has_cells = true;
+            for (unsigned int v = 0; v < GeometryInfo<dim>::vertices_per_cell; ++v){
+                for (unsigned int idim = 0; idim < dim; ++idim){
+                    pmin[idim] = std::min(pmin[idim], cell->vertex(v)[idim]);
+                    pmax[idim] = std::max(pmax[idim], cell->vertex(v)[idim]);
+                }
+            }
+        }
+    }
+    // The input files are read collectively, so a processor without cells takes part with an empty box
+    // (pmin > pmax) and holds no data until a later partition gives it cells
+    if (!has_cells){
+        for (unsigned int idim = 0; idim < dim; ++idim){
+            pmin[idim] = 1;
+            pmax[idim] = 0;
+        }
+    }
+
+    AQProps.top_elevation.load_subdomain(pmin, pmax);
+    AQProps.bottom_elevation.load_subdomain(pmin, pmax);
+    for (unsigned int i = 0; i < AQProps.HydraulicConductivity.size(); ++i){
+        if (AQProps.HKuse[i])
+            AQProps.HydraulicConductivity[i].load_subdomain(pmin, pmax);
+    }
+    AQProps.Porosity.load_subdomain(pmin, pmax);
+    AQProps.GroundwaterRecharge.load_subdomain(pmin, pmax);
+    pcout << "Scattered input data restricted to the processor subdomains (halo: "
+          << AQProps.input_param.subdomain_halo << ")" << std::endl;
+}
+
 template <int dim>
 void NPSAT<dim>::solve_refine(){
 
@@ -251,12 +347,17 @@ void NPSAT<dim>::solve_refine(){
                                                     AQProps.HydraulicConductivity[2]);
     }
 
-    MyFunction<dim, dim> GR_funct(AQProps.GroundwaterRecharge);
-
+    // The particle tracking should use the same conductivity data as the flow simulation.
+    // The function that was created while reading the input is replaced
+    delete AQProps.HK_function;
+    AQProps.HK_function = HK_function;
 
     for (int iter = 0; iter < AQProps.solver_param.NonLinearIter ; ++iter){
         pcout << "|----------- Iteration : " << iter << " -------------|" << std::endl;
 
+        // The recharge function copies the data that are loaded for the current partition
+        MyFunction<dim, dim> GR_funct(AQProps.GroundwaterRecharge);
+
         DirBC.assign_dirichlet_to_triangulation(triangulation,
                                                 dirichlet_boundary,
                                                 top_boundary_ids,
@@ -284,10 +385,32 @@ void NPSAT<dim>::solve_refine(){
 
 
         if (iter < AQProps.solver_param.NonLinearIter - 1){
-            create_dim_1_grids();
+            double max_change, rms_change;
+            create_dim_1_grids(max_change, rms_change);
+            pcout << "Water table change: max = " << max_change << ", rms = " << rms_change << std::endl;
+            if (AQProps.solver_param.NonLinearTol > 0 && max_change < AQProps.solver_param.NonLinearTol){
+                pcout << "Nonlinear iterations converged after " << iter + 1 << " iterations" << std::endl;
+                // The relaxed water table is not applied, therefore the top grid keeps the elevations
+                // of the mesh where the head was solved. The mesh may be rebuilt from it (see #repartition_for_tracking)
+                for (unsigned int i = 0; i < top_grid.data_point.size(); ++i)
+                    top_grid.data_point[i][0] = top_grid.data_point[i][1];
+                break;
+            }
             if (iter < AQProps.refine_param.MaxRefinement)
                 flag_cells_for_refinement();
-            do_refinement1();
+            bool topology_changed = do_refinement1();
+            const uint64_t bytes_before = allgather_bytes();
+
+            // If the refinement did not change the mesh, the mesh structure is still valid and
+            // the new elevations are computed from the column arrays
+            if (!topology_changed && mesh_struct.has_columns()){
+                mesh_struct.assign_top_bottom(top_grid, bottom_grid, pcout, mpi_communicator);
+                mesh_struct.updateColumnElevation(mesh_dof_handler,
+                                                  triangulation,
+                                                  pcout);
+                print_mesh_comm(bytes_before);
+                continue;
+            }
 
             mesh_struct.prefix = "iter" + std::to_string(iter);
             mesh_struct.updateMeshStruct(mesh_dof_handler,
@@ -295,33 +418,74 @@ void NPSAT<dim>::solve_refine(){
                                          mesh_constraints,
                                          mesh_locally_owned,
                                          mesh_locally_relevant,
-                                         mesh_vertices,
-                                         distributed_mesh_vertices,
-                                         mesh_Offset_vertices,
-                                         distributed_mesh_Offset_vertices,
                                          mpi_communicator, pcout);
 
             mesh_struct.assign_top_bottom(top_grid, bottom_grid, pcout, mpi_communicator);
             mesh_struct.updateMeshElevation(mesh_dof_handler,
                                             triangulation,
-                                            mesh_constraints,
-                                            mesh_vertices,
-                                            distributed_mesh_vertices,
-                                            mesh_Offset_vertices,
-                                            distributed_mesh_Offset_vertices,
                                             mpi_communicator,
                                             pcout);
+            mesh_struct.build_columns(mesh_dof_handler, mpi_communicator);
+            print_mesh_comm(bytes_before);
             //print_mesh();
 
         }
     }
     //save_solution();
+    print_cache_stats();
     pcout << "Simulation ended at \n" << print_current_time() << std::endl;
 }
 
 template <int dim>
-void NPSAT<dim>::create_dim_1_grids(){
+void NPSAT<dim>::print_cache_stats(){
+    if (AQProps.input_param.cached_inputs.size() == 0)
+        return;
+    const unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+    std::vector<std::string> names;
+    std::vector<const InterpInterface<dim>*> inputs;
+    names.push_back("TOP"); inputs.push_back(&AQProps.top_elevation);
+    names.push_back("BOT"); inputs.push_back(&AQProps.bottom_elevation);
+    names.push_back("KX");  inputs.push_back(&AQProps.HydraulicConductivity[0]);
+    if (dim == 3){
+        names.push_back("KY"); inputs.push_back(&AQProps.HydraulicConductivity[1]);
+    }
+    names.push_back("KZ");  inputs.push_back(&AQProps.HydraulicConductivity[dim-1]);
+    names.push_back("POR"); inputs.push_back(&AQProps.Porosity);
+    names.push_back("RCH"); inputs.push_back(&AQProps.GroundwaterRecharge);
+    for (unsigned int i = 0; i < DirBC.interp_funct.size(); ++i){
+        names.push_back("DIR" + std::to_string(i));
+        inputs.push_back(&DirBC.interp_funct[i]);
+    }
+
+    for (unsigned int i = 0; i < inputs.size(); ++i){
+        unsigned long hits, misses;
+        inputs[i]->cache_stats(hits, misses);
+        sum_scalar<unsigned long>(hits, n_proc, mpi_communicator, MPI_UNSIGNED_LONG);
+        sum_scalar<unsigned long>(misses, n_proc, mpi_communicator, MPI_UNSIGNED_LONG);
+        if (hits + misses == 0)
+            continue;
+        pcout << "Cache " << names[i] << ": " << hits << " hits, " << misses << " misses ("
+              << 100.0*static_cast<double>(hits)/static_cast<double>(hits + misses) << "% hit rate)" << std::endl;
+    }
+}
+
+template <int dim>
+void NPSAT<dim>::print_mesh_comm(uint64_t bytes_before){
+    int n_split, n_columns;
+    mesh_struct.column_stats(n_split, n_columns, mpi_communicator);
+    uint64_t bytes = allgather_bytes() - bytes_before;
+    MPI_Allreduce(MPI_IN_PLACE, &bytes, 1, MPI_UINT64_T, MPI_SUM, mpi_communicator);
+    pcout << "Mesh update: " << n_split << " of " << n_columns << " columns split between processors, "
+          << static_cast<double>(bytes)/1048576.0 << " MB gathered" << std::endl;
+}
+
+template <int dim>
+void NPSAT<dim>::create_dim_1_grids(double& max_change, double& rms_change){
     pcout << "Create 2D grids..." << std::endl << std::flush;
+    const double relax = AQProps.solver_param.RelaxFactor;
+    double sum_sq_change = 0;
+    double n_change = 0;
+    max_change = 0;
     top_grid.reset();
     bottom_grid.reset();
     std::vector<double> new_old_elev(2);
@@ -383,7 +547,11 @@ void NPSAT<dim>::create_dim_1_grids(){
                             int id = is_point_in_list<dim-1>(temp_point_dim_1, top_grid.P, 1e-3);
                             if (id < 0){
                                 top_grid.add_point(temp_point_dim_1);
-                                new_old_elev[0] = values[ii];
+                                double change = values[ii] - temp_point_dim[dim-1];
+                                max_change = std::max(max_change, std::abs(change));
+                                sum_sq_change += change*change;
+                                n_change += 1;
+                                new_old_elev[0] = temp_point_dim[dim-1] + relax*change;
                                 new_old_elev[1] = temp_point_dim[dim-1];
                                 top_grid.data_point.push_back(new_old_elev);
                                 tempcell[static_cast<unsigned int>(ind[ii])] = point_counter_top;
@@ -429,6 +597,13 @@ void NPSAT<dim>::create_dim_1_grids(){
     top_grid.Nel = top_grid.MSH.size();
     bottom_grid.Np = bottom_grid.P.size();
     bottom_grid.Nel = bottom_grid.MSH.size();
+
+    double reduced[2] = {sum_sq_change, n_change};
+    MPI_Allreduce(MPI_IN_PLACE, reduced, 2, MPI_DOUBLE, MPI_SUM, mpi_communicator);
+    MPI_Allreduce(MPI_IN_PLACE, &max_change, 1, MPI_DOUBLE, MPI_MAX, mpi_communicator);
+    rms_change = 0;
+    if (reduced[1] > 0)
+        rms_change = std::sqrt(reduced[0]/reduced[1]);
     //std::cout << "Rank " << my_rank << " has (" << top_grid.Np << "," << top_grid.Nel << ") top and (" << bottom_grid.Np << "," << bottom_grid.Nel << ") bottom" << std::endl;
 
     //for (unsigned int i = 0; i < top_grid.Np; ++i){
@@ -464,116 +639,40 @@ void NPSAT<dim>::flag_cells_for_refinement(){
 }
 
 template <int dim>
-void NPSAT<dim>::do_refinement(){
-    // first prepare the triangulation
-    triangulation.prepare_coarsening_and_refinement();
-
-    //prepare vertices for transfering
-    parallel::distributed::SolutionTransfer<dim, TrilinosWrappers::MPI::Vector>mesh_trans(mesh_dof_handler);
-    std::vector<const TrilinosWrappers::MPI::Vector *> x_fs_system (1);
-
-    x_fs_system[0] = &mesh_vertices;
-    mesh_trans.prepare_for_coarsening_and_refinement(x_fs_system);
-
-    std::cout << "Number of active cells Before: "
-              << triangulation.n_active_cells()
-              << std::endl;
-    // execute the actual refinement
-    triangulation.execute_coarsening_and_refinement ();
-
-    std::cout << "Number of active cells After: "
-              << triangulation.n_active_cells()
-              << std::endl;
+bool NPSAT<dim>::do_refinement1(){
 
-    //For the mesh
-    mesh_dof_handler.distribute_dofs(mesh_fe); // distribute the dofs again
-    mesh_locally_owned = mesh_dof_handler.locally_owned_dofs();
-    DoFTools::extract_locally_relevant_dofs (mesh_dof_handler, mesh_locally_relevant);
+    // Each processor restores its own copy of the vertices from the stored offsets
+    mesh_struct.move_to_flat(triangulation);
 
-    distributed_mesh_vertices.reinit(mesh_locally_owned, mpi_communicator);
-    distributed_mesh_vertices.compress(VectorOperation::insert);
-
-    std::vector<TrilinosWrappers::MPI::Vector *> mesh_tmp (1);
-    mesh_tmp[0] = &(distributed_mesh_vertices);
-
-    mesh_trans.interpolate (mesh_tmp);
-    //mesh_constraints.distribute(mesh_tmp[0]);
-    mesh_vertices.reinit (mesh_locally_owned, mesh_locally_relevant, mpi_communicator);
-    mesh_vertices = distributed_mesh_vertices;
-    pcout << "moving vertices " << std::endl << std::flush;
-    mesh_struct.move_vertices(mesh_dof_handler,
-                             mesh_vertices);
-
-}
-
-template <int dim>
-void NPSAT<dim>::do_refinement1(){
-
-    std::vector<bool> locally_owned_vertices = triangulation.get_used_vertices();
+    // now the mesh should consistent as when it was first created
+    // so we can hopefully refine it
+    int any_flagged = 0;
     {
-        // Create the boolean input of communicate_locally_moved_vertices method
-        // see implementation of GridTools::get_locally_owned_vertices in grid_tools.cc line 2172 (8.5.0)
         typename parallel::distributed::Triangulation<dim>::active_cell_iterator
         cell = triangulation.begin_active(),
         endc = triangulation.end();
         for (; cell!=endc; ++cell){
-            if (cell->is_artificial() ||
-                    (cell->is_ghost() && cell->subdomain_id() < triangulation.locally_owned_subdomain() )){
-                for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v)
-                    locally_owned_vertices[cell->vertex_index(v)] = false;
-
+            if (cell->is_locally_owned() && (cell->refine_flag_set() || cell->coarsen_flag_set())){
+                any_flagged = 1;
+                break;
             }
         }
     }
+    MPI_Allreduce(MPI_IN_PLACE, &any_flagged, 1, MPI_INT, MPI_MAX, mpi_communicator);
 
-    // Call the method before
-    triangulation.communicate_locally_moved_vertices(locally_owned_vertices);
-    //{
-    //    std::ofstream out ("test_triaD" + std::to_string(my_rank) + ".vtk");
-    //    GridOut grid_out;
-    //    grid_out.write_ucd(triangulation, out);
-    //}
-
-    {// Apply the opposite displacement
-        std::map<types::global_dof_index, bool> set_dof;
-        std::map<types::global_dof_index, bool>::iterator it_set;
-        typename DoFHandler<dim>::active_cell_iterator
-        cell = mesh_dof_handler.begin_active(),
-        endc = mesh_dof_handler.end();
-        for (; cell != endc; ++cell){
-            if (cell->is_locally_owned()){
-                for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
-                    Point<dim> &v=cell->vertex(vertex_no);
-                    for (unsigned int dir=0; dir < dim; ++dir){
-                        types::global_dof_index dof = cell->vertex_dof_index(vertex_no, dir);
-                        it_set = set_dof.find(dof);
-                        if (it_set == set_dof.end()){
-                            //std::cout << dof << ": " << v(dir) << ", " << mesh_Offset_vertices(dof) << std::endl;
-                            v(dir) = v(dir) - mesh_Offset_vertices(dof);
-                            //std::cout << v(dir) << std::endl;
-                            set_dof[dof] = true;
-                        }
-                    }
-                }
-            }
-        }
-    }
-    //{
-    //    std::ofstream out ("test_triaE" + std::to_string(my_rank) + ".vtk");
-    //    GridOut grid_out;
-    //    grid_out.write_ucd(triangulation, out);
-    //}
-    triangulation.communicate_locally_moved_vertices(locally_owned_vertices);
-
-
-    // now the mesh should consistent as when it was first created
-    // so we can hopefully refine it
     triangulation.execute_coarsening_and_refinement ();
+    // The boundary ids and the well cells are updated through #mesh_change_connection.
+    // The refinement also moves cells between the processors, so the subdomain data are loaded again
+    if (any_flagged > 0){
+        partition_columns();
+        load_subdomain_data();
+    }
     //{
     //    std::ofstream out ("test_triaE" + std::to_string(my_rank) + ".vtk");
     //    GridOut grid_out;
     //    grid_out.write_ucd(triangulation, out);
     //}
+    return any_flagged > 0;
 }
 
 template <int dim>
@@ -582,6 +681,9 @@ void NPSAT<dim>::particle_tracking(){
     pcout << "Started at \n" << print_current_time() << std::endl;
     unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
 
+    if (AQProps.part_param.pilot_stride > 0 && n_proc > 1 && AQProps.part_param.replicated_mesh == 0)
+        repartition_for_tracking();
+
     MyFunction<dim, dim> porosity_fnc(AQProps.Porosity);
 
     Particle_Tracking<dim> pt(mpi_communicator,
@@ -594,6 +696,12 @@ void NPSAT<dim>::particle_tracking(){
 
     //pt.average_velocity_field(velocity_dof_handler,velocity_fe);
     pt.average_velocity_field();
+    if (AQProps.part_param.replicated_mesh == 1 || AQProps.part_param.export_mesh == 1){
+        std::string export_file;
+        if (AQProps.part_param.export_mesh == 1)
+            export_file = AQProps.Dirs.output + AQProps.sim_prefix + "_tracking_mesh.bin";
+        pt.build_replicated_mesh(export_file);
+    }
 
     std::vector<Streamline<dim>> All_streamlines;
     std::vector<std::vector<Streamline<dim>>> part_of_streamlines(n_proc);
@@ -640,7 +748,15 @@ void NPSAT<dim>::particle_tracking(){
         //std::cout << "I'm proc " << my_rank << " and have " << part_of_streamlines[my_rank].size() << " to trace" << std::endl;
         MPI_Barrier(mpi_communicator);
 
-        pt.trace_particles(part_of_streamlines[my_rank], particle_iter++, AQProps.Dirs.output + AQProps.sim_prefix);
+        if (AQProps.part_param.replicated_mesh == 1){
+            // Every processor has received all particles and keeps an equal share of them
+            std::vector<Streamline<dim>> my_streamlines;
+            for (unsigned int i = my_rank; i < part_of_streamlines[my_rank].size(); i += n_proc)
+                my_streamlines.push_back(part_of_streamlines[my_rank][i]);
+            pt.trace_particles_replicated(my_streamlines, particle_iter++, AQProps.Dirs.output + AQProps.sim_prefix);
+        }
+        else
+            pt.trace_particles(part_of_streamlines[my_rank], particle_iter++, AQProps.Dirs.output + AQProps.sim_prefix);
 
         // Processor 0 which is responsible to send out the streamlines will
         // broadcast if there are more streamlines to trace
@@ -648,6 +764,7 @@ void NPSAT<dim>::particle_tracking(){
         if (part_done[0] == 1)
             break;
     }
+    pt.print_step_statistics();
     pcout << "Particle tracking ended at \n" << print_current_time() << std::endl;
     pcout << "To gather the streamlines use the following command: \n"
           << "npsat -p " << AQProps.main_param_file
@@ -655,6 +772,161 @@ void NPSAT<dim>::particle_tracking(){
 
 }
 
+template <int dim>
+void NPSAT<dim>::partition_columns(){
+    if (AQProps.column_partition != 1 || Utilities::MPI::n_mpi_processes(mpi_communicator) == 1)
+        return;
+    typedef typename parallel::distributed::Triangulation<dim>::cell_iterator tria_iterator;
+
+    // The number of active cells of each coarse cell, i.e. of each p4est tree
+    std::vector<unsigned int> tree_cells(triangulation.n_cells(0), 0);
+    typename parallel::distributed::Triangulation<dim>::active_cell_iterator
+    cell = triangulation.begin_active(),
+    endc = triangulation.end();
+    for (; cell != endc; ++cell){
+        if (!cell->is_locally_owned())
+            continue;
+        tria_iterator root = cell;
+        while (root->level() > 0)
+            root = root->parent();
+        tree_cells[root->index()]++;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, tree_cells.data(), tree_cells.size(), MPI_UNSIGNED, MPI_SUM, mpi_communicator);
+
+    // The last cell of a tree along the space filling curve is reached by following the last child.
+    // It carries 19 times the default weight of all cells of its tree. A partition boundary is placed at the first cell
+    // whose preceding weight exceeds the target, so a target that falls within the weight of this cell puts the
+    // boundary at the end of the tree. This is the case for 95% of the weight, while the load stays proportional to the cells.
+    boost::signals2::connection weight_connection = triangulation.signals.cell_weight.connect(
+                [&tree_cells](const tria_iterator& tria_cell,
+                              const typename parallel::distributed::Triangulation<dim>::CellStatus status) -> unsigned int{
+        if (status != parallel::distributed::Triangulation<dim>::CELL_PERSIST || !tria_cell->active())
+            return 0;
+        tria_iterator c = tria_cell;
+        while (c->level() > 0){
+            if (c->parent()->child(c->parent()->n_children() - 1) != c)
+                return 0;
+            c = c->parent();
+        }
+        return static_cast<unsigned int>(std::min(19000.0*tree_cells[c->index()], 1.0e9));
+    });
+    triangulation.repartition();
+    weight_connection.disconnect();
+}
+
+template <int dim>
+void NPSAT<dim>::repartition_for_tracking(){
+    pcout << "Pilot particle tracking..." << std::endl;
+    unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+    MyFunction<dim, dim> porosity_fnc(AQProps.Porosity);
+
+    std::vector<unsigned int> cell_steps;
+    {
+        Particle_Tracking<dim> pilot(mpi_communicator,
+                                     dof_handler, fe,
+                                     Headconstraints,
+                                     locally_relevant_solution,
+                                     AQProps.HK_function[0],
+                                     porosity_fnc,
+                                     AQProps.part_param);
+        pilot.average_velocity_field();
+
+        std::vector<std::vector<Streamline<dim>>> part_of_streamlines(n_proc);
+        if (my_rank == 0){
+            std::vector<Streamline<dim>> All_streamlines;
+            AQProps.wells.distribute_particles(All_streamlines,
+                                               AQProps.part_param.Wells_N_per_layer,
+                                               AQProps.part_param.Wells_N_Layers,
+                                               AQProps.part_param.radius);
+            for (unsigned int i = 0; i < All_streamlines.size(); i += AQProps.part_param.pilot_stride)
+                part_of_streamlines[my_rank].push_back(All_streamlines[i]);
+            pcout << "      There are " << part_of_streamlines[my_rank].size()  << " pilot particles to trace" << std::endl;
+        }
+        MPI_Barrier(mpi_communicator);
+        Sent_receive_streamlines_all_to_all(part_of_streamlines, my_rank, n_proc, mpi_communicator);
+        pilot.trace_particles(part_of_streamlines[my_rank], 0, AQProps.Dirs.output + AQProps.sim_prefix + "_pilot");
+        pcout << "Pilot tracking with the flow partition:" << std::endl;
+        pilot.print_step_statistics();
+        cell_steps = pilot.get_cell_steps();
+    }
+
+    double total_steps = 0;
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = dof_handler.begin_active(),
+    endc = dof_handler.end();
+    for (; cell != endc; ++cell){
+        if (cell->is_locally_owned())
+            total_steps += cell_steps[cell->active_cell_index()];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &total_steps, 1, MPI_DOUBLE, MPI_SUM, mpi_communicator);
+    if (total_steps == 0){
+        pcout << "The pilot particles took no steps. The partition is not changed" << std::endl;
+        return;
+    }
+
+    // Each cell has a default weight of 1000. The weights of the particle steps sum up to
+    // 10 times the weight of all cells, so that the new partition is driven by the particle work
+    const double step_weight = 10000.0*triangulation.n_global_active_cells()/total_steps;
+    boost::signals2::connection weight_connection = triangulation.signals.cell_weight.connect(
+                [&cell_steps, step_weight](const typename parallel::distributed::Triangulation<dim>::cell_iterator& tria_cell,
+                                           const typename parallel::distributed::Triangulation<dim>::CellStatus status) -> unsigned int{
+        if (status != parallel::distributed::Triangulation<dim>::CELL_PERSIST || !tria_cell->active())
+            return 0;
+        // p4est stores the weights as int. A cell that collects most of the steps must not overflow it
+        return static_cast<unsigned int>(std::min(step_weight*cell_steps[tria_cell->active_cell_index()], 1.0e9));
+    });
+
+    // The cells that move to other processors are rebuilt from the coarse mesh.
+    // Therefore the mesh is flattened and the elevations are computed again after the repartition
+    mesh_struct.move_to_flat(triangulation);
+    parallel::distributed::SolutionTransfer<dim, TrilinosWrappers::MPI::Vector> sol_trans(dof_handler);
+    sol_trans.prepare_for_coarsening_and_refinement(locally_relevant_solution);
+    triangulation.repartition();
+    weight_connection.disconnect();
+    load_subdomain_data();
+
+    dof_handler.distribute_dofs(fe);
+    const IndexSet locally_owned_dofs = dof_handler.locally_owned_dofs();
+    IndexSet locally_relevant_dofs;
+    DoFTools::extract_locally_relevant_dofs(dof_handler, locally_relevant_dofs);
+    TrilinosWrappers::MPI::Vector distributed_solution(locally_owned_dofs, mpi_communicator);
+    sol_trans.interpolate(distributed_solution);
+
+    // The particle tracking needs only the hanging node constraints
+    Headconstraints.clear();
+    Headconstraints.reinit(locally_relevant_dofs);
+    DoFTools::make_hanging_node_constraints(dof_handler, Headconstraints);
+    Headconstraints.close();
+    Headconstraints.distribute(distributed_solution);
+    locally_relevant_solution.reinit(locally_owned_dofs, locally_relevant_dofs, mpi_communicator);
+    locally_relevant_solution = distributed_solution;
+
+    const uint64_t bytes_before = allgather_bytes();
+    mesh_struct.prefix = "tracking";
+    mesh_struct.updateMeshStruct(mesh_dof_handler,
+                                 mesh_fe,
+                                 mesh_constraints,
+                                 mesh_locally_owned,
+                                 mesh_locally_relevant,
+                                 mpi_communicator, pcout);
+    if (top_grid.P.size() > 0){
+        mesh_struct.assign_top_bottom(top_grid, bottom_grid, pcout, mpi_communicator);
+    }
+    else{
+        // There was a single nonlinear iteration, so the mesh has the initial elevations
+        const MyFunction<dim, dim> top_function(AQProps.top_elevation);
+        const MyFunction<dim, dim> bottom_function(AQProps.bottom_elevation);
+        mesh_struct.compute_initial_elevations(top_function,bottom_function);
+    }
+    mesh_struct.updateMeshElevation(mesh_dof_handler,
+                                    triangulation,
+                                    mpi_communicator,
+                                    pcout);
+    mesh_struct.build_columns(mesh_dof_handler, mpi_communicator);
+    print_mesh_comm(bytes_before);
+    pcout << "Repartitioned for particle tracking" << std::endl;
+}
+
 template <int dim>
 void NPSAT<dim>::print_mesh(){
     pcout << "\t Printing mesh only..." << std::endl << std::flush;
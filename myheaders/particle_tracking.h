@@ -1,10 +1,19 @@
 #ifndef PARTICLE_TRACKING_H
 #define PARTICLE_TRACKING_H
 
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
 #include <deal.II/dofs/dof_handler.h>
+#include <deal.II/dofs/dof_tools.h>
+#include <deal.II/lac/constraint_matrix.h>
 #include <deal.II/lac/trilinos_vector.h>
 #include <deal.II/fe/fe_q.h>
+#include <deal.II/fe/fe_dgq.h>
 #include <deal.II/fe/fe_system.h>
+#include <deal.II/fe/fe_values.h>
+#include <deal.II/base/quadrature_lib.h>
 #include <deal.II/base/conditional_ostream.h>
 
 #include "my_functions.h"
@@ -12,55 +21,35 @@
 #include "streamlines.h"
 #include "cgal_functions.h"
 #include "mpi_help.h"
+#include "cell_geometry_cache.h"
+#include "tracking_mesh.h"
 
 
 using namespace dealii;
 
-template <int dim>
-class AverageVel{
+/*!
+ * \brief The CellIdSet class is a small flat set of cells identified by their (level, index) pair.
+ *
+ * The neighbor searches visit only a few tens of cells, therefore a linear scan of a vector
+ * is faster than any tree or hash based container.
+ */
+class CellIdSet{
 public:
-    AverageVel(bool local, int dof_in, Point<dim> v, std::vector<types::global_dof_index> c);
-    AverageVel(int dof_in, Point<dim> av_vel_in);
-    void Addvelocity(Point<dim> v);
-    std::vector<types::global_dof_index> cnstr;
-    std::vector<Point<dim>> V;
-    bool is_local;
-    int dof;
-    Point<dim> av_vel;
-    bool is_averaged;
-
+    //! Adds the cell to the set. Returns false if the cell was already in the set
+    bool insert(int level, int index){
+        for (unsigned int i = 0; i < ids.size(); ++i){
+            if (ids[i].first == level && ids[i].second == index)
+                return false;
+        }
+        ids.push_back(std::pair<int,int>(level, index));
+        return true;
+    }
+    //! Removes all cells from the set
+    void clear(){ids.clear();}
+private:
+    std::vector<std::pair<int,int>> ids;
 };
 
-template <int dim>
-AverageVel<dim>::AverageVel(bool local, int dof_in, Point<dim> v, std::vector<types::global_dof_index> c){
-    is_local = local;
-    dof = dof_in;
-    V.push_back(v);
-    for (unsigned int ii = 0; ii < c.size(); ++ii){
-        if (static_cast<int>(c[ii]) != dof)
-            cnstr.push_back(c[ii]);
-    }
-    is_averaged = false;
-    for (unsigned int idim = 0; idim < dim; ++idim)
-        av_vel[idim] = -9999.9;
-}
-
-template <int dim>
-AverageVel<dim>::AverageVel(int dof_in, Point<dim> av_vel_in){
-    dof = dof_in;
-    av_vel = av_vel_in;
-    is_averaged = true;
-    is_local = false;
-    cnstr.clear();
-    V.clear();
-}
-
-template <int dim>
-void AverageVel<dim>::Addvelocity(Point<dim> v){
-    V.push_back(v);
-}
-
-
 template <int dim>
 class Particle_Tracking{
 public:
@@ -80,6 +69,43 @@ public:
     //                            FESystem<dim>& velocity_fe);
     bool average_velocity_field();
 
+    /*!
+     * \brief print_step_statistics prints the number of tracking steps, rejected steps and velocity evaluations
+     * summed over all processors. It also prints how many steps of the fixed step length would have covered
+     * the same distance, so that the adaptive and the fixed step methods can be compared.
+     * The number of times the terminated streamlines moved between processors is printed as well.
+     * All processors must call this method.
+     */
+    void print_step_statistics();
+
+    //! Returns the number of tracking steps that started in each cell, indexed by the active cell index
+    const std::vector<unsigned int>& get_cell_steps()const{return cell_steps;}
+
+    /*!
+     * \brief build_replicated_mesh assembles the TrackingMesh of the whole domain on every compute node.
+     *
+     * Each processor contributes its locally owned cells and dofs. The data are gathered on the first processor of
+     * each node, which builds the tracking mesh into an MPI-3 shared memory window. The other processors of the node
+     * access the same copy, so there is one tracking mesh per node and not per processor.
+     * This must be called by all processors after #average_velocity_field.
+     *
+     * \param export_file If this is not empty the first processor writes the tracking mesh into this file,
+     * which is the input of the standalone tracer npsat_trace. The shared memory copy is built only if
+     * ParticleParameters::replicated_mesh is 1, therefore the mesh can be exported without tracing on it.
+     * In that case the data are gathered only on the first processor.
+     */
+    void build_replicated_mesh(std::string export_file);
+
+    /*!
+     * \brief trace_particles_replicated traces the streamlines to completion on the replicated tracking mesh.
+     *
+     * Any processor can trace any particle, therefore the particles do not move between processors and the method
+     * does not communicate. The output files are the same as the ones of #trace_particles.
+     * It requires #build_replicated_mesh and supports only the Runge Kutta 4 steps of method 3.
+     * Any other ParticleParameters::method is rejected and no particle is traced.
+     */
+    void trace_particles_replicated(std::vector<Streamline<dim>>& streamlines, int iter, std::string prefix);
+
 private:
     MPI_Comm                            mpi_communicator;
     DoFHandler<dim>&                    dof_handler;
@@ -91,7 +117,23 @@ private:
     ConditionalOStream                  pcout;
     ParticleParameters                  param;
 
-    std::map<unsigned int, AverageVel<dim>> VelocityMap;
+    //! The averaged nodal velocity. There is one ghosted vector per direction
+    //! that holds the values of the locally relevant dofs of the #dof_handler
+    std::vector<TrilinosWrappers::MPI::Vector> nodal_velocity;
+
+    //! The geometry of the active cells. It is built after the velocity field is averaged
+    CellGeometryCache<dim>              cell_cache;
+
+    //! The velocities in unit coordinates on the faces of the cells that are used by the semi-analytical method.
+    //! For each active cell index there are 2*dim values in the order of the faces
+    std::vector<double>                 cell_face_vel;
+    //! Flags the cells whose face velocities have been computed
+    std::vector<bool>                   cell_face_vel_set;
+    //! The flux through each interior face, indexed by the face index. It is computed once and used by the cells
+    //! on both sides of the face. The sign is positive out of the reference cell of the face (see #shared_face_flux)
+    std::vector<double>                 face_flux;
+    //! Flags the faces whose flux has been computed
+    std::vector<bool>                   face_flux_set;
 
     bool                                bprint_DBG;
     std::ofstream                       dbg_file;
@@ -102,6 +144,36 @@ private:
     int                                 dbg_curr_Sid;
     int                                 dbg_my_rank;
 
+    //! The number of accepted tracking steps
+    double                              n_steps;
+    //! The number of steps that the adaptive method has rejected
+    double                              n_rejected_steps;
+    //! The number of velocity evaluations
+    double                              n_velocity_evals;
+    //! The number of fixed length steps that would cover the distance of the accepted steps
+    double                              n_fixed_steps;
+    //! The number of tracking steps that started in each cell
+    std::vector<unsigned int>           cell_steps;
+    //! The number of streamlines that have terminated on this processor
+    double                              n_finished_streamlines;
+    //! The sum of the migrations of the terminated streamlines
+    double                              n_migrations;
+    //! The maximum number of migrations of a terminated streamline
+    double                              max_migrations;
+    //! The number of times that a streamline has moved from an owned cell into the halo
+    double                              n_halo_entries;
+    //! The number of times that a streamline has moved from the halo back to an owned cell
+    double                              n_halo_returns;
+    //! The number of times that a streamline has been handed to another processor from a point in the halo
+    double                              n_halo_handoffs;
+    //! The file where the number of migrations of each terminated streamline is written
+    std::ofstream                       migration_file;
+
+    //! The bytes of the replicated tracking mesh. They live in a shared memory window of the node
+    BinaryIO::InputBuffer               replicated_buffer;
+    //! The replicated tracking mesh. It must be declared after #replicated_buffer that holds its arrays
+    TrackingMesh<dim>                   replicated_mesh;
+
     /**
      * @brief internal_backward_tracking
      * @param cell
@@ -113,6 +185,63 @@ private:
      * of the streamline has not been expanded
      */
     int internal_backward_tracking(typename DoFHandler<dim>::active_cell_iterator cell, Streamline<dim> &streamline);
+
+    //! The state of a particle that is traced in lock-step rounds
+    struct TracedParticle{
+        Streamline<dim>* streamline;
+        //! The cell where the last point of the streamline lies
+        typename DoFHandler<dim>::active_cell_iterator cell;
+        //! The number of steps taken so far
+        int n_iter;
+        //! The exit code as in #internal_backward_tracking. It is 0 while the particle is active
+        int outcome;
+    };
+
+    /*!
+     * \brief batch_backward_tracking traces the particles in lock-step rounds.
+     *
+     * In each round every active particle takes one step. Before the step the particles are sorted by
+     * the index of their current cell and each group of the same cell is advanced by #batch_step,
+     * so that the particles that travel close together share the cell data. The groups are formed again
+     * in every round as the particles change cells.
+     * On return the outcome of each particle is the same as the one #internal_backward_tracking would return.
+     */
+    void batch_backward_tracking(std::vector<TracedParticle>& particles);
+
+    /*!
+     * \brief batch_step advances up to #ParticleParameters::batch_size particles that lie in the same cell by one step.
+     *
+     * For the Runge Kutta 4 method the stage velocities of all particles are evaluated together by #batch_cell_velocity.
+     * A particle with a stage point outside of the cell repeats the step with #find_next_point, which
+     * handles the search of the neighbor cells. The other methods use #find_next_point for every particle.
+     * \param particles is the list of all traced particles
+     * \param ids are the indices of the particles of this batch
+     */
+    void batch_step(std::vector<TracedParticle>& particles, const std::vector<int>& ids);
+
+    /*!
+     * \brief batch_cell_velocity computes the velocity of many points in the same cell.
+     *
+     * The points and velocities are stored by direction, i.e. the x coordinates of all points
+     * followed by the y coordinates etc. The unit coordinates of all points are computed first by Newton iterations
+     * of the d-linear mapping with the vertices of the cell loaded once. Then the d-linear shape functions are evaluated
+     * inline and the velocities are interpolated from #batch_nodal_vel in loops over the points, which the compiler can vectorize.
+     * It requires the FE_Q(1) element, whose dofs are numbered as the vertices.
+     * \param inside is set to 0 for the points that are not in the cell. Their velocities are not valid
+     */
+    void batch_cell_velocity(typename DoFHandler<dim>::active_cell_iterator& cell, unsigned int n,
+                             const std::vector<double>& X, std::vector<double>& V, std::vector<char>& inside);
+
+    //! Writes the points of the streamline in the log file and queues the particles that continue to another processor
+    void finish_streamline(Streamline<dim>& streamline, int outcome, std::ofstream& log_file,
+                           std::ofstream& err_file, std::vector<Streamline<dim>>& new_particles);
+
+    //! The nodal velocities of the cell of the current batch. The dim values of each dof are contiguous
+    std::vector<double>                 batch_nodal_vel;
+    //! The shape function values of the current batch. The values of each shape function for all points are contiguous
+    std::vector<double>                 batch_shape;
+    //! The unit coordinates of the points of the current batch, stored by direction
+    std::vector<double>                 batch_unit;
     int compute_point_velocity(Point<dim>& p, Point<dim>& v, typename DoFHandler<dim>::active_cell_iterator &cell);
     int find_next_point(Streamline<dim> &streamline, typename DoFHandler<dim>::active_cell_iterator &cell);
     void Send_receive_particles(std::vector<Streamline<dim>>    new_particles,
@@ -122,16 +251,12 @@ private:
      * @brief check_cell_point tests the spatial relationship between a given cell and a given point.
      *
      * First checks if the point is inside the cell by calling the dealii method point_inside.
+     * The cached bounding box and face planes of the cell are tested before that, to avoid the inverse mapping for points
+     * that are clearly inside or outside.
      *
-     * If the point is not inside the input cell, then we loop through the cell faces to check if any neighbor cells contain the point.
-     *
-     * This is executed using the following logic:
-     *
-     * First we create a list of tested cells and a list of adjacent cells. Initially the adjacent list is empty and the tested cells contains only the initial cell.
-     * For each cell in the tested cell list we loop through the cells that touch each of the face of the tested cell and if those cells have not visited already
-     * we add them to the adjacent cell list.
-     * Next we check the cells int the list of adjacent cells if they contain the point. In addition each of the adjacent cells become tested cell for the next iteration.
-     * The number of times we do that is choosen by the user. Typicaly 3 is more than enough.
+     * If the point is not inside the input cell, the cell that contains the point is searched with #locate_point.
+     * This walks from the cell towards the point through the faces indicated by the unit coordinates of the point
+     * and falls back to a search of ParticleParameters::search_iter layers of neighbors if the walk gets stuck.
      * @param cell This is the initial cell. In the case that the return value is 0  or 1 the cell is the same as the input.
      * If the return value is 2 or 3 then the cell reference changes to point the new cell.
      * However if the return value is negative then the cell still points to the original cell.
@@ -142,8 +267,8 @@ private:
      *      - 2 if the point is found inside an adjacent cell that is locally owned
      *      - 3 if the point is found inside an adjacent cell that is ghost
      *      - -3 if the point is found inside an adjacent cell that is artificial.
-     * The last case indicates that something wrong happens. For example the step maybe too large so it skips the ghost cell.
-     * That's why when this returns negative values we tell the algorithm to take one very small euler step instead of a larger RK4 step
+     * The last case means that the particle has left the ghost cells of the halo (see CellGeometryCache::build_halo).
+     * The steps then return 55 and the particle continues from its last point on the processor that owns the cell of that point
      */
     int check_cell_point(typename DoFHandler<dim>::active_cell_iterator &cell, Point<dim>& p);
 
@@ -169,7 +294,8 @@ private:
     double calculate_step(typename DoFHandler<dim>::active_cell_iterator cell, Point<dim> Vel);
 
     /**
-     * @brief add_streamline_point Adds the point and velocity to the streamline. First checks if the cell is locally owned.
+     * @brief add_streamline_point Adds the point and velocity to the streamline. First checks if the cell is locally owned
+     * or part of the halo (see CellGeometryCache::build_halo).
      * If yes adds the point and the velocity. If not adds only the point. This particle position will transfer to other processors
      * and the one that onws the cell that this particle is will the compute the velocity.
      * @param cell
@@ -177,8 +303,10 @@ private:
      * @param p
      * @param vel
      * @return
-     *      - 0  if the cell is locally owned
-     *      - 55 if the cell is artificial or ghost
+     *      - 0  if the cell is locally owned or in the halo
+     *      - 55 if the cell is artificial or a ghost cell outside of the halo. If the last point of the streamline
+     *           is in the halo and the cell is artificial the point is not added, and the particle continues from the last point
+     *           on the processor that owns its cell
      */
     int add_streamline_point(typename DoFHandler<dim>::active_cell_iterator &cell,
                              Streamline<dim> &streamline,
@@ -206,6 +334,70 @@ private:
                         Point<dim> P_prev, Point<dim> V_prev,
                         Point<dim>& P_next, Point<dim>& V_next, int& count_nest);
 
+    /**
+     * @brief adaptive_rk_step takes one step of the embedded Bogacki-Shampine 3(2) method.
+     *
+     * The difference between the third and the second order solutions estimates the position error.
+     * The step is rejected and repeated with a shorter length if the error exceeds
+     * ParticleParameters::abs_tol + ParticleParameters::rel_tol * step length,
+     * or if any stage point leaves the domain or cannot be located in the neighborhood of the cell.
+     * A step whose stage points leave the cell is also rejected if it is longer than the fixed step length of any cell
+     * that the stages enter. It is repeated with that length, so a step cannot jump over refined cells (e.g. around wells).
+     * The step length never exceeds the minimum vertex distance of the cell and never goes below 1% of the fixed step length.
+     * The velocity of the last stage is the velocity of the new point, so each accepted step costs three velocity evaluations.
+     * @param streamline The step length for the next step is stored in Streamline::step_length
+     * @param cell
+     * @return The same codes as #add_streamline_point
+     */
+    int adaptive_rk_step(Streamline<dim> &streamline, typename DoFHandler<dim>::active_cell_iterator &cell);
+
+    //! Returns the step length of the fixed step methods in the cell
+    double fixed_step_length(typename DoFHandler<dim>::active_cell_iterator &cell);
+
+    /**
+     * @brief semi_analytical_step moves the particle from its current position to the exit face of the cell (Pollock's method).
+     *
+     * Within the cell each velocity component in unit coordinates varies linearly between the values of
+     * #compute_cell_face_velocity on the two opposite faces. The travel time to each face follows analytically
+     * and the particle moves to the face with the shortest time. The exit point is added to the streamline
+     * with the velocity interpolated from the nodal velocities, as for the other methods.
+     * @return
+     *  - The codes of #add_streamline_point if the particle enters a neighbor cell.
+     *  - 1, -9 or 2 if the particle exits the domain from the top, bottom or a side face. In that case the exit
+     * point is also added to the streamline.
+     *  - -66 if the particle is at a stagnation point
+     *  - -88 if the mapping of the particle position has failed
+     */
+    int semi_analytical_step(Streamline<dim> &streamline, typename DoFHandler<dim>::active_cell_iterator &cell);
+
+    /**
+     * @brief compute_cell_face_velocity computes the flux through each face of the cell from the head solution
+     * and converts it to a velocity in unit coordinates by dividing with the cell volume. The flux through
+     * a face is therefore the same as the flux of the velocity field that #semi_analytical_step uses.
+     * The flux through an interior face comes from #shared_face_flux, so the two cells of the face agree on it.
+     * A face whose neighbor is artificial uses the flux of this side only.
+     */
+    void compute_cell_face_velocity(typename DoFHandler<dim>::active_cell_iterator &cell);
+
+    /**
+     * @brief shared_face_flux returns the outward flux of the cell through the face iface, or through its subface
+     * isub if the neighbor is refined. The flux is the average of the fluxes that the two sides integrate from their
+     * own head gradients. It is stored by the index of the finer face, with a positive sign out of the reference cell,
+     * which is the finer cell for a hanging face and the cell with the lower index otherwise.
+     * @param isub is the subface, or -1 if the neighbor is not refined
+     */
+    double shared_face_flux(const typename DoFHandler<dim>::active_cell_iterator &cell, unsigned int iface, int isub,
+                            FEFaceValues<dim>& fe_face_values, FESubfaceValues<dim>& fe_subface_values);
+
+    //! Integrates the outward flux of the velocity over the face or subface that fe_values is initialized on
+    double integrate_face_flux(const FEFaceValuesBase<dim>& fe_values);
+
+    /**
+     * @brief rk_stage locates the point starting from the cell and computes its velocity
+     * @return 0 if the velocity was computed. Otherwise the code of #check_cell_point if negative or the code of #compute_point_velocity
+     */
+    int rk_stage(typename DoFHandler<dim>::active_cell_iterator &cell, Point<dim>& p, Point<dim>& v);
+
     /**
      * @brief time_step_multiplier calculates a step multiplier for the imput step.
      * In general the step is defined by the user by setting  the #ParticleParameters::step_size
@@ -222,7 +414,36 @@ private:
      */
     double time_step_multiplier(typename DoFHandler<dim>::active_cell_iterator cell);
 
-    bool cell_exists(std::vector<Point<dim>> PointList, Point<dim> test_point);
+    /**
+     * @brief cell_contains tests if the point is inside the cell with the given active cell index.
+     * The cached bounding box and face planes decide most cases and point_inside is called only when they cannot.
+     */
+    bool cell_contains(int icell, const Point<dim>& p);
+
+    /**
+     * @brief locate_point searches the active cell that contains the point p starting from the input cell.
+     *
+     * First it walks from cell to cell. At each cell the point is expressed in the unit coordinates of the cell
+     * and the walk continues through the face with the largest excess of the unit coordinates, skipping
+     * faces at the boundary and cells that have been visited. If the point is outside the bounding box of the cell
+     * the unit coordinates are approximated from the bounding box without inverse mapping.
+     * The cell geometry and the neighbors are read from the #cell_cache.
+     * The search does not continue through artificial cells, but it returns an artificial neighbor if the point lies in it,
+     * so that the particle can be handed to another processor.
+     *
+     * If the walk stops at the domain boundary or on a distorted cell, the neighbors are searched layer by layer
+     * up to ParticleParameters::search_iter layers.
+     * @param cell on input the starting cell. If the point is found it points to the cell that contains the point.
+     * @param p
+     * @return true if the point was found
+     */
+    bool locate_point(typename DoFHandler<dim>::active_cell_iterator& cell, const Point<dim>& p);
+
+    /**
+     * @brief face_child_towards_point returns the active cell index of the child behind the face that is closest to the point.
+     * It is used when the neighbor behind the face is refined.
+     */
+    int face_child_towards_point(int icell, unsigned int face, const Point<dim>& p);
 
     void plot_cell(typename DoFHandler<dim>::active_cell_iterator cell);
     void plot_point(Point<dim> p);
@@ -274,6 +495,16 @@ Particle_Tracking<dim>::Particle_Tracking(MPI_Comm& mpi_communicator_in,
     param(param_in),
     pcout(std::cout,(Utilities::MPI::this_mpi_process(mpi_communicator) == 0))
 {
+    n_steps = 0;
+    n_rejected_steps = 0;
+    n_velocity_evals = 0;
+    n_fixed_steps = 0;
+    n_finished_streamlines = 0;
+    n_migrations = 0;
+    max_migrations = 0;
+    n_halo_entries = 0;
+    n_halo_returns = 0;
+    n_halo_handoffs = 0;
     bprint_DBG = false;
     if (bprint_DBG){
         dbg_i_step = 1;
@@ -286,6 +517,11 @@ void Particle_Tracking<dim>::trace_particles(std::vector<Streamline<dim>>& strea
     unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
     unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
     dbg_my_rank = my_rank;
+    if (!cell_cache.is_built()){
+        cell_cache.build(dof_handler);
+        cell_cache.build_halo(param.halo_layers);
+        cell_steps.assign(dof_handler.get_triangulation().n_active_cells(), 0);
+    }
 
     //This is the name file where all particle trajectories are written
     const std::string log_file_name = (prefix + "_" +
@@ -301,6 +537,14 @@ void Particle_Tracking<dim>::trace_particles(std::vector<Streamline<dim>>& strea
                                        Utilities::int_to_string(my_rank, 4) +
                                        ".traj");
 
+    //This is the name file where the number of migrations of each streamline is written
+    const std::string migration_file_name = (prefix + "_" +
+                                             Utilities::int_to_string(static_cast<unsigned int>(iter), 4) +
+                                             "_migrations_" +
+                                             Utilities::int_to_string(my_rank, 4) +
+                                             ".traj");
+    migration_file.open(migration_file_name.c_str());
+
     if (bprint_DBG){
         // This is the name file where the particles in matlab code format will be saved
         const std::string dbg_file_name = (prefix + "_" +
@@ -351,6 +595,8 @@ void Particle_Tracking<dim>::trace_particles(std::vector<Streamline<dim>>& strea
             }
         }
         Range_tree_3_type ParticlesXY(prtclsxy.begin(), prtclsxy.end());
+        std::vector<TracedParticle> batch;
+        std::vector<bool> queued(streamlines.size(), false);
         //int cnt_ptr = 0;int cnt_cells = 0;
         typename DoFHandler<dim>::active_cell_iterator
         cell = dof_handler.begin_active(),
@@ -384,52 +630,35 @@ void Particle_Tracking<dim>::trace_particles(std::vector<Streamline<dim>>& strea
                 // loop through each point found in the cell box
                 for (unsigned int jj = 0; jj < particle_id_in_cell.size(); ++jj){
                     int iprt = particle_id_in_cell[jj];
-                    bool is_particle_inside = cell->point_inside(streamlines[iprt].P[0]);
+                    bool is_particle_inside = cell_contains(cell->active_cell_index(), streamlines[iprt].P[0]);
                     if (is_particle_inside){
-                        //std::cout << iprt << " : " << streamlines[iprt].E_id << " : " << streamlines[iprt].S_id << std::endl;
-                        int outcome = internal_backward_tracking(cell, streamlines[iprt]);
-                        if (outcome == -88){// the transformation of the point has failed
-                            err_file << "transformation failed" << ",  \t"
-                                     << streamlines[iprt].E_id << ",  \t"
-                                     << streamlines[iprt].S_id << std::endl;
+                        if (param.batch_size > 0){
+                            // A particle on a face of two cells is queued only once
+                            if (!queued[iprt]){
+                                queued[iprt] = true;
+                                TracedParticle tp;
+                                tp.streamline = &streamlines[iprt];
+                                tp.cell = cell;
+                                tp.n_iter = 0;
+                                tp.outcome = 0;
+                                batch.push_back(tp);
+                            }
                             continue;
                         }
-                        if (outcome == -66){ // The particle has stuck
-                            err_file << "Particle stuck" << ",  \t"
-                                     << streamlines[iprt].E_id << ",  \t"
-                                     << streamlines[iprt].S_id << std::endl;
-                        }
-                        // Print the particle positions in the file
-                        for (unsigned int i = 0; i < streamlines[iprt].V.size(); ++i){
-                            log_file << streamlines[iprt].E_id << "  \t"
-                                     << streamlines[iprt].S_id << "  \t"
-                                     << outcome << "  \t"
-                                     << streamlines[iprt].p_id[i] << "  \t"
-                                     << std::setprecision(15);
-                            for (unsigned int idim = 0; idim < dim; ++idim)
-                                log_file << streamlines[iprt].P[i][idim] << "  \t";
-                            for (unsigned int idim = 0; idim < dim; ++idim)
-                                log_file << streamlines[iprt].V[i][idim] << "  \t";
-                            log_file << std::endl;
-                        }
-
-                        if (outcome == 55){
-                            // this particle will continue to another processor
-                            int n = streamlines[iprt].P.size()-1;
-                            Streamline<dim> temp_strm(streamlines[iprt].E_id,
-                                                      streamlines[iprt].S_id,
-                                                      streamlines[iprt].P[n]);
-                            temp_strm.p_id[0] = streamlines[iprt].p_id[n];
-                            temp_strm.proc_id = streamlines[iprt].proc_id;
-                            temp_strm.BBl = streamlines[iprt].BBl;
-                            temp_strm.BBu = streamlines[iprt].BBu;
-                            new_particles.push_back(temp_strm);
-                        }
+                        //std::cout << iprt << " : " << streamlines[iprt].E_id << " : " << streamlines[iprt].S_id << std::endl;
+                        int outcome = internal_backward_tracking(cell, streamlines[iprt]);
+                        finish_streamline(streamlines[iprt], outcome, log_file, err_file, new_particles);
                     }
                 }
             }
         }
 
+        if (batch.size() > 0){
+            batch_backward_tracking(batch);
+            for (unsigned int i = 0; i < batch.size(); ++i)
+                finish_streamline(*batch[i].streamline, batch[i].outcome, log_file, err_file, new_particles);
+        }
+
         MPI_Barrier(mpi_communicator);
         //std::cout<< "I'm proc" << my_rank << " and have " << new_particles.size() << " particles to send" << std::endl << std::flush;
         MPI_Barrier(mpi_communicator);
@@ -445,7 +674,7 @@ void Particle_Tracking<dim>::trace_particles(std::vector<Streamline<dim>>& strea
         //std::cout << my_rank << " : " << max_N_part << std::endl;
 
         if (trace_iter>3)
-            return;
+            break;
 
         if (max_N_part == 0)
             break;
@@ -459,6 +688,7 @@ void Particle_Tracking<dim>::trace_particles(std::vector<Streamline<dim>>& strea
 
     log_file.close();
     err_file.close();
+    migration_file.close();
 
     if (bprint_DBG){
         dbg_file.close();
@@ -518,138 +748,512 @@ int Particle_Tracking<dim>::internal_backward_tracking(typename DoFHandler<dim>:
 }
 
 template <int dim>
-int Particle_Tracking<dim>::check_cell_point(typename DoFHandler<dim>::active_cell_iterator& cell, Point<dim>& p){
-    //Point<dim> testp(327.79903158960485,
-    //                 859.7581620110702,
-    //                 10.91061720969245);
-    //bool dbg_pnt = false;
-    //if (testp.distance(p) < 0.1){
-    //    std::cout << "Debug this point" << std::endl;
-    //    dbg_pnt = true;
-    //}
-    int outcome = 0;
-    if (cell->point_inside(p)){
-        outcome = 1;
-        //if (dbg_pnt){
-        //    std::cout << "Point found inside cell" << std::endl;
-        //}
+void Particle_Tracking<dim>::finish_streamline(Streamline<dim>& streamline, int outcome, std::ofstream& log_file,
+                                               std::ofstream& err_file, std::vector<Streamline<dim>>& new_particles){
+    if (outcome != 55){
+        migration_file << streamline.E_id << "  \t"
+                       << streamline.S_id << "  \t"
+                       << streamline.n_migrations << std::endl;
+        n_finished_streamlines += 1;
+        n_migrations += streamline.n_migrations;
+        max_migrations = std::max(max_migrations, static_cast<double>(streamline.n_migrations));
     }
-    else{
-        //if (dbg_pnt){
-        //    std::cout << "Point is NOT found inside cell" << std::endl;
-        //}
-        bool cell_found = false;
-        // if the point is outside of the cell then search all neighbors until the point is found
-        // or until we have search enough neighbors to make sure that the point is actually outside of the domain
-        std::vector<typename DoFHandler<dim>::active_cell_iterator> tested_cells;
-        std::vector<typename DoFHandler<dim>::active_cell_iterator> adjacent_cells;
-        std::vector<Point<dim>> cells_checked;
-        std::vector<Point<dim>> cells2check;
-        typename DoFHandler<dim>::active_cell_iterator neighbor_child;
-        tested_cells.push_back(cell);
-        cells_checked.push_back(cell->center());
-        int nSearch = 0;
-        while (nSearch < param.search_iter){
-            for (unsigned int i = 0; i < tested_cells.size(); ++i){
-                // for each face of the tested cell check its neighbors
-                for (unsigned int j = 0; j < GeometryInfo<dim>::faces_per_cell; ++j){
-                    if (!tested_cells[i]->at_boundary(j)){
-                        if(tested_cells[i]->neighbor(j)->active()){
-                            // if the neighbor is active then we check first if we have already checked it
-                            // or have already marked it for check and then we add it accordingly
-                            if (!cell_exists(cells_checked, tested_cells[i]->neighbor(j)->center()) &
-                                    !cell_exists(cells2check, tested_cells[i]->neighbor(j)->center())){
-                                if (!tested_cells[i]->neighbor(j)->is_artificial()){
-                                    adjacent_cells.push_back(tested_cells[i]->neighbor(j));
-                                    cells2check.push_back(tested_cells[i]->neighbor(j)->center());
-                                }
-                            }
-                        }
-                        else{
-                            // if the neighbor cell is not active then it has children
-                            // Here we check those children that touch the face of the tested cell
-                            for (unsigned int ichild = 0; ichild < tested_cells[i]->neighbor(j)->n_children(); ++ichild){
-                                // if the child has children, this child doesnt not touch the test cell and we will examine it later
-                                // However if the child is active we will add it this iteration even if it doesnt touch the cell in question
-                                if(tested_cells[i]->neighbor(j)->child(ichild)->active()){
-                                    neighbor_child = tested_cells[i]->neighbor(j)->child(ichild);
-                                    if (!cell_exists(cells_checked, neighbor_child->center()) &
-                                            !cell_exists(cells2check, neighbor_child->center())){
-                                        if (!neighbor_child->is_artificial()){
-                                            adjacent_cells.push_back(neighbor_child);
-                                            cells2check.push_back(neighbor_child->center());
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+
+    if (outcome == -88){// the transformation of the point has failed
+        err_file << "transformation failed" << ",  \t"
+                 << streamline.E_id << ",  \t"
+                 << streamline.S_id << std::endl;
+        return;
+    }
+    if (outcome == -66){ // The particle has stuck
+        err_file << "Particle stuck" << ",  \t"
+                 << streamline.E_id << ",  \t"
+                 << streamline.S_id << std::endl;
+    }
+    // Print the particle positions in the file
+    for (unsigned int i = 0; i < streamline.V.size(); ++i){
+        log_file << streamline.E_id << "  \t"
+                 << streamline.S_id << "  \t"
+                 << outcome << "  \t"
+                 << streamline.p_id[i] << "  \t"
+                 << std::setprecision(15);
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            log_file << streamline.P[i][idim] << "  \t";
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            log_file << streamline.V[i][idim] << "  \t";
+        log_file << std::endl;
+    }
+
+    if (outcome == 55){
+        // this particle will continue to another processor
+        int n = streamline.P.size()-1;
+        Streamline<dim> temp_strm(streamline.E_id,
+                                  streamline.S_id,
+                                  streamline.P[n]);
+        temp_strm.p_id[0] = streamline.p_id[n];
+        temp_strm.proc_id = streamline.proc_id;
+        temp_strm.BBl = streamline.BBl;
+        temp_strm.BBu = streamline.BBu;
+        temp_strm.n_migrations = streamline.n_migrations + 1;
+        new_particles.push_back(temp_strm);
+    }
+}
+
+template <int dim>
+void Particle_Tracking<dim>::batch_backward_tracking(std::vector<TracedParticle>& particles){
+    std::vector<int> active;
+    active.reserve(particles.size());
+
+    // The velocity of the starting points is computed as in internal_backward_tracking
+    for (unsigned int i = 0; i < particles.size(); ++i){
+        Streamline<dim>& streamline = *particles[i].streamline;
+        dbg_curr_Eid = streamline.E_id;
+        dbg_curr_Sid = streamline.S_id;
+        Point<dim> v;
+        int check_id = check_cell_point(particles[i].cell, streamline.P[streamline.P.size()-1]);
+        if (check_id == 1)
+            particles[i].outcome = compute_point_velocity(streamline.P[streamline.P.size()-1], v, particles[i].cell, check_id);
+        else
+            particles[i].outcome = -88;
+
+        if (particles[i].outcome != 0)
+            continue;
+        if (param.streaml_iter <= 0){
+            particles[i].outcome = -99;
+            continue;
+        }
+        streamline.V.push_back(v);
+        active.push_back(i);
+    }
+
+    const unsigned int batch_size = param.batch_size;
+    std::vector<int> still_active;
+    std::vector<int> ids;
+    while (active.size() > 0){
+        // Regroup the particles by their current cell
+        std::stable_sort(active.begin(), active.end(), [&particles](int a, int b){
+            return particles[a].cell->active_cell_index() < particles[b].cell->active_cell_index();
+        });
+
+        unsigned int first = 0;
+        while (first < active.size()){
+            const unsigned int icell = particles[active[first]].cell->active_cell_index();
+            unsigned int last = first + 1;
+            while (last < active.size() && particles[active[last]].cell->active_cell_index() == icell)
+                ++last;
+            for (unsigned int ib = first; ib < last; ib += batch_size){
+                ids.assign(active.begin() + ib, active.begin() + std::min(last, ib + batch_size));
+                batch_step(particles, ids);
             }
-            // The adjacent_cells is a list of cells that are likely to contain the point
-            tested_cells.clear();
-            //if (dbg_pnt)
-            //    std::cout << "^^^^^^^^^^^^ [" << nSearch << "] ^^^^^^^^^^^^^^" << std::endl;
-            for (unsigned int i = 0; i < adjacent_cells.size(); ++i){
-                //if (dbg_pnt){
-                    //Point<dim> minp(10000, 10000, 10000);
-                    //Point<dim> maxp(-10000, -10000, -10000);
-                    //Point <dim> ttt;
-                    //for (unsigned int vertex_no = 0; vertex_no < GeometryInfo<dim>::vertices_per_cell; ++vertex_no){
-                    //    ttt = adjacent_cells[i]->vertex(vertex_no);
-                    //    for (unsigned int iii = 0; iii < dim; ++iii){
-                    //        if (ttt[iii] < minp[iii])
-                    //            minp[iii] = ttt[iii];
-                    //        if (ttt[iii] > maxp[iii])
-                    //            maxp[iii] = ttt[iii];
-                    //    }
-                    //}
-                    //std::cout << "cell: [" << minp[0] << " " << minp[1] << " " << minp[2] << "], ["
-                    //          << maxp[0] << " " << maxp[1] << " " << maxp[2] << "]" << std::endl;
-
-                //}
-                bool is_in_cell = adjacent_cells[i]->point_inside(p);
-                if (is_in_cell){
-                    cell_found = true;
-                    if (bprint_DBG)
-                        print_Cell_var(adjacent_cells[i],cell_type(adjacent_cells[i]));
-                    if (cell->is_locally_owned()){
-                        cell = adjacent_cells[i];
-                        //plot_cell(cell);
-                        outcome = 2;
-                    }
-                    else if(cell->is_ghost()){
-                        cell = adjacent_cells[i];
-                        //plot_cell(cell);
-                        outcome = 3;
-                    }
-                    else if(cell->is_artificial()){
-                        outcome = -3;
-                    }
-                    else
-                        std::cerr << "That cant be right. The cell must be either local, ghost or artificial" << std::endl;
-                    break;
+            first = last;
+        }
+
+        still_active.clear();
+        for (unsigned int i = 0; i < active.size(); ++i){
+            TracedParticle& tp = particles[active[i]];
+            tp.n_iter++;
+            if (tp.streamline->times_not_expanded > param.Stuck_iter)
+                tp.outcome = -66;
+            if (tp.outcome == 0 && tp.n_iter < param.streaml_iter)
+                still_active.push_back(active[i]);
+            else
+                print_strm_exit_info(tp.outcome, tp.streamline->E_id, tp.streamline->S_id);
+        }
+        active.swap(still_active);
+    }
+}
+
+template <int dim>
+void Particle_Tracking<dim>::batch_step(std::vector<TracedParticle>& particles, const std::vector<int>& ids){
+    typename DoFHandler<dim>::active_cell_iterator cell = particles[ids[0]].cell;
+    const int icell = cell->active_cell_index();
+    const unsigned int n = ids.size();
+
+    if (param.method != 3 || cell_cache.status(icell) != 0 || fe.degree != 1){
+        for (unsigned int k = 0; k < n; ++k){
+            TracedParticle& tp = particles[ids[k]];
+            dbg_curr_Eid = tp.streamline->E_id;
+            dbg_curr_Sid = tp.streamline->S_id;
+            tp.outcome = find_next_point(*tp.streamline, tp.cell);
+        }
+        return;
+    }
+
+    // Load the nodal velocities of the cell once for all particles
+    const unsigned int dofs_per_cell = fe.dofs_per_cell;
+    std::vector<types::global_dof_index> local_dof_indices(dofs_per_cell);
+    cell->get_dof_indices(local_dof_indices);
+    batch_nodal_vel.resize(dofs_per_cell*dim);
+    for (unsigned int i = 0; i < dofs_per_cell; ++i)
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            batch_nodal_vel[i*dim + idim] = nodal_velocity[idim](local_dof_indices[i]);
+
+    // The step length depends only on the cell, so it is the same for the whole batch
+    const double step_length = time_step_multiplier(cell)*(cell_cache.min_vertex_distance(icell)/param.step_size);
+
+    // All arrays are stored by direction. K holds the velocities of the 4 stages
+    std::vector<double> P0(n*dim), X(n*dim), V(n*dim), av(n*dim, 0.0);
+    std::vector<std::vector<double>> K(4, std::vector<double>(n*dim));
+    std::vector<char> inside(n, 1), stage_inside(n);
+    for (unsigned int k = 0; k < n; ++k){
+        const Streamline<dim>& streamline = *particles[ids[k]].streamline;
+        const int last = streamline.P.size()-1;
+        for (unsigned int idim = 0; idim < dim; ++idim){
+            P0[idim*n + k] = streamline.P[last][idim];
+            K[0][idim*n + k] = streamline.V[last][idim];
+        }
+    }
+
+    // Each stage moves from the initial point along the velocity of the previous stage, as take_euler_step does
+    const double stage_weight[3] = {0.5, 0.5, 1.0};
+    std::vector<double> scale(n);
+    for (unsigned int istage = 0; istage < 3; ++istage){
+        const std::vector<double>& Kprev = K[istage];
+        for (unsigned int k = 0; k < n; ++k){
+            double norm = 0;
+            for (unsigned int idim = 0; idim < dim; ++idim)
+                norm += Kprev[idim*n + k]*Kprev[idim*n + k];
+            scale[k] = stage_weight[istage]*step_length/std::sqrt(norm);
+        }
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            for (unsigned int k = 0; k < n; ++k)
+                X[idim*n + k] = P0[idim*n + k] + Kprev[idim*n + k]*scale[k];
+        batch_cell_velocity(cell, n, X, K[istage+1], stage_inside);
+        for (unsigned int k = 0; k < n; ++k)
+            inside[k] = inside[k] && stage_inside[k];
+    }
+
+    // The RK4 weights are 1/6, 2/6, 2/6, 1/6
+    const double RK_weights[4] = {1.0/6.0, 2.0/6.0, 2.0/6.0, 1.0/6.0};
+    for (unsigned int istage = 0; istage < 4; ++istage)
+        for (unsigned int j = 0; j < n*dim; ++j)
+            av[j] += RK_weights[istage]*K[istage][j];
+    for (unsigned int k = 0; k < n; ++k){
+        double norm = 0;
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            norm += av[idim*n + k]*av[idim*n + k];
+        scale[k] = step_length/std::sqrt(norm);
+    }
+    for (unsigned int idim = 0; idim < dim; ++idim)
+        for (unsigned int k = 0; k < n; ++k)
+            X[idim*n + k] = P0[idim*n + k] + av[idim*n + k]*scale[k];
+    batch_cell_velocity(cell, n, X, V, stage_inside);
+
+    for (unsigned int k = 0; k < n; ++k){
+        TracedParticle& tp = particles[ids[k]];
+        if (inside[k] && stage_inside[k]){
+            Point<dim> p, v;
+            for (unsigned int idim = 0; idim < dim; ++idim){
+                p[idim] = X[idim*n + k];
+                v[idim] = V[idim*n + k];
+            }
+            n_steps += 1;
+            n_fixed_steps += 1;
+            cell_steps[icell]++;
+            tp.outcome = add_streamline_point(tp.cell, *tp.streamline, p, v, 0);
+        }
+        else{
+            // A stage has left the cell. The step is repeated by the method that searches the neighbor cells
+            dbg_curr_Eid = tp.streamline->E_id;
+            dbg_curr_Sid = tp.streamline->S_id;
+            tp.outcome = find_next_point(*tp.streamline, tp.cell);
+        }
+    }
+}
+
+template <int dim>
+void Particle_Tracking<dim>::batch_cell_velocity(typename DoFHandler<dim>::active_cell_iterator& cell, unsigned int n,
+                                                 const std::vector<double>& X, std::vector<double>& V, std::vector<char>& inside){
+    const unsigned int n_vert = GeometryInfo<dim>::vertices_per_cell;
+    n_velocity_evals += n;
+
+    // The vertex coordinates are loaded once. The vertex i of the unit cell has the coordinate
+    // bit idim of i along the direction idim, which is also the numbering of the dofs of FE_Q(1)
+    double XV[n_vert][dim];
+    for (unsigned int i = 0; i < n_vert; ++i)
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            XV[i][idim] = cell->vertex(i)[idim];
+    const double tol = 1e-10*cell_cache.min_vertex_distance(cell->active_cell_index());
+
+    // The unit coordinates of all points are computed together with Newton iterations of the d-linear mapping
+    batch_unit.assign(n*dim, 0.5);
+    std::fill(inside.begin(), inside.begin() + n, 0);
+    for (unsigned int iter = 0; iter < 10; ++iter){
+        bool all_converged = true;
+        for (unsigned int k = 0; k < n; ++k){
+            if (inside[k])
+                continue;
+            double xi[dim], x[dim], J[dim][dim];
+            for (unsigned int a = 0; a < dim; ++a){
+                xi[a] = batch_unit[a*n + k];
+                x[a] = 0;
+                for (unsigned int b = 0; b < dim; ++b)
+                    J[a][b] = 0;
+            }
+            for (unsigned int i = 0; i < n_vert; ++i){
+                double N = 1;
+                double dN[dim];
+                for (unsigned int b = 0; b < dim; ++b)
+                    dN[b] = 1;
+                for (unsigned int c = 0; c < dim; ++c){
+                    const double f = ((i >> c) & 1) ? xi[c] : 1 - xi[c];
+                    const double df = ((i >> c) & 1) ? 1 : -1;
+                    N *= f;
+                    for (unsigned int b = 0; b < dim; ++b)
+                        dN[b] *= (b == c) ? df : f;
                 }
-                else{
-                    tested_cells.push_back(adjacent_cells[i]);
-                    cells_checked.push_back(adjacent_cells[i]->center());
+                for (unsigned int a = 0; a < dim; ++a){
+                    x[a] += N*XV[i][a];
+                    for (unsigned int b = 0; b < dim; ++b)
+                        J[a][b] += dN[b]*XV[i][a];
                 }
             }
-            if (cell_found){
-                break;
+            double r[dim], res = 0;
+            for (unsigned int a = 0; a < dim; ++a){
+                r[a] = X[a*n + k] - x[a];
+                res += r[a]*r[a];
+            }
+            if (std::sqrt(res) < tol){
+                // The point is in the cell if its unit coordinates are in the unit cell
+                inside[k] = 1;
+                for (unsigned int a = 0; a < dim; ++a)
+                    if (xi[a] < -1e-8 || xi[a] > 1 + 1e-8)
+                        inside[k] = 2;
+                continue;
+            }
+            all_converged = false;
+            double dxi[dim];
+            if (dim == 2){
+                const double det = J[0][0]*J[1][1] - J[0][1]*J[1][0];
+                dxi[0] = ( J[1][1]*r[0] - J[0][1]*r[1])/det;
+                dxi[1] = (-J[1][0]*r[0] + J[0][0]*r[1])/det;
             }
             else{
-                nSearch++;
-                adjacent_cells.clear();
-                cells2check.clear();
+                const double det = J[0][0]*(J[1][1]*J[2][2] - J[1][2]*J[2][1])
+                                 - J[0][1]*(J[1][0]*J[2][2] - J[1][2]*J[2][0])
+                                 + J[0][2]*(J[1][0]*J[2][1] - J[1][1]*J[2][0]);
+                for (unsigned int a = 0; a < dim; ++a){
+                    double M[dim][dim];
+                    for (unsigned int i = 0; i < dim; ++i)
+                        for (unsigned int j = 0; j < dim; ++j)
+                            M[i][j] = (j == a) ? r[i] : J[i][j];
+                    dxi[a] = (M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1])
+                            - M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0])
+                            + M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]))/det;
+                }
             }
+            for (unsigned int a = 0; a < dim; ++a)
+                batch_unit[a*n + k] = xi[a] + dxi[a];
+        }
+        if (all_converged)
+            break;
+    }
+    // The points whose iterations did not converge or that lay outside of the unit cell are not in the cell
+    for (unsigned int k = 0; k < n; ++k)
+        inside[k] = inside[k] == 1 ? 1 : 0;
+
+    // The shape functions of the d-linear element are evaluated over the batch arrays
+    batch_shape.resize(n_vert*n);
+    for (unsigned int i = 0; i < n_vert; ++i){
+        double* N = &batch_shape[i*n];
+        std::fill(N, N + n, 1.0);
+        for (unsigned int c = 0; c < dim; ++c){
+            const double* xi = &batch_unit[c*n];
+            if ((i >> c) & 1)
+                for (unsigned int k = 0; k < n; ++k)
+                    N[k] *= xi[k];
+            else
+                for (unsigned int k = 0; k < n; ++k)
+                    N[k] *= 1 - xi[k];
+        }
+    }
+
+    std::fill(V.begin(), V.end(), 0.0);
+    for (unsigned int i = 0; i < n_vert; ++i){
+        const double* N = &batch_shape[i*n];
+        for (unsigned int idim = 0; idim < dim; ++idim){
+            const double vi = batch_nodal_vel[i*dim + idim];
+            double* Vd = &V[idim*n];
+            for (unsigned int k = 0; k < n; ++k)
+                Vd[k] += N[k]*vi;
+        }
+    }
+}
+
+template <int dim>
+int Particle_Tracking<dim>::check_cell_point(typename DoFHandler<dim>::active_cell_iterator& cell, Point<dim>& p){
+    if (cell_contains(cell->active_cell_index(), p))
+        return 1;
+
+    int outcome = 0;
+    typename DoFHandler<dim>::active_cell_iterator found_cell = cell;
+    if (locate_point(found_cell, p)){
+        if (bprint_DBG)
+            print_Cell_var(found_cell,cell_type(found_cell));
+        const int found_status = cell_cache.status(found_cell->active_cell_index());
+        if (found_status == 0){
+            cell = found_cell;
+            outcome = 2;
+        }
+        else if(found_status == 1){
+            cell = found_cell;
+            outcome = 3;
+        }
+        else if(found_status == 2){
+            outcome = -3;
         }
+        else
+            std::cerr << "That cant be right. The cell must be either local, ghost or artificial" << std::endl;
     }
     return outcome;
 }
 
+template <int dim>
+bool Particle_Tracking<dim>::cell_contains(int icell, const Point<dim>& p){
+    if (!cell_cache.in_bbox(icell, p))
+        return false;
+    const int plane_outcome = cell_cache.plane_test(icell, p);
+    if (plane_outcome >= 0)
+        return plane_outcome == 1;
+    return cell_cache.cell(icell)->point_inside(p);
+}
+
+template <int dim>
+int Particle_Tracking<dim>::face_child_towards_point(int icell, unsigned int face, const Point<dim>& p){
+    int best_child = -1;
+    double best_dst = std::numeric_limits<double>::max();
+    for (unsigned int isub = 0; isub < GeometryInfo<dim>::max_children_per_face; ++isub){
+        const int ichild = cell_cache.neighbor(icell, face, isub);
+        if (ichild < 0)
+            break;
+        if (cell_cache.in_bbox(ichild, p))
+            return ichild;
+        const double dst = cell_cache.bbox_center(ichild).distance(p);
+        if (dst < best_dst){
+            best_dst = dst;
+            best_child = ichild;
+        }
+    }
+    return best_child;
+}
+
+template <int dim>
+bool Particle_Tracking<dim>::locate_point(typename DoFHandler<dim>::active_cell_iterator& cell, const Point<dim>& p){
+    const MappingQ1<dim> mapping;
+    CellIdSet visited;
+    const int start_cell = cell->active_cell_index();
+    int current = start_cell;
+    visited.insert(cell->level(), cell->index());
+
+    // Directed walk
+    const int max_steps = std::max(1, param.search_iter) * GeometryInfo<dim>::faces_per_cell;
+    std::vector<std::pair<double, unsigned int>> exit_faces;
+    for (int istep = 0; istep < max_steps; ++istep){
+        Point<dim> p_unit;
+        bool mapped = false;
+        if (cell_cache.in_bbox(current, p)){
+            const int plane_outcome = cell_cache.plane_test(current, p);
+            if (plane_outcome == 1){
+                cell = cell_cache.cell(current);
+                return true;
+            }
+            Point<dim> p_temp = p;
+            mapped = try_mapping(p_temp, p_unit, cell_cache.cell(current), mapping);
+            if (mapped && plane_outcome != 0 && GeometryInfo<dim>::is_inside_unit_cell(p_unit)){
+                cell = cell_cache.cell(current);
+                return true;
+            }
+        }
+        if (!mapped){
+            // approximate the unit coordinates with the relative position of the point in the bounding box
+            p_unit = cell_cache.bbox_position(current, p);
+        }
+
+        // The faces 2*idim and 2*idim+1 are the faces at the unit coordinate idim = 0 and 1.
+        // The faces are tested in descending order of how far the point lies beyond them
+        exit_faces.clear();
+        for (unsigned int idim = 0; idim < dim; ++idim){
+            if (p_unit[idim] < 0)
+                exit_faces.push_back(std::pair<double, unsigned int>(-p_unit[idim], 2*idim));
+            else if (p_unit[idim] > 1)
+                exit_faces.push_back(std::pair<double, unsigned int>(p_unit[idim] - 1, 2*idim + 1));
+        }
+        std::sort(exit_faces.begin(), exit_faces.end(),
+                  [](const std::pair<double, unsigned int>& a, const std::pair<double, unsigned int>& b){return a.first > b.first;});
+
+        bool moved = false;
+        for (unsigned int i = 0; i < exit_faces.size(); ++i){
+            const unsigned int face = exit_faces[i].second;
+            int next;
+            if (cell_cache.neighbor(current, face, 1) < 0)
+                next = cell_cache.neighbor(current, face, 0);
+            else
+                next = face_child_towards_point(current, face, p);
+            if (next < 0)
+                continue;
+            if (!visited.insert(cell_cache.cell(next)->level(), cell_cache.cell(next)->index()))
+                continue;
+            if (cell_cache.status(next) == 2){
+                // The artificial cells have no velocity and no cached data, so the walk does not continue through them.
+                // If the point is in one of them the particle has left the part of the mesh that this processor knows
+                if (cell_cache.cell(next)->point_inside(p)){
+                    cell = cell_cache.cell(next);
+                    return true;
+                }
+                continue;
+            }
+            current = next;
+            moved = true;
+            break;
+        }
+        if (!moved)
+            break;
+    }
+
+    // The walk has stopped at the boundary or on a distorted cell.
+    // Search the neighbors of the starting cell layer by layer
+    visited.clear();
+    visited.insert(cell->level(), cell->index());
+    std::vector<int> tested_cells(1, start_cell);
+    std::vector<int> adjacent_cells;
+    for (int nSearch = 0; nSearch < param.search_iter; ++nSearch){
+        for (unsigned int i = 0; i < tested_cells.size(); ++i){
+            // for each face of the tested cell check its neighbors, including the children of refined neighbors
+            for (unsigned int j = 0; j < GeometryInfo<dim>::faces_per_cell; ++j){
+                for (unsigned int isub = 0; isub < GeometryInfo<dim>::max_children_per_face; ++isub){
+                    const int inb = cell_cache.neighbor(tested_cells[i], j, isub);
+                    if (inb < 0)
+                        break;
+                    if (!visited.insert(cell_cache.cell(inb)->level(), cell_cache.cell(inb)->index()))
+                        continue;
+                    if (cell_cache.status(inb) == 2){
+                        if (cell_cache.cell(inb)->point_inside(p)){
+                            cell = cell_cache.cell(inb);
+                            return true;
+                        }
+                        continue;
+                    }
+                    adjacent_cells.push_back(inb);
+                }
+            }
+        }
+        // The adjacent_cells is a list of cells that are likely to contain the point
+        tested_cells.clear();
+        for (unsigned int i = 0; i < adjacent_cells.size(); ++i){
+            if (cell_contains(adjacent_cells[i], p)){
+                cell = cell_cache.cell(adjacent_cells[i]);
+                return true;
+            }
+            tested_cells.push_back(adjacent_cells[i]);
+        }
+        adjacent_cells.clear();
+    }
+    return false;
+}
+
 template <int dim>
 int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v, typename DoFHandler<dim>::active_cell_iterator &cell, int check_point_status){
+    n_velocity_evals += 1;
     int outcome = -101;
     if (check_point_status < 0 || cell->is_artificial()){
         std::cerr << "Proc " << dbg_my_rank << " attempts compute_point_velocity for point ("
@@ -714,7 +1318,6 @@ int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v,
         if (new_way){
             for (unsigned int idim = 0; idim < dim; ++idim)
                 v[idim] = 0;
-            typename std::map<unsigned int, AverageVel<dim>>::iterator vel_it;
             const unsigned int dofs_per_cell = fe.dofs_per_cell;
             std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
             cell->get_dof_indices (local_dof_indices);
@@ -724,15 +1327,8 @@ int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v,
             fe_values_temp.reinit(cell);
             for (unsigned int i = 0; i < dofs_per_cell; ++i){
                 double N = fe_values_temp.shape_value(i,0);
-                vel_it = VelocityMap.find(local_dof_indices[i]);
-                if (vel_it != VelocityMap.end()){
-                    for (unsigned int idim = 0; idim < dim; ++idim)
-                        v[idim] += N * vel_it->second.av_vel[idim];
-
-                }
-                else {
-                    return -98;
-                }
+                for (unsigned int idim = 0; idim < dim; ++idim)
+                    v[idim] += N * nodal_velocity[idim](local_dof_indices[i]);
             }
             return 0;
         }
@@ -781,6 +1377,7 @@ int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v,
 
 template <int dim>
 int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v, typename DoFHandler<dim>::active_cell_iterator& cell){
+    n_velocity_evals += 1;
     int outcome = 0;
     Point<dim> p_unit;
     const MappingQ1<dim> mapping;
@@ -798,84 +1395,17 @@ int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v,
 
     //First we have to make sure that the point is in the cell
     if (!cell_found){
-        if (!cell->point_inside(p)){
-            // if the point is outside of the cell then search all neighbors until the point is found
+        if (cell_contains(cell->active_cell_index(), p))
+            cell_found = true;
+        else{
+            // if the point is outside of the cell then search the neighbors until the point is found
             // or until we have search enough neighbors to make sure that the point is actually outside of the domain
-
-            std::vector<typename DoFHandler<dim>::active_cell_iterator> tested_cells;
-            std::vector<typename DoFHandler<dim>::active_cell_iterator> adjacent_cells;
-            typename DoFHandler<dim>::active_cell_iterator neighbor_child;
-            tested_cells.push_back(cell);
-            std::vector<Point<dim>> cells_checked;
-            cells_checked.push_back(cell->center());
-            int nSearch = 0;
-            while (nSearch < param.search_iter){
-                for (unsigned int i = 0; i < tested_cells.size(); ++i){
-                    // for each face of the tested cell check its neighbors
-                    for (unsigned int j = 0; j < GeometryInfo<dim>::faces_per_cell; ++j){
-                        if (tested_cells[i]->at_boundary(j))
-                            continue;
-                        if(!tested_cells[i]->neighbor(j)->active()){
-                            // if the neighbor cell is not active then it has children
-                            // Here we check those children that touch the face of the tested cell
-                            for (unsigned int ichild = 0; ichild < tested_cells[i]->neighbor(j)->n_children(); ++ichild){
-                                // if the child has children, this child doesnt not touch the test cell and we will examine it later
-                                if(!tested_cells[i]->neighbor(j)->child(ichild)->active())
-                                    continue;
-                                neighbor_child = tested_cells[i]->neighbor(j)->child(ichild);
-                                // Check if this cell has been tested
-                                double dst = 0.0;
-                                for (unsigned int ii = 0; ii < cells_checked.size(); ++ii){
-                                    dst = cells_checked[ii].distance(neighbor_child->center());
-                                    if (dst < 0.001)
-                                        break;
-                                }
-                                if (dst > 0.001){// none of the cell centers of the checked cells is almost identical
-                                                  // to this neighbor so we will add them to the list of cells for check
-                                    adjacent_cells.push_back(neighbor_child);
-                                }
-                            }
-                        }
-                        else{
-                            // if the neighbor is active then we check first if we have already checked it
-                            double dst = 0.0;
-                            for (unsigned int ii = 0; ii < cells_checked.size(); ++ii){
-                                dst = cells_checked[ii].distance(tested_cells[i]->neighbor(j)->center());
-                                if (dst < 0.001)
-                                    break;
-                            }
-                            if (dst > 0.001){// none  of the cell centers of the checked cells is almost identical
-                                             // to this neighbor so we will add it to the list of the cells for check
-                                adjacent_cells.push_back(tested_cells[i]->neighbor(j));
-                            }
-                        }
-                    }
-                }
-
-                // The adjacent_cells is a list of cells that are likely to contain the point
-                tested_cells.clear();
-                for (unsigned int i = 0; i < adjacent_cells.size(); ++i){
-                    bool is_in_cell = adjacent_cells[i]->point_inside(p);
-                    if (is_in_cell){
-                        cell_found = true;
-                        cell = adjacent_cells[i];
-                        break;
-                    }
-                    else{
-                        tested_cells.push_back(adjacent_cells[i]);
-                        cells_checked.push_back(adjacent_cells[i]->center());
-                    }
-                }
-
-                nSearch++;
-                adjacent_cells.clear();
-                if (cell_found)
-                    break;
+            typename DoFHandler<dim>::active_cell_iterator found_cell = cell;
+            if (locate_point(found_cell, p)){
+                cell_found = true;
+                cell = found_cell;
             }
         }
-        else{
-            cell_found = true;
-        }
     }
 
     // We compute the unit coordinates using the new cell. This call is unessecary if the previous try mapping was success
@@ -916,7 +1446,7 @@ int Particle_Tracking<dim>::compute_point_velocity(Point<dim>& p, Point<dim>& v,
     }
 
     if (cell_found){
-        if (cell->is_ghost() || cell->is_artificial()){
+        if (cell->is_artificial() || (cell->is_ghost() && !cell_cache.in_halo(cell->active_cell_index()))){
             outcome = 55;
         }
         else{
@@ -965,12 +1495,20 @@ template <int dim>
 int Particle_Tracking<dim>::find_next_point(Streamline<dim> &streamline, typename DoFHandler<dim>::active_cell_iterator &cell){
     int outcome = -9999;
     int last = streamline.P.size()-1; // this is the index of the last point in the streamline
-    double step_lenght = time_step_multiplier(cell) *(cell->minimum_vertex_distance()/param.step_size);
+    double step_lenght = time_step_multiplier(cell) *(cell_cache.min_vertex_distance(cell->active_cell_index())/param.step_size);
     double step_time;
     Point<dim> next_point;
     Point<dim> temp_velocity;
     typename DoFHandler<dim>::active_cell_iterator init_cell = cell;
+    cell_steps[cell->active_cell_index()]++;
 
+    if (param.method == 4)
+        return adaptive_rk_step(streamline, cell);
+    if (param.method == 5)
+        return semi_analytical_step(streamline, cell);
+
+    n_steps += 1;
+    n_fixed_steps += 1;
     if (param.method == 1){
         // Euler method is the simplest one. The next point is computed as function of the previous
         // point only.
@@ -1066,6 +1604,7 @@ void Particle_Tracking<dim>::Send_receive_particles(std::vector<Streamline<dim>>
     std::vector<std::vector<int> > S_id(n_proc);
     std::vector<std::vector<int> > proc_id(n_proc);
     std::vector<std::vector<int> > p_id(n_proc);
+    std::vector<std::vector<int> > n_migr(n_proc);
     std::vector<std::vector<double> > BBlx(n_proc);
     std::vector<std::vector<double> > BBly(n_proc);
     std::vector<std::vector<double> > BBlz(n_proc);
@@ -1083,6 +1622,7 @@ void Particle_Tracking<dim>::Send_receive_particles(std::vector<Streamline<dim>>
         S_id[my_rank].push_back(new_particles[i].S_id);
         proc_id[my_rank].push_back(new_particles[i].proc_id);
         p_id[my_rank].push_back(new_particles[i].p_id[0]);
+        n_migr[my_rank].push_back(new_particles[i].n_migrations);
         BBlx[my_rank].push_back(new_particles[i].BBl[0]);
         BBly[my_rank].push_back(new_particles[i].BBl[1]);
         if (dim == 3)
@@ -1105,6 +1645,7 @@ void Particle_Tracking<dim>::Send_receive_particles(std::vector<Streamline<dim>>
     Sent_receive_data<int>(S_id, data_per_proc, my_rank, mpi_communicator, MPI_INT);
     Sent_receive_data<int>(proc_id, data_per_proc, my_rank, mpi_communicator, MPI_INT);
     Sent_receive_data<int>(p_id, data_per_proc, my_rank, mpi_communicator, MPI_INT);
+    Sent_receive_data<int>(n_migr, data_per_proc, my_rank, mpi_communicator, MPI_INT);
     Sent_receive_data<double>(BBlx, data_per_proc, my_rank, mpi_communicator, MPI_DOUBLE);
     Sent_receive_data<double>(BBly, data_per_proc, my_rank, mpi_communicator, MPI_DOUBLE);
     if (dim == 3)
@@ -1138,6 +1679,7 @@ void Particle_Tracking<dim>::Send_receive_particles(std::vector<Streamline<dim>>
                     p[2] = BBuz[i][j];
                 temp.BBu = p;
                 temp.p_id[0] = p_id[i][j];
+                temp.n_migrations = n_migr[i][j];
                 streamlines.push_back(temp);
             }
         }
@@ -1181,18 +1723,37 @@ int Particle_Tracking<dim>::add_streamline_point(typename DoFHandler<dim>::activ
         print_point_var(p,return_value);
     }
 
+    // The last point of the streamline is in the halo if it was added on a cell that is owned by another processor
+    const int owned_id = static_cast<int>(cell->get_triangulation().locally_owned_subdomain());
+    const bool last_in_halo = streamline.proc_id >= 0 && streamline.proc_id != owned_id;
+
     if (return_value == 0 || return_value == -1){ // Either the computation has been normal or with reduced step
-        if (cell->is_ghost() || cell->is_artificial()){
+        if (cell->is_artificial() && last_in_halo){
+            // The owner of an artificial cell is not known. The particle continues from its last point
+            // on the processor that owns the halo cell of that point
+            n_halo_handoffs += 1;
+            return 55;
+        }
+        else if (cell->is_artificial() || (cell->is_ghost() && !cell_cache.in_halo(cell->active_cell_index()))){
+            if (last_in_halo)
+                n_halo_handoffs += 1;
             streamline.add_point(p, cell->subdomain_id());
             return 55;
         }
-        else if (cell->is_locally_owned()){
+        else{
             //plot_segment(streamline.P[streamline.P.size()-1], p);
+            if (cell->is_ghost() && !last_in_halo)
+                n_halo_entries += 1;
+            else if (cell->is_locally_owned() && last_in_halo)
+                n_halo_returns += 1;
             streamline.add_point_vel(p, vel, cell->subdomain_id());
             return 0;
         }
     }
     else{
+        // A stage of the step has reached a cell without velocity. The particle continues from its last point
+        if (return_value == 55 && last_in_halo)
+            n_halo_handoffs += 1;
         return return_value;
     }
     // The code should never reach this point but I added return statement to supress warnings
@@ -1215,7 +1776,11 @@ int Particle_Tracking<dim>::take_euler_step(typename DoFHandler<dim>::active_cel
 
     int check_pnt = check_cell_point(cell, P_next);
 
-    if (check_pnt < 0){
+    if (check_pnt == -3){
+        // The point is in an artificial cell. The particle continues from its last point on another processor
+        outcome = 55;
+    }
+    else if (check_pnt < 0){
         step_length = step_length/5.0;
         count_nest++;
         outcome = take_euler_step(cell, step_weight, step_length, P_prev, V_prev, P_next, V_next, count_nest);
@@ -1235,6 +1800,564 @@ int Particle_Tracking<dim>::take_euler_step(typename DoFHandler<dim>::active_cel
     }
 }
 
+template <int dim>
+int Particle_Tracking<dim>::rk_stage(typename DoFHandler<dim>::active_cell_iterator &cell, Point<dim>& p, Point<dim>& v){
+    int check_pnt = check_cell_point(cell, p);
+    if (check_pnt == -3)
+        return 55;
+    if (check_pnt < 0)
+        return check_pnt;
+    return compute_point_velocity(p, v, cell, check_pnt);
+}
+
+template <int dim>
+double Particle_Tracking<dim>::fixed_step_length(typename DoFHandler<dim>::active_cell_iterator &cell){
+    return time_step_multiplier(cell)*(cell_cache.min_vertex_distance(cell->active_cell_index())/param.step_size);
+}
+
+template <int dim>
+int Particle_Tracking<dim>::adaptive_rk_step(Streamline<dim> &streamline, typename DoFHandler<dim>::active_cell_iterator &cell){
+    const int last = streamline.P.size()-1;
+    const Point<dim> P0 = streamline.P[last];
+    const Point<dim> k1 = streamline.V[last];
+    const double speed = k1.norm();
+    const double cell_size = cell_cache.min_vertex_distance(cell->active_cell_index());
+    const double fixed_length = fixed_step_length(cell);
+    const double min_length = 0.01*fixed_length;
+
+    double step_length = fixed_length;
+    if (streamline.step_length > 0)
+        step_length = std::min(std::max(streamline.step_length, min_length), cell_size);
+
+    typename DoFHandler<dim>::active_cell_iterator init_cell = cell;
+    Point<dim> k2, k3, k4, P_stage;
+    while (true){
+        const double h = step_length/speed;
+        cell = init_cell;
+
+        // Bogacki-Shampine stages. The third stage point is the third order solution.
+        // cross_length is the smallest fixed step length of the other cells that the stage points enter
+        double cross_length = std::numeric_limits<double>::max();
+        for (unsigned int i = 0; i < dim; ++i)
+            P_stage[i] = P0[i] + 0.5*h*k1[i];
+        int outcome = rk_stage(cell, P_stage, k2);
+        if (outcome == 0){
+            if (cell != init_cell)
+                cross_length = std::min(cross_length, fixed_step_length(cell));
+            for (unsigned int i = 0; i < dim; ++i)
+                P_stage[i] = P0[i] + 0.75*h*k2[i];
+            outcome = rk_stage(cell, P_stage, k3);
+        }
+        if (outcome == 0){
+            if (cell != init_cell)
+                cross_length = std::min(cross_length, fixed_step_length(cell));
+            for (unsigned int i = 0; i < dim; ++i)
+                P_stage[i] = P0[i] + h*(2.0/9.0*k1[i] + 1.0/3.0*k2[i] + 4.0/9.0*k3[i]);
+            outcome = rk_stage(cell, P_stage, k4);
+        }
+        if (outcome == 0 && cell != init_cell)
+            cross_length = std::min(cross_length, fixed_step_length(cell));
+
+        if (outcome != 0){
+            // A stage point is outside of the domain or was not found in the neighborhood.
+            // Shorten the step so that the particle approaches the boundary before it exits
+            if (step_length > min_length){
+                step_length = std::max(0.5*step_length, min_length);
+                n_rejected_steps += 1;
+                continue;
+            }
+            n_steps += 1;
+            return add_streamline_point(cell, streamline, P_stage, k4, outcome);
+        }
+
+        if (outcome == 0 && step_length > cross_length){
+            // The step leaves the cell and is too long for the cells it enters.
+            // The shorter length is not limited by min_length, which refers to the current cell
+            step_length = cross_length;
+            n_rejected_steps += 1;
+            continue;
+        }
+
+        // The error is the difference from the embedded second order solution
+        double err = 0;
+        for (unsigned int i = 0; i < dim; ++i){
+            const double e = h*(-5.0/72.0*k1[i] + 1.0/12.0*k2[i] + 1.0/9.0*k3[i] - 1.0/8.0*k4[i]);
+            err += e*e;
+        }
+        err = std::sqrt(err);
+        const double tol = param.abs_tol + param.rel_tol*step_length;
+        double factor = 5.0;
+        if (err > 0)
+            factor = std::min(5.0, std::max(0.2, 0.9*std::pow(tol/err, 1.0/3.0)));
+
+        if (err > tol && step_length > min_length){
+            step_length = std::max(factor*step_length, min_length);
+            n_rejected_steps += 1;
+            continue;
+        }
+
+        n_steps += 1;
+        n_fixed_steps += step_length/fixed_length;
+        streamline.step_length = factor*step_length;
+        return add_streamline_point(cell, streamline, P_stage, k4, 0);
+    }
+}
+
+template <int dim>
+double Particle_Tracking<dim>::integrate_face_flux(const FEFaceValuesBase<dim>& fe_values){
+    std::vector<Tensor<1,dim>> head_grad(fe_values.n_quadrature_points);
+    fe_values.get_function_gradients(locally_relevant_solution, head_grad);
+    double flux = 0;
+    for (unsigned int q = 0; q < fe_values.n_quadrature_points; ++q){
+        const Point<dim>& xq = fe_values.quadrature_point(q);
+        const Tensor<1,dim> vel = HK_function.value(xq)*head_grad[q]/porosity.value(xq);
+        flux += vel*fe_values.normal_vector(q)*fe_values.JxW(q);
+    }
+    return flux;
+}
+
+template <int dim>
+double Particle_Tracking<dim>::shared_face_flux(const typename DoFHandler<dim>::active_cell_iterator &cell, unsigned int iface, int isub,
+                                                FEFaceValues<dim>& fe_face_values, FESubfaceValues<dim>& fe_subface_values){
+    typename DoFHandler<dim>::active_cell_iterator nb_cell;
+    unsigned int face_index;
+    bool is_reference;
+    if (isub >= 0){
+        nb_cell = cell->neighbor_child_on_subface(iface, isub);
+        face_index = cell->face(iface)->child(isub)->index();
+        is_reference = false;
+    }
+    else{
+        nb_cell = cell->neighbor(iface);
+        face_index = cell->face(iface)->index();
+        is_reference = cell->neighbor_is_coarser(iface) || cell->index() < nb_cell->index();
+    }
+
+    if (face_flux_set.size() == 0){
+        face_flux.assign(dof_handler.get_triangulation().n_raw_faces(), 0.0);
+        face_flux_set.assign(dof_handler.get_triangulation().n_raw_faces(), false);
+    }
+    if (face_flux_set[face_index])
+        return is_reference ? face_flux[face_index] : -face_flux[face_index];
+
+    // The flux of this side
+    double flux_this;
+    if (isub >= 0){
+        fe_subface_values.reinit(cell, iface, isub);
+        flux_this = integrate_face_flux(fe_subface_values);
+    }
+    else{
+        fe_face_values.reinit(cell, iface);
+        flux_this = integrate_face_flux(fe_face_values);
+    }
+    if (nb_cell->is_artificial())
+        return flux_this;
+
+    // The outward flux of the neighbor through the same face
+    double flux_nb;
+    if (isub < 0 && cell->neighbor_is_coarser(iface)){
+        const std::pair<unsigned int, unsigned int> nb_face = cell->neighbor_of_coarser_neighbor(iface);
+        fe_subface_values.reinit(nb_cell, nb_face.first, nb_face.second);
+        flux_nb = integrate_face_flux(fe_subface_values);
+    }
+    else{
+        fe_face_values.reinit(nb_cell, cell->neighbor_of_neighbor(iface));
+        flux_nb = integrate_face_flux(fe_face_values);
+    }
+
+    const double flux = 0.5*(flux_this - flux_nb);
+    face_flux[face_index] = is_reference ? flux : -flux;
+    face_flux_set[face_index] = true;
+    return flux;
+}
+
+template <int dim>
+void Particle_Tracking<dim>::compute_cell_face_velocity(typename DoFHandler<dim>::active_cell_iterator &cell){
+    const int icell = cell->active_cell_index();
+    const QGauss<dim-1> face_quadrature(2);
+    const UpdateFlags flags = update_gradients | update_quadrature_points | update_normal_vectors | update_JxW_values;
+    FEFaceValues<dim> fe_face_values(fe, face_quadrature, flags);
+    FESubfaceValues<dim> fe_subface_values(fe, face_quadrature, flags);
+    const double volume = cell->measure();
+
+    for (unsigned int iface = 0; iface < GeometryInfo<dim>::faces_per_cell; ++iface){
+        double flux = 0;
+        if (cell->at_boundary(iface)){
+            fe_face_values.reinit(cell, iface);
+            flux = integrate_face_flux(fe_face_values);
+        }
+        else if (cell->neighbor(iface)->has_children()){
+            // The face is split into the faces of the finer neighbors
+            for (unsigned int isub = 0; isub < cell->face(iface)->n_children(); ++isub)
+                flux += shared_face_flux(cell, iface, isub, fe_face_values, fe_subface_values);
+        }
+        else
+            flux = shared_face_flux(cell, iface, -1, fe_face_values, fe_subface_values);
+
+        // The outward normal of the faces at unit coordinate 0 points to the negative direction
+        if (iface % 2 == 0)
+            flux = -flux;
+        cell_face_vel[icell*GeometryInfo<dim>::faces_per_cell + iface] = flux/volume;
+    }
+    cell_face_vel_set[icell] = true;
+}
+
+template <int dim>
+int Particle_Tracking<dim>::semi_analytical_step(Streamline<dim> &streamline, typename DoFHandler<dim>::active_cell_iterator &cell){
+    if (cell_face_vel_set.size() == 0){
+        cell_face_vel.assign(dof_handler.get_triangulation().n_active_cells()*GeometryInfo<dim>::faces_per_cell, 0.0);
+        cell_face_vel_set.assign(dof_handler.get_triangulation().n_active_cells(), false);
+    }
+    const int icell = cell->active_cell_index();
+    if (!cell_face_vel_set[icell])
+        compute_cell_face_velocity(cell);
+    const double* uf = &cell_face_vel[icell*GeometryInfo<dim>::faces_per_cell];
+
+    const int last = streamline.P.size()-1;
+    Point<dim> p = streamline.P[last];
+    Point<dim> p_unit;
+    const MappingQ1<dim> mapping;
+    if (!try_mapping(p, p_unit, cell, mapping))
+        return -88;
+
+    // For each direction the velocity is u0 + A*xi. Find the time to reach the face that the particle moves to
+    double A[dim];
+    double up[dim];
+    double t_exit = std::numeric_limits<double>::max();
+    int exit_face = -1;
+    for (unsigned int idim = 0; idim < dim; ++idim){
+        p_unit[idim] = std::min(std::max(p_unit[idim], 0.0), 1.0);
+        const double u0 = uf[2*idim];
+        const double u1 = uf[2*idim + 1];
+        A[idim] = u1 - u0;
+        up[idim] = u0 + A[idim]*p_unit[idim];
+        const bool uniform = std::abs(A[idim]) <= 1e-10*std::max(std::abs(u0), std::abs(u1));
+        double t = std::numeric_limits<double>::max();
+        if (up[idim] > 0 && u1 > 0)
+            t = uniform ? (1 - p_unit[idim])/up[idim] : std::log(u1/up[idim])/A[idim];
+        else if (up[idim] < 0 && u0 < 0)
+            t = uniform ? -p_unit[idim]/up[idim] : std::log(u0/up[idim])/A[idim];
+        if (uniform)
+            A[idim] = 0;
+        if (t < t_exit){
+            t_exit = t;
+            exit_face = up[idim] > 0 ? 2*idim + 1 : 2*idim;
+        }
+    }
+    if (exit_face < 0)
+        return -66;
+
+    Point<dim> q_unit;
+    for (unsigned int idim = 0; idim < dim; ++idim){
+        if (static_cast<int>(idim) == exit_face/2)
+            q_unit[idim] = exit_face % 2;
+        else if (A[idim] == 0)
+            q_unit[idim] = p_unit[idim] + up[idim]*t_exit;
+        else
+            q_unit[idim] = p_unit[idim] + up[idim]*(std::exp(A[idim]*t_exit) - 1)/A[idim];
+        q_unit[idim] = std::min(std::max(q_unit[idim], 0.0), 1.0);
+    }
+    Point<dim> q = mapping.transform_unit_to_real_cell(cell, q_unit);
+    Point<dim> v;
+    int outcome = compute_point_velocity(q, v, cell, 1);
+    if (outcome != 0)
+        return outcome;
+
+    const double fixed_length = time_step_multiplier(cell)*(cell_cache.min_vertex_distance(icell)/param.step_size);
+    n_steps += 1;
+    n_fixed_steps += q.distance(streamline.P[last])/fixed_length;
+
+    if (cell_cache.neighbor(icell, exit_face, 0) < 0){
+        // The particle leaves the domain. Keep the exit point on the boundary face
+        outcome = add_streamline_point(cell, streamline, q, v, 0);
+        if (outcome != 0)
+            return outcome;
+        if (exit_face == 2*(dim-1) + 1)
+            return 1;
+        else if (exit_face == 2*(dim-1))
+            return -9;
+        return 2;
+    }
+
+    // Find the neighbor cell from a point just across the exit face
+    Point<dim> q_out_unit = q_unit;
+    q_out_unit[exit_face/2] = (exit_face % 2 == 1) ? 1 + 1e-6 : -1e-6;
+    Point<dim> q_out = mapping.transform_unit_to_real_cell(cell, q_out_unit);
+    typename DoFHandler<dim>::active_cell_iterator next_cell = cell;
+    int check_pnt = check_cell_point(next_cell, q_out);
+    if (check_pnt == -3){
+        // The cell across the face is artificial. The particle continues from the exit point on the processor that owns this cell
+        outcome = add_streamline_point(cell, streamline, q, v, 0);
+        if (outcome != 0)
+            return outcome;
+        return add_streamline_point(cell, streamline, q, v, 55);
+    }
+    if (check_pnt <= 0){
+        // The exit point is added as in the other exits and the point across the face gives the exit code
+        outcome = add_streamline_point(cell, streamline, q, v, 0);
+        if (outcome != 0)
+            return outcome;
+        Point<dim> v_out;
+        return compute_point_velocity(q_out, v_out, cell, 0);
+    }
+    cell = next_cell;
+    return add_streamline_point(cell, streamline, q, v, 0);
+}
+
+template <int dim>
+void Particle_Tracking<dim>::build_replicated_mesh(std::string export_file){
+    const unsigned int n_vert = GeometryInfo<dim>::vertices_per_cell;
+    const unsigned int n_faces = GeometryInfo<dim>::faces_per_cell;
+    const unsigned int n_sub = GeometryInfo<dim>::max_children_per_face;
+    unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
+
+    // The dofs of a piecewise constant element give a global number to each cell, which is known for the ghost cells too
+    FE_DGQ<dim> cell_fe(0);
+    DoFHandler<dim> cell_dof_handler(dof_handler.get_triangulation());
+    cell_dof_handler.distribute_dofs(cell_fe);
+    const int Nc = cell_dof_handler.n_dofs();
+    const int Nv = dof_handler.n_dofs();
+
+    // For each owned cell: its number, its vertex dofs, the numbers of its face neighbors and the boundary ids of its faces.
+    // For each owned dof: its number, coordinates, velocity and porosity
+    std::vector<int> cell_data;
+    std::vector<int> dof_ids;
+    std::vector<double> dof_data;
+    const IndexSet& owned_dofs = dof_handler.locally_owned_dofs();
+    std::vector<bool> dof_added(owned_dofs.n_elements(), false);
+    std::vector<types::global_dof_index> cell_index(1);
+    typename DoFHandler<dim>::active_cell_iterator
+    cell = dof_handler.begin_active(),
+    endc = dof_handler.end(),
+    cell_dg = cell_dof_handler.begin_active();
+    for (; cell != endc; ++cell, ++cell_dg){
+        if (!cell->is_locally_owned())
+            continue;
+        cell_dg->get_dof_indices(cell_index);
+        cell_data.push_back(cell_index[0]);
+        for (unsigned int iv = 0; iv < n_vert; ++iv){
+            const types::global_dof_index idof = cell->vertex_dof_index(iv, 0);
+            cell_data.push_back(idof);
+            if (!owned_dofs.is_element(idof) || dof_added[owned_dofs.index_within_set(idof)])
+                continue;
+            dof_added[owned_dofs.index_within_set(idof)] = true;
+            dof_ids.push_back(idof);
+            for (unsigned int idim = 0; idim < dim; ++idim)
+                dof_data.push_back(cell->vertex(iv)[idim]);
+            for (unsigned int idim = 0; idim < dim; ++idim)
+                dof_data.push_back(nodal_velocity[idim](idof));
+            dof_data.push_back(porosity.value(cell->vertex(iv)));
+        }
+        for (unsigned int iface = 0; iface < n_faces; ++iface){
+            std::vector<int> nb(n_sub, -1);
+            if (!cell->at_boundary(iface)){
+                if (cell_dg->neighbor(iface)->active()){
+                    cell_dg->neighbor(iface)->get_dof_indices(cell_index);
+                    nb[0] = cell_index[0];
+                }
+                else{
+                    for (unsigned int isub = 0; isub < cell_dg->face(iface)->n_children(); ++isub){
+                        cell_dg->neighbor_child_on_subface(iface, isub)->get_dof_indices(cell_index);
+                        nb[isub] = cell_index[0];
+                    }
+                }
+            }
+            cell_data.insert(cell_data.end(), nb.begin(), nb.end());
+        }
+        for (unsigned int iface = 0; iface < n_faces; ++iface){
+            if (cell->at_boundary(iface))
+                cell_data.push_back(cell->face(iface)->boundary_id());
+            else
+                cell_data.push_back(-1);
+        }
+    }
+
+    std::vector<int> all_cell_data, all_dof_ids;
+    std::vector<double> all_dof_data;
+    MPI_Comm node_comm = MPI_COMM_NULL;
+    int node_rank = 0;
+    bool build_mesh = false;
+    if (param.replicated_mesh == 1){
+        MPI_Comm_split_type(mpi_communicator, MPI_COMM_TYPE_SHARED, my_rank, MPI_INFO_NULL, &node_comm);
+        MPI_Comm_rank(node_comm, &node_rank);
+        MPI_Comm leader_comm;
+        MPI_Comm_split(mpi_communicator, node_rank == 0 ? 0 : MPI_UNDEFINED, my_rank, &leader_comm);
+        gather_on_node_leaders<int>(cell_data, all_cell_data, node_comm, leader_comm, MPI_INT);
+        gather_on_node_leaders<int>(dof_ids, all_dof_ids, node_comm, leader_comm, MPI_INT);
+        gather_on_node_leaders<double>(dof_data, all_dof_data, node_comm, leader_comm, MPI_DOUBLE);
+        if (node_rank == 0)
+            MPI_Comm_free(&leader_comm);
+        build_mesh = node_rank == 0;
+    }
+    else{
+        // If the mesh is just exported, only the first processor gathers it. All processors form one group
+        // whose only leader is the first processor
+        MPI_Comm writer_comm = my_rank == 0 ? MPI_COMM_SELF : MPI_COMM_NULL;
+        gather_on_node_leaders<int>(cell_data, all_cell_data, mpi_communicator, writer_comm, MPI_INT);
+        gather_on_node_leaders<int>(dof_ids, all_dof_ids, mpi_communicator, writer_comm, MPI_INT);
+        gather_on_node_leaders<double>(dof_data, all_dof_data, mpi_communicator, writer_comm, MPI_DOUBLE);
+        build_mesh = my_rank == 0;
+    }
+
+    BinaryIO::BinaryWriter writer;
+    uint64_t n_bytes = 0;
+    if (build_mesh){
+        const unsigned int n_dof_data = 2*dim + 1;
+        std::vector<double> coords(Nv*dim), velocity(Nv*dim), vert_porosity(Nv);
+        for (unsigned int i = 0; i < all_dof_ids.size(); ++i){
+            for (unsigned int idim = 0; idim < dim; ++idim){
+                coords[all_dof_ids[i]*dim + idim] = all_dof_data[i*n_dof_data + idim];
+                velocity[all_dof_ids[i]*dim + idim] = all_dof_data[i*n_dof_data + dim + idim];
+            }
+            vert_porosity[all_dof_ids[i]] = all_dof_data[i*n_dof_data + 2*dim];
+        }
+        std::vector<int> cells(Nc*n_vert), neighbors(Nc*n_faces*n_sub), boundary_ids(Nc*n_faces);
+        const unsigned int n_cell_data = 1 + n_vert + n_faces*n_sub + n_faces;
+        for (unsigned int i = 0; i < all_cell_data.size(); i += n_cell_data){
+            const int icell = all_cell_data[i];
+            std::vector<int>::const_iterator it = all_cell_data.begin() + i + 1;
+            std::copy(it, it + n_vert, cells.begin() + icell*n_vert);
+            it += n_vert;
+            std::copy(it, it + n_faces*n_sub, neighbors.begin() + icell*n_faces*n_sub);
+            it += n_faces*n_sub;
+            std::copy(it, it + n_faces, boundary_ids.begin() + icell*n_faces);
+        }
+        TrackingMesh<dim>::build(coords, velocity, cells, neighbors, vert_porosity, boundary_ids, writer);
+        n_bytes = writer.serialized_size();
+    }
+
+    if (my_rank == 0 && !export_file.empty()){
+        if (writer.write(export_file, BinaryIO::TRACKING_MESH))
+            std::cout << "The tracking mesh has been written to " << export_file << std::endl;
+        else
+            std::cerr << "Could not write the tracking mesh to " << export_file << std::endl;
+    }
+
+    if (param.replicated_mesh == 0)
+        return;
+
+    SharedInputWindow* w = new SharedInputWindow;
+    w->node_comm = node_comm;
+    char* base;
+    MPI_Win_allocate_shared(node_rank == 0 ? n_bytes : 0, 1, MPI_INFO_NULL, w->node_comm, &base, &w->win);
+    if (node_rank != 0){
+        MPI_Aint sz;
+        int disp;
+        MPI_Win_shared_query(w->win, 0, &sz, &disp, &base);
+        n_bytes = sz;
+    }
+    MPI_Win_fence(0, w->win);
+    if (node_rank == 0)
+        writer.serialize(base, BinaryIO::TRACKING_MESH);
+    MPI_Win_fence(0, w->win);
+
+    replicated_buffer.attach(base, n_bytes, release_shared_input, w);
+    replicated_mesh.open(replicated_buffer, "the replicated tracking mesh");
+
+    uint64_t node_bytes = node_rank == 0 ? n_bytes : 0;
+    MPI_Allreduce(MPI_IN_PLACE, &node_bytes, 1, MPI_UINT64_T, MPI_SUM, mpi_communicator);
+    pcout << "Replicated tracking mesh: " << Nc << " cells, " << Nv << " vertices, "
+          << n_bytes/(1024.0*1024.0) << " MB per node (" << node_bytes/(1024.0*1024.0) << " MB in total)" << std::endl;
+}
+
+template <int dim>
+void Particle_Tracking<dim>::trace_particles_replicated(std::vector<Streamline<dim>>& streamlines, int iter, std::string prefix){
+    unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
+    if (param.method != 3){
+        pcout << "The replicated tracking mesh supports only the Runge Kutta 4 tracking method (3). "
+              << "The method " << param.method << " is not supported" << std::endl;
+        return;
+    }
+    const std::string suffix = Utilities::int_to_string(static_cast<unsigned int>(iter), 4) + "_";
+    const std::string rank_suffix = Utilities::int_to_string(my_rank, 4) + ".traj";
+    std::ofstream log_file((prefix + "_" + suffix + "particles_" + rank_suffix).c_str());
+    std::ofstream err_file((prefix + "_" + suffix + "particle_errors_" + rank_suffix).c_str());
+    migration_file.open((prefix + "_" + suffix + "migrations_" + rank_suffix).c_str());
+    std::vector<Streamline<dim>> new_particles;
+
+    std::vector<double> P, V;
+    for (unsigned int i = 0; i < streamlines.size(); ++i){
+        Streamline<dim>& streamline = streamlines[i];
+        P.clear();
+        V.clear();
+        double p0[dim];
+        for (unsigned int idim = 0; idim < dim; ++idim)
+            p0[idim] = streamline.P[0][idim];
+        const int outcome = replicated_mesh.trace(p0, -1, param.step_size, param.streaml_iter, param.Stuck_iter, P, V);
+
+        // The first point is already in the streamline and gets only its velocity
+        const unsigned int n_points = P.size()/dim;
+        for (unsigned int k = 0; k < n_points; ++k){
+            Point<dim> p, v;
+            for (unsigned int idim = 0; idim < dim; ++idim){
+                p[idim] = P[k*dim + idim];
+                v[idim] = V[k*dim + idim];
+            }
+            if (k == 0){
+                streamline.V.push_back(v);
+                streamline.proc_id = my_rank;
+            }
+            else
+                streamline.add_point_vel(p, v, my_rank);
+        }
+        if (n_points > 0){
+            n_steps += n_points - 1;
+            n_fixed_steps += n_points - 1;
+            n_velocity_evals += 4*(n_points - 1) + 1;
+        }
+        finish_streamline(streamline, outcome, log_file, err_file, new_particles);
+    }
+    migration_file.close();
+}
+
+template <int dim>
+void Particle_Tracking<dim>::print_step_statistics(){
+    double stats[4] = {n_steps, n_rejected_steps, n_velocity_evals, n_fixed_steps};
+    MPI_Allreduce(MPI_IN_PLACE, stats, 4, MPI_DOUBLE, MPI_SUM, mpi_communicator);
+    pcout << "Tracking steps: " << static_cast<long long>(stats[0])
+          << ", rejected: " << static_cast<long long>(stats[1])
+          << ", velocity evaluations: " << static_cast<long long>(stats[2]) << std::endl;
+    if (stats[0] > 0)
+        pcout << "Equivalent fixed length steps: " << static_cast<long long>(stats[3])
+              << " (" << stats[3]/stats[0] << " per step)" << std::endl;
+
+    // The distribution of the steps among the processors shows how well the tracking work is balanced
+    double min_steps = n_steps;
+    double max_steps = n_steps;
+    MPI_Allreduce(MPI_IN_PLACE, &min_steps, 1, MPI_DOUBLE, MPI_MIN, mpi_communicator);
+    MPI_Allreduce(MPI_IN_PLACE, &max_steps, 1, MPI_DOUBLE, MPI_MAX, mpi_communicator);
+    const double mean_steps = stats[0]/Utilities::MPI::n_mpi_processes(mpi_communicator);
+    pcout << "Steps per processor: min " << static_cast<long long>(min_steps)
+          << ", mean " << static_cast<long long>(mean_steps)
+          << ", max " << static_cast<long long>(max_steps);
+    if (mean_steps > 0)
+        pcout << ", imbalance (max/mean) " << max_steps/mean_steps;
+    pcout << std::endl;
+
+    double migr[2] = {n_finished_streamlines, n_migrations};
+    double max_migr = max_migrations;
+    MPI_Allreduce(MPI_IN_PLACE, migr, 2, MPI_DOUBLE, MPI_SUM, mpi_communicator);
+    MPI_Allreduce(MPI_IN_PLACE, &max_migr, 1, MPI_DOUBLE, MPI_MAX, mpi_communicator);
+    if (migr[0] > 0)
+        pcout << "Streamline migrations: " << static_cast<long long>(migr[1])
+              << " (" << migr[1]/migr[0] << " per streamline, max " << static_cast<long long>(max_migr)
+              << ") with " << param.halo_layers << " halo layers" << std::endl;
+
+    // Without the halo each entry to the halo and each return from it would be a migration,
+    // while the handoffs from the halo replace the migrations of the entries
+    double halo[3] = {n_halo_entries, n_halo_returns, n_halo_handoffs};
+    MPI_Allreduce(MPI_IN_PLACE, halo, 3, MPI_DOUBLE, MPI_SUM, mpi_communicator);
+    if (migr[0] > 0 && param.halo_layers > 0){
+        const double no_halo = migr[1] + halo[0] + halo[1] - halo[2];
+        pcout << "Halo entries: " << static_cast<long long>(halo[0])
+              << ", returns to owned cells: " << static_cast<long long>(halo[1])
+              << ", handoffs from the halo: " << static_cast<long long>(halo[2]) << std::endl;
+        pcout << "Streamline migrations with 0 halo layers: " << static_cast<long long>(no_halo)
+              << " (" << no_halo/migr[0] << " per streamline), with " << param.halo_layers << " halo layers: "
+              << static_cast<long long>(migr[1]) << " (" << migr[1]/migr[0] << " per streamline)" << std::endl;
+    }
+}
+
 template <int dim>
 void Particle_Tracking<dim>::plot_cell(typename DoFHandler<dim>::active_cell_iterator cell){
     std::vector<Point<dim>> verts;
@@ -1454,16 +2577,6 @@ double Particle_Tracking<dim>::time_step_multiplier(typename DoFHandler<dim>::ac
     return time_step;
 }
 
-template <int dim>
-bool Particle_Tracking<dim>::cell_exists(std::vector<Point<dim>> PointList, Point<dim> test_point){
-    for (unsigned int i = 0; i < PointList.size(); ++i){
-        if (test_point.distance(PointList[i]) < 0.001)
-            return true;
-    }
-
-    return false;
-}
-
 template <int dim>
 void Particle_Tracking<dim>::print_cell_velocity(std::vector<Point<dim>> p){
 
@@ -1722,225 +2835,93 @@ void Particle_Tracking<dim>::average_velocity_field(DoFHandler<dim>& velocity_do
 
 template <int dim>
 bool Particle_Tracking<dim>::average_velocity_field(){
-    unsigned int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
-    unsigned int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
-
-    //const std::string vField_file_name = ("VelField_"	+
-    //                                   Utilities::int_to_string(my_rank, 4) +
-    //                                   ".dbg");
-    //std::ofstream vField_file;
-    //vField_file.open(vField_file_name);
-
     MPI_Barrier(mpi_communicator);
     pcout << "Calculating Velocities..." << std::endl << std::flush;
 
-    typename std::map<unsigned int, AverageVel<dim>>::iterator vel_it, vel_it2;
-    const unsigned int dofs_per_cell = fe.dofs_per_cell;
-    std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
+    const IndexSet locally_owned_dofs = dof_handler.locally_owned_dofs();
+    IndexSet locally_relevant_dofs;
+    DoFTools::extract_locally_relevant_dofs(dof_handler, locally_relevant_dofs);
 
-    // Calculate velocities
+    // Only the hanging node constraints of the head apply to the velocity.
+    // The Dirichlet lines of the Headconstraints would overwrite the velocity with the prescribed head
+    ConstraintMatrix hanging_constraints;
+    hanging_constraints.reinit(locally_relevant_dofs);
+    DoFTools::make_hanging_node_constraints(dof_handler, hanging_constraints);
+    hanging_constraints.close();
 
-    IndexSet locally_owned_indices = locally_relevant_solution.locally_owned_elements();
+    // The sums and the counts are writable on the ghost dofs so that the contributions
+    // of the locally owned cells to dofs of other processors are sent during compress
+    std::vector<TrilinosWrappers::MPI::Vector> vel_sum(dim);
+    for (unsigned int idim = 0; idim < dim; ++idim)
+        vel_sum[idim].reinit(locally_owned_dofs, locally_relevant_dofs, mpi_communicator, true);
+    TrilinosWrappers::MPI::Vector vel_count;
+    vel_count.reinit(locally_owned_dofs, locally_relevant_dofs, mpi_communicator, true);
+
+    const unsigned int dofs_per_cell = fe.dofs_per_cell;
+    std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
 
+    // Each locally owned cell adds the velocity on its vertices to the vertex dofs.
+    // This way every cell contributes exactly once over all processors.
+    // The hanging dofs are not accumulated as they are computed from the constraints
     typename DoFHandler<dim>::active_cell_iterator
     cell = dof_handler.begin_active(),
     endc = dof_handler.end();
     for (; cell != endc; ++cell){
-        if (cell->is_locally_owned() || cell->is_ghost()){
-            //fe.reinit(cell);
+        if (cell->is_locally_owned()){
             cell->get_dof_indices (local_dof_indices);
-            for (unsigned int ii = 0; ii < local_dof_indices.size(); ++ii){
+            for (unsigned int ii = 0; ii < dofs_per_cell; ++ii){
+                if (hanging_constraints.is_constrained(local_dof_indices[ii]))
+                    continue;
                 Point<dim> vel;
                 calc_vel_on_point(cell, cell->vertex(ii), vel);
-                vel_it = VelocityMap.find(local_dof_indices[ii]);
-                if (vel_it != VelocityMap.end()){
-                    vel_it->second.Addvelocity(vel);
-                }
-                else{
-                    std::vector<types::global_dof_index> temp_cnstr;
-                    temp_cnstr.push_back(local_dof_indices[ii]);
-                    Headconstraints.resolve_indices(temp_cnstr);
-
-                    VelocityMap.insert(std::pair<unsigned int, AverageVel<dim>>(local_dof_indices[ii],
-                                       AverageVel<dim>(locally_owned_indices.is_element(local_dof_indices[ii]),
-                                                       local_dof_indices[ii], vel, temp_cnstr)));
-                }
-
+                for (unsigned int idim = 0; idim < dim; ++idim)
+                    vel_sum[idim](local_dof_indices[ii]) += vel[idim];
+                vel_count(local_dof_indices[ii]) += 1.0;
             }
         }
     }
-
-    // DEBUG--------------------
-    //vel_it = VelocityMap.begin();
-    //for (; vel_it != VelocityMap.end(); ++vel_it){
-    //    vField_file << vel_it->second.dof << "\t"
-    //                << vel_it->second.is_local << "\t"
-    //                << vel_it->second.V.size() << "\t"
-    //                << vel_it->second.cnstr.size() << "\t";
-    //    if (vel_it->second.cnstr.size() > 0){
-    //        vField_file << "| ";
-    //        for (unsigned int ii = 0; ii < vel_it->second.cnstr.size(); ++ii){
-    //            vField_file << vel_it->second.cnstr[ii] << " | ";
-    //        }
-    //    }
-    //    vField_file << std::endl;
-    //}
-    //vField_file.close();
-
-
-    // DEBUG--------------------
-
+    for (unsigned int idim = 0; idim < dim; ++idim)
+        vel_sum[idim].compress(VectorOperation::add);
+    vel_count.compress(VectorOperation::add);
 
     // Average Velocities
     pcout << "Averaging Velocities..." << std::endl << std::flush;
-    int count_iter = 0;
-    std::vector<std::vector<int>> not_known_id(n_proc);
-    std::vector<std::vector<int>> known_ids(n_proc);
-    std::vector<std::vector<double>> velX(n_proc);
-    std::vector<std::vector<double>> velY(n_proc);
-    std::vector<std::vector<double>> velZ(n_proc);
-    std::map<int, Point<dim>> received_vel;
-    typename std::map<int, Point<dim>>::iterator rec_it;
-    while (true){
-        not_known_id[my_rank].clear();
-        known_ids[my_rank].clear();
-        velX[my_rank].clear();
-        velY[my_rank].clear();
-        velZ[my_rank].clear();
-        int count_non_average = 0;
+    std::vector<TrilinosWrappers::MPI::Vector> vel_av(dim);
+    for (unsigned int idim = 0; idim < dim; ++idim)
+        vel_av[idim].reinit(locally_owned_dofs, mpi_communicator);
 
-        vel_it = VelocityMap.begin();
-        for (; vel_it != VelocityMap.end(); ++vel_it){
-            if (vel_it->second.is_local){
-                if (!vel_it->second.is_averaged){
-                    if (vel_it->second.cnstr.size() == 0){ // if its not constraint
-                        Point<dim> sum;
-                        for (unsigned int ii = 0; ii < vel_it->second.V.size(); ++ii){
-                            for (unsigned int idim = 0; idim < dim; ++idim)
-                                sum[idim] += vel_it->second.V[ii][idim];
-                        }
-                        for (unsigned int idim = 0; idim < dim; ++idim)
-                            vel_it->second.av_vel[idim] = sum[idim]/vel_it->second.V.size();
-                        vel_it->second.is_averaged = true;
-                    }
-                    else{
-                        Point<dim> sum;
-                        bool can_average = true;
-                        for (unsigned int ii = 0; ii < vel_it->second.cnstr.size(); ++ii){
-                            vel_it2 = VelocityMap.find(vel_it->second.cnstr[ii]);
-                            if (vel_it2 != VelocityMap.end()){
-                                if (vel_it2->second.is_averaged){
-                                    for (unsigned int idim = 0; idim < dim; ++idim)
-                                        sum[idim] += vel_it2->second.av_vel[idim];
-                                }
-                                else{
-                                    can_average = false;
-                                    break;
-                                }
-                            }
-                            else{
-                                rec_it = received_vel.find(vel_it->second.cnstr[ii]);
-                                if (rec_it != received_vel.end()){
-                                    for (unsigned int idim = 0; idim < dim; ++idim)
-                                        sum[idim] += rec_it->second[idim];
-                                }
-                                else{
-                                    not_known_id[my_rank].push_back(vel_it->second.dof);
-                                    can_average = false;
-                                    break;
-                                }
-                            }
-                        }
-                        if (can_average){
-                            for (unsigned int idim = 0; idim < dim; ++idim)
-                                vel_it->second.av_vel[idim] = sum[idim] / vel_it->second.cnstr.size();
-                            vel_it->second.is_averaged = true;
-                        }
-                        else{
-                            count_non_average++;
-                        }
-                    }
-                }
-            }
-            else {
-                // if the velocity its not local then we should get it from the processor that it has as local
-                // check first if we have asked for it in a previous iteration
-                rec_it = received_vel.find(vel_it->second.dof);
-                if (rec_it != received_vel.end()){
-                    for (unsigned int idim = 0; idim < dim; ++idim)
-                        vel_it->second.av_vel[idim] = rec_it->second[idim];
-                    vel_it->second.is_averaged = true;
-                }
-                else{
-                    not_known_id[my_rank].push_back(vel_it->second.dof);
-                    count_non_average++;
-                }
-            }
+    int count_non_average = 0;
+    for (IndexSet::ElementIterator it = locally_owned_dofs.begin(); it != locally_owned_dofs.end(); ++it){
+        if (hanging_constraints.is_constrained(*it))
+            continue;
+        const double cnt = vel_count(*it);
+        if (cnt > 0){
+            for (unsigned int idim = 0; idim < dim; ++idim)
+                vel_av[idim](*it) = vel_sum[idim](*it)/cnt;
         }
-
-        //std::cout << "I'm Rank " << my_rank << " has " << count_non_average << " unkwown velocities" << std::endl;
-
-        // Check if all points have been set
-        sum_scalar<int>(count_non_average, n_proc, mpi_communicator, MPI_INT);
-        pcout << "There are: " << count_non_average << " point velocities to be averaged" << std::endl;
-        if (count_non_average == 0)
-            break;
-
-
-
-        std::vector<int> sent_size;
-        Send_receive_size(static_cast<unsigned int>(not_known_id[my_rank].size()), n_proc, sent_size, mpi_communicator);
-        Sent_receive_data<int>(not_known_id, sent_size, my_rank, mpi_communicator, MPI_INT);
-
-
-
-        for (unsigned int i_proc = 0; i_proc < n_proc; ++i_proc){
-            if (my_rank == i_proc)
-                continue;
-            for (unsigned int ii = 0; ii < not_known_id[i_proc].size(); ++ii){
-                vel_it = VelocityMap.find(not_known_id[i_proc][ii]);
-                if (vel_it != VelocityMap.end()){
-                    if (vel_it->second.is_local && vel_it->second.is_averaged){
-                        known_ids[my_rank].push_back(vel_it->second.dof);
-                        velX[my_rank].push_back(vel_it->second.av_vel[0]);
-                        velY[my_rank].push_back(vel_it->second.av_vel[1]);
-                        if (dim == 3)
-                            velZ[my_rank].push_back(vel_it->second.av_vel[2]);
-                    }
-                }
-            }
+        else{
+            count_non_average++;
         }
+    }
 
-        //std::cout << "I'm Rank " << my_rank << " and I have " << known_ids[my_rank].size() << " to send" << std::endl;
-        Send_receive_size(static_cast<unsigned int>(known_ids[my_rank].size()), n_proc, sent_size, mpi_communicator);
-        Sent_receive_data<int>(known_ids, sent_size, my_rank, mpi_communicator, MPI_INT);
-        Sent_receive_data<double>(velX, sent_size, my_rank, mpi_communicator, MPI_DOUBLE);
-        Sent_receive_data<double>(velY, sent_size, my_rank, mpi_communicator, MPI_DOUBLE);
-        if (dim == 3)
-            Sent_receive_data<double>(velZ, sent_size, my_rank, mpi_communicator, MPI_DOUBLE);
-
-        // loop through the replies and get th ones you need
-        // but first put them in a map for faster querying
-
-        for (unsigned int i_proc = 0; i_proc < n_proc; ++ i_proc){
-            if (my_rank == i_proc)
-                continue;
-            for (unsigned int ii = 0; ii < known_ids[i_proc].size(); ++ii){
-                Point<dim> tempV;
-                tempV[0] = velX[i_proc][ii];
-                tempV[1] = velY[i_proc][ii];
-                if (dim == 3)
-                    tempV[2] = velZ[i_proc][ii];
-                received_vel.insert(std::pair<int,Point<dim>>(known_ids[i_proc][ii], tempV));
-            }
-        }
+    nodal_velocity.resize(dim);
+    for (unsigned int idim = 0; idim < dim; ++idim){
+        vel_av[idim].compress(VectorOperation::insert);
+        hanging_constraints.distribute(vel_av[idim]);
+        // The assignment to the ghosted vector imports the values of the locally relevant dofs
+        nodal_velocity[idim].reinit(locally_owned_dofs, locally_relevant_dofs, mpi_communicator);
+        nodal_velocity[idim] = vel_av[idim];
+    }
 
+    // The mesh does not change during the tracking, so the cell geometry is computed once here
+    cell_cache.build(dof_handler);
+    cell_cache.build_halo(param.halo_layers);
+    cell_steps.assign(dof_handler.get_triangulation().n_active_cells(), 0);
 
-        count_iter++;
-        if (count_iter >= 20){
-            std::cerr << " Not all point velocities could be averaged after 20 iterations" << std::endl;
-            return false;
-        }
+    sum_scalar<int>(count_non_average, Utilities::MPI::n_mpi_processes(mpi_communicator), mpi_communicator, MPI_INT);
+    if (count_non_average > 0){
+        std::cerr << " There are " << count_non_average << " point velocities without contributing cells" << std::endl;
+        return false;
     }
     return true;
 }
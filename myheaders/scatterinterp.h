@@ -2,11 +2,14 @@
 #define SCATTERINTERP_H
 
 #include <fstream>
+#include <limits>
 
 #include <deal.II/base/point.h>
 
 #include "cgal_functions.h"
 #include "helper_functions.h"
+#include "binary_io.h"
+#include "mpi_help.h"
 
 /*!
  * \brief The SCI_TYPE enum can take one of the 3 values
@@ -74,9 +77,17 @@ public:
      *      v(lay-1)
      * ----------z(lay-1)
      *      vlay
+     *
+     * The data can also be given in the NPSAT binary format (see BinaryIO#convert_to_binary).
+     * In that case the file is memory mapped instead of parsed.
+     *
+     * The file is read with #read_input_file, therefore this must be called by all processors.
      */
     void get_data(std::string filename);
 
+    //! Reads the data from the content of the file that has been read already
+    void get_data(std::string filename, const BinaryIO::InputBuffer& input);
+
     /*!
      * \brief interpolate calculates the interpolation.
      * \param p The point which we want to find its value
@@ -93,9 +104,40 @@ public:
      */
     void set_edge_points(Point<dim> a, Point<dim> b);
 
+    /*!
+     * \brief set_subdomain_loading enables the subdomain restricted loading of the scattered data.
+     * This must be called before #get_data. When enabled, #get_data reads only the header of the file
+     * and the scattered points are read later by #load_subdomain.
+     * \param halo_in is the distance around the subdomain bounding box where the points are also loaded.
+     */
+    void set_subdomain_loading(double halo_in);
+
+    //! Returns true if the subdomain restricted loading is enabled
+    bool is_subdomain_loading()const{return subdomain_loading;}
+
+    /*!
+     * \brief load_subdomain reads only the scattered points that lay within the bounding box defined by
+     * pmin and pmax, expanded by the halo. The points that were loaded before are replaced, therefore
+     * this has to be called again every time the mesh is refined or repartitioned. #interpolate never reads the file.
+     * A query outside of the loaded area uses the loaded points and is counted as a warning.
+     *
+     * Each processor streams the file on its own and keeps only the points of its area, therefore the
+     * file is never held in memory as a whole.
+     * A processor that has no cells passes an empty box (pmin > pmax) and drops its points.
+     * \param pmin is the lower left corner of the processor subdomain
+     * \param pmax is the upper right corner of the processor subdomain
+     */
+    void load_subdomain(Point<dim> pmin, Point<dim> pmax);
+
+    //! Returns the number of 2D scattered points that are currently loaded
+    unsigned int n_loaded_points()const;
+
+    //! Returns true if the interpolated values do not vary along the vertical direction (HOR interpolation in 3D)
+    bool is_horizontal()const;
+
 private:
 
-    //! this is a container to hold the triangulation of the 2D scattered data
+    //! this is a container to hold the triangulation of the 2D scattered data.
     ine_Delaunay_triangulation T;
 
     //! This is a map between the triangulation and the values that correspond to each 2D point
@@ -126,9 +168,60 @@ private:
     Point<dim> P2;
     bool points_known;
 
+    //! If true only the points around the processor subdomain are loaded
+    bool subdomain_loading;
+
+    //! The distance around the subdomain bounding box where the points are also loaded
+    double halo;
+
+    //! The name of the file with the scattered data. It is needed to read the points after #get_data
+    std::string data_file;
+
+    //! True if the #data_file is in the NPSAT binary format
+    bool binary_data;
+
+    //! This is set to true when the 2D points have been inserted into the triangulation #T
+    bool data_loaded;
+
+    //! The lower left corner of the loaded area without the halo
+    double box_min[2];
+
+    //! The upper right corner of the loaded area without the halo
+    double box_max[2];
+
+    //! The number of queries outside of the loaded area. These are interpolated from the loaded points
+    mutable unsigned int N_outside;
+
     void interp_X1D(double x, int &ind, double &t)const;
     double interp_V1D_stratified(double z, double t, int ind)const;
 
+    //! Returns true if the data are stored in the 1D containers #X_1D and #V_1D
+    bool is_1D_data()const;
+
+    //! Sets the #sci_type from the keyword FULL, HOR or VERT
+    void set_sci_type(const std::string& temp);
+
+    //! Sets #Stratified from the keyword STRATIFIED or SIMPLE
+    void set_style(const std::string& temp);
+
+    //! Reads the data from the content of a file in the NPSAT binary format
+    void get_data_binary(std::string filename, const BinaryIO::InputBuffer& buffer);
+
+    //! Inserts a 2D point and its #Ndata values
+    void insert_point(double x, double y, const double* v);
+
+    /*!
+     * \brief read_scattered_points replaces the loaded points with the scattered points of the #data_file that lay within
+     * the given rectangle.
+     *
+     * \param input is the content of the file if it has been read already. If it is null the text files are
+     * streamed line by line and the binary files are memory mapped, so only the points of the rectangle are kept in memory.
+     */
+    void read_scattered_points(const BinaryIO::InputBuffer* input, double xmin, double ymin, double xmax, double ymax);
+
+    //! Counts the queries outside of the loaded area and warns about the first one
+    void check_loaded_area(const Point<dim>& p)const;
+
 };
 
 template<int dim>
@@ -136,6 +229,37 @@ ScatterInterp<dim>::ScatterInterp(){
     Ndata = 0;
     Npnts = 0;
     points_known = false;
+    subdomain_loading = false;
+    binary_data = false;
+    halo = 0;
+    data_loaded = false;
+    N_outside = 0;
+    box_min[0] = -std::numeric_limits<double>::max(); box_min[1] = -std::numeric_limits<double>::max();
+    box_max[0] =  std::numeric_limits<double>::max(); box_max[1] =  std::numeric_limits<double>::max();
+}
+
+template <int dim>
+void ScatterInterp<dim>::set_subdomain_loading(double halo_in){
+    subdomain_loading = true;
+    halo = halo_in;
+}
+
+template <int dim>
+bool ScatterInterp<dim>::is_1D_data()const{
+    return (dim == 2 && Stratified) || (dim == 3 && sci_type == 2);
+}
+
+template <int dim>
+unsigned int ScatterInterp<dim>::n_loaded_points()const{
+    if (is_1D_data())
+        return X_1D.size();
+    else
+        return T.number_of_vertices();
+}
+
+template <int dim>
+bool ScatterInterp<dim>::is_horizontal()const{
+    return dim == 3 && sci_type == 1;
 }
 
 template <int dim>
@@ -150,101 +274,265 @@ void ScatterInterp<dim>::set_edge_points(Point<dim> a, Point<dim> b){
     }
 }
 
+template <int dim>
+void ScatterInterp<dim>::set_sci_type(const std::string& temp){
+    if (temp == "FULL")
+        sci_type = 0;
+    else if (temp == "HOR")
+        sci_type = 1;
+    else if (temp == "VERT")
+        sci_type = 2;
+    else
+        std::cout << "Unkown interpolation type. Valid options are FULL, HOR, VERT" << std::endl;
+}
+
+template <int dim>
+void ScatterInterp<dim>::set_style(const std::string& temp){
+    if (temp == "STRATIFIED")
+        Stratified = true;
+    else if (temp == "SIMPLE")
+        Stratified = false;
+    else
+        std::cout << "Unknown interpolation style. Valid options are STRATIFIED or SIMPLE" << std::endl;
+}
+
+template <int dim>
+void ScatterInterp<dim>::get_data_binary(std::string filename, const BinaryIO::InputBuffer& buffer){
+    BinaryIO::MappedFile bfile;
+    if (!bfile.open(buffer, filename))
+        return;
+    if (bfile.kind() != BinaryIO::SCATTERED){
+        std::cerr << " ScatterInterp Cannot read " << filename << ". It is not a SCATTERED binary file" << std::endl;
+        return;
+    }
+    set_sci_type(bfile.get_string("type"));
+    set_style(bfile.get_string("style"));
+
+    uint64_t n;
+    const int32_t* size = bfile.get_int("size", n);
+    if (size == 0 || n < 3)
+        return;
+    Npnts = size[0];
+    Ndata = size[1];
+    unsigned int Ncols = size[2];
+    function_values.resize(Ndata);
+    data_file = filename;
+    binary_data = true;
+
+    if (is_1D_data()){
+        const double* data = bfile.get_double("data", n);
+        if (data == 0 || n < static_cast<uint64_t>(Npnts)*Ncols)
+            return;
+        for (unsigned int i = 0; i < Npnts; ++i){
+            const double* row = data + static_cast<uint64_t>(i)*Ncols;
+            X_1D.push_back(row[0]);
+            V_1D.push_back(std::vector<double>(row + 1, row + 1 + Ndata));
+        }
+        function_values.clear();
+    }
+    else if (!subdomain_loading){
+        read_scattered_points(&buffer, box_min[0], box_min[1], box_max[0], box_max[1]);
+    }
+}
+
 template <int dim>
 void ScatterInterp<dim>::get_data(std::string filename){
-    std::ifstream  datafile(filename.c_str());
-    if (!datafile.good()){
-        std::cerr << "Can't open " << filename << std::endl;
+    BinaryIO::InputBuffer buffer;
+    if (read_input_file(filename, buffer))
+        get_data(filename, buffer);
+}
+
+template <int dim>
+void ScatterInterp<dim>::get_data(std::string filename, const BinaryIO::InputBuffer& input){
+    if (BinaryIO::is_binary(input)){
+        get_data_binary(filename, input);
         return;
     }
-    else{
-        char buffer[512];
-        {// Read the data type
-            datafile.getline(buffer, 512);
-            std::istringstream inp(buffer);
-            std::string temp;
-            inp >> temp;
-            if (temp != "SCATTERED"){
-                std::cerr << " ScatterInterp Cannot read " << temp << " data." << std::endl;
-                return;
-            }
+    BinaryIO::BufferStream datafile(input);
+    std::string line;
+    {// Read the data type
+        getline(datafile, line);
+        std::istringstream inp(line);
+        std::string temp;
+        inp >> temp;
+        if (temp != "SCATTERED"){
+            std::cerr << " ScatterInterp Cannot read " << temp << " data." << std::endl;
+            return;
         }
+    }
+
+    {// Read SCI_TYPE
+        getline(datafile, line);
+        std::istringstream inp(line);
+        std::string temp;
+        inp >> temp;
+        set_sci_type(temp);
+    }
 
-        {// Read SCI_TYPE
-            datafile.getline(buffer, 512);
-            std::istringstream inp(buffer);
-            std::string temp;
-            inp >> temp;
-            if (temp == "FULL")
-                sci_type = 0;
-            else if (temp == "HOR")
-                sci_type = 1;
-            else if (temp == "VERT")
-                sci_type = 2;
-            else
-                std::cout << "Unkown interpolation type. Valid options are FULL, HOR, VERT" << std::endl;
+    {// Read interpolation style
+        getline(datafile, line);
+        std::istringstream inp(line);
+        std::string temp;
+        inp >> temp;
+        set_style(temp);
+    }
+
+    {//Read number of points and number of data
+        getline(datafile, line);
+        std::istringstream inp(line);
+        inp >> Npnts;
+        inp >> Ndata;
+        function_values.resize(Ndata);
+    }
+    data_file = filename;
+    if (is_1D_data()){// Read the actual data
+        double x, v;
+        for (unsigned int i = 0; i < Npnts; ++i){
+            getline(datafile, line);
+            std::istringstream inp(line);
+            inp >> x;
+            X_1D.push_back(x);
+            std::vector<double> temp;
+            for (unsigned int j = 0; j < Ndata; ++j){
+                inp >> v;
+                temp.push_back(v);
+            }
+            // Here we need to store the values
+            V_1D.push_back(temp);
         }
+        function_values.clear();
+    }// Read data block
+    else if (!subdomain_loading){
+        read_scattered_points(&input, box_min[0], box_min[1], box_max[0], box_max[1]);
+    }
+}
 
-        {// Read interpolation style
-            datafile.getline(buffer, 512);
-            std::istringstream inp(buffer);
-            std::string temp;
-            inp >> temp;
-            if (temp == "STRATIFIED")
-                Stratified = true;
-            else if (temp == "SIMPLE")
-                Stratified = false;
-            else
-                std::cout << "Unknown interpolation style. Valid options are STRATIFIED or SIMPLE" << std::endl;
+template <int dim>
+void ScatterInterp<dim>::insert_point(double x, double y, const double* v){
+    ine_Point2 p(x, y);
+    T.insert(p);
+    for (unsigned int j = 0; j < Ndata; ++j){
+        ine_Coord_type ct(v[j]);
+        function_values[j].insert(std::make_pair(p,ct));
+    }
+}
 
+template <int dim>
+void ScatterInterp<dim>::read_scattered_points(const BinaryIO::InputBuffer* input, double xmin, double ymin, double xmax, double ymax){
+    T.clear();
+    function_values.clear();
+    function_values.resize(Ndata);
+
+    if (binary_data){
+        // The checksum has been verified when the file was first read
+        BinaryIO::MappedFile bfile;
+        if (input != 0){
+            if (!bfile.open(*input, data_file, false))
+                return;
         }
+        else if (!bfile.open(data_file, false))
+            return;
+        uint64_t n;
+        const double* data = bfile.get_double("data", n);
+        const uint64_t Ncols = Ndata + 2;
+        if (data == 0 || n < Npnts*Ncols)
+            return;
+        for (unsigned int i = 0; i < Npnts; ++i){
+            const double* row = data + i*Ncols;
+            if (row[0] < xmin || row[0] > xmax || row[1] < ymin || row[1] > ymax)
+                continue;
+            insert_point(row[0], row[1], row + 2);
+        }
+        data_loaded = true;
+        return;
+    }
 
-        {//Read number of points and number of data
-            datafile.getline(buffer,512);
-            std::istringstream inp(buffer);
-            inp >> Npnts;
-            inp >> Ndata;
-            function_values.resize(Ndata);
+    std::ifstream file_stream;
+    BinaryIO::BufferStream* buffer_stream = 0;
+    if (input != 0)
+        buffer_stream = new BinaryIO::BufferStream(*input);
+    else{
+        file_stream.open(data_file.c_str());
+        if (!file_stream.good()){
+            std::cerr << "Can't open " << data_file << std::endl;
+            return;
         }
-        {// Read the actual data
-            double x, y, v;
-            for (unsigned int i = 0; i < Npnts; ++i){
-                datafile.getline(buffer, 512);
-                std::istringstream inp(buffer);
-                if ((dim == 2 && Stratified) || (dim == 3 && sci_type == 2)){
-                    inp >> x;
-                    X_1D.push_back(x);
-                    std::vector<double> temp;
-                    for (unsigned int j = 0; j < Ndata; ++j){
-                        inp >> v;
-                        temp.push_back(v);
-                    }
-                    // Here we need to store the values
-                    V_1D.push_back(temp);
-                }
-                else{
-                    inp >> x;
-                    inp >> y;
-                    ine_Point2 p(x, y);
-                    T.insert(p);
-                    for (unsigned int j = 0; j < Ndata; ++j){
-                        inp >> v;
-                        ine_Coord_type ct(v);
-                        function_values[j].insert(std::make_pair(p,ct));
-                    }
-                }
-            }
+    }
+    std::istream& datafile = input != 0 ? static_cast<std::istream&>(*buffer_stream) : file_stream;
+
+    std::string line;
+    // Skip the 4 header lines
+    for (unsigned int i = 0; i < 4; ++i)
+        getline(datafile, line);
+
+    double x, y;
+    std::vector<double> v(Ndata);
+    for (unsigned int i = 0; i < Npnts; ++i){
+        getline(datafile, line);
+        std::istringstream inp(line);
+        inp >> x;
+        inp >> y;
+        if (x < xmin || x > xmax || y < ymin || y > ymax)
+            continue;
+        for (unsigned int j = 0; j < Ndata; ++j)
+            inp >> v[j];
+        insert_point(x, y, v.data());
+    }
+    delete buffer_stream;
+    data_loaded = true;
+}
 
-            if ((dim == 2 && Stratified) || (dim == 3 && sci_type == 2)){
-                function_values.clear();
-            }
-        }// Read data block
+template <int dim>
+void ScatterInterp<dim>::load_subdomain(Point<dim> pmin, Point<dim> pmax){
+    if (!subdomain_loading || is_1D_data())
+        return;
 
+    if (pmin[0] > pmax[0]){
+        // This processor has no cells and does not query the data
+        T.clear();
+        function_values.clear();
+        function_values.resize(Ndata);
+        data_loaded = false;
+        return;
+    }
+
+    box_min[0] = pmin[0];
+    box_max[0] = pmax[0];
+    if (dim == 3){
+        box_min[1] = pmin[1];
+        box_max[1] = pmax[1];
     }
+    // In 2D the second coordinate is the elevation, which is not known yet, so the area is clipped only along x
+
+    read_scattered_points(0, box_min[0] - halo, box_min[1] - halo, box_max[0] + halo, box_max[1] + halo);
+
+    // The natural neighbor interpolation requires at least a triangle.
+    // If the halo is too small to include one, fall back to the full data set
+    if (T.number_of_vertices() < 3){
+        std::cerr << "Only " << T.number_of_vertices() << " points of " << data_file
+                  << " lay around the subdomain. The full data set will be loaded" << std::endl;
+        box_min[0] = -std::numeric_limits<double>::max(); box_min[1] = -std::numeric_limits<double>::max();
+        box_max[0] =  std::numeric_limits<double>::max(); box_max[1] =  std::numeric_limits<double>::max();
+        read_scattered_points(0, box_min[0], box_min[1], box_max[0], box_max[1]);
+    }
+}
+
+template <int dim>
+void ScatterInterp<dim>::check_loaded_area(const Point<dim>& p)const{
+    if (p[0] >= box_min[0] - halo && p[0] <= box_max[0] + halo &&
+            (dim == 2 || (p[1] >= box_min[1] - halo && p[1] <= box_max[1] + halo)))
+        return;
+    if (N_outside == 0)
+        std::cerr << "The point (" << p << ") is outside of the area of " << data_file
+                  << " that is loaded on this processor. Increase the Subdomain halo" << std::endl;
+    N_outside++;
 }
 
 template <int dim>
-double ScatterInterp<dim>::interpolate(Point<dim> point)const{    
+double ScatterInterp<dim>::interpolate(Point<dim> point)const{
+    if (subdomain_loading && !is_1D_data())
+        check_loaded_area(point);
+
     if (dim == 3){
         if (sci_type == 0){// FULL 3D INTERPOLATION
             Point<3> pp;
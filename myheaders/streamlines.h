@@ -63,6 +63,12 @@ public:
     //! Counts the times that the streamline bounding box has not been expanded
     int times_not_expanded;
 
+    //! The length of the next step of the adaptive tracking method. Zero means that the step has not been set yet
+    double step_length;
+
+    //! The number of times the streamline has moved to another processor
+    int n_migrations;
+
     bool del;
 };
 
@@ -74,6 +80,9 @@ Streamline<dim>::Streamline(int E, int S, dealii::Point<dim> p){
     BBl = p;
     BBu = p;
     times_not_expanded = 0;
+    step_length = 0;
+    n_migrations = 0;
+    proc_id = -1;
     p_id.push_back(0);
     del = false;
 }
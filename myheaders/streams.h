@@ -9,12 +9,19 @@
 #include <deal.II/dofs/dof_handler.h>
 #include <deal.II/fe/fe_q.h>
 #include <deal.II/lac/constraint_matrix.h>
+#include <deal.II/base/qprojector.h>
+#include <deal.II/grid/cell_id.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
 
 //#include "my_functions.h"
 #include "cgal_functions.h"
 #include "helper_functions.h"
 #include "boost_functions.h"
 #include "mpi_help.h"
+#include "binary_io.h"
 
 using namespace dealii;
 
@@ -60,6 +67,9 @@ public:
      * .        .
      * .        .
      *
+     * The file can also be in the NPSAT binary format (see BinaryIO#convert_to_binary)
+     *
+     * The file is read with #read_input_file, therefore this must be called by all processors.
      */
 
     bool read_streams(std::string namefile);
@@ -74,14 +84,19 @@ public:
     std::vector<double>         length;
     //! A list of the stream line widths.
     //std::vector<double>         width;
-    //! A list of triangles
+    //! A list of triangles. Each triangle carries the id of its stream segment.
+    //! The stream id depends by the order they are listed in the input file. It set by the program
     ineTriangle_list            stream_triangles;
-    //! A list of stream ids. The stream id depends by the order they are listed in the input file. It set by the program
-    std::vector<int>            stream_ids;
     //! A tree structures which holds the streams.
     //! (This is a pointer because I was getting compile errors due to calling a private constructor of class.
     //! Setting this as a point and adding a construction code on the class constructor made the code at least to compile
     //ine_Tree*                    stream_tree;
+
+    /*!
+     * \brief get_tree returns the tree of the #stream_triangles. The tree is built the first time it is requested
+     * and it is kept for the subsequent calls.
+     */
+    ine_Tree& get_tree();
     //! The number of line segments
     unsigned int N_seg;
     //! A list of stream outlines. Each stream outline consists of a number of points which define the shape of the stream.
@@ -126,15 +141,16 @@ public:
      *
      * Once we have a list of triangles that overlap with the given cell we loop through them.
      * In the case that rivers are defined as lines which are converted into polygons each polygon is split into
-     * 2 triangles. Therefore, from the list of intersected triangles we make a list of unique river polygons that
-     * intersect the given cell face. Then for each polygon we use boost methods to do a detailed intersection between
-     * the river polygon and the cell face. This will return the centroid of the intersection and the area.
-     * We multiply the intersected area with the stream rate to calculate the stream volume of this river intersection.
+     * 2 triangles. The triangles carry the id of their river polygon, therefore from the list of intersected triangles
+     * we make directly a list of unique river polygons that intersect the given cell face. Then each polygon is clipped by
+     * the convex cell face (see #convex_clip_area). This will return the centroid of the intersection and the area.
+     * The intersected area times the stream rate is the stream volume of this river intersection.
      *
      *
     * \param xc is a list of the x coordinates of the centroid of the intersected area
     * \param yc is a list of the y coordinates of the centroid of the intersected area
-    * \param Q is the recharge rate of intersected segment
+    * \param area is the area of each intersection
+    * \param segment is the stream segment id of each intersection
     * \param xp is a list of the x coordinates of the triangulation cell
     * \param yp is a list of the y coordinates of the triangulation cell
     * \param stream_tree A list of triangles that represent the river network
@@ -142,11 +158,11 @@ public:
     */
     bool get_stream_recharge(std::vector<double>& xc,
                              std::vector<double>& yc,
-                             std::vector<double>& Q,
+                             std::vector<double>& area,
+                             std::vector<int>& segment,
                              std::vector<double> xp,
                              std::vector<double> yp,
-                             ine_Tree &stream_tree,
-                             double& ar);
+                             ine_Tree &stream_tree);
 
     /*! Calculate the contributions to the Right Hand side vector from the streams
     *
@@ -158,6 +174,10 @@ public:
     * For each intersection an 1-point quadrature (on the centroid) formula is defined and the contrubition for each stream intersection
     * is added accordinlgy to the RHS vector system_rhs
     *
+    * The intersections are cached per cell as (face, centroid in unit coordinates, area, segment). Because the horizontal coordinates
+    * of the mesh do not change between iterations, the intersections are computed only for the cells that are not in the cache,
+    * which are the children of refined cells and the cells that this processor received after repartitioning.
+    *
     *
     * \param system_rhs Right hand side vector
     * \param dof_handler is the typical deal dof_handler
@@ -195,6 +215,39 @@ private:
     void create_river_outline(std::vector<double>& xx,
                               std::vector<double>& yy,
                               Point<dim-1> A, Point<dim-1> B, double width);
+
+    //! Allocates the containers for #N_seg segments
+    void allocate();
+
+    //! Sets the outline, bounding box and triangles of the i-th segment
+    //! \param N_points is the number of points of the segment as given in the input file
+    //! \param xx are the x coordinates of the stream outline
+    //! \param yy are the y coordinates of the stream outline
+    void set_segment(unsigned int i, unsigned int N_points, std::vector<double>& xx, std::vector<double>& yy);
+
+    //! Reads the streams from the content of a file in the NPSAT binary format
+    bool read_streams_binary(std::string namefile, const BinaryIO::InputBuffer& input);
+
+    //! The tree of the #stream_triangles. It is a shared pointer because the CGAL tree cannot be copied.
+    //! The tree primitives hold copies of the triangles, therefore the copies of the class can share the tree
+    std::shared_ptr<ine_Tree> stream_tree;
+
+    //! The intersection of a stream segment with the top face of a cell
+    struct FaceIntersection{
+        //! The face of the cell
+        unsigned int face;
+        //! The centroid of the intersection in the unit coordinates of the cell
+        Point<dim> unit_centroid;
+        //! The area of the intersection
+        double area;
+        //! The stream segment id
+        int segment;
+    };
+
+    //! The intersections of the top faces of the locally owned cells with the streams. The cells that touch the top boundary
+    //! but do not intersect any stream have an empty list. Since the horizontal coordinates of the mesh do not change
+    //! the intersections are computed only for the cells that are not in the map i.e. after refinement or repartitioning.
+    std::map<CellId, std::vector<FaceIntersection> > face_intersections;
 };
 
 template <int dim>
@@ -203,6 +256,15 @@ Streams<dim>::Streams()
     N_seg = 0;
 }
 
+template <int dim>
+ine_Tree& Streams<dim>::get_tree(){
+    if (!stream_tree || stream_tree->size() != stream_triangles.size()){
+        stream_tree = std::make_shared<ine_Tree>();
+        stream_tree->insert(stream_triangles.begin(), stream_triangles.end());
+    }
+    return *stream_tree;
+}
+
 
 template <int dim>
 void Streams<dim>::setup_cell(typename DoFHandler<dim>::face_iterator top_face, Triangulation<dim-1> &tria){
@@ -215,38 +277,129 @@ void Streams<dim>::setup_cell(typename DoFHandler<dim>::face_iterator top_face,
 }
 
 template <int dim>
-bool Streams<dim>::Streams::read_streams(std::string namefile){
-    std::ifstream  datafile(namefile.c_str());
-    char buffer[512];
-    if (!datafile.good()){
-        std::cout << "Can't open the file" << namefile << std::endl;
+void Streams<dim>::allocate(){
+    length.resize(N_seg);
+    Q_rate.resize(N_seg);
+    Xpoly.resize(N_seg);
+    Ypoly.resize(N_seg);
+    Xmin.resize(N_seg);
+    Xmax.resize(N_seg);
+    Ymin.resize(N_seg);
+    Ymax.resize(N_seg);
+}
+
+template <int dim>
+void Streams<dim>::set_segment(unsigned int i, unsigned int N_points, std::vector<double>& xx, std::vector<double>& yy){
+    Xpoly[i] = xx;
+    Ypoly[i] = yy;
+    Xmin[i] = 100000000; Xmax[i] = -100000000;
+    Ymin[i] = 100000000; Ymax[i] = -100000000;
+    for (unsigned j = 0; j < xx.size(); ++j){
+        if (xx[j] > Xmax[i])
+            Xmax[i] = xx[j];
+        if (xx[j] < Xmin[i])
+            Xmin[i] = xx[j];
+        if (yy[j] > Ymax[i])
+            Ymax[i] = yy[j];
+        if (yy[j] < Ymin[i])
+            Ymin[i] = yy[j];
+    }
+
+    // The triangles carry the segment id
+    stream_triangles.push_back(ine_Stream_Triangle(ine_Triangle(ine_Point3(xx[0], yy[0], 0.0),
+                                                                ine_Point3(xx[1], yy[1], 0.0),
+                                                                ine_Point3(xx[2], yy[2], 0.0)), i));
+    //std::cout << "plot([" << xx[0] << " " << xx[1] << " " << xx[2] << " " <<xx[0] << "],[";
+    //std::cout << yy[0] << " " << yy[1] << " " << yy[2] << " " << yy[0] << "])" << std::endl;
+
+    if (N_points  == 4){
+        stream_triangles.push_back(ine_Stream_Triangle(ine_Triangle(ine_Point3(xx[2], yy[2], 0.0),
+                                                                    ine_Point3(xx[3], yy[3], 0.0),
+                                                                    ine_Point3(xx[0], yy[0], 0.0)), i));
+        //std::cout << "plot([" << xx[2] << " " << xx[3] << " " << xx[0] << " " <<xx[2] << "],[";
+        //std::cout << yy[2] << " " << yy[3] << " " << yy[0] << " " << yy[2] << "])" << std::endl;
+    }
+}
+
+template <int dim>
+bool Streams<dim>::read_streams_binary(std::string namefile, const BinaryIO::InputBuffer& input){
+    BinaryIO::MappedFile bfile;
+    if (!bfile.open(input, namefile))
+        return false;
+    if (bfile.kind() != BinaryIO::STREAMS){
+        std::cerr << namefile << " is not a STREAMS binary file" << std::endl;
         return false;
     }
-    else{
+    uint64_t n, n_rate, n_width, n_coords;
+    const int32_t* npoints = bfile.get_int("npoints", n);
+    const double* rate = bfile.get_double("rate", n_rate);
+    const double* width = bfile.get_double("width", n_width);
+    const double* coords = bfile.get_double("coords", n_coords);
+    if (npoints == 0 || rate == 0 || width == 0 || coords == 0 || n_rate != n || n_width != n)
+        return false;
+    if (dim != 3){
+        std::cout << "Streams cannot be defined in problems other than 3D" << std::endl;
+        return false;
+    }
+
+    N_seg = n;
+    allocate();
+    uint64_t ic = 0;
+    for (unsigned int i = 0; i < N_seg; ++i){
+        unsigned int N_points = npoints[i];
+        if (N_points < 2 || N_points > 4 )
+            std::cerr << "The stream segment " << i << " consists of " << N_points << " points." << std::endl;
+        if (ic + 2*N_points > n_coords){
+            std::cerr << namefile << " has fewer coordinates than segment points" << std::endl;
+            return false;
+        }
+        Q_rate[i] = rate[i];
+
+        std::vector<double> xx;
+        std::vector<double> yy;
+        if (N_points == 2){
+            Point<dim-1> A, B;
+            A[0] = coords[ic];   A[1] = coords[ic+1];
+            B[0] = coords[ic+2]; B[1] = coords[ic+3];
+            create_river_outline(xx, yy, A, B, width[i]);
+        }
+        else{
+            for (unsigned int j = 0; j < N_points; ++j){
+                xx.push_back(coords[ic + 2*j]);
+                yy.push_back(coords[ic + 2*j + 1]);
+            }
+        }
+        ic += 2*N_points;
+        set_segment(i, N_points, xx, yy);
+    }
+    return true;
+}
+
+template <int dim>
+bool Streams<dim>::Streams::read_streams(std::string namefile){
+    BinaryIO::InputBuffer input;
+    if (!read_input_file(namefile, input))
+        return false;
+    if (BinaryIO::is_binary(input))
+        return read_streams_binary(namefile, input);
+
+    BinaryIO::BufferStream datafile(input);
+    std::string line;
+    {
         {	// read the number of river segments
-            datafile.getline(buffer,512);
-            std::istringstream inp(buffer);
+            getline(datafile, line);
+            std::istringstream inp(line);
             inp >> N_seg;
         }
         {// read the river segments info
-            //A.resize(N_seg);
-            //B.resize(N_seg);
-            length.resize(N_seg);
-            Q_rate.resize(N_seg);
-            //width.resize(N_seg);
-            Xpoly.resize(N_seg);
-            Ypoly.resize(N_seg);
-            Xmin.resize(N_seg);
-            Xmax.resize(N_seg);
-            Ymin.resize(N_seg);
-            Ymax.resize(N_seg);
+            allocate();
 
             double x, y, q, w;
             for (unsigned int i = 0; i < N_seg; ++i){
                 unsigned int N_points;
                 {
-                    datafile.getline(buffer,512);
-                    std::istringstream inp(buffer);
+                    getline(datafile, line);
+                    std::istringstream inp(line);
                     inp >> N_points;
                     if (N_points < 2 || N_points > 4 )
                         std::cerr << "The stream segment " << i << " consists of " << N_points << " points." << std::endl;
@@ -262,8 +415,8 @@ bool Streams<dim>::Streams::read_streams(std::string namefile){
                 if (N_points == 2){
                     Point<dim-1> A, B;
                     {//Point A
-                        datafile.getline(buffer,512);
-                        std::istringstream inp(buffer);
+                        getline(datafile, line);
+                        std::istringstream inp(line);
                         inp >> x; inp>> y;
                         if (dim == 3){
                             A[0] = x; A[1] = y;
@@ -273,8 +426,8 @@ bool Streams<dim>::Streams::read_streams(std::string namefile){
                         }
                     }
                     {//Point B
-                        datafile.getline(buffer,512);
-                        std::istringstream inp(buffer);
+                        getline(datafile, line);
+                        std::istringstream inp(line);
                         inp >> x; inp>> y;
                         if (dim == 3){
                             B[0] = x; B[1] = y;
@@ -287,44 +440,14 @@ bool Streams<dim>::Streams::read_streams(std::string namefile){
                 }
                 else{
                     for (unsigned int j = 0; j < N_points; ++j){
-                        datafile.getline(buffer,512);
-                        std::istringstream inp(buffer);
+                        getline(datafile, line);
+                        std::istringstream inp(line);
                         inp >> x; inp>> y;
                         xx.push_back(x);
                         yy.push_back(y);
                     }
                 }
-                Xpoly[i] = xx;
-                Ypoly[i] = yy;
-                Xmin[i] = 100000000; Xmax[i] = -100000000;
-                Ymin[i] = 100000000; Ymax[i] = -100000000;
-                for (unsigned j = 0; j < xx.size(); ++j){
-                    if (xx[j] > Xmax[i])
-                        Xmax[i] = xx[j];
-                    if (xx[j] < Xmin[i])
-                        Xmin[i] = xx[j];
-                    if (yy[j] > Ymax[i])
-                        Ymax[i] = yy[j];
-                    if (yy[j] < Ymin[i])
-                        Ymin[i] = yy[j];
-                }
-
-                stream_triangles.push_back(ine_Triangle(ine_Point3(xx[0], yy[0], 0.0),
-                                                        ine_Point3(xx[1], yy[1], 0.0),
-                                                        ine_Point3(xx[2], yy[2], 0.0)));
-                //std::cout << "plot([" << xx[0] << " " << xx[1] << " " << xx[2] << " " <<xx[0] << "],[";
-                //std::cout << yy[0] << " " << yy[1] << " " << yy[2] << " " << yy[0] << "])" << std::endl;
-
-
-                stream_ids.push_back(i);
-                if (N_points  == 4){
-                    stream_triangles.push_back(ine_Triangle(ine_Point3(xx[2], yy[2], 0.0),
-                                               ine_Point3(xx[3], yy[3], 0.0),
-                                               ine_Point3(xx[0], yy[0], 0.0)));
-                    //std::cout << "plot([" << xx[2] << " " << xx[3] << " " << xx[0] << " " <<xx[2] << "],[";
-                    //std::cout << yy[2] << " " << yy[3] << " " << yy[0] << " " << yy[2] << "])" << std::endl;
-                    stream_ids.push_back(i);
-                }
+                set_segment(i, N_points, xx, yy);
             }
         }
         //stream_tree->insert(stream_triangles.begin(), stream_triangles.end());
@@ -415,49 +538,32 @@ void Streams<dim>::create_river_outline(std::vector<double>& xx,
 }
 
 template <int dim>
-bool Streams<dim>::get_stream_recharge(std::vector<double>& xc, std::vector<double>& yc, std::vector<double> &Q,
+bool Streams<dim>::get_stream_recharge(std::vector<double>& xc, std::vector<double>& yc,
+                                       std::vector<double>& area, std::vector<int>& segment,
                                        std::vector<double> xp,
                                        std::vector<double> yp,
-                                       ine_Tree& stream_tree,
-                                       double& ar){
+                                       ine_Tree& stream_tree){
     std::vector<int> ids;
     xc.clear();
     yc.clear();
-    Q.clear();
+    area.clear();
+    segment.clear();
 
-    bool tf = find_intersection_in_AABB_TREE(stream_tree,
-                                             stream_triangles,
-                                             xp, yp, ids);
-    ar = 0;
+    bool tf = find_intersection_in_AABB_TREE(stream_tree, xp, yp, ids);
     if (tf){
-        std::map<int,int> unique_ids;
         // make a unique list of river segment ids
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
         for (unsigned int i = 0; i < ids.size(); ++i){
-            unique_ids[stream_ids[ids[i]]] = stream_ids[ids[i]];
-        }
-        std::map<int,int>::iterator it = unique_ids.begin();
-        for (; it != unique_ids.end(); ++it){
             double d_xc, d_yc;
-            try {
-                double area = polyXpoly(xp, yp, Xpoly[it->first], Ypoly[it->first], d_xc, d_yc);
-                ar +=area;
-                //std::cout << "Cell: ";
-                //print_poly_matlab(xp,yp);
-                //std::cout << "River: ";
-                //print_poly_matlab(Xoutline[it->first], Youtline[it->first]);
-                //std::cout << /* "Intersected area: " << area << */ "plot(" << d_xc << ", " << d_yc << ", 'x')" << std::endl;
-
-                if (area < 0.1){
-                    int aa = 0;
-                    aa++;
-                    //std::cout << "The area " << area << " is too small" << std::endl;
-                }
-                xc.push_back(d_xc);
-                yc.push_back(d_yc);
-                Q.push_back(area * Q_rate[it->first]);
-            } catch (...) {
-                std::cout << "Boost failed to find intersection" << std::endl;
-            }
+            // The cell face is convex, therefore it is used as the clip polygon
+            double ar = convex_clip_area(Xpoly[ids[i]], Ypoly[ids[i]], xp, yp, d_xc, d_yc);
+            if (ar <= 0)
+                continue;
+            xc.push_back(d_xc);
+            yc.push_back(d_yc);
+            area.push_back(ar);
+            segment.push_back(ids[i]);
         }
     }
     return tf;
@@ -488,23 +594,32 @@ void Streams<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
 
     Triangulation<dim-1> tria;
     initTria<dim>(tria);
-    ine_Tree stream_tree;
-    stream_tree.insert(stream_triangles.begin(), stream_triangles.end());
-
-
+    ine_Tree& tree = get_tree();
+    const MappingQ1<dim-1> mapping;
 
     const unsigned int dofs_per_cell = fe.dofs_per_cell;
     Vector<double>       cell_rhs_streams (dofs_per_cell);
     std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
 
+    std::map<CellId, std::vector<FaceIntersection> > new_face_intersections;
+    typename std::map<CellId, std::vector<FaceIntersection> >::iterator it;
+    unsigned int n_computed = 0;
+
     double QSTRM = 0;
     double SUMA_AREA = 0;
-    //int dbg_coounter = 0;
     typename DoFHandler<dim>::active_cell_iterator
     cell = dof_handler.begin_active(),
     endc = dof_handler.end();
     for (; cell!=endc; ++cell){
-        if (cell->is_locally_owned()){
+        if (!cell->is_locally_owned() || !cell->at_boundary())
+            continue;
+
+        const CellId cell_id = cell->id();
+        it = face_intersections.find(cell_id);
+        if (it == face_intersections.end()){
+            // The intersections of this cell have not been computed yet
+            std::vector<FaceIntersection> cell_intersections;
+            bool has_top_face = false;
             for (unsigned int i_face=0; i_face < GeometryInfo<dim>::faces_per_cell; ++i_face){
                 if(cell->face(i_face)->at_boundary()){
                     bool isfacetop = false;
@@ -516,9 +631,9 @@ void Streams<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
                     }
 
                     if (isfacetop){
-                        const MappingQ1<dim-1> mapping;
+                        has_top_face = true;
                         setup_cell(cell->face(i_face), tria);
-                        std::vector<double> xc, yc, Qface;
+                        std::vector<double> xc, yc, area;
                         std::vector<double> xface(GeometryInfo<dim>::vertices_per_face);
                         std::vector<double> yface(GeometryInfo<dim>::vertices_per_face);
                         // We have to use the correct order of vertices which is not like dealii vertex numbering
@@ -528,56 +643,75 @@ void Streams<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
                             yface[jj] = cell->face(i_face)->vertex(v_nmb[jj])[1];
                         }
 
-                        //print_poly_matlab(xface,yface);
-                        //std::cout << dbg_coounter++ << std::endl;
-                        double ar;
-                        bool tf = get_stream_recharge(xc,yc,Qface,xface,yface, stream_tree, ar);
-                        SUMA_AREA += ar;
-                        if (tf){ // if this cell intersects a stream
-                            cell_rhs_streams = 0;
-                            // construct one point quadrature using the centroid of the intersected area
-                            for (unsigned int k = 0; k < xc.size(); ++k){
-                                Point<dim-1> quad_point;
-                                quad_point[0] = xc[k]; quad_point[1] = yc[k];
-                                Point<dim-1> unit_mid_point;
-                                bool mapping_done = try_mapping<dim-1>(quad_point, unit_mid_point,
-                                                                       tria.begin_active(), mapping);
-                                if (mapping_done){
-                                    double weight = 1.0;
-                                    Quadrature<dim-1>stream_quad(unit_mid_point);
-                                    FEFaceValues<dim>fe_face_stream_values(fe, stream_quad, update_values | update_quadrature_points);
-                                    fe_face_stream_values.reinit(cell, i_face);
-                                    for (unsigned int q_point = 0; q_point < stream_quad.size(); ++q_point){
-                                        for (unsigned int j = 0; j < dofs_per_cell; ++j){
-                                            double Q_temp = weight*Qface[k]*fe_face_stream_values.shape_value(j,q_point);
-                                            cell_rhs_streams(j) += Q_temp;
-                                            QSTRM += Q_temp;
-                                        }
-                                    }
-                                }
+                        std::vector<int> segments;
+                        get_stream_recharge(xc, yc, area, segments, xface, yface, tree);
+                        // convert the centroids of the intersected areas to unit coordinates of the cell
+                        for (unsigned int k = 0; k < xc.size(); ++k){
+                            Point<dim-1> quad_point;
+                            quad_point[0] = xc[k]; quad_point[1] = yc[k];
+                            Point<dim-1> unit_mid_point;
+                            bool mapping_done = try_mapping<dim-1>(quad_point, unit_mid_point,
+                                                                   tria.begin_active(), mapping);
+                            if (mapping_done){
+                                FaceIntersection fi;
+                                fi.face = i_face;
+                                fi.unit_centroid = QProjector<dim>::project_to_face(Quadrature<dim-1>(unit_mid_point), i_face).point(0);
+                                fi.area = area[k];
+                                fi.segment = segments[k];
+                                cell_intersections.push_back(fi);
                             }
-                            cell->get_dof_indices (local_dof_indices);
-                            constraints.distribute_local_to_global(cell_rhs_streams,
-                                                                   local_dof_indices,
-                                                                   system_rhs);
                         }
                     }
                 }
             }
+            if (!has_top_face)
+                continue;
+            n_computed++;
+            it = new_face_intersections.insert(std::make_pair(cell_id, cell_intersections)).first;
+        }
+        else{
+            typename std::map<CellId, std::vector<FaceIntersection> >::iterator it_old = it;
+            it = new_face_intersections.insert(std::make_pair(cell_id, std::vector<FaceIntersection>())).first;
+            it->second.swap(it_old->second);
+        }
+
+        if (it->second.size() == 0)
+            continue;
+
+        // construct one point quadrature using the centroid of each intersected area
+        cell_rhs_streams = 0;
+        for (unsigned int k = 0; k < it->second.size(); ++k){
+            const FaceIntersection& fi = it->second[k];
+            SUMA_AREA += fi.area;
+            for (unsigned int j = 0; j < dofs_per_cell; ++j){
+                double Q_temp = fi.area*Q_rate[fi.segment]*fe.shape_value(j, fi.unit_centroid);
+                cell_rhs_streams(j) += Q_temp;
+                QSTRM += Q_temp;
+            }
         }
+        cell->get_dof_indices (local_dof_indices);
+        constraints.distribute_local_to_global(cell_rhs_streams,
+                                               local_dof_indices,
+                                               system_rhs);
     }
+    // The cells that have been refined or moved to other processors are dropped
+    face_intersections.swap(new_face_intersections);
 
     sum_scalar<double>(QSTRM, n_proc, mpi_communicator, MPI_DOUBLE);
     sum_scalar<double>(SUMA_AREA, n_proc, mpi_communicator, MPI_DOUBLE);
+    sum_scalar<unsigned int>(n_computed, n_proc, mpi_communicator, MPI_UNSIGNED);
     if (my_rank == 0)
-        std::cout << "\t Q_streams = " << QSTRM << " and AREA = " << SUMA_AREA << std::endl;
+        std::cout << "\t Q_streams = " << QSTRM << " and AREA = " << SUMA_AREA
+                  << " (intersections computed for " << n_computed << " cells)" << std::endl;
 }
 
 template <int dim>
 void Streams<dim>::flag_cells_for_refinement(parallel::distributed::Triangulation<dim>& triangulation){
+    if (N_seg == 0 || dim != 3)
+        return;
 
-    ine_Tree stream_tree;
-    stream_tree.insert(stream_triangles.begin(), stream_triangles.end());
+    const unsigned int v_nmb[4] = {0, 1, 3, 2};
+    ine_Tree& stream_tree = get_tree();
 
     typename parallel::distributed::Triangulation<dim>::active_cell_iterator
     cell = triangulation.begin_active(),
@@ -588,16 +722,16 @@ void Streams<dim>::flag_cells_for_refinement(parallel::distributed::Triangulatio
                 if(cell->face(i_face)->at_boundary() && cell->face(i_face)->boundary_id() == GeometryInfo<dim>::faces_per_cell-1){
                     std::vector<double> xface(GeometryInfo<dim>::vertices_per_face);
                     std::vector<double> yface(GeometryInfo<dim>::vertices_per_face);
+                    // The vertices are ordered counterclockwise and not in the dealii numbering
                     for (unsigned int jj = 0; jj < GeometryInfo<dim>::vertices_per_face; ++jj){
-                        xface[jj] = cell->face(i_face)->vertex(jj)[0];
-                        yface[jj] = cell->face(i_face)->vertex(jj)[1];
+                        xface[jj] = cell->face(i_face)->vertex(v_nmb[jj])[0];
+                        yface[jj] = cell->face(i_face)->vertex(v_nmb[jj])[1];
                     }
 
-                    std::vector<int> ids;
-                    bool tf = find_intersection_in_AABB_TREE(stream_tree,
-                                                             stream_triangles,
-                                                             xface, yface, ids);
-                    if (tf){
+                    std::vector<double> xc, yc, area;
+                    std::vector<int> segments;
+                    get_stream_recharge(xc, yc, area, segments, xface, yface, stream_tree);
+                    if (area.size() > 0){
                         cell->set_refine_flag ();
                     }
                 }
@@ -0,0 +1,594 @@
+#ifndef TRACKING_MESH_H
+#define TRACKING_MESH_H
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include "binary_io.h"
+
+/*!
+ * \brief The TrackingMesh class is a compact read-only copy of the velocity field that is sufficient to trace particles.
+ *
+ * It consists of the vertex coordinates, the averaged nodal velocities, the vertices of each hexahedral
+ * (quadrilateral in 2D) cell in the deal.II lexicographic order, the face neighbors of each cell and a uniform grid
+ * of buckets for the point location. The arrays are stored in the NPSAT binary format (kind BinaryIO#TRACKING_MESH),
+ * therefore the same bytes can live in a file, in the memory of a processor or in a shared memory window,
+ * and the class accesses them without copying.
+ *
+ * The class does not depend on deal.II. The velocity is interpolated with the bilinear (trilinear) shape functions
+ * of the cell, which is the same field as the Q1 finite element velocity of Particle_Tracking.
+ */
+template <int dim>
+class TrackingMesh{
+public:
+    //! The number of vertices of a cell
+    static const int n_vert = 1 << dim;
+    //! The number of faces of a cell. The face 2*d is at unit coordinate d = 0 and the face 2*d+1 at d = 1
+    static const int n_face = 2*dim;
+    //! The maximum number of neighbors behind a face
+    static const int n_sub = 1 << (dim - 1);
+
+    TrackingMesh() : Nv(0), Nc(0){}
+
+    /*!
+     * \brief build creates the arrays of the tracking mesh. This is done by a single processor.
+     * \param coords are the coordinates of the vertices (Nv x dim)
+     * \param velocity are the velocities of the vertices (Nv x dim)
+     * \param cells are the vertex ids of the cells (Nc x n_vert)
+     * \param neighbors are the neighbor cells of each face (Nc x n_face x n_sub). A face on the boundary has -1 on
+     * all entries. If the neighbor is not refined only the first entry is set and the rest are -1.
+     * \param porosity is the porosity at the vertices (Nv). The velocities are already divided by the porosity,
+     * so it is not used for the tracing
+     * \param boundary_ids are the boundary ids of the faces (Nc x n_face). The interior faces have -1
+     * \param writer is where the arrays are added
+     */
+    static void build(const std::vector<double>& coords, const std::vector<double>& velocity,
+                      const std::vector<int>& cells, const std::vector<int>& neighbors,
+                      const std::vector<double>& porosity, const std::vector<int>& boundary_ids,
+                      BinaryIO::BinaryWriter& writer);
+
+    //! Returns the dimension of the tracking mesh stored in a file or 0 if the file is not a tracking mesh
+    static int file_dimension(const std::string& filename);
+
+    //! Uses the bytes of a buffer that holds a tracking mesh. The buffer must outlive this object
+    bool open(const BinaryIO::InputBuffer& buffer, const std::string& name);
+
+    //! Maps a tracking mesh file into memory
+    bool open(const std::string& filename);
+
+    int n_cells()const{return Nc;}
+    int n_vertices()const{return Nv;}
+
+    //! Returns the porosity of the vertex
+    double porosity(int ivert)const{return POR[ivert];}
+
+    //! Returns the boundary id of the face of the cell or -1 if the face is in the interior
+    int boundary_id(int icell, int iface)const{return BID[icell*n_face + iface];}
+
+    //! Computes the unit coordinates of the point in the cell with Newton iterations. Returns false if the iterations fail
+    bool unit_coords(int icell, const double* p, double* xi)const;
+
+    //! Interpolates the velocity at the unit coordinates xi of the cell
+    void velocity(int icell, const double* xi, double* v)const;
+
+    //! Finds the cell that contains the point using the buckets. Returns -1 if the point is outside of the mesh
+    int find_cell(const double* p, double* xi)const;
+
+    /*!
+     * \brief locate finds the cell that contains the point by walking from icell through the faces
+     * that the unit coordinates of the point indicate. If the walk fails the buckets are searched.
+     * \param icell is the starting cell. On success it is the cell that contains the point
+     * \param xi are the unit coordinates of the point in the found cell
+     * \param exit_face If the point is outside of the mesh, this is the boundary face where the walk stopped or -1
+     * \return true if the point is in the mesh
+     */
+    bool locate(int& icell, const double* p, double* xi, int& exit_face)const;
+
+    /*!
+     * \brief trace computes a streamline with the Runge Kutta 4 steps of Particle_Tracking (method 3).
+     *
+     * The step length is the minimum vertex distance of the cell divided by step_size.
+     * \param p0 is the starting point
+     * \param icell is a cell near the starting point. If it is negative, the cell is found from the buckets
+     * \param step_size is the number of steps per cell
+     * \param max_steps is the maximum number of steps
+     * \param stuck_iter is the number of steps after which a streamline whose bounding box does not expand is stopped
+     * \param P are the positions of the streamline (dim values per point). The starting point is included
+     * \param V are the velocities of the positions
+     * \return the same exit codes as Particle_Tracking:
+     *  - 0 the maximum number of steps has been reached
+     *  - 1 the particle exits from the top
+     *  - -9 the particle exits from the bottom
+     *  - 2 the particle exits from a side
+     *  - -66 the particle has stuck
+     *  - -88 the starting point is not in the mesh
+     */
+    int trace(const double* p0, int icell, double step_size, int max_steps, int stuck_iter,
+              std::vector<double>& P, std::vector<double>& V)const;
+
+private:
+    TrackingMesh(const TrackingMesh&);
+    TrackingMesh& operator=(const TrackingMesh&);
+
+    BinaryIO::MappedFile file;
+    int Nv;
+    int Nc;
+    const double* X;
+    const double* VEL;
+    const int32_t* C;
+    const int32_t* NB;
+    const double* hmin;
+    const double* POR;
+    const int32_t* BID;
+    const int32_t* bucket_start;
+    const int32_t* bucket_cells;
+    double lo[dim];
+    double hi[dim];
+    int nb[dim];
+
+    bool set_arrays(const std::string& name);
+    int bucket_index(const double* p)const;
+    void cell_center(int icell, double* c)const;
+
+    //! Converts the face where a particle leaves the mesh to an exit code
+    static int exit_code(int face){
+        if (face == 2*(dim - 1) + 1)
+            return 1;
+        else if (face == 2*(dim - 1))
+            return -9;
+        else
+            return 2;
+    }
+};
+
+template <int dim>
+void TrackingMesh<dim>::build(const std::vector<double>& coords, const std::vector<double>& velocity,
+                              const std::vector<int>& cells, const std::vector<int>& neighbors,
+                              const std::vector<double>& porosity, const std::vector<int>& boundary_ids,
+                              BinaryIO::BinaryWriter& writer){
+    const int n_cells = cells.size()/n_vert;
+    const int n_vertices = coords.size()/dim;
+
+    std::vector<double> bbox(2*dim);
+    for (int idim = 0; idim < dim; ++idim){
+        bbox[idim] = std::numeric_limits<double>::max();
+        bbox[dim + idim] = -std::numeric_limits<double>::max();
+    }
+    for (int iv = 0; iv < n_vertices; ++iv){
+        for (int idim = 0; idim < dim; ++idim){
+            bbox[idim] = std::min(bbox[idim], coords[iv*dim + idim]);
+            bbox[dim + idim] = std::max(bbox[dim + idim], coords[iv*dim + idim]);
+        }
+    }
+
+    // The minimum vertex distance controls the step length as in the Particle_Tracking
+    std::vector<double> min_dist(n_cells, std::numeric_limits<double>::max());
+    for (int ic = 0; ic < n_cells; ++ic){
+        for (int i = 0; i < n_vert; ++i){
+            for (int j = i + 1; j < n_vert; ++j){
+                double d = 0;
+                for (int idim = 0; idim < dim; ++idim){
+                    const double dx = coords[cells[ic*n_vert + i]*dim + idim] - coords[cells[ic*n_vert + j]*dim + idim];
+                    d += dx*dx;
+                }
+                min_dist[ic] = std::min(min_dist[ic], std::sqrt(d));
+            }
+        }
+    }
+
+    // The buckets have about the same size in every direction and there is about one cell per bucket
+    double volume = 1;
+    for (int idim = 0; idim < dim; ++idim)
+        volume *= std::max(bbox[dim + idim] - bbox[idim], 1e-12);
+    const double h = std::pow(volume/std::max(n_cells, 1), 1.0/dim);
+    // The info array is the dimension, the number of vertices, the number of cells and the number of buckets per direction
+    std::vector<int> info(3 + dim);
+    info[0] = dim;
+    info[1] = n_vertices;
+    info[2] = n_cells;
+    int n_buckets = 1;
+    for (int idim = 0; idim < dim; ++idim){
+        info[3 + idim] = std::max(1, static_cast<int>(std::ceil((bbox[dim + idim] - bbox[idim])/h)));
+        n_buckets *= info[3 + idim];
+    }
+
+    // Each cell is added to the buckets that overlap its bounding box
+    std::vector<std::vector<int> > bucket_lists(n_buckets);
+    for (int ic = 0; ic < n_cells; ++ic){
+        int ilo[3] = {0, 0, 0};
+        int ihi[3] = {0, 0, 0};
+        for (int idim = 0; idim < dim; ++idim){
+            double cmin = std::numeric_limits<double>::max();
+            double cmax = -std::numeric_limits<double>::max();
+            for (int i = 0; i < n_vert; ++i){
+                cmin = std::min(cmin, coords[cells[ic*n_vert + i]*dim + idim]);
+                cmax = std::max(cmax, coords[cells[ic*n_vert + i]*dim + idim]);
+            }
+            const double bs = (bbox[dim + idim] - bbox[idim])/info[3 + idim];
+            ilo[idim] = std::max(0, std::min(info[3 + idim] - 1, static_cast<int>(std::floor((cmin - bbox[idim])/bs))));
+            ihi[idim] = std::max(0, std::min(info[3 + idim] - 1, static_cast<int>(std::floor((cmax - bbox[idim])/bs))));
+        }
+        for (int k = ilo[2]; k <= ihi[2]; ++k)
+            for (int j = ilo[1]; j <= ihi[1]; ++j)
+                for (int i = ilo[0]; i <= ihi[0]; ++i){
+                    int ib = i;
+                    if (dim > 1) ib += info[3]*j;
+                    if (dim > 2) ib += info[3]*info[4]*k;
+                    bucket_lists[ib].push_back(ic);
+                }
+    }
+    std::vector<int> start(n_buckets + 1, 0);
+    std::vector<int> bucket_cells;
+    for (int ib = 0; ib < n_buckets; ++ib){
+        bucket_cells.insert(bucket_cells.end(), bucket_lists[ib].begin(), bucket_lists[ib].end());
+        start[ib + 1] = bucket_cells.size();
+    }
+
+    writer.add("info", info);
+    writer.add("bbox", bbox);
+    writer.add("coords", coords);
+    writer.add("velocity", velocity);
+    writer.add("cells", cells);
+    writer.add("neighbors", neighbors);
+    writer.add("min_dist", min_dist);
+    writer.add("porosity", porosity);
+    writer.add("boundary_ids", boundary_ids);
+    writer.add("bucket_start", start);
+    writer.add("bucket_cells", bucket_cells);
+}
+
+template <int dim>
+int TrackingMesh<dim>::file_dimension(const std::string& filename){
+    BinaryIO::MappedFile f;
+    if (!f.open(filename, false) || f.kind() != BinaryIO::TRACKING_MESH)
+        return 0;
+    uint64_t n;
+    const int32_t* info = f.get_int("info", n);
+    if (info == 0 || n == 0)
+        return 0;
+    return info[0];
+}
+
+template <int dim>
+bool TrackingMesh<dim>::open(const BinaryIO::InputBuffer& buffer, const std::string& name){
+    if (!file.open(buffer, name, false))
+        return false;
+    return set_arrays(name);
+}
+
+template <int dim>
+bool TrackingMesh<dim>::open(const std::string& filename){
+    if (!file.open(filename))
+        return false;
+    return set_arrays(filename);
+}
+
+template <int dim>
+bool TrackingMesh<dim>::set_arrays(const std::string& name){
+    if (file.kind() != BinaryIO::TRACKING_MESH){
+        std::cerr << name << " is not a tracking mesh" << std::endl;
+        return false;
+    }
+    uint64_t n_info, n_bbox, n_x, n_v, n_c, n_nb, n_h, n_por, n_bid, n_bs, n_bc;
+    const int32_t* info = file.get_int("info", n_info);
+    const double* bbox = file.get_double("bbox", n_bbox);
+    X = file.get_double("coords", n_x);
+    VEL = file.get_double("velocity", n_v);
+    C = file.get_int("cells", n_c);
+    NB = file.get_int("neighbors", n_nb);
+    hmin = file.get_double("min_dist", n_h);
+    POR = file.get_double("porosity", n_por);
+    BID = file.get_int("boundary_ids", n_bid);
+    bucket_start = file.get_int("bucket_start", n_bs);
+    bucket_cells = file.get_int("bucket_cells", n_bc);
+    if (info == 0 || n_info != 3 + dim || info[0] != dim || bbox == 0 || n_bbox != 2*dim){
+        std::cerr << name << " is not a tracking mesh of dimension " << dim << std::endl;
+        return false;
+    }
+    const int nv = info[1];
+    const int nc = info[2];
+    int n_buckets = 1;
+    for (int idim = 0; idim < dim; ++idim){
+        lo[idim] = bbox[idim];
+        hi[idim] = bbox[dim + idim];
+        nb[idim] = info[3 + idim];
+        n_buckets *= nb[idim];
+    }
+    if (n_x != static_cast<uint64_t>(nv*dim) || n_v != static_cast<uint64_t>(nv*dim) ||
+            n_c != static_cast<uint64_t>(nc*n_vert) || n_nb != static_cast<uint64_t>(nc*n_face*n_sub) ||
+            n_h != static_cast<uint64_t>(nc) || n_por != static_cast<uint64_t>(nv) ||
+            n_bid != static_cast<uint64_t>(nc*n_face) || n_bs != static_cast<uint64_t>(n_buckets + 1) || bucket_cells == 0){
+        std::cerr << "The arrays of " << name << " have inconsistent sizes" << std::endl;
+        return false;
+    }
+    Nv = nv;
+    Nc = nc;
+    return true;
+}
+
+template <int dim>
+bool TrackingMesh<dim>::unit_coords(int icell, const double* p, double* xi)const{
+    const int32_t* cv = &C[icell*n_vert];
+    for (int idim = 0; idim < dim; ++idim)
+        xi[idim] = 0.5;
+
+    for (int iter = 0; iter < 20; ++iter){
+        double x[dim];
+        double J[dim][dim];
+        for (int a = 0; a < dim; ++a){
+            x[a] = 0;
+            for (int b = 0; b < dim; ++b)
+                J[a][b] = 0;
+        }
+        for (int iv = 0; iv < n_vert; ++iv){
+            // The shape function of the vertex is the product of xi or 1-xi depending on the bits of the vertex number
+            double N = 1;
+            double dN[dim];
+            for (int b = 0; b < dim; ++b)
+                dN[b] = 1;
+            for (int d = 0; d < dim; ++d){
+                const bool upper = (iv >> d) & 1;
+                const double f = upper ? xi[d] : 1 - xi[d];
+                N *= f;
+                for (int b = 0; b < dim; ++b)
+                    dN[b] *= (b == d) ? (upper ? 1.0 : -1.0) : f;
+            }
+            const double* xv = &X[cv[iv]*dim];
+            for (int a = 0; a < dim; ++a){
+                x[a] += N*xv[a];
+                for (int b = 0; b < dim; ++b)
+                    J[a][b] += dN[b]*xv[a];
+            }
+        }
+
+        // Solve J*dxi = p - x with Gauss elimination and partial pivoting
+        double r[dim];
+        for (int a = 0; a < dim; ++a)
+            r[a] = p[a] - x[a];
+        for (int k = 0; k < dim; ++k){
+            int piv = k;
+            for (int a = k + 1; a < dim; ++a)
+                if (std::abs(J[a][k]) > std::abs(J[piv][k]))
+                    piv = a;
+            if (std::abs(J[piv][k]) < 1e-300)
+                return false;
+            if (piv != k){
+                for (int b = 0; b < dim; ++b)
+                    std::swap(J[k][b], J[piv][b]);
+                std::swap(r[k], r[piv]);
+            }
+            for (int a = k + 1; a < dim; ++a){
+                const double m = J[a][k]/J[k][k];
+                for (int b = k; b < dim; ++b)
+                    J[a][b] -= m*J[k][b];
+                r[a] -= m*r[k];
+            }
+        }
+        double dxi_max = 0;
+        for (int k = dim - 1; k >= 0; --k){
+            double s = r[k];
+            for (int b = k + 1; b < dim; ++b)
+                s -= J[k][b]*r[b];
+            r[k] = s/J[k][k];
+            xi[k] += r[k];
+            dxi_max = std::max(dxi_max, std::abs(r[k]));
+        }
+        if (!std::isfinite(dxi_max))
+            return false;
+        if (dxi_max < 1e-12)
+            break;
+    }
+    return true;
+}
+
+template <int dim>
+void TrackingMesh<dim>::velocity(int icell, const double* xi, double* v)const{
+    const int32_t* cv = &C[icell*n_vert];
+    for (int idim = 0; idim < dim; ++idim)
+        v[idim] = 0;
+    for (int iv = 0; iv < n_vert; ++iv){
+        double N = 1;
+        for (int d = 0; d < dim; ++d)
+            N *= ((iv >> d) & 1) ? xi[d] : 1 - xi[d];
+        const double* vv = &VEL[cv[iv]*dim];
+        for (int idim = 0; idim < dim; ++idim)
+            v[idim] += N*vv[idim];
+    }
+}
+
+template <int dim>
+int TrackingMesh<dim>::bucket_index(const double* p)const{
+    int ib = 0;
+    int stride = 1;
+    for (int idim = 0; idim < dim; ++idim){
+        if (p[idim] < lo[idim] || p[idim] > hi[idim])
+            return -1;
+        const int i = std::min(nb[idim] - 1, static_cast<int>((p[idim] - lo[idim])/(hi[idim] - lo[idim])*nb[idim]));
+        ib += i*stride;
+        stride *= nb[idim];
+    }
+    return ib;
+}
+
+template <int dim>
+void TrackingMesh<dim>::cell_center(int icell, double* c)const{
+    for (int idim = 0; idim < dim; ++idim)
+        c[idim] = 0;
+    for (int iv = 0; iv < n_vert; ++iv)
+        for (int idim = 0; idim < dim; ++idim)
+            c[idim] += X[C[icell*n_vert + iv]*dim + idim]/n_vert;
+}
+
+template <int dim>
+int TrackingMesh<dim>::find_cell(const double* p, double* xi)const{
+    const int ib = bucket_index(p);
+    if (ib < 0)
+        return -1;
+    const double tol = 1e-8;
+    for (int i = bucket_start[ib]; i < bucket_start[ib + 1]; ++i){
+        const int icell = bucket_cells[i];
+        if (!unit_coords(icell, p, xi))
+            continue;
+        bool inside = true;
+        for (int idim = 0; idim < dim; ++idim)
+            if (xi[idim] < -tol || xi[idim] > 1 + tol)
+                inside = false;
+        if (inside)
+            return icell;
+    }
+    return -1;
+}
+
+template <int dim>
+bool TrackingMesh<dim>::locate(int& icell, const double* p, double* xi, int& exit_face)const{
+    const double tol = 1e-8;
+    exit_face = -1;
+    int current = icell;
+    for (int iter = 0; iter < 100 && current >= 0; ++iter){
+        if (!unit_coords(current, p, xi))
+            break;
+        // Move through the face that the point violates the most
+        int face = -1;
+        double worst = tol;
+        for (int idim = 0; idim < dim; ++idim){
+            if (-xi[idim] > worst){
+                worst = -xi[idim];
+                face = 2*idim;
+            }
+            if (xi[idim] - 1 > worst){
+                worst = xi[idim] - 1;
+                face = 2*idim + 1;
+            }
+        }
+        if (face < 0){
+            icell = current;
+            return true;
+        }
+        exit_face = face;
+        const int32_t* fn = &NB[(current*n_face + face)*n_sub];
+        if (fn[0] < 0)
+            break;
+        // If the neighbor is refined, continue from the child that is closest to the point
+        int next = fn[0];
+        double best = std::numeric_limits<double>::max();
+        for (int isub = 0; isub < n_sub && fn[isub] >= 0; ++isub){
+            double c[dim];
+            cell_center(fn[isub], c);
+            double d = 0;
+            for (int idim = 0; idim < dim; ++idim)
+                d += (c[idim] - p[idim])*(c[idim] - p[idim]);
+            if (d < best){
+                best = d;
+                next = fn[isub];
+            }
+        }
+        current = next;
+    }
+
+    // The walk may stop at a boundary of a non convex domain or may not converge.
+    // In both cases the buckets decide whether the point is in the mesh
+    const int found = find_cell(p, xi);
+    if (found >= 0){
+        icell = found;
+        exit_face = -1;
+        return true;
+    }
+    return false;
+}
+
+template <int dim>
+int TrackingMesh<dim>::trace(const double* p0, int icell, double step_size, int max_steps, int stuck_iter,
+                             std::vector<double>& P, std::vector<double>& V)const{
+    double xi[dim];
+    int exit_face;
+    if (Nc == 0)
+        return -88;
+    if (icell < 0)
+        icell = find_cell(p0, xi);
+    if (icell < 0 || !locate(icell, p0, xi, exit_face))
+        return -88;
+
+    double p[dim], v[dim], bbl[dim], bbu[dim];
+    velocity(icell, xi, v);
+    for (int idim = 0; idim < dim; ++idim){
+        p[idim] = p0[idim];
+        bbl[idim] = p0[idim];
+        bbu[idim] = p0[idim];
+        P.push_back(p[idim]);
+        V.push_back(v[idim]);
+    }
+
+    // The stages move from the initial point along the velocity of the previous stage
+    const double stage_weight[3] = {0.5, 0.5, 1.0};
+    const double RK_weights[4] = {1.0/6.0, 2.0/6.0, 2.0/6.0, 1.0/6.0};
+    int times_not_expanded = 0;
+    for (int istep = 0; istep < max_steps; ++istep){
+        const double step_length = hmin[icell]/step_size;
+        double K[4][dim];
+        double y[dim];
+        for (int idim = 0; idim < dim; ++idim)
+            K[0][idim] = v[idim];
+
+        for (int istage = 0; istage < 4; ++istage){
+            double dir[dim];
+            double w;
+            if (istage < 3){
+                for (int idim = 0; idim < dim; ++idim)
+                    dir[idim] = K[istage][idim];
+                w = stage_weight[istage];
+            }
+            else{
+                for (int idim = 0; idim < dim; ++idim){
+                    dir[idim] = 0;
+                    for (int k = 0; k < 4; ++k)
+                        dir[idim] += RK_weights[k]*K[k][idim];
+                }
+                w = 1.0;
+            }
+            double norm = 0;
+            for (int idim = 0; idim < dim; ++idim)
+                norm += dir[idim]*dir[idim];
+            norm = std::sqrt(norm);
+            if (norm <= 0)
+                return -66;
+            for (int idim = 0; idim < dim; ++idim)
+                y[idim] = p[idim] + dir[idim]*w*step_length/norm;
+
+            int c = icell;
+            if (!locate(c, y, xi, exit_face))
+                return exit_face < 0 ? -88 : exit_code(exit_face);
+            if (istage < 3){
+                velocity(c, xi, K[istage + 1]);
+            }
+            else{
+                velocity(c, xi, v);
+                icell = c;
+            }
+        }
+
+        bool expand = false;
+        for (int idim = 0; idim < dim; ++idim){
+            p[idim] = y[idim];
+            P.push_back(p[idim]);
+            V.push_back(v[idim]);
+            if (p[idim] < bbl[idim]){
+                bbl[idim] = p[idim];
+                expand = true;
+            }
+            if (p[idim] > bbu[idim]){
+                bbu[idim] = p[idim];
+                expand = true;
+            }
+        }
+        if (expand)
+            times_not_expanded = 0;
+        else if (++times_not_expanded > stuck_iter)
+            return -66;
+    }
+    return 0;
+}
+
+#endif // TRACKING_MESH_H
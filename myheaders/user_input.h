@@ -17,6 +17,8 @@
 #include "dsimstructs.h"
 #include "helper_functions.h"
 #include "cgal_functions.h"
+#include "binary_io.h"
+#include "mpi_help.h"
 
 using namespace dealii;
 
@@ -42,6 +44,8 @@ public:
     *
     * Current availale options are
     * - -p <input_file>
+    * - -g <Nproc> <Nchunks>
+    * - -c <TYPE> <text_file> <binary_file> converts a text input file to the binary format
     * - -h displays help options
     */
     bool parse_command_line(const int argc, char *const *argv);
@@ -71,10 +75,20 @@ public:
 
     bool do_gather;
 
+    //! This is set to true when the -c option is used. In that case no simulation is carried out
+    bool do_convert;
+
+    //! Converts the input file given with the -c option into the binary format
+    bool convert_input();
+
 private:
     //! This is the typical MPI communicator
     MPI_Comm                                  mpi_communicator;
 
+    //! Enables the memoization of the inputs that are listed in the "d Cached inputs" option.
+    //! The Dirichlet functions are enabled by NPSAT because they are read there
+    void enable_input_caches();
+
     //! This is used to print the output only on one processor
     ConditionalOStream                        pcout;
 
@@ -93,6 +107,15 @@ private:
      */
     int nproc_solve;
 
+    //! The type of the file that is converted (INTERP, MESH, WELLS or STREAMS)
+    std::string convert_type;
+
+    //! The text file that is converted into binary
+    std::string convert_in;
+
+    //! The name of the binary file
+    std::string convert_out;
+
     /*!
      * \brief nStreamlineChunks specifies in how many chunks the streamlines have been divided in particle
      * tracking during the construction phase of the NPSAT
@@ -136,6 +159,7 @@ bool CL_arguments<dim>::parse_command_line(const int argc, char *const *argv){
             args.push_back(argv[i]);
 
         do_gather = false;
+        do_convert = false;
         while (args.size()){
             if (args.front() == "-p"){
                 args.pop_front();
@@ -182,6 +206,22 @@ bool CL_arguments<dim>::parse_command_line(const int argc, char *const *argv){
                     args.pop_front();
                 }
             }
+            else if (args.front() == "-c"){
+                args.pop_front();
+                if (args.size() < 3){
+                    std::cerr << "Error: flag '-c' must be followed by the "
+                              << "file type, the input text file and the output binary file."
+                              << std::endl;
+                    args.clear();
+                }
+                else{
+                    convert_type = args.front(); args.pop_front();
+                    convert_in = args.front(); args.pop_front();
+                    convert_out = args.front(); args.pop_front();
+                    do_convert = true;
+                    out = true;
+                }
+            }
             else if (args.front() == "-h"){
                 args.pop_front();
                 print_usage_message();
@@ -208,6 +248,8 @@ void CL_arguments<dim>::print_usage_message(){
           "                                where the particle tracking has been split into Nchunks\n"
           "                       (The parameter file is also required. You have to provide\n"
           "                        -p and -g options to gather particles)\n"
+          "            [-c TYPE input output] Converts a text input file to the binary format\n"
+          "                                TYPE is one of INTERP, MESH, WELLS, STREAMS\n"
           "\n"
           "The input file has the following format and allows the following\n"
           "values (you can cut and paste this and use it for your own parameter\n"
@@ -327,6 +369,19 @@ void CL_arguments<dim>::declare_parameters(){
                           "e----------------------------------\n"
                           "The number of initial refinements around the Streams");
 
+        prm.declare_entry("f Column partition", "0", Patterns::Integer(0,1),
+                          "f----------------------------------\n"
+                          "If 1 the mesh is partitioned so that the refined cells of each\n"
+                          "coarse cell tend to stay on one processor. This reduces the communication\n"
+                          "of the moving mesh and the vertical particle migrations.\n"
+                          "The mesh is the same as without this option.\n"
+                          "Limitations: An x-y column consists of one coarse cell per vertical\n"
+                          "layer, and these are not consecutive in the partition order, so the\n"
+                          "columns can still be split at the layer interfaces. About 1 in 20\n"
+                          "partition boundaries still falls inside a coarse cell. The number of\n"
+                          "cells per processor may differ from an even split by up to the cells\n"
+                          "of one coarse cell.");
+
     }
     prm.leave_subsection();
 
@@ -416,6 +471,18 @@ void CL_arguments<dim>::declare_parameters(){
         prm.declare_entry("d Output details", "0", Patterns::Integer(0,2),
                           "d----------------------------------\n"
                           "If 1 displays details about the ML solver");
+
+        prm.declare_entry("e Nonlinear tolerance", "0", Patterns::Double(0,1000),
+                          "e----------------------------------\n"
+                          "The nonlinear iterations stop when the maximum change of the\n"
+                          "water table between two iterations is smaller than this value.\n"
+                          "Use 0 to run all the nonlinear iterations");
+
+        prm.declare_entry("f Relaxation factor", "1", Patterns::Double(0.01,1),
+                          "f----------------------------------\n"
+                          "Under relaxation factor of the water table update.\n"
+                          "The new water table is old + f*(new - old).\n"
+                          "Values smaller than 1 damp oscillations of the free surface. Use 1 for no relaxation");
     }
     prm.leave_subsection();
 
@@ -477,9 +544,10 @@ void CL_arguments<dim>::declare_parameters(){
                           "f----------------------------------\n"
                           "The maximum number of steps per streamline");
 
-        prm.declare_entry("g Tracking method", "3", Patterns::Integer(1,3),
+        prm.declare_entry("g Tracking method", "3", Patterns::Integer(1,5),
                           "g----------------------------------\n"
-                          "1-> Euler, 2->RK2, 3->RK4");
+                          "1-> Euler, 2->RK2, 3->RK4, 4->Adaptive RK3(2)\n"
+                          "5->Semi-analytical from cell face to cell face");
 
         prm.declare_entry("h Step size", "6", Patterns::Double(1,100),
                           "h----------------------------------\n"
@@ -511,6 +579,50 @@ void CL_arguments<dim>::declare_parameters(){
         prm.declare_entry("n Distance from well", "50.0", Patterns::Double(1,1000),
                           "n----------------------------------\n"
                           "The distance from well that the particles will be releazed");
+
+        prm.declare_entry("o Absolute tolerance", "0.1", Patterns::Double(0,1000),
+                          "o----------------------------------\n"
+                          "The absolute error tolerance of the position per step\n"
+                          "for the adaptive tracking method (4)");
+
+        prm.declare_entry("p Relative tolerance", "0.001", Patterns::Double(0,1),
+                          "p----------------------------------\n"
+                          "The error tolerance of the position per step relative to the step length\n"
+                          "for the adaptive tracking method (4)");
+
+        prm.declare_entry("q Pilot particle stride", "0", Patterns::Integer(0,10000),
+                          "q----------------------------------\n"
+                          "If N > 0, every N-th particle is traced in a pilot run and the mesh is\n"
+                          "repartitioned so that the particle steps per processor are balanced.\n"
+                          "0 keeps the partition of the flow simulation");
+
+        prm.declare_entry("r Particle batch size", "0", Patterns::Integer(0,10000),
+                          "r----------------------------------\n"
+                          "If N > 0, the particles advance one step at a time in rounds and the\n"
+                          "particles of the same cell are evaluated together in batches of N.\n"
+                          "0 traces each particle to completion one at a time");
+
+        prm.declare_entry("s Halo layers", "0", Patterns::Integer(0,1),
+                          "s----------------------------------\n"
+                          "1 traces the particles through the ghost cells of the mesh\n"
+                          "and moves them to another processor when they leave the ghost layer.\n"
+                          "The ghost layer is one cell deep, so there are no deeper halos.\n"
+                          "0 moves the particles as soon as they enter a ghost cell");
+
+        prm.declare_entry("t Replicated tracking mesh", "0", Patterns::Integer(0,1),
+                          "t----------------------------------\n"
+                          "If 1 a compact copy of the velocity field of the whole domain is kept\n"
+                          "once per compute node in shared memory. Each processor traces its share\n"
+                          "of the particles without moving them to other processors.\n"
+                          "This supports only the Runge Kutta 4 method (3). Any other\n"
+                          "tracking method is rejected");
+
+        prm.declare_entry("u Export tracking mesh", "0", Patterns::Integer(0,1),
+                          "u----------------------------------\n"
+                          "If 1 the mesh, the velocity field, the porosity and the boundary ids\n"
+                          "are written in the output folder as prefix_tracking_mesh.bin.\n"
+                          "The file is the input of the standalone tracer npsat_trace,\n"
+                          "which repeats the particle tracking without solving the flow");
     }
     prm.leave_subsection ();
 
@@ -535,18 +647,64 @@ void CL_arguments<dim>::declare_parameters(){
                           "along the Z");
     }
     prm.leave_subsection();
+
+    //+++++++++++++++++++++++++++++++++++++++++
+    // INPUT OPTIONS
+    //+++++++++++++++++++++++++++++++++++++++++
+    prm.enter_subsection("K. Input options ====================================");
+    {
+        prm.declare_entry("a Load subdomain data", "0", Patterns::Integer(0,1),
+                          "a----------------------------------\n"
+                          "Set to 1 so that each processor keeps only the scattered\n"
+                          "interpolation points around its own part of the domain.\n"
+                          "This reduces the memory for large input data sets");
+
+        prm.declare_entry("b Subdomain halo", "1000", Patterns::Double(0,1000000),
+                          "b----------------------------------\n"
+                          "The distance around the processor subdomain where\n"
+                          "the scattered points are also loaded");
+
+        prm.declare_entry("c Read input once", "1", Patterns::Integer(0,2),
+                          "c----------------------------------\n"
+                          "0 -> Every processor reads the input files\n"
+                          "1 -> The processor 0 reads the input files and\n"
+                          "broadcasts their content\n"
+                          "2 -> As 1 but the processors of each node share\n"
+                          "a single copy of the content in shared memory.\n"
+                          "The main parameter file is always read by the processor 0");
+
+        prm.declare_entry("d Cached inputs", "", Patterns::Anything(),
+                          "d----------------------------------\n"
+                          "A space separated list of inputs whose interpolated\n"
+                          "values are memoized. Valid keywords are:\n"
+                          "TOP BOT KX KY KZ POR RCH DIR (Dirichlet functions).\n"
+                          "Constant inputs are never cached");
+
+        prm.declare_entry("e Cache size", "200000", Patterns::Integer(0,100000000),
+                          "e----------------------------------\n"
+                          "The maximum number of values that are cached per input.\n"
+                          "When a cache is full it is cleared");
+
+        prm.declare_entry("f Cache tolerance", "0.001", Patterns::Double(0,1000),
+                          "f----------------------------------\n"
+                          "Points that are closer than this in every coordinate\n"
+                          "share the same cached value");
+    }
+    prm.leave_subsection();
 }
 
 template<int dim>
 bool CL_arguments<dim>::read_param_file(){
 
-    std::ifstream f(param_file.c_str());
-    if (!f.good())
+    // The parameter file is read by the processor 0 only, before the input read mode is known
+    BinaryIO::InputBuffer input;
+    if (!read_input_file(param_file, input, mpi_communicator))
         return false;
 
     AQprop.main_param_file = param_file;
 
-    prm.parse_input(param_file);
+    prm.parse_input_from_string(std::string(input.data(), input.size()).c_str());
+    input.clear();
 
 
     //+++++++++++++++++++++++++++++++++++++++++
@@ -562,6 +720,31 @@ bool CL_arguments<dim>::read_param_file(){
     }
     prm.leave_subsection ();
 
+    //+++++++++++++++++++++++++++++++++++++++++
+    // INPUT OPTIONS
+    //+++++++++++++++++++++++++++++++++++++++++
+    // These have to be known before any of the input files is read
+    prm.enter_subsection("K. Input options ====================================");
+    {
+        AQprop.input_param.bLoadSubdomain = prm.get_integer("a Load subdomain data");
+        AQprop.input_param.subdomain_halo = prm.get_double("b Subdomain halo");
+        AQprop.input_param.ReadInputOnce = prm.get_integer("c Read input once");
+        input_read_mode() = AQprop.input_param.ReadInputOnce;
+        AQprop.input_param.cached_inputs = BinaryIO::tokenize(prm.get("d Cached inputs"));
+        AQprop.input_param.cache_size = prm.get_integer("e Cache size");
+        AQprop.input_param.cache_tolerance = prm.get_double("f Cache tolerance");
+        if (AQprop.input_param.bLoadSubdomain == 1){
+            AQprop.top_elevation.set_subdomain_loading(AQprop.input_param.subdomain_halo);
+            AQprop.bottom_elevation.set_subdomain_loading(AQprop.input_param.subdomain_halo);
+            AQprop.HydraulicConductivity.resize(dim);
+            for (unsigned int i = 0; i < AQprop.HydraulicConductivity.size(); ++i)
+                AQprop.HydraulicConductivity[i].set_subdomain_loading(AQprop.input_param.subdomain_halo);
+            AQprop.Porosity.set_subdomain_loading(AQprop.input_param.subdomain_halo);
+            AQprop.GroundwaterRecharge.set_subdomain_loading(AQprop.input_param.subdomain_halo);
+        }
+    }
+    prm.leave_subsection ();
+
 
     //+++++++++++++++++++++++++++++++++++++++++
     // GEOMETRY
@@ -633,6 +816,8 @@ bool CL_arguments<dim>::read_param_file(){
 
         AQprop.N_streams_refinement = prm.get_integer("e Stream Refinement");
 
+        AQprop.column_partition = prm.get_integer("f Column partition");
+
 
         if (temp_str != ""){
             std::vector<std::string> temp1 = Utilities::split_string_list(temp_str);
@@ -772,6 +957,8 @@ bool CL_arguments<dim>::read_param_file(){
         AQprop.solver_param.solver_tol = prm.get_double("b Solver tolerance");
         AQprop.solver_param.Maxiter = prm.get_integer("c Max iterations");
         AQprop.solver_param.output_details = prm.get_integer("d Output details");
+        AQprop.solver_param.NonLinearTol = prm.get_double("e Nonlinear tolerance");
+        AQprop.solver_param.RelaxFactor = prm.get_double("f Relaxation factor");
     }
     prm.leave_subsection ();
 
@@ -805,6 +992,18 @@ bool CL_arguments<dim>::read_param_file(){
         AQprop.part_param.Wells_N_Layers = prm.get_integer("l Layers per well");
         AQprop.part_param.Wells_N_per_layer = prm.get_integer("m Particles per layer(well)");
         AQprop.part_param.radius = prm.get_double("n Distance from well");
+        AQprop.part_param.abs_tol = prm.get_double("o Absolute tolerance");
+        AQprop.part_param.rel_tol = prm.get_double("p Relative tolerance");
+        AQprop.part_param.pilot_stride = prm.get_integer("q Pilot particle stride");
+        AQprop.part_param.batch_size = prm.get_integer("r Particle batch size");
+        AQprop.part_param.halo_layers = prm.get_integer("s Halo layers");
+        AQprop.part_param.replicated_mesh = prm.get_integer("t Replicated tracking mesh");
+        AQprop.part_param.export_mesh = prm.get_integer("u Export tracking mesh");
+        if (AQprop.part_param.replicated_mesh == 1 && AQprop.part_param.method != 3){
+            std::cerr << "The replicated tracking mesh supports only the Runge Kutta 4 tracking method (3). "
+                      << "Set the tracking method to 3 or the replicated tracking mesh to 0" << std::endl;
+            return false;
+        }
     }
     prm.leave_subsection ();
 
@@ -820,9 +1019,40 @@ bool CL_arguments<dim>::read_param_file(){
     }
     prm.leave_subsection ();
 
+    enable_input_caches();
+
     return true;
 }
 
+template <int dim>
+void CL_arguments<dim>::enable_input_caches(){
+    const InputParameters& ip = AQprop.input_param;
+    if (ip.is_cached("TOP"))
+        AQprop.top_elevation.enable_cache(ip.cache_size, ip.cache_tolerance);
+    if (ip.is_cached("BOT"))
+        AQprop.bottom_elevation.enable_cache(ip.cache_size, ip.cache_tolerance);
+    if (ip.is_cached("KX"))
+        AQprop.HydraulicConductivity[0].enable_cache(ip.cache_size, ip.cache_tolerance);
+    if (ip.is_cached("KY") && dim == 3 && AQprop.HKuse[1])
+        AQprop.HydraulicConductivity[1].enable_cache(ip.cache_size, ip.cache_tolerance);
+    if (ip.is_cached("KZ") && AQprop.HKuse[dim-1])
+        AQprop.HydraulicConductivity[dim-1].enable_cache(ip.cache_size, ip.cache_tolerance);
+    if (ip.is_cached("POR"))
+        AQprop.Porosity.enable_cache(ip.cache_size, ip.cache_tolerance);
+    if (ip.is_cached("RCH"))
+        AQprop.GroundwaterRecharge.enable_cache(ip.cache_size, ip.cache_tolerance);
+}
+
+template <int dim>
+bool CL_arguments<dim>::convert_input(){
+    bool done = BinaryIO::convert_to_binary<dim>(convert_type, convert_in, convert_out);
+    if (done)
+        pcout << convert_in << " has been converted to " << convert_out << std::endl;
+    else
+        std::cerr << "Failed to convert " << convert_in << std::endl;
+    return done;
+}
+
 template <int dim>
 int CL_arguments<dim>::get_np(){
     return nproc_solve;
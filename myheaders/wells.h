@@ -1,6 +1,8 @@
 #ifndef WELLS_H
 #define WELLS_H
 
+#include <algorithm>
+
 #include <deal.II/base/point.h>
 #include <deal.II/distributed/tria.h>
 #include <deal.II/grid/tria_accessor.h>
@@ -11,6 +13,7 @@
 #include "my_functions.h"
 #include "mpi_help.h"
 #include "streamlines.h"
+#include "binary_io.h"
 
 
 using namespace dealii;
@@ -35,24 +38,6 @@ public:
     //! The well id
     int well_id;
 
-    //! A vector that stores the cell elements that the screen length intersects
-    std::vector<typename DoFHandler<dim>::active_cell_iterator > well_cells;
-
-    //! A vector that stores the well rates that correspond to each cell
-    std::vector<double > Q_cell;
-
-    //! A vector that stores the length of the screen that is contained within each cell
-    std::vector<double > L_cell;
-
-    //! A vector that stores the hydraulic conductivity of each cell
-    std::vector<double>  K_cell;
-
-    //! A vector that is set to true if the cell is locally owned by the current processor
-    std::vector<bool> 	 owned;
-
-    //! A vector that stores the middle point of the screen that is contained within each cell
-    std::vector<Point<dim> > mid_point;
-
     /*!
      * \brief distribute_particles distributes particles around the well screen
      * \param particles is the output vector of Point<dim> with the location particles
@@ -158,6 +143,10 @@ public:
      *
      * -Q is the pumping(Negative) or recharging(positive) well rate
      *
+     * The file can also be in the NPSAT binary format (see BinaryIO#convert_to_binary)
+     *
+     * The file is read with #read_input_file, therefore this must be called by all processors.
+     *
      * \param base_filename is the name of the well input file
      * \return true if there are no errors during reading
      */
@@ -165,6 +154,10 @@ public:
 
     /*!
     * \brief add_contributions add the contributions from the wells to the right hand size vector
+    *
+    * The cells that contain the wells are found once after each mesh change (see #build_index). The pumping rate of each well
+    * is distributed to its cells according to K*L of each cell. The sums of K, L and K*L per well are reduced over all processors
+    * as a single compact array that contains only the wells that are in the domain. This method must be called by all processors.
     * \param system_rhs this is the right hand size vector
     * \param dof_handler
     * \param fe
@@ -182,8 +175,17 @@ public:
     /*!
      * \brief flag_cells_for_refinement flags for refinement the elements that are intersected by a well
      * \param triangulation
+     * \param top_function if the top and bottom functions are given, the triangulation is assumed to be the flat mesh
+     * with elevations between 0 and flat_height, as it is created before the mesh structure assigns the actual elevations.
+     * The elevations of the cell vertices are then computed as bottom + (top - bottom)*z/flat_height, which is the same
+     * vertical distribution that the mesh structure applies.
+     * \param bot_function is the bottom elevation function
+     * \param flat_height is the height of the flat mesh
      */
-    void flag_cells_for_refinement(parallel::distributed::Triangulation<dim>& 	triangulation);
+    void flag_cells_for_refinement(parallel::distributed::Triangulation<dim>& 	triangulation,
+                                   const Function<dim>* top_function = 0,
+                                   const Function<dim>* bot_function = 0,
+                                   double flat_height = 100);
 
     /*!
      * \brief distribute_particles Distributes the particles around all wells of the domain
@@ -202,11 +204,56 @@ public:
 
     //! Prints the well info. It is used for debuging.
     void print_wells();
+
+    /*!
+     * \brief mesh_changed informs the class that the triangulation has been refined, coarsened or repartitioned
+     * so that the well to cell index is rebuilt during the next #add_contributions.
+     * NPSAT calls it from the Triangulation::Signals::any_change signal
+     */
+    void mesh_changed(){index_valid = false;}
+
+private:
+    //! Sets the i-th well
+    void set_well(int i, double Xcoord, double Ycoord, double top, double bot, double Q);
+
+    //! A locally owned cell whose horizontal projection contains a well
+    struct WellCell{
+        typename DoFHandler<dim>::active_cell_iterator cell;
+        int well_id;
+        //! The unit coordinates of the well in the horizontal projection of the cell
+        Point<dim-1> p_unit2D;
+    };
+
+    //! The locally owned cells that contain wells sorted by well id
+    std::vector<WellCell> well_cells;
+
+    //! The ids of the wells that are found in at least one cell of any processor
+    std::vector<int> active_wells;
+
+    //! The position of each well in #active_wells or -1 if the well is not in the domain
+    std::vector<int> well_slot;
+
+    //! False if the triangulation may have changed since the index was built
+    bool index_valid;
+
+    //! The DoFHandler that the index was built for
+    const DoFHandler<dim>* index_dof_handler;
+
+    /*!
+     * \brief build_index finds the locally owned cells that contain wells.
+     *
+     * The horizontal coordinates of the mesh do not change during the simulation, therefore the unit coordinates
+     * of the wells in the horizontal projection of the cells are computed only here.
+     * The method is collective as it also computes the list of #active_wells
+     */
+    void build_index(const DoFHandler<dim>& dof_handler, MPI_Comm mpi_communicator);
 };
 
 template <int dim>
 Well_Set<dim>::Well_Set(){
     Nwells = 0;
+    index_valid = false;
+    index_dof_handler = 0;
 }
 
 
@@ -244,54 +291,83 @@ void Well_Set<dim>::setup_cell(typename parallel::distributed::Triangulation<dim
     }
 }
 
+template <int dim>
+void Well_Set<dim>::set_well(int i, double Xcoord, double Ycoord, double top, double bot, double Q){
+    wellxy.push_back(std::make_pair(ine_Point2(Xcoord, Ycoord), i) );
+
+    if (top - bot <= 0){
+        std::cerr << "Well " << i << " has " << top-bot << " screen length" << std::endl;
+    }
+
+    Point<dim> p_top;
+    Point<dim> p_bot;
+    if (dim == 2){
+        p_top[0] = Xcoord; p_top[1] = top;
+        p_bot[0] = Xcoord; p_bot[1] = bot;
+    }
+    else if (dim == 3){
+        p_top[0] = Xcoord; p_top[1] = Ycoord; p_top[2] = top;
+        p_bot[0] = Xcoord; p_bot[1] = Ycoord; p_bot[2] = bot;
+    }
+
+    wells[i].top = p_top;
+    wells[i].bottom = p_bot;
+    wells[i].Qtot = Q;
+    wells[i].well_id = i;
+}
+
 template <int dim>
 bool Well_Set<dim>::read_wells(std::string base_filename)
 {
-    std::ifstream  datafile(base_filename.c_str());
-    if (!datafile.good()){
-        std::cout << "Can't open the file" << base_filename << std::endl;
+    BinaryIO::InputBuffer input;
+    if (!read_input_file(base_filename, input))
         return false;
+    if (BinaryIO::is_binary(input)){
+        BinaryIO::MappedFile bfile;
+        if (!bfile.open(input, base_filename))
+            return false;
+        if (bfile.kind() != BinaryIO::WELLS){
+            std::cerr << base_filename << " is not a WELLS binary file" << std::endl;
+            return false;
+        }
+        uint64_t n;
+        const double* data = bfile.get_double("data", n);
+        if (data == 0)
+            return false;
+        const int Ncols = (dim == 3) ? 5 : 4;
+        Nwells = static_cast<int>(n/Ncols);
+        wells.resize(Nwells);
+        for (int i = 0; i < Nwells; i++){
+            const double* row = data + i*Ncols;
+            if (dim == 3)
+                set_well(i, row[0], row[1], row[2], row[3], row[4]);
+            else
+                set_well(i, row[0], 0, row[1], row[2], row[3]);
+        }
+        WellsXY.insert(wellxy.begin(), wellxy.end());
+        return true;
     }
-    else{
-        char buffer[512];
+
+    BinaryIO::BufferStream datafile(input);
+    {
+        std::string line;
         double Xcoord, Ycoord, top, bot, Q;
-        datafile.getline(buffer,512);
-        std::istringstream inp1(buffer);
+        getline(datafile, line);
+        std::istringstream inp1(line);
         inp1 >> Nwells;
         wells.resize(Nwells);
         for (int i = 0; i < Nwells; i++){
-            datafile.getline(buffer,512);
-            std::istringstream inp(buffer);
+            getline(datafile, line);
+            std::istringstream inp(line);
             inp >> Xcoord;
             if (dim == 2)
                 Ycoord = 0;
             else if (dim == 3)
                 inp >> Ycoord;
-
-            wellxy.push_back(std::make_pair(ine_Point2(Xcoord, Ycoord), i) );
             inp >> top;
             inp >> bot;
             inp >> Q;
-
-            if (top - bot <= 0){
-                std::cerr << "Well " << i << " has " << top-bot << " screen length" << std::endl;
-            }
-
-            Point<dim> p_top;
-            Point<dim> p_bot;
-            if (dim == 2){
-                p_top[0] = Xcoord; p_top[1] = top;
-                p_bot[0] = Xcoord; p_bot[1] = bot;
-            }
-            else if (dim == 3){
-                p_top[0] = Xcoord; p_top[1] = Ycoord; p_top[2] = top;
-                p_bot[0] = Xcoord; p_bot[1] = Ycoord; p_bot[2] = bot;
-            }
-
-            wells[i].top = p_top;
-            wells[i].bottom = p_bot;
-            wells[i].Qtot = Q;
-            wells[i].well_id = i;
+            set_well(i, Xcoord, Ycoord, top, bot, Q);
         }
         WellsXY.insert(wellxy.begin(), wellxy.end());
         return true;
@@ -299,7 +375,10 @@ bool Well_Set<dim>::read_wells(std::string base_filename)
 }
 
 template <int dim>
-void Well_Set<dim>::flag_cells_for_refinement(parallel::distributed::Triangulation<dim>& triangulation){
+void Well_Set<dim>::flag_cells_for_refinement(parallel::distributed::Triangulation<dim>& triangulation,
+                                              const Function<dim>* top_function,
+                                              const Function<dim>* bot_function,
+                                              double flat_height){
     Triangulation<dim-1> tria;
     initTria<dim>(tria);
 
@@ -331,6 +410,19 @@ void Well_Set<dim>::flag_cells_for_refinement(parallel::distributed::Triangulati
             setup_cell(cell,tria);
             typename Triangulation<dim-1>::active_cell_iterator cell2D = tria.begin_active();
 
+            // The elevations of the cell vertices
+            double vertex_z[GeometryInfo<dim>::vertices_per_cell];
+            for (unsigned int j = 0; j < GeometryInfo<dim>::vertices_per_cell ; j++){
+                vertex_z[j] = cell->vertex(j)[dim-1];
+                if (top_function != 0 && bot_function != 0){
+                    Point<dim> p = cell->vertex(j);
+                    p[dim-1] = 0;
+                    double top = top_function->value(p);
+                    double bot = bot_function->value(p);
+                    vertex_z[j] = bot + (top - bot)*vertex_z[j]/flat_height;
+                }
+            }
+
             for (unsigned int iw = 0; iw < well_id_in_cell.size(); ++iw){
                 int i = well_id_in_cell[iw];
                 well_point_2d[0] = wells[i].top[0];
@@ -353,8 +445,8 @@ void Well_Set<dim>::flag_cells_for_refinement(parallel::distributed::Triangulati
                 double z_bot = 0;
 
                 for (unsigned int j = 0; j < GeometryInfo<dim>::vertices_per_cell ; j++){
-                    z_top = z_top +  GeometryInfo<dim>::d_linear_shape_function(p_unit_top, j)*cell->vertex(j)[dim-1];
-                    z_bot = z_bot +  GeometryInfo<dim>::d_linear_shape_function(p_unit_bot, j)*cell->vertex(j)[dim-1];
+                    z_top = z_top +  GeometryInfo<dim>::d_linear_shape_function(p_unit_top, j)*vertex_z[j];
+                    z_bot = z_bot +  GeometryInfo<dim>::d_linear_shape_function(p_unit_bot, j)*vertex_z[j];
                 }
 
                 double well_TPF = wells[i].top[dim-1];
@@ -384,33 +476,13 @@ void Well_Set<dim>::flag_cells_for_refinement(parallel::distributed::Triangulati
 }
 
 template <int dim>
-void Well_Set<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
-                                      const DoFHandler<dim>& dof_handler,
-                                      const FE_Q<dim>& fe,
-                                      const ConstraintMatrix& constraints,
-                                      const MyTensorFunction<dim>& hydraulic_conductivity,
-                                      MPI_Comm mpi_communicator){
-
-    if (Nwells == 0)
-        return;
-
-    int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
-    int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+void Well_Set<dim>::build_index(const DoFHandler<dim>& dof_handler, MPI_Comm mpi_communicator){
+    well_cells.clear();
     Triangulation<dim-1> tria;
     initTria<dim>(tria);
     const MappingQ1<dim-1> mapping2D;
-    const MappingQ1<dim> mapping;
-    const unsigned int dofs_per_cell = fe.dofs_per_cell;
-    Vector<double> cell_rhs_wells (dofs_per_cell);
-    std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
-
-    std::vector<std::vector<int> > 		well_id(n_proc);
-    std::vector<std::vector<double> > 	cell_length(n_proc);
-    std::vector<std::vector<double> > 	cell_cond(n_proc);
-
-    double Qwell_total = 0;
-
     Point<dim-1> well_point_2d;
+
     typename DoFHandler<dim>::active_cell_iterator
     cell = dof_handler.begin_active(),
     endc = dof_handler.end();
@@ -418,7 +490,6 @@ void Well_Set<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
         if (cell->is_locally_owned()){
             std::vector<int> well_id_in_cell;
             std::vector<double> xp; std::vector<double> yp;
-            //double xm,ym;
             if (dim == 2){
                 xp.push_back(cell->face(2)->vertex(0)[0]);yp.push_back(0);
                 xp.push_back(cell->face(2)->vertex(1)[0]);yp.push_back(0);
@@ -428,22 +499,7 @@ void Well_Set<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
                 xp.push_back(cell->face(4)->vertex(1)[0]); yp.push_back(cell->face(4)->vertex(1)[1]);
                 xp.push_back(cell->face(4)->vertex(3)[0]); yp.push_back(cell->face(4)->vertex(3)[1]);
                 xp.push_back(cell->face(4)->vertex(2)[0]); yp.push_back(cell->face(4)->vertex(2)[1]);
-                //xm = 0;ym = 0;
-                //for (unsigned int kk = 0; kk < xp.size(); kk++){
-                //    xm += xp[kk];
-                //    ym += yp[kk];
-                //}
-                //xm = xm/static_cast<double>(xp.size());
-                //ym = ym/static_cast<double>(xp.size());
             }
-            //std::cout << xm << " " << ym << std::endl;
-            //double dst = std::sqrt(std::pow(xm - 33474.74070, 2.0) + std::pow(ym - 1027.05735, 2.0));
-            //std::cout << dst << std::endl;
-            //if (dst < 1.0){
-            //    std::cout << "You should really check this cell" << std::endl;
-            //    int a = 0;
-            //    dummy_function(true,a);
-            //}
 
             bool are_wells = get_point_ids_in_set(WellsXY, xp, yp, well_id_in_cell);
             if (!are_wells)
@@ -454,241 +510,191 @@ void Well_Set<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
 
             for (unsigned int iw = 0; iw < well_id_in_cell.size(); ++iw){
                 int i = well_id_in_cell[iw];
-                /*
-                bool dgb_print = false;
-                if (i == 714){
-                    std::cout << "Debug this well" << std::endl;
-                    int cccnt=1;
-                    int ff = 0;
-                    cccnt++;
-                    ff = cccnt;
-                    well_point_2d[0] = wells[i].top[0];
-                    dgb_print = true;
-                }
-                */
-
                 well_point_2d[0] = wells[i].top[0];
                 if (dim == 3)
                     well_point_2d[1] = wells[i].top[1];
 
-                bool is_in_cell = cell2D->point_inside(well_point_2d);
-
-                if (is_in_cell == true){
-                    // If the point is inside the cell find its unit coordinates
-                    // and the top and bottom of the cell at the well point
-                    Point<dim-1> p_unit2D;
-                    bool mapping_done = try_mapping<dim-1>(well_point_2d, p_unit2D, cell2D, mapping2D);
-                    if (!mapping_done)
-                        continue;
-
-                    Point<dim> p_unit_top, p_unit_bot;
-                    for (unsigned int ii = 0; ii < dim-1; ++ii){
-                        p_unit_top[ii] = p_unit2D[ii];
-                        p_unit_bot[ii] = p_unit2D[ii];
-                    }
-                    p_unit_top[dim-1] = 1;
-                    p_unit_bot[dim-1] = 0;
-                    double z_top = 0;
-                    double z_bot = 0;
-                    for (unsigned int j = 0; j < dofs_per_cell; j++){
-                        z_top = z_top +  GeometryInfo<dim>::d_linear_shape_function(p_unit_top, j)*cell->vertex(j)[dim-1];
-                        z_bot = z_bot +  GeometryInfo<dim>::d_linear_shape_function(p_unit_bot, j)*cell->vertex(j)[dim-1];
-                    }
-                    double well_TPF = wells[i].top[dim-1];
-                    double well_BPF = wells[i].bottom[dim-1];
-                    bool add_this_cell = false;
-                    double segment_length;
-                    Point<dim> p_mid;
-                    for (unsigned int ii = 0; ii < dim-1; ++ii)
-                        p_mid[ii] = well_point_2d[ii];
-                    double K;
-                    // case 1
-                    if  (well_BPF < z_bot && well_TPF > z_top){
-                        // the well screen fully penetrates this cell.
-                        p_mid[dim-1] = (z_top - z_bot)/2.0 + z_bot;
-                        Tensor<2,dim> K_tensor = hydraulic_conductivity.value(p_mid);
-                        K = K_tensor[0][0];
-                        segment_length = z_top - z_bot;
-                        add_this_cell = true;
-                    }
-                    //case 2
-                    if  (well_BPF > z_bot && well_TPF < z_top){
-                        // the well screen is all within this cell.
-                        p_mid[dim-1] = (well_TPF - well_BPF)/2.0 + well_BPF;
-                        Tensor<2,dim> K_tensor = hydraulic_conductivity.value(p_mid);
-                        K = K_tensor[0][0];
-                        segment_length = well_TPF - well_BPF;
-                        add_this_cell = true;
-                    }
-                    //case 3
-                    if (well_BPF < z_bot && well_TPF < z_top && well_TPF > z_bot){
-                        // the bottom of the screen is below the cell and the top is in the cell
-                        p_mid[dim-1] = (well_TPF - z_bot)/2.0 + z_bot;
-                        Tensor<2,dim> K_tensor = hydraulic_conductivity.value(p_mid);
-                        K = K_tensor[0][0];
-                        segment_length = well_TPF - z_bot;
-                        add_this_cell = true;
-                    }
-                    //case 4
-                    if (well_BPF > z_bot && well_BPF < z_top && well_TPF > z_top){
-                        // the bottom of the screen is in the cell and the top of the screen is above the cell
-                        p_mid[dim-1] = (z_top - well_BPF)/2.0 + well_BPF;
-                        Tensor<2,dim> K_tensor = hydraulic_conductivity.value(p_mid);
-                        K = K_tensor[0][0];
-                        segment_length = z_top - well_BPF;
-                        add_this_cell = true;
-                    }
-                    //case 5
-                   if (well_BPF > z_top && cell->face(2*dim-1)->at_boundary()){ //2*dim-1 returns the top face
-                        // The well is above of the water table. Still we want the first layer to take out water
-                        //std::cout << "Zt:" << z_top << ", Zb:" << z_bot << ", Wb:" << well_BPF << std::endl;
-                        //std::cout << "The bottome of the well is above the top cell" << std::endl;
-                        p_mid[dim-1] = (z_top - z_bot)/2 + z_bot;
-                        Tensor<2,dim> K_tensor = hydraulic_conductivity.value(p_mid);
-                        K = K_tensor[0][0];
-                        segment_length = z_top - z_bot;
-                        add_this_cell = true;
-                    }
-                    if (add_this_cell){
-                        /*
-                        if (dgb_print){
-                            std::cout << wells[i].well_cells.size() << std::endl;
-                            std::cout << cell->center() << std::endl;
-                        }
-                        */
-                        wells[i].well_cells.push_back(cell);
-                        wells[i].mid_point.push_back(p_mid);
-                        wells[i].L_cell.push_back(segment_length);
-                        wells[i].K_cell.push_back(K);
-                        wells[i].owned.push_back(true);
-
-                        well_id[my_rank].push_back(i);
-                        cell_length[my_rank].push_back(segment_length);
-                        cell_cond[my_rank].push_back(K);
-                        /*
-                        if (dgb_print){
-                            std::cout << wells[i].well_cells[wells[i].well_cells.size()-1]->center() << std::endl;
-                            std::cout << wells[i].mid_point[wells[i].mid_point.size()-1] << std::endl;;
-                        }
-                        */
-                    }
-                }
+                if (!cell2D->point_inside(well_point_2d))
+                    continue;
+
+                WellCell wc;
+                bool mapping_done = try_mapping<dim-1>(well_point_2d, wc.p_unit2D, cell2D, mapping2D);
+                if (!mapping_done)
+                    continue;
+                wc.cell = cell;
+                wc.well_id = i;
+                well_cells.push_back(wc);
             }
         }
     }
+    std::stable_sort(well_cells.begin(), well_cells.end(),
+                     [](const WellCell& a, const WellCell& b){return a.well_id < b.well_id;});
+
+    // Find which wells are in the domain of any processor so that the sums of each well
+    // are exchanged as a compact array
+    std::vector<int> local_flag(Nwells, 0);
+    std::vector<int> global_flag(Nwells, 0);
+    for (unsigned int j = 0; j < well_cells.size(); ++j)
+        local_flag[well_cells[j].well_id] = 1;
+    MPI_Allreduce(local_flag.data(), global_flag.data(), Nwells, MPI_INT, MPI_MAX, mpi_communicator);
+    active_wells.clear();
+    well_slot.assign(Nwells, -1);
+    for (int i = 0; i < Nwells; ++i){
+        if (global_flag[i] > 0){
+            well_slot[i] = active_wells.size();
+            active_wells.push_back(i);
+        }
+    }
 
-    // So far we have loop through the cells that are locally owned and each processor
-    // has stored into the wells class the info about K and segment length.
-    // Next all processors will send everything to all processors so that
-    // each processor can weight the pumping independently
-
-    MPI_Barrier(mpi_communicator);
-    std::vector<int> N_data;
-    // First send the number of cells that each processor has calculated the required data
-    Send_receive_size(cell_cond[my_rank].size(), n_proc, N_data, mpi_communicator);
-    // Next send the data
-    Sent_receive_data<int>(well_id, N_data, my_rank, mpi_communicator, MPI_INT);
-    Sent_receive_data<double>(cell_cond, N_data, my_rank, mpi_communicator, MPI_DOUBLE);
-    Sent_receive_data<double>(cell_length, N_data, my_rank, mpi_communicator, MPI_DOUBLE);
-    MPI_Barrier(mpi_communicator);
-
-    // Each processor will add the data to its wells variable
-    // But these data are not owned
-    for (int i = 0; i < n_proc; ++i){
-        if (i == my_rank)// This has already the data
-            continue;
+    index_valid = true;
+    index_dof_handler = &dof_handler;
+}
 
-        for (int j = 0; j < N_data[i]; ++j){
-            wells[well_id[i][j]].K_cell.push_back(cell_cond[i][j]);
-            wells[well_id[i][j]].L_cell.push_back(cell_length[i][j]);
-            wells[well_id[i][j]].owned.push_back(false);
-            typename DoFHandler<dim>::active_cell_iterator dummy_cell;
-            wells[well_id[i][j]].well_cells.push_back(dummy_cell);
-            Point<dim> dummy_point;
-            wells[well_id[i][j]].mid_point.push_back(dummy_point);
+template <int dim>
+void Well_Set<dim>::add_contributions(TrilinosWrappers::MPI::Vector& system_rhs,
+                                      const DoFHandler<dim>& dof_handler,
+                                      const FE_Q<dim>& fe,
+                                      const ConstraintMatrix& constraints,
+                                      const MyTensorFunction<dim>& hydraulic_conductivity,
+                                      MPI_Comm mpi_communicator){
+
+    if (Nwells == 0)
+        return;
+
+    int my_rank = Utilities::MPI::this_mpi_process(mpi_communicator);
+    int n_proc = Utilities::MPI::n_mpi_processes(mpi_communicator);
+    const unsigned int dofs_per_cell = fe.dofs_per_cell;
+    Vector<double> cell_rhs_wells (dofs_per_cell);
+    std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
+
+    // The index is rebuilt only if the mesh of any processor has changed (see #mesh_changed)
+    int rebuild = (!index_valid || index_dof_handler != &dof_handler) ? 1 : 0;
+    MPI_Allreduce(MPI_IN_PLACE, &rebuild, 1, MPI_INT, MPI_MAX, mpi_communicator);
+    if (rebuild > 0)
+        build_index(dof_handler, mpi_communicator);
+
+    // For each cell of the index compute the part of the screen that is in the cell. Only the vertical
+    // coordinates of the cells change between iterations, so the cached horizontal unit coordinates are reused.
+    const unsigned int n_wc = well_cells.size();
+    std::vector<bool> contributes(n_wc, false);
+    std::vector<double> cell_length(n_wc, 0);
+    std::vector<double> cell_cond(n_wc, 0);
+    std::vector<Point<dim> > unit_mid_point(n_wc);
+
+    // The sums of K, L and K*L of each well in the domain
+    std::vector<double> well_sums(3*active_wells.size(), 0);
+
+    for (unsigned int j = 0; j < n_wc; ++j){
+        const WellCell& wc = well_cells[j];
+        const int i = wc.well_id;
+
+        Point<dim> p_unit_top, p_unit_bot;
+        for (unsigned int ii = 0; ii < dim-1; ++ii){
+            p_unit_top[ii] = wc.p_unit2D[ii];
+            p_unit_bot[ii] = wc.p_unit2D[ii];
         }
-    }
-    // Now each processor will loop though the wells.
-    // if there are well with owned == true we will distribute the pumping rate to all cells
-    // even to those that have owned == false but we will assign rates only to the owned == true
-    //int Cnt_wellsQ = 0;
-    for (int i = 0; i < Nwells; ++i){
-        //double Qwell_temp = 0;
-        //std::cout << "well-> i: " << i << " wid:  " << wells[i].well_id << " pnt: " << wells[i].bottom << std::endl;
-        bool any_true = false;
-        int N_cells = wells[i].owned.size();
-        for (int j = 0; j < N_cells; ++j){
-            if (wells[i].owned[j] == true){
-                any_true = true;
-                break;
-            }
+        p_unit_top[dim-1] = 1;
+        p_unit_bot[dim-1] = 0;
+        double z_top = 0;
+        double z_bot = 0;
+        for (unsigned int jj = 0; jj < GeometryInfo<dim>::vertices_per_cell; jj++){
+            z_top = z_top +  GeometryInfo<dim>::d_linear_shape_function(p_unit_top, jj)*wc.cell->vertex(jj)[dim-1];
+            z_bot = z_bot +  GeometryInfo<dim>::d_linear_shape_function(p_unit_bot, jj)*wc.cell->vertex(jj)[dim-1];
         }
-        if (any_true){
-            std::vector<double> wK(N_cells);
-            std::vector<double> wL(N_cells);
-            std::vector<double> wKL(N_cells);
-            double sum_K, sum_L, sum_KL;
-            sum_K = 0; sum_L = 0; sum_KL = 0;
-            for (int j = 0; j < N_cells; ++j){
-                wK[j] = wells[i].K_cell[j];
-                wL[j] = wells[i].L_cell[j];
-                sum_K += wK[j];
-                sum_L += wL[j];
-            }
-            for (int j = 0; j < N_cells; ++j){
-                wKL[j] = (wK[j]/sum_K) * (wL[j]/sum_L);
-                sum_KL += wKL[j];
-            }
-            for (int j = 0; j < N_cells; ++j){
-                if (wells[i].owned[j] == true){
-                    cell_rhs_wells = 0;
-                    // convert the mid point to unit point
-                    Point<dim> p_unit_mid_point;
-                    bool mapping_done = try_mapping<dim>(wells[i].mid_point[j], p_unit_mid_point, wells[i].well_cells[j],mapping);
-                    if (mapping_done){
-                        Quadrature<dim> temp_quadrature(p_unit_mid_point);
-                        FEValues<dim> fe_values_temp(fe, temp_quadrature, update_values | update_quadrature_points);
-                        fe_values_temp.reinit(wells[i].well_cells[j]);
-                        for (unsigned int q_point = 0; q_point < temp_quadrature.size(); ++q_point){
-                            for (unsigned int ii = 0; ii < dofs_per_cell; ++ii){
-                                double Q_temp = (wKL[j]/sum_KL)*wells[i].Qtot*fe_values_temp.shape_value(ii,q_point);
-                                //std::cout << i << " : " << Q_temp << std::endl;
-                                cell_rhs_wells(ii) += Q_temp;
-                                Qwell_total += Q_temp;
-                                //Qwell_temp += Q_temp;
-                            }
-                        }
-                        wells[i].well_cells[j]->get_dof_indices (local_dof_indices);
-                        constraints.distribute_local_to_global(cell_rhs_wells,
-                                                               local_dof_indices,
-                                                               system_rhs);
-                    }
-                }
-            }
+        double well_TPF = wells[i].top[dim-1];
+        double well_BPF = wells[i].bottom[dim-1];
+        bool add_this_cell = false;
+        double segment_length = 0;
+        Point<dim> p_mid;
+        for (unsigned int ii = 0; ii < dim-1; ++ii)
+            p_mid[ii] = wells[i].top[ii];
+        // case 1
+        if  (well_BPF < z_bot && well_TPF > z_top){
+            // the well screen fully penetrates this cell.
+            p_mid[dim-1] = (z_top - z_bot)/2.0 + z_bot;
+            segment_length = z_top - z_bot;
+            add_this_cell = true;
+        }
+        //case 2
+        if  (well_BPF > z_bot && well_TPF < z_top){
+            // the well screen is all within this cell.
+            p_mid[dim-1] = (well_TPF - well_BPF)/2.0 + well_BPF;
+            segment_length = well_TPF - well_BPF;
+            add_this_cell = true;
+        }
+        //case 3
+        if (well_BPF < z_bot && well_TPF < z_top && well_TPF > z_bot){
+            // the bottom of the screen is below the cell and the top is in the cell
+            p_mid[dim-1] = (well_TPF - z_bot)/2.0 + z_bot;
+            segment_length = well_TPF - z_bot;
+            add_this_cell = true;
         }
+        //case 4
+        if (well_BPF > z_bot && well_BPF < z_top && well_TPF > z_top){
+            // the bottom of the screen is in the cell and the top of the screen is above the cell
+            p_mid[dim-1] = (z_top - well_BPF)/2.0 + well_BPF;
+            segment_length = z_top - well_BPF;
+            add_this_cell = true;
+        }
+        //case 5
+        if (well_BPF > z_top && wc.cell->face(2*dim-1)->at_boundary()){ //2*dim-1 returns the top face
+            // The well is above of the water table. Still we want the first layer to take out water
+            p_mid[dim-1] = (z_top - z_bot)/2 + z_bot;
+            segment_length = z_top - z_bot;
+            add_this_cell = true;
+        }
+        if (!add_this_cell || z_top - z_bot <= 0)
+            continue;
 
-        //if (std::abs(Qwell_temp) > 0){
-        //    Cnt_wellsQ++;
-        //}
-        //else{
-        //    std::cout << "Well " << wells[i].well_id << " at " << wells[i].top << " has zero Q" << std::endl;
-        //}
+        Tensor<2,dim> K_tensor = hydraulic_conductivity.value(p_mid);
+        contributes[j] = true;
+        cell_length[j] = segment_length;
+        cell_cond[j] = K_tensor[0][0];
+        // The vertical edges of the cells are vertical lines, therefore along the well the elevation
+        // varies linearly with the vertical unit coordinate
+        for (unsigned int ii = 0; ii < dim-1; ++ii)
+            unit_mid_point[j][ii] = wc.p_unit2D[ii];
+        unit_mid_point[j][dim-1] = (p_mid[dim-1] - z_bot)/(z_top - z_bot);
+
+        const int slot = well_slot[i];
+        well_sums[3*slot + 0] += cell_cond[j];
+        well_sums[3*slot + 1] += cell_length[j];
+        well_sums[3*slot + 2] += cell_cond[j]*cell_length[j];
+    }
 
+    // Each processor needs the sums over all the cells of the wells.
+    // Only the wells that are in the domain are exchanged
+    if (well_sums.size() > 0)
+        MPI_Allreduce(MPI_IN_PLACE, well_sums.data(), well_sums.size(), MPI_DOUBLE, MPI_SUM, mpi_communicator);
+
+    // Each processor distributes the pumping rate of the wells to its own cells.
+    // The weight of a cell is (K/sum_K)*(L/sum_L) normalized by the sum of the weights of all cells of the well
+    double Qwell_total = 0;
+    for (unsigned int j = 0; j < n_wc; ++j){
+        if (!contributes[j])
+            continue;
+        const int i = well_cells[j].well_id;
+        const int slot = well_slot[i];
+        const double sum_K = well_sums[3*slot + 0];
+        const double sum_L = well_sums[3*slot + 1];
+        const double sum_KL = well_sums[3*slot + 2]/(sum_K*sum_L);
+        const double wKL = (cell_cond[j]/sum_K) * (cell_length[j]/sum_L);
+
+        cell_rhs_wells = 0;
+        for (unsigned int ii = 0; ii < dofs_per_cell; ++ii){
+            double Q_temp = (wKL/sum_KL)*wells[i].Qtot*fe.shape_value(ii, unit_mid_point[j]);
+            cell_rhs_wells(ii) += Q_temp;
+            Qwell_total += Q_temp;
+        }
+        well_cells[j].cell->get_dof_indices (local_dof_indices);
+        constraints.distribute_local_to_global(cell_rhs_wells,
+                                               local_dof_indices,
+                                               system_rhs);
     }
-    //std::cout << "Wells with pumping rates: " << Cnt_wellsQ << std::endl;
-    MPI_Barrier(mpi_communicator);
+
     sum_scalar<double>(Qwell_total,n_proc, mpi_communicator, MPI_DOUBLE);
     if (my_rank == 0)
         std::cout << "\t QWELLS: [" << Qwell_total << "]" << std::endl;
-    MPI_Barrier(mpi_communicator);
-    for (int i = 0; i < Nwells; ++i){
-        wells[i].Q_cell.clear();
-        wells[i].L_cell.clear();
-        wells[i].K_cell.clear();
-        wells[i].owned.clear();
-        wells[i].mid_point.clear();
-        wells[i].well_cells.clear();
-    }
 }
 
 
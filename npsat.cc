@@ -70,6 +70,11 @@ int main (int argc, char **argv){
     //std::cout << "Is here?" << std::endl;
     //return 0;
     if (CLI.parse_command_line(argc,argv)){
+        if (CLI.do_convert){
+            if (Utilities::MPI::this_mpi_process(MPI_COMM_WORLD) == 0)
+                CLI.convert_input();
+            return 0;
+        }
         bool read_param = CLI.read_param_file();
         if (read_param){
             if (CLI.do_gather){
@@ -0,0 +1,256 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+
+#include "../myheaders/tracking_mesh.h"
+
+/*!
+ * \brief The TraceOptions struct holds the command line options of the standalone tracer
+ */
+struct TraceOptions{
+    //! The tracking mesh file that NPSAT exports with the option "u Export tracking mesh"
+    std::string mesh_file;
+    //! The file with the starting points of the particles
+    std::string particle_file;
+    //! The prefix of the output files
+    std::string output_prefix;
+    //! The tracking method. The tracking mesh supports only the Runge Kutta 4 method (3) of npsat
+    int method;
+    //! The number of steps per cell
+    double step_size;
+    //! The maximum number of steps of a streamline
+    int max_steps;
+    //! The number of steps after which a streamline whose bounding box does not expand is stopped
+    int stuck_iter;
+    //! The number of threads
+    int n_threads;
+    //! The number of particles that are traced before the results are written
+    int chunk_size;
+
+    TraceOptions()
+        :
+          method(3),
+          step_size(5),
+          max_steps(1000),
+          stuck_iter(50),
+          n_threads(std::thread::hardware_concurrency()),
+          chunk_size(10000)
+    {
+        if (n_threads < 1)
+            n_threads = 1;
+    }
+};
+
+//! The starting point and the results of one particle
+struct TracedStreamline{
+    int E_id;
+    int S_id;
+    double p0[3];
+    int outcome;
+    std::vector<double> P;
+    std::vector<double> V;
+};
+
+void print_usage(){
+    std::cout << "Usage: npsat_trace -m mesh_file -p particle_file -o output_prefix [options]" << std::endl;
+    std::cout << "  -m   The tracking mesh written by npsat with \"u Export tracking mesh\" = 1" << std::endl;
+    std::cout << "  -p   The particle file. The first line is the number of particles N" << std::endl;
+    std::cout << "       followed by N lines of: Entity_id Streamline_id x y (z)" << std::endl;
+    std::cout << "  -o   The prefix of the output files. Each chunk c is written into prefix_cccc_particles_0000.traj" << std::endl;
+    std::cout << "       and prefix_cccc_particle_errors_0000.traj, which npsat -g 1 n_chunks gathers" << std::endl;
+    std::cout << "  -g   The tracking method. Only 3 (Runge Kutta 4) is supported (default 3)" << std::endl;
+    std::cout << "  -s   The number of steps per cell (default 5)" << std::endl;
+    std::cout << "  -n   The maximum number of steps (default 1000)" << std::endl;
+    std::cout << "  -k   The number of steps to consider a particle stuck (default 50)" << std::endl;
+    std::cout << "  -t   The number of threads (default the number of cores)" << std::endl;
+    std::cout << "  -c   The number of particles of each chunk (default 10000)" << std::endl;
+}
+
+bool parse_command_line(int argc, char **argv, TraceOptions& opt){
+    for (int i = 1; i < argc; ++i){
+        const std::string flag = argv[i];
+        if (i + 1 >= argc){
+            std::cerr << "The option " << flag << " has no value" << std::endl;
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (flag == "-m")
+            opt.mesh_file = value;
+        else if (flag == "-p")
+            opt.particle_file = value;
+        else if (flag == "-o")
+            opt.output_prefix = value;
+        else if (flag == "-g")
+            opt.method = std::atoi(value.c_str());
+        else if (flag == "-s")
+            opt.step_size = std::atof(value.c_str());
+        else if (flag == "-n")
+            opt.max_steps = std::atoi(value.c_str());
+        else if (flag == "-k")
+            opt.stuck_iter = std::atoi(value.c_str());
+        else if (flag == "-t")
+            opt.n_threads = std::max(1, std::atoi(value.c_str()));
+        else if (flag == "-c")
+            opt.chunk_size = std::max(1, std::atoi(value.c_str()));
+        else{
+            std::cerr << "Unknown option " << flag << std::endl;
+            return false;
+        }
+    }
+    if (opt.mesh_file.empty() || opt.particle_file.empty() || opt.output_prefix.empty()){
+        std::cerr << "The options -m, -p and -o are required" << std::endl;
+        return false;
+    }
+    if (opt.method != 3){
+        std::cerr << "The tracking mesh supports only the Runge Kutta 4 tracking method (3). "
+                  << "The method " << opt.method << " is not supported" << std::endl;
+        return false;
+    }
+    if (opt.step_size <= 0 || opt.max_steps <= 0){
+        std::cerr << "The step size and the maximum number of steps must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <int dim>
+bool read_particles(const std::string& filename, std::vector<TracedStreamline>& particles){
+    std::ifstream datafile(filename.c_str());
+    if (!datafile.good()){
+        std::cerr << "Can't open " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    getline(datafile, line);
+    std::istringstream inp(line.c_str());
+    int N = 0;
+    inp >> N;
+    particles.resize(N);
+    for (int i = 0; i < N; ++i){
+        getline(datafile, line);
+        std::istringstream inp(line.c_str());
+        TracedStreamline& s = particles[i];
+        inp >> s.E_id;
+        inp >> s.S_id;
+        for (int idim = 0; idim < dim; ++idim)
+            inp >> s.p0[idim];
+        if (inp.fail()){
+            std::cerr << "Error while reading line " << i + 2 << " of " << filename << std::endl;
+            return false;
+        }
+        s.outcome = 0;
+    }
+    return true;
+}
+
+/*!
+ * \brief chunk_file_name returns the name of an output file of a chunk.
+ *
+ * The names follow the particle files of npsat, where the chunk takes the place of the iteration and the tracer
+ * is processor 0. Therefore npsat -g 1 n_chunks gathers the output of the tracer.
+ */
+std::string chunk_file_name(const std::string& prefix, int i_chunk, const std::string& type){
+    std::ostringstream name;
+    name << prefix << "_" << std::setw(4) << std::setfill('0') << i_chunk
+         << "_" << type << "_0000.traj";
+    return name.str();
+}
+
+/*!
+ * \brief run_tracer traces the particles of the file on the tracking mesh.
+ *
+ * The particles are processed in chunks. The threads take the particles of the chunk one by one,
+ * since the lengths of the streamlines vary a lot. When the chunk is traced the streamlines are written
+ * in the order of the particle file into the files of the chunk (see #chunk_file_name),
+ * with the same format as the particle files of npsat.
+ */
+template <int dim>
+int run_tracer(const TraceOptions& opt){
+    TrackingMesh<dim> mesh;
+    if (!mesh.open(opt.mesh_file))
+        return 1;
+    std::cout << "Tracking mesh: " << mesh.n_cells() << " cells, " << mesh.n_vertices() << " vertices" << std::endl;
+
+    std::vector<TracedStreamline> particles;
+    if (!read_particles<dim>(opt.particle_file, particles))
+        return 1;
+    std::cout << "Tracing " << particles.size() << " particles with " << opt.n_threads << " threads" << std::endl;
+
+    int n_chunks = 0;
+    for (unsigned int first = 0; first < particles.size(); first += opt.chunk_size, ++n_chunks){
+        const unsigned int last = std::min(static_cast<unsigned int>(particles.size()), first + opt.chunk_size);
+        std::ofstream log_file(chunk_file_name(opt.output_prefix, n_chunks, "particles").c_str());
+        std::ofstream err_file(chunk_file_name(opt.output_prefix, n_chunks, "particle_errors").c_str());
+        if (!log_file.good() || !err_file.good()){
+            std::cerr << "Can't open the output files of chunk " << n_chunks << std::endl;
+            return 1;
+        }
+        std::atomic<unsigned int> next(first);
+        std::vector<std::thread> threads;
+        for (int ith = 0; ith < opt.n_threads; ++ith){
+            threads.push_back(std::thread([&](){
+                for (unsigned int i = next++; i < last; i = next++){
+                    TracedStreamline& s = particles[i];
+                    s.outcome = mesh.trace(s.p0, -1, opt.step_size, opt.max_steps, opt.stuck_iter, s.P, s.V);
+                }
+            }));
+        }
+        for (unsigned int ith = 0; ith < threads.size(); ++ith)
+            threads[ith].join();
+
+        for (unsigned int i = first; i < last; ++i){
+            TracedStreamline& s = particles[i];
+            if (s.outcome == -88){
+                err_file << "transformation failed" << ",  \t" << s.E_id << ",  \t" << s.S_id << std::endl;
+                continue;
+            }
+            if (s.outcome == -66)
+                err_file << "Particle stuck" << ",  \t" << s.E_id << ",  \t" << s.S_id << std::endl;
+            const unsigned int n_points = s.P.size()/dim;
+            for (unsigned int k = 0; k < n_points; ++k){
+                log_file << s.E_id << "  \t"
+                         << s.S_id << "  \t"
+                         << s.outcome << "  \t"
+                         << k << "  \t"
+                         << std::setprecision(15);
+                for (int idim = 0; idim < dim; ++idim)
+                    log_file << s.P[k*dim + idim] << "  \t";
+                for (int idim = 0; idim < dim; ++idim)
+                    log_file << s.V[k*dim + idim] << "  \t";
+                log_file << std::endl;
+            }
+            std::vector<double>().swap(s.P);
+            std::vector<double>().swap(s.V);
+        }
+        std::cout << "Traced " << last << " of " << particles.size() << " particles" << std::endl;
+    }
+    std::cout << "The streamlines are written in " << n_chunks << " chunks. Gather them with npsat -g 1 " << n_chunks << std::endl;
+    return 0;
+}
+
+/*!
+ * The standalone tracer repeats the particle tracking of NPSAT on a frozen velocity field.
+ * It needs neither MPI nor deal.II, therefore it runs on a workstation and the particles can be traced again with
+ * different starting points and step settings without solving the flow.
+ */
+int main(int argc, char **argv){
+    TraceOptions opt;
+    if (argc < 2 || !parse_command_line(argc, argv, opt)){
+        print_usage();
+        return 1;
+    }
+
+    const int dim = TrackingMesh<3>::file_dimension(opt.mesh_file);
+    if (dim == 2)
+        return run_tracer<2>(opt);
+    else if (dim == 3)
+        return run_tracer<3>(opt);
+    std::cerr << opt.mesh_file << " is not a tracking mesh" << std::endl;
+    return 1;
+}